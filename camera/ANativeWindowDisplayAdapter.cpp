@@ -19,16 +19,15 @@
 #include <ui/GraphicBuffer.h>
 #include <ui/GraphicBufferMapper.h>
 #include <hal_public.h>
+#include <cutils/properties.h>
 
 namespace Ti {
 namespace Camera {
 
 ///Constant declarations
-///@todo Check the time units
-const int ANativeWindowDisplayAdapter::DISPLAY_TIMEOUT = 1000;  // seconds
+const int ANativeWindowDisplayAdapter::DEFAULT_REFRESH_RATE = 60;  // Hz
 
-//Suspends buffers after given amount of failed dq's
-const int ANativeWindowDisplayAdapter::FAILED_DQS_TO_SUSPEND = 3;
+const nsecs_t ANativeWindowDisplayAdapter::DEQUEUE_RETRY_DELAY = 10000000LL;  // ns
 
 
 OMX_COLOR_FORMATTYPE toOMXPixFormat(const char* parameters_format)
@@ -104,8 +103,14 @@ ANativeWindowDisplayAdapter::ANativeWindowDisplayAdapter():mDisplayThread(NULL),
     mPreviewWidth = 0;
     mPreviewHeight = 0;
 
-    mSuspend = false;
-    mFailedDQs = 0;
+    mPresentInterval = 0;
+    mLastPresent = 0;
+    mHasPendingFrame = false;
+    memset(&mPendingFrame, 0, sizeof(mPendingFrame));
+    mPendingArrival = 0;
+    mFailedDequeues = 0;
+    mDequeueRetryTime = 0;
+    memset(&mStats, 0, sizeof(mStats));
 
     mPaused = false;
     mXOff = -1;
@@ -145,8 +150,8 @@ ANativeWindowDisplayAdapter::~ANativeWindowDisplayAdapter()
         // Send the semaphore to signal once the command is completed
         msg.arg1 = &sem;
 
-        ///Post the message to display thread
-        mDisplayThread->msgQ().put(&msg);
+        ///Post the message to display thread, ahead of anything still queued
+        mDisplayThread->msgQ().putUrgent(&msg);
 
         ///Wait for the ACK - implies that the thread is now started and waiting for frames
         sem.Wait();
@@ -164,8 +169,22 @@ ANativeWindowDisplayAdapter::~ANativeWindowDisplayAdapter()
 
 status_t ANativeWindowDisplayAdapter::initialize()
 {
+    char value[PROPERTY_VALUE_MAX];
+
     LOG_FUNCTION_NAME;
 
+    ///A refresh rate of 0 disables pacing, every frame is queued on arrival
+    property_get("camera.display.refresh", value, "");
+    const int refreshRate = ( '\0' != value[0] ) ? atoi(value) : DEFAULT_REFRESH_RATE;
+    if ( 0 < refreshRate ) {
+        ///Leave a quarter period of slack for the arrival jitter of frames
+        ///running at the refresh rate
+        const nsecs_t period = 1000000000LL / refreshRate;
+        mPresentInterval = period - period / 4;
+    }
+    CAMHAL_LOGDB("Display refresh rate %d, present interval %lld ns",
+                 refreshRate, (long long) mPresentInterval);
+
     ///Create the display thread
     mDisplayThread = new DisplayThread(this);
     if ( !mDisplayThread.get() )
@@ -465,6 +484,9 @@ CameraBuffer* ANativeWindowDisplayAdapter::allocateBufferList(int width, int hei
     memset (mBuffers, 0, sizeof(CameraBuffer) * lnumBufs);
 
     mFramesType.clear();
+    mBufferIndex.clear();
+    mEnqueueTimes.clear();
+    mEnqueueTimes.insertAt(0, 0, lnumBufs);
 
     if ( NULL == mANativeWindow ) {
         return NULL;
@@ -559,6 +581,7 @@ CameraBuffer* ANativeWindowDisplayAdapter::allocateBufferList(int width, int hei
         mBuffers[i].type = CAMERA_BUFFER_ANW;
         mBuffers[i].format = mPixelFormat;
         mFramesWithCameraAdapterMap.add(handle, i);
+        mBufferIndex.add(handle, i);
 
         // Tag remaining preview buffers as preview frames
         if ( i >= ( mBufferCount - undequeued ) ) {
@@ -865,6 +888,8 @@ int ANativeWindowDisplayAdapter::freeBufferList(CameraBuffer * buflist)
     }
 
     mFramesType.clear();
+    mBufferIndex.clear();
+    mEnqueueTimes.clear();
 
     return NO_ERROR;
 }
@@ -878,17 +903,18 @@ bool ANativeWindowDisplayAdapter::supportsExternalBuffering()
 void ANativeWindowDisplayAdapter::displayThread()
 {
     bool shouldLive = true;
-    int timeout = 0;
     status_t ret;
 
     LOG_FUNCTION_NAME;
 
     while(shouldLive)
         {
+        ///Sleep until a message arrives, or until a waiting frame or a failed
+        ///dequeue is due
         ret = Utils::MessageQueue::waitForMsg(&mDisplayThread->msgQ()
                                                                 ,  &mDisplayQ
                                                                 , NULL
-                                                                , ANativeWindowDisplayAdapter::DISPLAY_TIMEOUT);
+                                                                , nextWakeup());
 
         if ( !mDisplayThread->msgQ().isEmpty() )
             {
@@ -930,11 +956,97 @@ void ANativeWindowDisplayAdapter::displayThread()
                 }
             }
         }
+
+        if ( shouldLive && (mDisplayState == ANativeWindowDisplayAdapter::DISPLAY_STARTED) )
+            {
+            presentPendingFrame();
+            returnStaleFrames();
+            retryFailedDequeue();
+        }
     }
 
     LOG_FUNCTION_NAME_EXIT;
 }
 
+int ANativeWindowDisplayAdapter::nextWakeup()
+{
+    nsecs_t deadline = 0;
+
+    android::AutoMutex lock(mLock);
+
+    if ( mHasPendingFrame ) {
+        deadline = mLastPresent + mPresentInterval;
+    }
+
+    if ( ( 0 < mFailedDequeues ) && ( ( 0 == deadline ) || ( mDequeueRetryTime < deadline ) ) ) {
+        deadline = mDequeueRetryTime;
+    }
+
+    if ( 0 == deadline ) {
+        return -1;
+    }
+
+    const nsecs_t wait = deadline - systemTime();
+    if ( 0 >= wait ) {
+        return 0;
+    }
+
+    ///Round up, waking early would only mean another wait
+    return (int) ( ( wait + 999999LL ) / 1000000LL );
+}
+
+void ANativeWindowDisplayAdapter::presentPendingFrame()
+{
+    android::AutoMutex lock(mLock);
+
+    if ( !mHasPendingFrame || ( systemTime() < ( mLastPresent + mPresentInterval ) ) ) {
+        return;
+    }
+
+    mHasPendingFrame = false;
+
+    if ( ( NULL == mANativeWindow ) || ( NULL == mBuffers ) ) {
+        return;
+    }
+
+    presentFrameLocked(mPendingFrame, mPendingFrame.mBuffer - mBuffers, mPendingArrival);
+}
+
+void ANativeWindowDisplayAdapter::returnStaleFrames()
+{
+    android::Vector<DisplayFrame> frames;
+
+    {
+        android::AutoMutex lock(mLock);
+        if ( mStaleFrames.isEmpty() ) {
+            return;
+        }
+        frames = mStaleFrames;
+        mStaleFrames.clear();
+    }
+
+    for ( size_t i = 0; i < frames.size(); i++ ) {
+        CAMHAL_LOGVB("Dropping stale display frame %p", frames[i].mBuffer);
+        mFrameProvider->returnFrame(frames[i].mBuffer, frames[i].mType);
+    }
+}
+
+void ANativeWindowDisplayAdapter::retryFailedDequeue()
+{
+    {
+        android::AutoMutex lock(mLock);
+
+        if ( ( 0 == mFailedDequeues ) || ( systemTime() < mDequeueRetryTime ) ) {
+            return;
+        }
+
+        ///Counted again by handleFrameReturn() if the retry fails as well
+        mFailedDequeues--;
+    }
+
+    handleFrameReturn();
+}
+
 
 bool ANativeWindowDisplayAdapter::processHalMsg()
 {
@@ -954,6 +1066,12 @@ bool ANativeWindowDisplayAdapter::processHalMsg()
             CAMHAL_LOGDA("Display thread received DISPLAY_START command from Camera HAL");
             mDisplayState = ANativeWindowDisplayAdapter::DISPLAY_STARTED;
 
+            {
+                android::AutoMutex lock(mLock);
+                mLastPresent = 0;
+                memset(&mStats, 0, sizeof(mStats));
+            }
+
             break;
 
         case DisplayThread::DISPLAY_STOP:
@@ -966,13 +1084,24 @@ bool ANativeWindowDisplayAdapter::processHalMsg()
             mDisplayState = ANativeWindowDisplayAdapter::DISPLAY_STOPPED;
 
             // flush frame message queue
-            while ( !mDisplayQ.isEmpty() ) {
-                Utils::Message message;
-                mDisplayQ.get(&message);
+            mDisplayQ.clear();
+
+            {
+                ///A waiting frame is returned to the window with the rest
+                ///of the buffers in disableDisplay
+                android::AutoMutex lock(mLock);
+                mHasPendingFrame = false;
+                mStaleFrames.clear();
+                mFailedDequeues = 0;
             }
 
             break;
 
+        case DisplayThread::DISPLAY_FRAME:
+
+            ///A frame waits for its slot, nextWakeup() takes care of it
+            break;
+
         case DisplayThread::DISPLAY_EXIT:
 
             CAMHAL_LOGDA("Display thread received DISPLAY_EXIT command from Camera HAL.");
@@ -1013,15 +1142,9 @@ bool ANativeWindowDisplayAdapter::processHalMsg()
 status_t ANativeWindowDisplayAdapter::PostFrame(ANativeWindowDisplayAdapter::DisplayFrame &dispFrame)
 {
     status_t ret = NO_ERROR;
-    uint32_t actualFramesWithDisplay = 0;
-    android_native_buffer_t *buffer = NULL;
-    android::GraphicBufferMapper &mapper = android::GraphicBufferMapper::get();
     int i;
 
     ///@todo Do cropping based on the stabilized frame coordinates
-    ///@todo Insert logic to drop frames here based on refresh rate of
-    ///display or rendering rate whichever is lower
-    ///Queue the buffer to overlay
 
     if ( NULL == mANativeWindow ) {
         return NO_INIT;
@@ -1032,12 +1155,11 @@ status_t ANativeWindowDisplayAdapter::PostFrame(ANativeWindowDisplayAdapter::Dis
         return BAD_VALUE;
     }
 
-    for ( i = 0; i < mBufferCount; i++ )
-    {
-        if ( dispFrame.mBuffer == &mBuffers[i] )
-        {
-            break;
-        }
+    ///Frames always carry one of our own buffers
+    i = dispFrame.mBuffer - mBuffers;
+    if ( ( 0 > i ) || ( mBufferCount <= i ) ) {
+        CAMHAL_LOGEB("Buffer %p is not a display buffer", dispFrame.mBuffer);
+        return BAD_VALUE;
     }
 
 #if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
@@ -1055,13 +1177,56 @@ status_t ANativeWindowDisplayAdapter::PostFrame(ANativeWindowDisplayAdapter::Dis
 
 #endif
 
-    android::AutoMutex lock(mLock);
+    {
+        android::AutoMutex lock(mLock);
+        const nsecs_t now = systemTime();
+
+        mFramesType.add( (int)mBuffers[i].opaque, dispFrame.mType);
+
+        ///A newer frame makes the waiting one stale, it goes back to the
+        ///camera adapter without being shown. This runs inside the adapter's
+        ///frame dispatch, so the display thread returns it.
+        if ( mHasPendingFrame ) {
+            mFramesType.removeItem((int) mPendingFrame.mBuffer->opaque);
+            mStaleFrames.add(mPendingFrame);
+            mHasPendingFrame = false;
+            mStats.dropped++;
+        }
+
+        ///Preview frames coming in faster than the display refreshes wait
+        ///for the next slot instead of piling up in the window queue.
+        ///Snapshots are shown right away.
+        if ( ( 0 < mPresentInterval ) &&
+             ( CameraFrame::SNAPSHOT_FRAME != dispFrame.mType ) &&
+             ( mDisplayState == ANativeWindowDisplayAdapter::DISPLAY_STARTED ) &&
+             !mPaused &&
+             ( now < ( mLastPresent + mPresentInterval ) ) ) {
+            mPendingFrame = dispFrame;
+            mPendingArrival = now;
+            mHasPendingFrame = true;
+
+            ///Wake the display thread so it sleeps until the slot
+            Utils::Message msg;
+            msg.command = DisplayThread::DISPLAY_FRAME;
+            msg.arg1 = NULL;
+            mDisplayThread->msgQ().put(&msg);
+        } else {
+            ret = presentFrameLocked(dispFrame, i, now);
+        }
+    }
 
-    mFramesType.add( (int)mBuffers[i].opaque, dispFrame.mType);
+    return ret;
+}
+
+status_t ANativeWindowDisplayAdapter::presentFrameLocked(DisplayFrame &dispFrame, int index,
+                                                         nsecs_t arrival)
+{
+    status_t ret = NO_ERROR;
+    android::GraphicBufferMapper &mapper = android::GraphicBufferMapper::get();
+    buffer_handle_t *handle = (buffer_handle_t *) mBuffers[index].opaque;
 
     if ( mDisplayState == ANativeWindowDisplayAdapter::DISPLAY_STARTED &&
-                (!mPaused ||  CameraFrame::CameraFrame::SNAPSHOT_FRAME == dispFrame.mType) &&
-                !mSuspend)
+                (!mPaused ||  CameraFrame::CameraFrame::SNAPSHOT_FRAME == dispFrame.mType) )
     {
         uint32_t xOff, yOff;
 
@@ -1083,19 +1248,34 @@ status_t ANativeWindowDisplayAdapter::PostFrame(ANativeWindowDisplayAdapter::Dis
             mYOff = yOff;
         }
 
-        {
-            buffer_handle_t *handle = (buffer_handle_t *) mBuffers[i].opaque;
-            if (!mUseExternalBufferLocking) {
-                // unlock buffer before sending to display
-                mapper.unlock(*handle);
-            }
-            ret = mANativeWindow->enqueue_buffer(mANativeWindow, handle);
+        if (!mUseExternalBufferLocking) {
+            // unlock buffer before sending to display
+            mapper.unlock(*handle);
         }
+        ret = mANativeWindow->enqueue_buffer(mANativeWindow, handle);
         if ( NO_ERROR != ret ) {
             CAMHAL_LOGE("Surface::queueBuffer returned error %d", ret);
+        } else {
+            const nsecs_t now = systemTime();
+            const nsecs_t pacing = now - arrival;
+
+            if ( NULL != mFrameTimeline.get() ) {
+                mFrameTimeline->mark(dispFrame.mBuffer, FrameTimeline::STAGE_DISPLAY_ENQUEUE);
+            }
+            if ( CameraFrame::SNAPSHOT_FRAME != dispFrame.mType ) {
+                notifyFrameDisplayed();
+            }
+
+            mLastPresent = now;
+            mEnqueueTimes.editItemAt(index) = now;
+            mStats.presented++;
+            mStats.pacingSum += pacing;
+            if ( pacing > mStats.pacingMax ) {
+                mStats.pacingMax = pacing;
+            }
         }
 
-        mFramesWithCameraAdapterMap.removeItem((buffer_handle_t *) dispFrame.mBuffer->opaque);
+        mFramesWithCameraAdapterMap.removeItem(handle);
 
 
         // HWComposer has not minimum buffer requirement. We should be able to dequeue
@@ -1106,7 +1286,6 @@ status_t ANativeWindowDisplayAdapter::PostFrame(ANativeWindowDisplayAdapter::Dis
     }
     else
     {
-        buffer_handle_t *handle = (buffer_handle_t *) mBuffers[i].opaque;
         if (!mUseExternalBufferLocking) {
             // unlock buffer before giving it up
             mapper.unlock(*handle);
@@ -1118,7 +1297,9 @@ status_t ANativeWindowDisplayAdapter::PostFrame(ANativeWindowDisplayAdapter::Dis
             CAMHAL_LOGE("Surface::cancelBuffer returned error %d", ret);
         }
 
-        mFramesWithCameraAdapterMap.removeItem((buffer_handle_t *) dispFrame.mBuffer->opaque);
+        mFramesWithCameraAdapterMap.removeItem(handle);
+        mEnqueueTimes.editItemAt(index) = 0;
+        mStats.cancelled++;
 
         Utils::Message msg;
         mDisplayQ.put(&msg);
@@ -1134,7 +1315,7 @@ bool ANativeWindowDisplayAdapter::handleFrameReturn()
     status_t err;
     buffer_handle_t *buf;
     int i = 0;
-    unsigned int k;
+    ssize_t k;
     int stride;  // dummy variable to get stride
     android::GraphicBufferMapper &mapper = android::GraphicBufferMapper::get();
     android::Rect bounds;
@@ -1156,6 +1337,13 @@ bool ANativeWindowDisplayAdapter::handleFrameReturn()
             CAMHAL_LOGEA("Preview surface abandoned!");
             returnBuffersToWindow();
             mANativeWindow = NULL;
+        } else {
+            ///The window still owes us the buffer, try again later instead
+            ///of leaving the camera adapter one buffer short
+            android::AutoMutex lock(mLock);
+            mFailedDequeues++;
+            mDequeueRetryTime = systemTime() + DEQUEUE_RETRY_DELAY;
+            mStats.dequeueFailures++;
         }
 
         return false;
@@ -1174,14 +1362,17 @@ bool ANativeWindowDisplayAdapter::handleFrameReturn()
         return false;
     }
 
-    for(i = 0; i < mBufferCount; i++)
-    {
-        if (mBuffers[i].opaque == buf)
-            break;
-    }
-    if (i == mBufferCount) {
+    k = mBufferIndex.indexOfKey(buf);
+    if ( 0 > k ) {
         CAMHAL_LOGEB("Failed to find handle %p", buf);
+        return false;
+    }
+    i = mBufferIndex.valueAt(k);
+
+    if ( NULL != mFrameTimeline.get() ) {
+        mFrameTimeline->mark(&mBuffers[i], FrameTimeline::STAGE_DISPLAY_DEQUEUE);
     }
+
     if (!mUseExternalBufferLocking) {
         // lock buffer before sending to FrameProvider for filling
         bounds.left = 0;
@@ -1206,12 +1397,19 @@ bool ANativeWindowDisplayAdapter::handleFrameReturn()
         android::AutoMutex lock(mLock);
         mFramesWithCameraAdapterMap.add((buffer_handle_t *) mBuffers[i].opaque, i);
 
-        for( k = 0; k < mFramesType.size() ; k++) {
-            if(mFramesType.keyAt(k) == (int)mBuffers[i].opaque)
-                break;
+        const nsecs_t enqueued = mEnqueueTimes[i];
+        if ( 0 < enqueued ) {
+            const nsecs_t held = systemTime() - enqueued;
+            mStats.windowCount++;
+            mStats.windowSum += held;
+            if ( held > mStats.windowMax ) {
+                mStats.windowMax = held;
+            }
+            mEnqueueTimes.editItemAt(i) = 0;
         }
 
-        if ( k == mFramesType.size() ) {
+        k = mFramesType.indexOfKey((int) mBuffers[i].opaque);
+        if ( 0 > k ) {
             CAMHAL_LOGE("Frame type for preview buffer 0%x not found!!", mBuffers[i].opaque);
             return false;
         }
@@ -1268,6 +1466,33 @@ void ANativeWindowDisplayAdapter::setExternalLocking(bool extBuffLocking)
     mUseExternalBufferLocking = extBuffLocking;
 }
 
+void ANativeWindowDisplayAdapter::dump(int fd)
+{
+    DisplayStats stats;
+    nsecs_t interval;
+    char line[384];
+
+    {
+        android::AutoMutex lock(mLock);
+        stats = mStats;
+        interval = mPresentInterval;
+    }
+
+    snprintf(line, sizeof(line),
+             "Display: %u presented, %u dropped stale, %u cancelled, %u failed dequeues, "
+             "present interval %lld us\n"
+             "  waiting for slot: average %lld us, worst %lld us\n"
+             "  held by window: %u frames, average %lld us, worst %lld us\n",
+             stats.presented, stats.dropped, stats.cancelled, stats.dequeueFailures,
+             (long long) ns2us(interval),
+             stats.presented ? (long long) ns2us(stats.pacingSum / stats.presented) : 0LL,
+             (long long) ns2us(stats.pacingMax),
+             stats.windowCount,
+             stats.windowCount ? (long long) ns2us(stats.windowSum / stats.windowCount) : 0LL,
+             (long long) ns2us(stats.windowMax));
+    write(fd, line, strlen(line));
+}
+
 /*--------------------ANativeWindowDisplayAdapter Class ENDS here-----------------------------*/
 
 } // namespace Camera
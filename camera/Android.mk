@@ -23,6 +23,17 @@ ifdef TI_CAMERAHAL_DEBUG_FUNCTION_NAMES
     TI_CAMERAHAL_COMMON_CFLAGS += -DTI_UTILS_FUNCTION_LOGGER_ENABLE
 endif
 
+ifdef TI_CAMERAHAL_TRACE_FUNCTION_NAMES
+    # Record function enter/exit into the binary trace buffers instead
+    TI_CAMERAHAL_COMMON_CFLAGS += -DTI_UTILS_FUNCTION_TRACER_ENABLE
+endif
+
+ifdef TI_CAMERAHAL_TRACE_LEVEL
+    # Compile in TI_TRACE_* calls up to this level (1 errors .. 5 verbose),
+    # the records are printed by "dumpsys media.camera"
+    TI_CAMERAHAL_COMMON_CFLAGS += -DTI_UTILS_TRACE_LEVEL=$(TI_CAMERAHAL_TRACE_LEVEL)
+endif
+
 ifdef TI_CAMERAHAL_DEBUG_TIMESTAMPS
     # Enable timestamp logging
     TI_CAMERAHAL_COMMON_CFLAGS += -DTI_UTILS_DEBUG_USE_TIMESTAMPS
@@ -121,6 +132,7 @@ TI_CAMERAHAL_COMMON_SRC := \
     CameraHal_Module.cpp \
     CameraHal.cpp \
     CameraHalUtilClasses.cpp \
+    FrameTimeline.cpp \
     AppCallbackNotifier.cpp \
     ANativeWindowDisplayAdapter.cpp \
     BufferSourceAdapter.cpp \
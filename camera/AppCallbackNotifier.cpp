@@ -20,14 +20,15 @@
 #include <MetadataBufferType.h>
 #include <ui/GraphicBuffer.h>
 #include <ui/GraphicBufferMapper.h>
+#include <cutils/properties.h>
 #include "NV12_resize.h"
+#include "PixelConvert.h"
 #include "TICameraParameters.h"
 
 namespace Ti {
 namespace Camera {
 
 const int AppCallbackNotifier::NOTIFIER_TIMEOUT = -1;
-android::KeyedVector<void*, android::sp<Encoder_libjpeg> > gEncoderQueue;
 
 void AppCallbackNotifierEncoderCallback(void* main_jpeg,
                                         void* thumb_jpeg,
@@ -64,7 +65,6 @@ void AppCallbackNotifier::EncoderDoneCb(void* main_jpeg, void* thumb_jpeg, Camer
     size_t jpeg_size;
     uint8_t* src = NULL;
     CameraBuffer *camera_buffer;
-    android::sp<Encoder_libjpeg> encoder = NULL;
 
     LOG_FUNCTION_NAME;
 
@@ -84,33 +84,36 @@ void AppCallbackNotifier::EncoderDoneCb(void* main_jpeg, void* thumb_jpeg, Camer
     src = main_param->src;
 
     if(encoded_mem && encoded_mem->data && (jpeg_size > 0)) {
+        uint8_t* jpeg = main_param->dst;
+
         if (cookie2) {
             ExifElementsTable* exif = (ExifElementsTable*) cookie2;
-            Section_t* exif_section = NULL;
-
-            exif->insertExifToJpeg((unsigned char*) encoded_mem->data, jpeg_size);
+            const uint8_t* thumb = NULL;
+            size_t thumb_size = 0;
+            uint8_t* exif_jpeg = NULL;
+            size_t exif_jpeg_size = 0;
 
             if(thumb_jpeg) {
                 thumb_param = (Encoder_libjpeg::params *) thumb_jpeg;
-                exif->insertExifThumbnailImage((const char*)thumb_param->dst,
-                                               (int)thumb_param->jpeg_size);
+                thumb = thumb_param->dst;
+                thumb_size = thumb_param->jpeg_size;
             }
 
-            exif_section = FindSection(M_EXIF);
-
-            if (exif_section) {
-                picture = mRequestMemory(-1, jpeg_size + exif_section->Size, 1, NULL);
-                if (picture && picture->data) {
-                    exif->saveJpeg((unsigned char*) picture->data, jpeg_size + exif_section->Size);
-                }
+            // APP1 is serialized into the headroom in front of the main image
+            exif_jpeg = exif->insertExifToJpeg(jpeg, jpeg_size, thumb, thumb_size,
+                                               &exif_jpeg_size);
+            if (exif_jpeg) {
+                jpeg = exif_jpeg;
+                jpeg_size = exif_jpeg_size;
             }
+
             delete exif;
             cookie2 = NULL;
-        } else {
-            picture = mRequestMemory(-1, jpeg_size, 1, NULL);
-            if (picture && picture->data) {
-                memcpy(picture->data, encoded_mem->data, jpeg_size);
-            }
+        }
+
+        picture = mRequestMemory(-1, jpeg_size, 1, NULL);
+        if (picture && picture->data) {
+            memcpy(picture->data, jpeg, jpeg_size);
         }
     }
     } // scope for mutex lock
@@ -153,11 +156,7 @@ void AppCallbackNotifier::EncoderDoneCb(void* main_jpeg, void* thumb_jpeg, Camer
         if (cookie2) {
             delete (ExifElementsTable*) cookie2;
         }
-        encoder = gEncoderQueue.valueFor(src);
-        if (encoder.get()) {
-            gEncoderQueue.removeItem(src);
-            encoder.clear();
-        }
+        mEncoderPool->remove(src);
         mFrameProvider->returnFrame(camera_buffer, type);
     }
 
@@ -174,11 +173,22 @@ status_t AppCallbackNotifier::initialize()
     LOG_FUNCTION_NAME;
 
     mPreviewMemory = 0;
+    mPreparedPreviewMemory = 0;
+    mPreparedPreviewSize = 0;
 
     mMeasurementEnabled = false;
 
     mNotifierState = NOTIFIER_STOPPED;
 
+    mTrimDeadline = 0;
+
+    ///Preview callbacks only need the newest frames, a slow client should
+    ///not keep the adapter out of buffers
+    mFrameQ.setCoalescePolicy(NOTIFIER_CMD_PROCESS_PREVIEW_FRAME,
+                              Utils::MessageQueue::COALESCE_DROP_OLDEST,
+                              MAX_QUEUED_PREVIEW_FRAMES);
+    mFrameQ.setDropCallback(frameDropRelay, this);
+
     ///Create the app notifier thread
     mNotificationThread = new NotificationThread(this);
     if(!mNotificationThread.get())
@@ -196,12 +206,28 @@ status_t AppCallbackNotifier::initialize()
         return ret;
         }
 
+    ///Start the JPEG encoder threads
+    mEncoderPool = new JpegEncoderPool();
+    ret = mEncoderPool->initialize();
+    if(ret!=NO_ERROR)
+        {
+        CAMHAL_LOGEA("Couldn't start JPEG encoder pool");
+        mEncoderPool.clear();
+        return ret;
+        }
+
     mUseMetaDataBufferMode = true;
     mRawAvailable = false;
 
     mRecording = false;
     mPreviewing = false;
     mExternalLocking = false;
+    mResizeThreads = IC_RESIZE_THREADS_AUTO;
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get("camera.callback.zerocopy", value, "0");
+    mZeroCopyPreview = (atoi(value) != 0);
+    mLentPreviewLimit = 0;
 
     LOG_FUNCTION_NAME_EXIT;
 
@@ -286,7 +312,7 @@ bool AppCallbackNotifier::notificationThread()
     ret = Utils::MessageQueue::waitForMsg(&mNotificationThread->msgQ(),
                                             &mEventQ,
                                             &mFrameQ,
-                                            AppCallbackNotifier::NOTIFIER_TIMEOUT);
+                                            memoryTrimTimeout());
 
     //CAMHAL_LOGDA("Notification Thread received message");
 
@@ -306,16 +332,71 @@ bool AppCallbackNotifier::notificationThread()
         notifyEvent();
      }
 
+    returnDroppedFrames();
+
     if(mFrameQ.hasMsg()) {
        ///Received a frame from one of the frame providers
        //CAMHAL_LOGDA("Notification Thread received a frame from frame provider (CameraAdapter)");
        notifyFrame();
     }
 
+    trimIdleMemory();
+
     LOG_FUNCTION_NAME_EXIT;
     return shouldLive;
 }
 
+int AppCallbackNotifier::memoryTrimTimeout()
+{
+    android::AutoMutex lock(mLock);
+
+    if ( NULL == mTrimMemoryManager.get() ) {
+        return AppCallbackNotifier::NOTIFIER_TIMEOUT;
+    }
+
+    const nsecs_t remaining = mTrimDeadline - systemTime();
+    if ( remaining <= 0 ) {
+        return 0;
+    }
+
+    // round up, waking early would only spin until the deadline
+    return (int) ns2ms(remaining + ms2ns(1) - 1);
+}
+
+void AppCallbackNotifier::trimIdleMemory()
+{
+    android::sp<MemoryManager> memoryManager;
+
+    {
+        android::AutoMutex lock(mLock);
+        if ( ( NULL == mTrimMemoryManager.get() ) || ( systemTime() < mTrimDeadline ) ) {
+            return;
+        }
+        memoryManager = mTrimMemoryManager;
+        mTrimMemoryManager.clear();
+    }
+
+    CAMHAL_LOGD("Camera idle, releasing the pooled buffers");
+    memoryManager->trimPool(0);
+}
+
+void AppCallbackNotifier::scheduleMemoryTrim(const android::sp<MemoryManager> &memoryManager,
+                                             nsecs_t delay)
+{
+    {
+        android::AutoMutex lock(mLock);
+        mTrimMemoryManager = memoryManager;
+        mTrimDeadline = systemTime() + delay;
+    }
+
+    // the notifier thread picks up the new deadline when it wakes
+    if ( ( NULL != memoryManager.get() ) && ( NULL != mNotificationThread.get() ) ) {
+        Utils::Message msg = {0,0,0,0,0,0};
+        msg.command = NotificationThread::NOTIFIER_TRIM_SCHEDULED;
+        mNotificationThread->msgQ().put(&msg);
+    }
+}
+
 void AppCallbackNotifier::notifyEvent()
 {
     ///Receive and send the event notifications to app
@@ -489,9 +570,6 @@ static void copy2Dto1D(void *dst,
                        const char *pixelFormat)
 {
     unsigned int alignedRow, row;
-    unsigned char *bufferDst, *bufferSrc;
-    unsigned char *bufferDstEnd, *bufferSrcEnd;
-    uint16_t *bufferSrc_UV;
 
     unsigned int *y_uv = (unsigned int *)src;
 
@@ -499,227 +577,59 @@ static void copy2Dto1D(void *dst,
     CAMHAL_LOGVB("pixelFormat = %s; offset=%d",pixelFormat,offset);
 
     if (pixelFormat!=NULL) {
-        if (strcmp(pixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV422I) == 0) {
-            bytesPerPixel = 2;
-            bufferSrc = ( unsigned char * ) y_uv[0] + offset;
-            uint32_t xOff = offset % stride;
-            uint32_t yOff = offset / stride;
-            uint8_t *bufferSrcUV = ((uint8_t*)y_uv[1] + (stride/2)*yOff + xOff);
-            uint8_t *bufferSrcUVEven = bufferSrcUV;
-
-            uint8_t *bufferDstY = ( uint8_t * ) dst;
-            uint8_t *bufferDstU = bufferDstY + 1;
-            uint8_t *bufferDstV = bufferDstY + 3;
+        const uint8_t *bufferSrcY = (uint8_t*)y_uv[0] + offset;
+        uint32_t xOff = offset % stride;
+        uint32_t yOff = offset / stride;
+        const uint8_t *bufferSrcUV = ((uint8_t*)y_uv[1] + (stride/2)*yOff + xOff);
 
+        if (strcmp(pixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV422I) == 0) {
             // going to convert from NV12 here and return
-            for ( int i = 0 ; i < height; i ++ ) {
-                for ( int j = 0 ; j < width / 2 ; j++ ) {
-
-                    // Y
-                    *bufferDstY = *bufferSrc;
-                    bufferSrc++;
-                    bufferDstY += 2;
-
-                    *bufferDstY = *bufferSrc;
-                    bufferSrc++;
-                    bufferDstY += 2;
-
-                    // V
-                    *bufferDstV = *(bufferSrcUV + 1);
-                    bufferDstV += 4;
-
-                    // U
-                    *bufferDstU = *bufferSrcUV;
-                    bufferDstU += 4;
-
-                    bufferSrcUV += 2;
-                }
-                if ( i % 2 ) {
-                    bufferSrcUV += ( stride - width);
-                    bufferSrcUVEven = bufferSrcUV;
-                } else {
-                    bufferSrcUV = bufferSrcUVEven;
-                }
-                bufferSrc += ( stride - width);
-            }
-
+            Utils::PixelConvert::nv12ToYuyv(bufferSrcY, stride,
+                                            bufferSrcUV, stride,
+                                            (uint8_t*)dst, width * 2,
+                                            width, height);
             return;
-        } else if (strcmp(pixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV420SP) == 0 ||
-                   strcmp(pixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV420P) == 0) {
-            bytesPerPixel = 1;
-            bufferDst = ( unsigned char * ) dst;
-            bufferDstEnd = ( unsigned char * ) dst + width*height*bytesPerPixel;
-            bufferSrc = ( unsigned char * ) y_uv[0] + offset;
-            bufferSrcEnd = ( unsigned char * ) ( ( size_t ) y_uv[0] + length + offset);
-            row = width*bytesPerPixel;
-            alignedRow = stride-width;
-            int stride_bytes = stride / 8;
-            uint32_t xOff = offset % stride;
-            uint32_t yOff = offset / stride;
-
-            // going to convert from NV12 here and return
-            // Step 1: Y plane: iterate through each row and copy
-            for ( int i = 0 ; i < height ; i++) {
-                memcpy(bufferDst, bufferSrc, row);
-                bufferSrc += stride;
-                bufferDst += row;
-                if ( ( bufferSrc > bufferSrcEnd ) || ( bufferDst > bufferDstEnd ) ) {
-                    break;
-                }
-            }
-
-            bufferSrc_UV = ( uint16_t * ) ((uint8_t*)y_uv[1] + (stride/2)*yOff + xOff);
-
-            if (strcmp(pixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV420SP) == 0) {
-                 uint16_t *bufferDst_UV;
-
-                // Step 2: UV plane: convert NV12 to NV21 by swapping U & V
-                bufferDst_UV = (uint16_t *) (((uint8_t*)dst)+row*height);
-
-#ifdef ARCH_ARM_HAVE_NEON
-                for (int i = 0 ; i < height/2 ; i++, bufferSrc_UV += alignedRow/2) {
-                    int n = width;
-                    asm volatile (
-                    "   pld [%[src], %[src_stride], lsl #2]                         \n\t"
-                    "   cmp %[n], #32                                               \n\t"
-                    "   blt 1f                                                      \n\t"
-                    "0: @ 32 byte swap                                              \n\t"
-                    "   sub %[n], %[n], #32                                         \n\t"
-                    "   vld2.8  {q0, q1} , [%[src]]!                                \n\t"
-                    "   vswp q0, q1                                                 \n\t"
-                    "   cmp %[n], #32                                               \n\t"
-                    "   vst2.8  {q0,q1},[%[dst]]!                                   \n\t"
-                    "   bge 0b                                                      \n\t"
-                    "1: @ Is there enough data?                                     \n\t"
-                    "   cmp %[n], #16                                               \n\t"
-                    "   blt 3f                                                      \n\t"
-                    "2: @ 16 byte swap                                              \n\t"
-                    "   sub %[n], %[n], #16                                         \n\t"
-                    "   vld2.8  {d0, d1} , [%[src]]!                                \n\t"
-                    "   vswp d0, d1                                                 \n\t"
-                    "   cmp %[n], #16                                               \n\t"
-                    "   vst2.8  {d0,d1},[%[dst]]!                                   \n\t"
-                    "   bge 2b                                                      \n\t"
-                    "3: @ Is there enough data?                                     \n\t"
-                    "   cmp %[n], #8                                                \n\t"
-                    "   blt 5f                                                      \n\t"
-                    "4: @ 8 byte swap                                               \n\t"
-                    "   sub %[n], %[n], #8                                          \n\t"
-                    "   vld2.8  {d0, d1} , [%[src]]!                                \n\t"
-                    "   vswp d0, d1                                                 \n\t"
-                    "   cmp %[n], #8                                                \n\t"
-                    "   vst2.8  {d0[0],d1[0]},[%[dst]]!                             \n\t"
-                    "   bge 4b                                                      \n\t"
-                    "5: @ end                                                       \n\t"
-#ifdef NEEDS_ARM_ERRATA_754319_754320
-                    "   vmov s0,s0  @ add noop for errata item                      \n\t"
-#endif
-                    : [dst] "+r" (bufferDst_UV), [src] "+r" (bufferSrc_UV), [n] "+r" (n)
-                    : [src_stride] "r" (stride_bytes)
-                    : "cc", "memory", "q0", "q1"
-                    );
-                }
-#else
-                for ( int i = 0; i < height/2; ++i ) {
-                    for ( int j = 0; j < width/2; ++j ) {
-                        bufferDst_UV[j] = (bufferSrc_UV[j] >> 8) | (bufferSrc_UV[j] << 8);
-                    }
-                    bufferSrc_UV += stride/bytesPerPixel/2;
-                    bufferDst_UV += width/2;
-                }
-#endif
-            } else if (strcmp(pixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV420P) == 0) {
-                // Step 2: UV plane: convert NV12 to YV12 by de-interleaving U & V
-                // TODO(XXX): This version of CameraHal assumes NV12 format it set at
-                //            camera adapter to support YV12. Need to address for
-                //            USBCamera
-
-                size_t yStride, uvStride, ySize, uvSize, size;
-                alignYV12(width, height, yStride, uvStride, ySize, uvSize, size);
-
-                uint16_t *bufferDst_V = (uint16_t *) (((uint8_t*)dst) + ySize);
-                uint16_t *bufferDst_U = (uint16_t *) (((uint8_t*)dst) + ySize + uvSize);
-
-#ifdef ARCH_ARM_HAVE_NEON
-                int inc = (uvStride - width/2)/2;
-
-                for (int i = 0 ; i < height/2 ; i++, bufferSrc_UV += alignedRow/2) {
-                    int n = width;
-                    asm volatile (
-                    "   pld [%[src], %[src_stride], lsl #2]                         \n\t"
-                    "   cmp %[n], #32                                               \n\t"
-                    "   blt 1f                                                      \n\t"
-                    "0: @ 32 byte swap                                              \n\t"
-                    "   sub %[n], %[n], #32                                         \n\t"
-                    "   vld2.8  {q0, q1} , [%[src]]!                                \n\t"
-                    "   cmp %[n], #32                                               \n\t"
-                    "   vst1.8  {q1},[%[dst_v]]!                                    \n\t"
-                    "   vst1.8  {q0},[%[dst_u]]!                                    \n\t"
-                    "   bge 0b                                                      \n\t"
-                    "1: @ Is there enough data?                                     \n\t"
-                    "   cmp %[n], #16                                               \n\t"
-                    "   blt 3f                                                      \n\t"
-                    "2: @ 16 byte swap                                              \n\t"
-                    "   sub %[n], %[n], #16                                         \n\t"
-                    "   vld2.8  {d0, d1} , [%[src]]!                                \n\t"
-                    "   cmp %[n], #16                                               \n\t"
-                    "   vst1.8  {d1},[%[dst_v]]!                                    \n\t"
-                    "   vst1.8  {d0},[%[dst_u]]!                                    \n\t"
-                    "   bge 2b                                                      \n\t"
-                    "3: @ Is there enough data?                                     \n\t"
-                    "   cmp %[n], #8                                                \n\t"
-                    "   blt 5f                                                      \n\t"
-                    "4: @ 8 byte swap                                               \n\t"
-                    "   sub %[n], %[n], #8                                          \n\t"
-                    "   vld2.8  {d0, d1} , [%[src]]!                                \n\t"
-                    "   cmp %[n], #8                                                \n\t"
-                    "   vst1.8  {d1[0]},[%[dst_v]]!                                 \n\t"
-                    "   vst1.8  {d0[0]},[%[dst_u]]!                                 \n\t"
-                    "   bge 4b                                                      \n\t"
-                    "5: @ end                                                       \n\t"
-#ifdef NEEDS_ARM_ERRATA_754319_754320
-                    "   vmov s0,s0  @ add noop for errata item                      \n\t"
-#endif
-                    : [dst_u] "+r" (bufferDst_U), [dst_v] "+r" (bufferDst_V),
-                      [src] "+r" (bufferSrc_UV), [n] "+r" (n)
-                    : [src_stride] "r" (stride_bytes)
-                    : "cc", "memory", "q0", "q1"
-                    );
-
-                    bufferDst_U += inc;
-                    bufferDst_V += inc;
-                }
-#else
-                uint8_t * udst = reinterpret_cast<uint8_t*>(bufferDst_V);
-                uint8_t * vdst = reinterpret_cast<uint8_t*>(bufferDst_U);
+        } else if (strcmp(pixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV420SP) == 0) {
+            uint8_t *bufferDstY = (uint8_t*)dst;
+            uint8_t *bufferDstUV = bufferDstY + width * height;
 
-                for ( int i = 0; i < height/2; ++i ) {
-                    for ( int j = 0; j < width/2; ++j ) {
-                        udst[j] = bufferSrc_UV[j] >> 8;
-                        vdst[j] = bufferSrc_UV[j] & 0x00ff;
-                    }
-                    bufferSrc_UV += stride/bytesPerPixel/2;
-                    udst += width/2;
-                    vdst += width/2;
-                }
-#endif
-            }
-            return ;
+            // Step 1: Y plane
+            Utils::PixelConvert::copyPlane(bufferSrcY, stride, bufferDstY, width, width, height);
 
+            // Step 2: UV plane: convert NV12 to NV21 by swapping U & V
+            Utils::PixelConvert::swapUV(bufferSrcUV, stride, bufferDstUV, width, width/2, height/2);
+            return;
+        } else if (strcmp(pixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV420P) == 0) {
+            // Convert NV12 to YV12 by de-interleaving U & V
+            // TODO(XXX): This version of CameraHal assumes NV12 format it set at
+            //            camera adapter to support YV12. Need to address for
+            //            USBCamera
+
+            size_t yStride, uvStride, ySize, uvSize, size;
+            alignYV12(width, height, yStride, uvStride, ySize, uvSize, size);
+
+            uint8_t *bufferDstY = (uint8_t*)dst;
+            uint8_t *bufferDstV = bufferDstY + ySize;
+            uint8_t *bufferDstU = bufferDstV + uvSize;
+
+            // Step 1: Y plane
+            Utils::PixelConvert::copyPlane(bufferSrcY, stride, bufferDstY, yStride, width, height);
+
+            // Step 2: UV plane, YV12 keeps V ahead of U
+            Utils::PixelConvert::deinterleaveUV(bufferSrcUV, stride,
+                                                bufferDstU, uvStride,
+                                                bufferDstV, uvStride,
+                                                width/2, height/2);
+            return;
         } else if(strcmp(pixelFormat, android::CameraParameters::PIXEL_FORMAT_RGB565) == 0) {
             bytesPerPixel = 2;
         }
     }
 
-    bufferDst = ( unsigned char * ) dst;
-    bufferSrc = ( unsigned char * ) y_uv[0];
     row = width*bytesPerPixel;
     alignedRow = ( row + ( stride -1 ) ) & ( ~ ( stride -1 ) );
 
-    //iterate through each row
-    for ( int i = 0 ; i < height ; i++,  bufferSrc += alignedRow, bufferDst += row) {
-        memcpy(bufferDst, bufferSrc, row);
-    }
+    Utils::PixelConvert::copyPlane((uint8_t*)y_uv[0], alignedRow, (uint8_t*)dst, row, row, height);
 }
 
 static void copyCroppedNV12(CameraFrame* frame, unsigned char *dst)
@@ -748,16 +658,8 @@ static void copyCroppedNV12(CameraFrame* frame, unsigned char *dst)
     unsigned const char *chroma = src + uvoffset;
 
     // copy luma and chroma line x line
-    for (unsigned int i = 0; i < height; i++) {
-        memcpy(dst, luma, width);
-        luma += stride;
-        dst += width;
-    }
-    for (unsigned int i = 0; i < height / 2; i++) {
-        memcpy(dst, chroma, width);
-        chroma += stride;
-        dst += width;
-    }
+    Utils::PixelConvert::copyPlane(luma, stride, dst, width, width, height);
+    Utils::PixelConvert::copyPlane(chroma, stride, dst + width * height, width, width, height / 2);
 }
 
 void AppCallbackNotifier::copyAndSendPictureFrame(CameraFrame* frame, int32_t msgType)
@@ -841,10 +743,113 @@ void AppCallbackNotifier::setExternalLocking(bool extBuffLocking)
     mExternalLocking = extBuffLocking;
 }
 
+void AppCallbackNotifier::setResizeThreads(int threads)
+{
+    mResizeThreads = threads;
+}
+
+bool AppCallbackNotifier::canSendPreviewFrameInPlace(CameraFrame* frame, size_t &size)
+{
+    CameraBuffer *buffer = frame->mBuffer;
+
+    if ( !mZeroCopyPreview || mExternalLocking || (0 == mLentPreviewLimit) ) {
+        return false;
+    }
+
+    // Only ION buffers carry an fd the client side can map
+    if ( (CAMERA_BUFFER_ION != buffer->type) || (0 > buffer->fd) || (0 != frame->mOffset) ) {
+        return false;
+    }
+
+    // data sync frames are sent as they are
+    if ( CameraFrame::FRAME_DATA_SYNC == frame->mFrameType ) {
+        size = frame->mLength;
+        return ( size <= buffer->size );
+    }
+
+    // Image frames must already be in the requested layout. Preview YUV is
+    // NV12 internally, while the application expects NV21/YV12/YUYV, so those
+    // always go through copy2Dto1D.
+    if ( (NULL == buffer->format) || (NULL == mPreviewPixelFormat) ||
+         (0 != strcmp(buffer->format, mPreviewPixelFormat)) ||
+         (0 == strcmp(mPreviewPixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV420SP)) ||
+         (0 == strcmp(mPreviewPixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV420P)) ||
+         (0 == strcmp(mPreviewPixelFormat, android::CameraParameters::PIXEL_FORMAT_YUV422I)) ) {
+        return false;
+    }
+
+    if ( ((int) frame->mWidth != mPreviewWidth) || ((int) frame->mHeight != mPreviewHeight) ||
+         (frame->mAlignment != frame->mWidth * CameraHal::getBPP(mPreviewPixelFormat)) ) {
+        return false;
+    }
+
+    size = CameraHal::calculateBufferSize(mPreviewPixelFormat, mPreviewWidth, mPreviewHeight);
+
+    return ( (0 < size) && (size <= frame->mLength) && (size <= buffer->size) );
+}
+
+camera_memory_t* AppCallbackNotifier::getInPlacePreviewMemory(CameraBuffer *buffer, size_t size)
+{
+    camera_memory_t *mem = NULL;
+    ssize_t index = mInPlacePreviewMemory.indexOfKey(buffer);
+
+    if ( 0 <= index ) {
+        mem = mInPlacePreviewMemory.valueAt(index);
+        if ( mem->size == size ) {
+            return mem;
+        }
+
+        mem->release(mem);
+        mInPlacePreviewMemory.removeItemsAt(index);
+    }
+
+    // The heap maps the buffer fd, so the application reads the frame in place
+    mem = mRequestMemory(buffer->fd, size, 1, NULL);
+    if ( (NULL == mem) || (NULL == mem->data) ) {
+        CAMHAL_LOGEB("Mapping preview buffer fd %d failed", buffer->fd);
+        if ( mem ) {
+            mem->release(mem);
+        }
+        return NULL;
+    }
+
+    mInPlacePreviewMemory.add(buffer, mem);
+
+    return mem;
+}
+
+void AppCallbackNotifier::returnLentPreviewFrames(size_t keep)
+{
+    while ( mLentPreviewFrames.size() > keep ) {
+        const LentPreviewFrame &lent = mLentPreviewFrames.itemAt(0);
+        mFrameProvider->returnFrame(lent.mBuffer, (CameraFrame::FrameType) lent.mFrameType);
+        mLentPreviewFrames.removeAt(0);
+    }
+}
+
+void AppCallbackNotifier::releaseInPlacePreviewMemory()
+{
+    for ( size_t i = 0; i < mInPlacePreviewMemory.size(); i++ ) {
+        camera_memory_t *mem = mInPlacePreviewMemory.valueAt(i);
+        mem->release(mem);
+    }
+    mInPlacePreviewMemory.clear();
+}
+
+void AppCallbackNotifier::releasePreparedPreviewMemory()
+{
+    if ( mPreparedPreviewMemory ) {
+        mPreparedPreviewMemory->release(mPreparedPreviewMemory);
+        mPreparedPreviewMemory = 0;
+        mPreparedPreviewSize = 0;
+    }
+}
+
 void AppCallbackNotifier::copyAndSendPreviewFrame(CameraFrame* frame, int32_t msgType)
 {
     camera_memory_t* picture = NULL;
     CameraBuffer * dest = NULL;
+    size_t inPlaceSize = 0;
 
     // scope for lock
     {
@@ -859,6 +864,32 @@ void AppCallbackNotifier::copyAndSendPreviewFrame(CameraFrame* frame, int32_t ms
             goto exit;
         }
 
+        if ( canSendPreviewFrameInPlace(frame, inPlaceSize) ) {
+            picture = getInPlacePreviewMemory(frame->mBuffer, inPlaceSize);
+        }
+
+        if ( NULL != picture ) {
+            // The frame goes back to the adapter once the application
+            // has been given mLentPreviewLimit newer ones
+            LentPreviewFrame lent;
+            lent.mBuffer = frame->mBuffer;
+            lent.mFrameType = frame->mFrameType;
+            mLentPreviewFrames.push_back(lent);
+
+            if ( mCameraHal->msgTypeEnabled(msgType) ) {
+                if ( NULL != mFrameTimeline.get() ) {
+                    mFrameTimeline->mark(frame->mBuffer, FrameTimeline::STAGE_CALLBACK);
+                }
+                mDataCb(msgType, picture, 0, NULL, mCallbackCookie);
+                if ( CAMERA_MSG_PREVIEW_FRAME == msgType ) {
+                    mCameraHal->previewFrameDelivered();
+                }
+            }
+
+            returnLentPreviewFrames(mLentPreviewLimit);
+            return;
+        }
+
         dest = &mPreviewBuffers[mPreviewBufCount];
         if (mExternalLocking) {
             lockBufferAndUpdatePtrs(frame);
@@ -910,8 +941,15 @@ void AppCallbackNotifier::copyAndSendPreviewFrame(CameraFrame* frame, int32_t ms
        mCameraHal->msgTypeEnabled(msgType) &&
        (dest != NULL) && (dest->mapped != NULL)) {
         android::AutoMutex locker(mLock);
-        if ( mPreviewMemory )
+        if ( mPreviewMemory ) {
+            if ( NULL != mFrameTimeline.get() ) {
+                mFrameTimeline->mark(frame->mBuffer, FrameTimeline::STAGE_CALLBACK);
+            }
             mDataCb(msgType, mPreviewMemory, mPreviewBufCount, NULL, mCallbackCookie);
+            if ( CAMERA_MSG_PREVIEW_FRAME == msgType ) {
+                mCameraHal->previewFrameDelivered();
+            }
+        }
     }
 
     if (mExternalLocking) {
@@ -982,6 +1020,7 @@ void AppCallbackNotifier::notifyFrame()
     frame = NULL;
     switch(msg.command)
         {
+        case AppCallbackNotifier::NOTIFIER_CMD_PROCESS_PREVIEW_FRAME:
         case AppCallbackNotifier::NOTIFIER_CMD_PROCESS_FRAME:
 
                 frame = (CameraFrame *) msg.arg1;
@@ -1026,11 +1065,37 @@ void AppCallbackNotifier::notifyFrame()
                     unsigned int current_snapshot = 0;
                     Encoder_libjpeg::params *main_jpeg = NULL, *tn_jpeg = NULL;
                     void* exif_data = NULL;
+                    size_t exif_headroom = 0;
                     const char *previewFormat = NULL;
-                    camera_memory_t* raw_picture = mRequestMemory(-1, frame->mLength, 1, NULL);
 
-                    if(raw_picture) {
-                        buf = raw_picture->data;
+                    // Throttle the capture path while the encoders are saturated,
+                    // the capture is dropped rather than queued past the limit
+                    status_t slot = mEncoderPool->waitForSlot();
+                    if ( NO_ERROR != slot ) {
+                        if ( TIMED_OUT == slot ) {
+                            CAMHAL_LOGEA("JPEG encoder pool stayed full, dropping capture");
+                            errorNotify(CAMERA_ERROR_UNKNOWN);
+                        } else {
+                            CAMHAL_LOGEA("JPEG encoder pool is not running, dropping capture");
+                        }
+                        if (CameraFrame::HAS_EXIF_DATA & frame->mQuirks) {
+                            delete (ExifElementsTable*) frame->mCookie2;
+                        }
+                        mFrameProvider->returnFrame(frame->mBuffer,
+                                                    (CameraFrame::FrameType) frame->mFrameType);
+                        break;
+                    }
+
+                    // EXIF is serialized in front of the main image once it is encoded
+                    if (CameraFrame::HAS_EXIF_DATA & frame->mQuirks) {
+                        exif_data = frame->mCookie2;
+                        exif_headroom = EXIF_APP1_HEADROOM;
+                    }
+
+                    camera_memory_t* raw_picture = mRequestMemory(-1, frame->mLength + exif_headroom, 1, NULL);
+
+                    if(raw_picture && raw_picture->data) {
+                        buf = (uint8_t*) raw_picture->data + exif_headroom;
                     }
 
                     android::CameraParameters parameters;
@@ -1048,10 +1113,6 @@ void AppCallbackNotifier::notifyFrame()
                         tn_quality = 100;
                     }
 
-                    if (CameraFrame::HAS_EXIF_DATA & frame->mQuirks) {
-                        exif_data = frame->mCookie2;
-                    }
-
                     main_jpeg = (Encoder_libjpeg::params*)
                                     malloc(sizeof(Encoder_libjpeg::params));
 
@@ -1074,6 +1135,8 @@ void AppCallbackNotifier::notifyFrame()
                         main_jpeg->out_height = frame->mHeight;
                         main_jpeg->right_crop = rightCrop;
                         main_jpeg->start_offset = frame->mOffset;
+                        main_jpeg->resize_threads = mResizeThreads;
+                        main_jpeg->strips = mEncoderPool->maxStrips();
                         if ( CameraFrame::FORMAT_YUV422I_UYVY & frame->mQuirks) {
                             main_jpeg->format = TICameraParameters::PIXEL_FORMAT_YUV422I_UYVY;
                         }
@@ -1112,6 +1175,8 @@ void AppCallbackNotifier::notifyFrame()
                         tn_jpeg->out_height = tn_height;
                         tn_jpeg->right_crop = 0;
                         tn_jpeg->start_offset = 0;
+                        tn_jpeg->resize_threads = mResizeThreads;
+                        tn_jpeg->strips = 1;
                         tn_jpeg->format = android::CameraParameters::PIXEL_FORMAT_YUV420SP;;
                     }
 
@@ -1122,12 +1187,17 @@ void AppCallbackNotifier::notifyFrame()
                                                       this,
                                                       raw_picture,
                                                       exif_data, frame->mBuffer);
-                    gEncoderQueue.add(frame->mBuffer->mapped, encoder);
-#ifdef ANDROID_API_N_OR_LATER
-                    encoder->run("jpeg_encoder");
-#else
-                    encoder->run();
-#endif
+                    if ( NO_ERROR != mEncoderPool->queue(frame->mBuffer->mapped, encoder) ) {
+                        CAMHAL_LOGEA("JPEG encoder pool is not running, dropping capture");
+                        if (raw_picture) {
+                            raw_picture->release(raw_picture);
+                        }
+                        AppCallbackNotifierEncoderCallback(main_jpeg, tn_jpeg,
+                                                           (CameraFrame::FrameType)frame->mFrameType,
+                                                           NULL, NULL, NULL, NULL, true);
+                        mFrameProvider->returnFrame(frame->mBuffer,
+                                                    (CameraFrame::FrameType) frame->mFrameType);
+                    }
                     encoder.clear();
                     if (params != NULL)
                       {
@@ -1219,7 +1289,7 @@ void AppCallbackNotifier::notifyFrame()
                                                           (mmByte *)y_uv[1],
                                                           0};
 
-                                VT_resizeFrame_Video_opt2_lp(&input, &output, NULL, 0);
+                                VT_resizeFrame_Video_parallel_lp(&input, &output, NULL, mResizeThreads);
                                 mapper.unlock((buffer_handle_t)vBuf->opaque);
                                 if (mExternalLocking) {
                                     unlockBufferAndUpdatePtrs(frame);
@@ -1239,6 +1309,9 @@ void AppCallbackNotifier::notifyFrame()
                             CAMHAL_LOGVB("mDataCbTimestamp : frame->mBuffer=0x%x, videoMetadataBuffer=0x%x, videoMedatadaBufferMemory=0x%x",
                                             frame->mBuffer->opaque, videoMetadataBuffer, videoMedatadaBufferMemory);
 
+                            if ( NULL != mFrameTimeline.get() ) {
+                                mFrameTimeline->mark(frame->mBuffer, FrameTimeline::STAGE_ENCODER_INPUT);
+                            }
                             mDataCbTimestamp(frame->mTimestamp, CAMERA_MSG_VIDEO_FRAME,
                                                 videoMedatadaBufferMemory, 0, mCallbackCookie);
                             }
@@ -1255,6 +1328,9 @@ void AppCallbackNotifier::notifyFrame()
                                 lockBufferAndUpdatePtrs(frame);
                             }
                             *reinterpret_cast<buffer_handle_t*>(fakebuf->data) = reinterpret_cast<buffer_handle_t>(frame->mBuffer->mapped);
+                            if ( NULL != mFrameTimeline.get() ) {
+                                mFrameTimeline->mark(frame->mBuffer, FrameTimeline::STAGE_ENCODER_INPUT);
+                            }
                             mDataCbTimestamp(frame->mTimestamp, CAMERA_MSG_VIDEO_FRAME, fakebuf, 0, mCallbackCookie);
                             fakebuf->release(fakebuf);
                             if (mExternalLocking) {
@@ -1324,6 +1400,45 @@ void AppCallbackNotifier::frameCallbackRelay(CameraFrame* caFrame)
     LOG_FUNCTION_NAME_EXIT;
 }
 
+void AppCallbackNotifier::frameDropRelay(Utils::Message *msg, void *cookie)
+{
+    LOG_FUNCTION_NAME;
+
+    AppCallbackNotifier *appcbn = (AppCallbackNotifier*) cookie;
+    CameraFrame *frame = (CameraFrame *) msg->arg1;
+
+    if ( NULL != frame ) {
+        TI_TRACE_D("preview callback frame %p dropped", frame->mBuffer);
+        // runs on the adapter's dispatch thread, returning the frame from
+        // here would re-enter the adapter
+        android::AutoMutex lock(appcbn->mDroppedFramesLock);
+        appcbn->mDroppedFrames.add(frame);
+    }
+
+    LOG_FUNCTION_NAME_EXIT;
+}
+
+void AppCallbackNotifier::returnDroppedFrames()
+{
+    android::Vector<CameraFrame *> frames;
+
+    {
+        android::AutoMutex lock(mDroppedFramesLock);
+        if ( mDroppedFrames.isEmpty() ) {
+            return;
+        }
+        frames = mDroppedFrames;
+        mDroppedFrames.clear();
+    }
+
+    for ( size_t i = 0; i < frames.size(); i++ ) {
+        CameraFrame *frame = frames[i];
+        mFrameProvider->returnFrame(frame->mBuffer,
+                                    (CameraFrame::FrameType) frame->mFrameType);
+        delete frame;
+    }
+}
+
 void AppCallbackNotifier::frameCallback(CameraFrame* caFrame)
 {
     ///Post the event to the event queue of AppCallbackNotifier
@@ -1338,7 +1453,11 @@ void AppCallbackNotifier::frameCallback(CameraFrame* caFrame)
         frame = new CameraFrame(*caFrame);
         if ( NULL != frame )
             {
-              msg.command = AppCallbackNotifier::NOTIFIER_CMD_PROCESS_FRAME;
+              if ( CameraFrame::PREVIEW_FRAME_SYNC == frame->mFrameType ) {
+                  msg.command = AppCallbackNotifier::NOTIFIER_CMD_PROCESS_PREVIEW_FRAME;
+              } else {
+                  msg.command = AppCallbackNotifier::NOTIFIER_CMD_PROCESS_FRAME;
+              }
               msg.arg1 = frame;
               mFrameQ.put(&msg);
             }
@@ -1356,19 +1475,24 @@ void AppCallbackNotifier::flushAndReturnFrames()
 {
     LOG_FUNCTION_NAME;
 
-    Utils::Message msg;
+    Utils::Message msgs[FLUSH_BATCH_SIZE];
     CameraFrame *frame;
+    int count;
 
     android::AutoMutex lock(mLock);
-    while (!mFrameQ.isEmpty()) {
-        mFrameQ.get(&msg);
-        frame = (CameraFrame*) msg.arg1;
-        if (frame) {
-            mFrameProvider->returnFrame(frame->mBuffer,
-                                        (CameraFrame::FrameType) frame->mFrameType);
+    while (0 < (count = mFrameQ.getBatch(msgs, FLUSH_BATCH_SIZE))) {
+        for (int i = 0; i < count; i++) {
+            frame = (CameraFrame*) msgs[i].arg1;
+            if (frame) {
+                mFrameProvider->returnFrame(frame->mBuffer,
+                                            (CameraFrame::FrameType) frame->mFrameType);
+            }
         }
     }
 
+    returnLentPreviewFrames(0);
+    returnDroppedFrames();
+
     LOG_FUNCTION_NAME_EXIT;
 }
 
@@ -1445,6 +1569,11 @@ bool AppCallbackNotifier::processMessage()
             ret = false;
             break;
           }
+        case NotificationThread::NOTIFIER_TRIM_SCHEDULED:
+          {
+            // nothing to do, the wait timeout covers the new deadline
+            break;
+          }
         default:
           {
             CAMHAL_LOGEA("Error: ProcessMsg() command from Camera HAL");
@@ -1481,8 +1610,8 @@ AppCallbackNotifier::~AppCallbackNotifier()
     Utils::Message msg = {0,0,0,0,0,0};
     msg.command = NotificationThread::NOTIFIER_EXIT;
 
-    ///Post the message to display thread
-    mNotificationThread->msgQ().put(&msg);
+    ///Post the message to display thread, ahead of anything still queued
+    mNotificationThread->msgQ().putUrgent(&msg);
 
     //Exit and cleanup the thread
     mNotificationThread->requestExit();
@@ -1491,6 +1620,12 @@ AppCallbackNotifier::~AppCallbackNotifier()
     //Delete the display thread
     mNotificationThread.clear();
 
+    if ( NULL != mEncoderPool.get() )
+        {
+        mEncoderPool->release();
+        mEncoderPool.clear();
+        }
+
 
     ///Free the event and frame providers
     if ( NULL != mEventProvider )
@@ -1617,7 +1752,14 @@ status_t AppCallbackNotifier::startPreviewCallbacks(android::CameraParameters &p
     mPreviewPixelFormat = CameraHal::getPixelFormatConstant(params.getPreviewFormat());
     size = CameraHal::calculateBufferSize(mPreviewPixelFormat, w, h);
 
-    mPreviewMemory = mRequestMemory(-1, size, AppCallbackNotifier::MAX_BUFFERS, NULL);
+    if ( mPreparedPreviewMemory && (mPreparedPreviewSize == (size_t) size) ) {
+        mPreviewMemory = mPreparedPreviewMemory;
+        mPreparedPreviewMemory = 0;
+        mPreparedPreviewSize = 0;
+    } else {
+        releasePreparedPreviewMemory();
+        mPreviewMemory = mRequestMemory(-1, size, AppCallbackNotifier::MAX_BUFFERS, NULL);
+    }
     if (!mPreviewMemory) {
         return NO_MEMORY;
     }
@@ -1638,6 +1780,14 @@ status_t AppCallbackNotifier::startPreviewCallbacks(android::CameraParameters &p
 
     mPreviewBufCount = 0;
 
+    // There is no release from the application, a lent frame is kept as long
+    // as a copied frame would stay in the ring without stalling the adapter
+    mLentPreviewLimit = AppCallbackNotifier::MAX_BUFFERS;
+    if ( count < mLentPreviewLimit + (size_t) AppCallbackNotifier::MIN_UNLENT_PREVIEW_BUFFERS ) {
+        mLentPreviewLimit = ( count > (size_t) AppCallbackNotifier::MIN_UNLENT_PREVIEW_BUFFERS ) ?
+                            count - AppCallbackNotifier::MIN_UNLENT_PREVIEW_BUFFERS : 0;
+    }
+
     mPreviewing = true;
 
     LOG_FUNCTION_NAME_EXIT;
@@ -1680,6 +1830,42 @@ void AppCallbackNotifier::setVideoRes(int width, int height)
   LOG_FUNCTION_NAME_EXIT;
 }
 
+status_t AppCallbackNotifier::preparePreviewCallbacks(const char *format, int width, int height)
+{
+    const char *pixelFormat;
+    size_t size;
+
+    LOG_FUNCTION_NAME;
+
+    android::AutoMutex lock(mLock);
+
+    if ( mPreviewing )
+        {
+        CAMHAL_LOGDA("+Already previewing");
+        return NO_INIT;
+        }
+
+    pixelFormat = CameraHal::getPixelFormatConstant(format);
+    size = CameraHal::calculateBufferSize(pixelFormat, width, height);
+
+    if ( mPreparedPreviewMemory && (mPreparedPreviewSize == size) )
+        {
+        return NO_ERROR;
+        }
+
+    releasePreparedPreviewMemory();
+
+    mPreparedPreviewMemory = mRequestMemory(-1, size, AppCallbackNotifier::MAX_BUFFERS, NULL);
+    if ( !mPreparedPreviewMemory ) {
+        return NO_MEMORY;
+    }
+    mPreparedPreviewSize = size;
+
+    LOG_FUNCTION_NAME_EXIT;
+
+    return NO_ERROR;
+}
+
 status_t AppCallbackNotifier::stopPreviewCallbacks()
 {
     LOG_FUNCTION_NAME;
@@ -1698,8 +1884,15 @@ status_t AppCallbackNotifier::stopPreviewCallbacks()
     mFrameProvider->disableFrameNotification(CameraFrame::PREVIEW_FRAME_SYNC);
     mFrameProvider->disableFrameNotification(CameraFrame::SNAPSHOT_FRAME);
 
+    Utils::MessageQueue::Stats stats;
+    mFrameQ.getStats(stats);
+    CAMHAL_LOGDB("Frame queue: depth %d, max depth %d, %u of %u frames dropped",
+                 stats.depth, stats.maxDepth, stats.dropped, stats.queued);
+
     {
     android::AutoMutex lock(mLock);
+    returnLentPreviewFrames(0);
+    releaseInPlacePreviewMemory();
     mPreviewMemory->release(mPreviewMemory);
     mPreviewMemory = 0;
     }
@@ -1712,6 +1905,28 @@ status_t AppCallbackNotifier::stopPreviewCallbacks()
 
 }
 
+void AppCallbackNotifier::setFrameTimeline(const android::sp<FrameTimeline> &timeline)
+{
+    mFrameTimeline = timeline;
+}
+
+void AppCallbackNotifier::dump(int fd)
+{
+    Utils::MessageQueue::Stats frames;
+    Utils::MessageQueue::Stats events;
+    char line[256];
+
+    mFrameQ.getStats(frames);
+    mEventQ.getStats(events);
+
+    snprintf(line, sizeof(line),
+             "Callback frame queue: depth %d, max depth %d, %u of %u frames dropped\n"
+             "Callback event queue: depth %d, max depth %d, %u events\n",
+             frames.depth, frames.maxDepth, frames.dropped, frames.queued,
+             events.depth, events.maxDepth, events.queued);
+    write(fd, line, strlen(line));
+}
+
 status_t AppCallbackNotifier::useMetaDataBufferMode(bool enable)
 {
     mUseMetaDataBufferMode = enable;
@@ -1947,8 +2162,6 @@ status_t AppCallbackNotifier::start()
     mNotifierState = AppCallbackNotifier::NOTIFIER_STARTED;
     CAMHAL_LOGDA(" --> AppCallbackNotifier NOTIFIER_STARTED \n");
 
-    gEncoderQueue.clear();
-
     LOG_FUNCTION_NAME_EXIT;
 
     return NO_ERROR;
@@ -1959,6 +2172,11 @@ status_t AppCallbackNotifier::stop()
 {
     LOG_FUNCTION_NAME;
 
+    {
+    android::AutoMutex lock(mLock);
+    releasePreparedPreviewMemory();
+    }
+
     if(mNotifierState!=AppCallbackNotifier::NOTIFIER_STARTED)
         {
         CAMHAL_LOGDA("AppCallbackNotifier already in stopped state");
@@ -1972,8 +2190,13 @@ status_t AppCallbackNotifier::stop()
     CAMHAL_LOGDA(" --> AppCallbackNotifier NOTIFIER_STOPPED \n");
     }
 
-    while(!gEncoderQueue.isEmpty()) {
-        android::sp<Encoder_libjpeg> encoder = gEncoderQueue.valueAt(0);
+    android::Vector< android::sp<Encoder_libjpeg> > encoders;
+    if ( NULL != mEncoderPool.get() ) {
+        mEncoderPool->removeAll(encoders);
+    }
+
+    while(!encoders.isEmpty()) {
+        android::sp<Encoder_libjpeg> encoder = encoders.itemAt(0);
         camera_memory_t* encoded_mem = NULL;
         ExifElementsTable* exif = NULL;
 
@@ -1990,7 +2213,7 @@ status_t AppCallbackNotifier::stop()
 
             encoder.clear();
         }
-        gEncoderQueue.removeItemsAt(0);
+        encoders.removeAt(0);
     }
 
     LOG_FUNCTION_NAME_EXIT;
@@ -15,6 +15,8 @@
  */
 
 #include "BaseCameraAdapter.h"
+#include <sched.h>
+#include <unistd.h>
 
 const int EVENT_MASK = 0xffff;
 
@@ -90,6 +92,19 @@ BaseCameraAdapter::BaseCameraAdapter()
 
     mSharedAllocator = NULL;
 
+    mFramesWithDisplay = 0;
+    mFramesWithEncoder = 0;
+
+    mPublishedSubscribers = new Subscribers();
+    mSubscribers = mPublishedSubscribers.get();
+    mSubscriberReaders = 0;
+
+    for ( int i = 0 ; i < REF_SET_COUNT ; i++ )
+        {
+        mFrameRefs[i].buffers = NULL;
+        mFrameRefs[i].count = 0;
+        }
+
 #if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
     mStartFocus.tv_sec = 0;
     mStartFocus.tv_usec = 0;
@@ -105,16 +120,7 @@ BaseCameraAdapter::~BaseCameraAdapter()
 
      android::AutoMutex lock(mSubscriberLock);
 
-     mFrameSubscribers.clear();
-     mImageSubscribers.clear();
-     mRawSubscribers.clear();
-     mVideoSubscribers.clear();
-     mVideoInSubscribers.clear();
-     mFocusSubscribers.clear();
-     mShutterSubscribers.clear();
-     mZoomSubscribers.clear();
-     mSnapshotSubscribers.clear();
-     mMetadataSubscribers.clear();
+     publishSubscribers(new Subscribers());
 
      LOG_FUNCTION_NAME_EXIT;
 }
@@ -172,6 +178,7 @@ status_t BaseCameraAdapter::setErrorHandler(ErrorNotifier *errorNotifier)
 void BaseCameraAdapter::enableMsgType(int32_t msgs, frame_callback callback, event_callback eventCb, void* cookie)
 {
     android::AutoMutex lock(mSubscriberLock);
+    android::sp<Subscribers> subscribers = new Subscribers(*mPublishedSubscribers);
 
     LOG_FUNCTION_NAME;
 
@@ -184,25 +191,25 @@ void BaseCameraAdapter::enableMsgType(int32_t msgs, frame_callback callback, eve
         switch ( frameMsg )
             {
             case CameraFrame::PREVIEW_FRAME_SYNC:
-                mFrameSubscribers.add((int) cookie, callback);
+                subscribers->mFrameSubscribers.add((int) cookie, callback);
                 break;
             case CameraFrame::FRAME_DATA_SYNC:
-                mFrameDataSubscribers.add((int) cookie, callback);
+                subscribers->mFrameDataSubscribers.add((int) cookie, callback);
                 break;
             case CameraFrame::SNAPSHOT_FRAME:
-                mSnapshotSubscribers.add((int) cookie, callback);
+                subscribers->mSnapshotSubscribers.add((int) cookie, callback);
                 break;
             case CameraFrame::IMAGE_FRAME:
-                mImageSubscribers.add((int) cookie, callback);
+                subscribers->mImageSubscribers.add((int) cookie, callback);
                 break;
             case CameraFrame::RAW_FRAME:
-                mRawSubscribers.add((int) cookie, callback);
+                subscribers->mRawSubscribers.add((int) cookie, callback);
                 break;
             case CameraFrame::VIDEO_FRAME_SYNC:
-                mVideoSubscribers.add((int) cookie, callback);
+                subscribers->mVideoSubscribers.add((int) cookie, callback);
                 break;
             case CameraFrame::REPROCESS_INPUT_FRAME:
-                mVideoInSubscribers.add((int) cookie, callback);
+                subscribers->mVideoInSubscribers.add((int) cookie, callback);
                 break;
             default:
                 CAMHAL_LOGEA("Frame message type id=0x%x subscription no supported yet!", frameMsg);
@@ -215,10 +222,10 @@ void BaseCameraAdapter::enableMsgType(int32_t msgs, frame_callback callback, eve
         CAMHAL_LOGVB("Event message type id=0x%x subscription request", eventMsg);
         if ( CameraHalEvent::ALL_EVENTS == eventMsg )
             {
-            mFocusSubscribers.add((int) cookie, eventCb);
-            mShutterSubscribers.add((int) cookie, eventCb);
-            mZoomSubscribers.add((int) cookie, eventCb);
-            mMetadataSubscribers.add((int) cookie, eventCb);
+            subscribers->mFocusSubscribers.add((int) cookie, eventCb);
+            subscribers->mShutterSubscribers.add((int) cookie, eventCb);
+            subscribers->mZoomSubscribers.add((int) cookie, eventCb);
+            subscribers->mMetadataSubscribers.add((int) cookie, eventCb);
             }
         else
             {
@@ -226,12 +233,15 @@ void BaseCameraAdapter::enableMsgType(int32_t msgs, frame_callback callback, eve
             }
         }
 
+    publishSubscribers(subscribers);
+
     LOG_FUNCTION_NAME_EXIT;
 }
 
 void BaseCameraAdapter::disableMsgType(int32_t msgs, void* cookie)
 {
     android::AutoMutex lock(mSubscriberLock);
+    android::sp<Subscribers> subscribers = new Subscribers(*mPublishedSubscribers);
 
     LOG_FUNCTION_NAME;
 
@@ -244,34 +254,34 @@ void BaseCameraAdapter::disableMsgType(int32_t msgs, void* cookie)
         switch ( frameMsg )
             {
             case CameraFrame::PREVIEW_FRAME_SYNC:
-                mFrameSubscribers.removeItem((int) cookie);
+                subscribers->mFrameSubscribers.removeItem((int) cookie);
                 break;
             case CameraFrame::FRAME_DATA_SYNC:
-                mFrameDataSubscribers.removeItem((int) cookie);
+                subscribers->mFrameDataSubscribers.removeItem((int) cookie);
                 break;
             case CameraFrame::SNAPSHOT_FRAME:
-                mSnapshotSubscribers.removeItem((int) cookie);
+                subscribers->mSnapshotSubscribers.removeItem((int) cookie);
                 break;
             case CameraFrame::IMAGE_FRAME:
-                mImageSubscribers.removeItem((int) cookie);
+                subscribers->mImageSubscribers.removeItem((int) cookie);
                 break;
             case CameraFrame::RAW_FRAME:
-                mRawSubscribers.removeItem((int) cookie);
+                subscribers->mRawSubscribers.removeItem((int) cookie);
                 break;
             case CameraFrame::VIDEO_FRAME_SYNC:
-                mVideoSubscribers.removeItem((int) cookie);
+                subscribers->mVideoSubscribers.removeItem((int) cookie);
                 break;
             case CameraFrame::REPROCESS_INPUT_FRAME:
-                mVideoInSubscribers.removeItem((int) cookie);
+                subscribers->mVideoInSubscribers.removeItem((int) cookie);
                 break;
             case CameraFrame::ALL_FRAMES:
-                mFrameSubscribers.removeItem((int) cookie);
-                mFrameDataSubscribers.removeItem((int) cookie);
-                mSnapshotSubscribers.removeItem((int) cookie);
-                mImageSubscribers.removeItem((int) cookie);
-                mRawSubscribers.removeItem((int) cookie);
-                mVideoSubscribers.removeItem((int) cookie);
-                mVideoInSubscribers.removeItem((int) cookie);
+                subscribers->mFrameSubscribers.removeItem((int) cookie);
+                subscribers->mFrameDataSubscribers.removeItem((int) cookie);
+                subscribers->mSnapshotSubscribers.removeItem((int) cookie);
+                subscribers->mImageSubscribers.removeItem((int) cookie);
+                subscribers->mRawSubscribers.removeItem((int) cookie);
+                subscribers->mVideoSubscribers.removeItem((int) cookie);
+                subscribers->mVideoInSubscribers.removeItem((int) cookie);
                 break;
             default:
                 CAMHAL_LOGEA("Frame message type id=0x%x subscription remove not supported yet!", frameMsg);
@@ -285,10 +295,10 @@ void BaseCameraAdapter::disableMsgType(int32_t msgs, void* cookie)
         if ( CameraHalEvent::ALL_EVENTS == eventMsg)
             {
             //TODO: Process case by case
-            mFocusSubscribers.removeItem((int) cookie);
-            mShutterSubscribers.removeItem((int) cookie);
-            mZoomSubscribers.removeItem((int) cookie);
-            mMetadataSubscribers.removeItem((int) cookie);
+            subscribers->mFocusSubscribers.removeItem((int) cookie);
+            subscribers->mShutterSubscribers.removeItem((int) cookie);
+            subscribers->mZoomSubscribers.removeItem((int) cookie);
+            subscribers->mMetadataSubscribers.removeItem((int) cookie);
             }
         else
             {
@@ -296,13 +306,81 @@ void BaseCameraAdapter::disableMsgType(int32_t msgs, void* cookie)
             }
         }
 
+    publishSubscribers(subscribers);
+
+    // the caller may free the subscriber as soon as this returns, so no
+    // callback may still be running on a set that contains it
+    waitForRetiredSubscribers();
+
     LOG_FUNCTION_NAME_EXIT;
 }
 
+BaseCameraAdapter::Subscribers::Subscribers(const Subscribers &other)
+    : mFrameSubscribers(other.mFrameSubscribers),
+      mSnapshotSubscribers(other.mSnapshotSubscribers),
+      mFrameDataSubscribers(other.mFrameDataSubscribers),
+      mVideoSubscribers(other.mVideoSubscribers),
+      mVideoInSubscribers(other.mVideoInSubscribers),
+      mImageSubscribers(other.mImageSubscribers),
+      mRawSubscribers(other.mRawSubscribers),
+      mFocusSubscribers(other.mFocusSubscribers),
+      mZoomSubscribers(other.mZoomSubscribers),
+      mShutterSubscribers(other.mShutterSubscribers),
+      mMetadataSubscribers(other.mMetadataSubscribers),
+      mRefs(0)
+{
+}
+
+android::sp<BaseCameraAdapter::Subscribers> BaseCameraAdapter::getSubscribers() const
+{
+    android::sp<Subscribers> subscribers;
+
+    // publishSubscribers() does not drop the previous set while a reader
+    // may have loaded the pointer but not yet referenced it
+    android_atomic_inc(&mSubscriberReaders);
+    subscribers = mSubscribers;
+    android_atomic_dec(&mSubscriberReaders);
+
+    return subscribers;
+}
+
+void BaseCameraAdapter::publishSubscribers(const android::sp<Subscribers> &subscribers)
+{
+    android::sp<Subscribers> previous = mPublishedSubscribers;
+
+    mPublishedSubscribers = subscribers;
+    android_memory_barrier();
+    mSubscribers = subscribers.get();
+    android_memory_barrier();
+
+    // readers only spend a few instructions between the two counter updates
+    while ( 0 != android_atomic_acquire_load(&mSubscriberReaders) )
+        {
+        sched_yield();
+        }
+
+    mRetiredSubscribers.add(previous);
+}
+
+void BaseCameraAdapter::waitForRetiredSubscribers()
+{
+    // publishSubscribers() waited out the readers, so every dispatch still
+    // running on a retired set holds a reference to it besides ours
+    for ( size_t i = 0 ; i < mRetiredSubscribers.size() ; i++ )
+        {
+        while ( 1 < mRetiredSubscribers[i]->users() )
+            {
+            usleep(1000);
+            }
+        }
+
+    mRetiredSubscribers.clear();
+}
+
 void BaseCameraAdapter::addFramePointers(CameraBuffer *frameBuf, void *buf)
 {
   unsigned int *pBuf = (unsigned int *)buf;
-  android::AutoMutex lock(mSubscriberLock);
+  android::AutoMutex lock(mFrameQueueLock);
 
   if ((frameBuf != NULL) && ( pBuf != NULL) )
     {
@@ -318,7 +396,7 @@ void BaseCameraAdapter::addFramePointers(CameraBuffer *frameBuf, void *buf)
 
 void BaseCameraAdapter::removeFramePointers()
 {
-  android::AutoMutex lock(mSubscriberLock);
+  android::AutoMutex lock(mFrameQueueLock);
 
   int size = mFrameQueue.size();
   CAMHAL_LOGVB("Removing %d Frames = ", size);
@@ -334,8 +412,10 @@ void BaseCameraAdapter::removeFramePointers()
 void BaseCameraAdapter::returnFrame(CameraBuffer * frameBuf, CameraFrame::FrameType frameType)
 {
     status_t res = NO_ERROR;
-    size_t subscriberCount = 0;
     int refCount = -1;
+    int typeIndex = -1;
+    volatile int32_t *ref = NULL;
+    volatile int32_t *total = NULL;
 
     if ( NULL == frameBuf )
         {
@@ -343,35 +423,41 @@ void BaseCameraAdapter::returnFrame(CameraBuffer * frameBuf, CameraFrame::FrameT
         return;
         }
 
-    if ( NO_ERROR == res)
+    if(frameType == CameraFrame::PREVIEW_FRAME_SYNC)
         {
-        android::AutoMutex lock(mReturnFrameLock);
-
-        refCount = getFrameRefCountByType(frameBuf, frameType);
+        android_atomic_dec(&mFramesWithDisplay);
+        }
+    else if(frameType == CameraFrame::VIDEO_FRAME_SYNC)
+        {
+        android_atomic_dec(&mFramesWithEncoder);
+        }
 
-        if(frameType == CameraFrame::PREVIEW_FRAME_SYNC)
-            {
-            mFramesWithDisplay--;
-            }
-        else if(frameType == CameraFrame::VIDEO_FRAME_SYNC)
-            {
-            mFramesWithEncoder--;
-            }
+    typeIndex = refTypeIndex(frameType);
+    if ( 0 <= typeIndex )
+        {
+        ref = frameRef(frameBuf, typeIndex, &total);
+        }
 
-        if ( 0 < refCount )
+    if ( NULL != ref )
+        {
+        // only the consumer dropping the last reference sees zero here
+        refCount = releaseFrameRef(ref);
+        if ( 0 > refCount )
             {
-
-            refCount--;
-            setFrameRefCountByType(frameBuf, frameType, refCount);
-
-            if (mRecording) {
-                refCount += getFrameRefCount(frameBuf);
+            CAMHAL_LOGDA("Frame returned when ref count is already zero!!");
+            return;
             }
 
-            }
-        else
+        int remaining = android_atomic_dec(total) - 1;
+        if (mRecording) {
+            refCount = remaining;
+        }
+        }
+    else
+        {
+        refCount = returnFallbackFrame(frameBuf, frameType);
+        if ( 0 > refCount )
             {
-            CAMHAL_LOGDA("Frame returned when ref count is already zero!!");
             return;
             }
         }
@@ -402,6 +488,32 @@ void BaseCameraAdapter::returnFrame(CameraBuffer * frameBuf, CameraFrame::FrameT
 
 }
 
+int BaseCameraAdapter::returnFallbackFrame(CameraBuffer * frameBuf, CameraFrame::FrameType frameType)
+{
+    int refCount = -1;
+
+    android::AutoMutex lock(mReturnFrameLock);
+
+    refCount = getFrameRefCountByType(frameBuf, frameType);
+
+    if ( 0 < refCount )
+        {
+        refCount--;
+        setFrameRefCountByType(frameBuf, frameType, refCount);
+
+        if (mRecording) {
+            refCount += getFrameRefCount(frameBuf);
+        }
+        }
+    else
+        {
+        CAMHAL_LOGDA("Frame returned when ref count is already zero!!");
+        refCount = -1;
+        }
+
+    return refCount;
+}
+
 status_t BaseCameraAdapter::sendCommand(CameraCommands operation, int value1, int value2, int value3, int value4) {
     status_t ret = NO_ERROR;
     struct timeval *refTimestamp;
@@ -431,17 +543,18 @@ status_t BaseCameraAdapter::sendCommand(CameraCommands operation, int value1, in
                     android::AutoMutex lock(mPreviewBufferLock);
                     mPreviewBuffers = desc->mBuffers;
                     mPreviewBuffersLength = desc->mLength;
-                    mPreviewBuffersAvailable.clear();
-                    mSnapshotBuffersAvailable.clear();
+                    registerFrameRefBuffers(REF_SET_PREVIEW, mPreviewBuffers, desc->mCount);
+                    clearFrameRefCounts(CameraFrame::PREVIEW_FRAME_SYNC);
+                    clearFrameRefCounts(CameraFrame::SNAPSHOT_FRAME);
                     for ( uint32_t i = 0 ; i < desc->mMaxQueueable ; i++ )
                         {
-                        mPreviewBuffersAvailable.add(&mPreviewBuffers[i], 0);
+                        setFrameRefCountByType(&mPreviewBuffers[i], CameraFrame::PREVIEW_FRAME_SYNC, 0);
                         }
                     // initial ref count for undeqeueued buffers is 1 since buffer provider
                     // is still holding on to it
                     for ( uint32_t i = desc->mMaxQueueable ; i < desc->mCount ; i++ )
                         {
-                        mPreviewBuffersAvailable.add(&mPreviewBuffers[i], 1);
+                        setFrameRefCountByType(&mPreviewBuffers[i], CameraFrame::PREVIEW_FRAME_SYNC, 1);
                         }
                     }
 
@@ -485,16 +598,17 @@ status_t BaseCameraAdapter::sendCommand(CameraCommands operation, int value1, in
                         android::AutoMutex lock(mPreviewDataBufferLock);
                         mPreviewDataBuffers = desc->mBuffers;
                         mPreviewDataBuffersLength = desc->mLength;
-                        mPreviewDataBuffersAvailable.clear();
+                        registerFrameRefBuffers(REF_SET_PREVIEW_DATA, mPreviewDataBuffers, desc->mCount);
+                        clearFrameRefCounts(CameraFrame::FRAME_DATA_SYNC);
                         for ( uint32_t i = 0 ; i < desc->mMaxQueueable ; i++ )
                             {
-                            mPreviewDataBuffersAvailable.add(&mPreviewDataBuffers[i], 0);
+                            setFrameRefCountByType(&mPreviewDataBuffers[i], CameraFrame::FRAME_DATA_SYNC, 0);
                             }
                         // initial ref count for undeqeueued buffers is 1 since buffer provider
                         // is still holding on to it
                         for ( uint32_t i = desc->mMaxQueueable ; i < desc->mCount ; i++ )
                             {
-                            mPreviewDataBuffersAvailable.add(&mPreviewDataBuffers[i], 1);
+                            setFrameRefCountByType(&mPreviewDataBuffers[i], CameraFrame::FRAME_DATA_SYNC, 1);
                             }
                         }
 
@@ -538,6 +652,7 @@ status_t BaseCameraAdapter::sendCommand(CameraCommands operation, int value1, in
                     android::AutoMutex lock(mCaptureBufferLock);
                     mCaptureBuffers = desc->mBuffers;
                     mCaptureBuffersLength = desc->mLength;
+                    registerFrameRefBuffers(REF_SET_CAPTURE, mCaptureBuffers, desc->mCount);
                     }
 
                 if ( NULL != desc )
@@ -577,14 +692,15 @@ status_t BaseCameraAdapter::sendCommand(CameraCommands operation, int value1, in
             if (ret == NO_ERROR) {
                 android::AutoMutex lock(mVideoInBufferLock);
                 mVideoInBuffers = desc->mBuffers;
-                mVideoInBuffersAvailable.clear();
+                registerFrameRefBuffers(REF_SET_VIDEO_IN, mVideoInBuffers, desc->mCount);
+                clearFrameRefCounts(CameraFrame::REPROCESS_INPUT_FRAME);
                 for (uint32_t i = 0 ; i < desc->mMaxQueueable ; i++) {
-                    mVideoInBuffersAvailable.add(&mVideoInBuffers[i], 0);
+                    setFrameRefCountByType(&mVideoInBuffers[i], CameraFrame::REPROCESS_INPUT_FRAME, 0);
                 }
                 // initial ref count for undeqeueued buffers is 1 since buffer provider
                 // is still holding on to it
                 for ( uint32_t i = desc->mMaxQueueable ; i < desc->mCount ; i++ ) {
-                    mVideoInBuffersAvailable.add(&mVideoInBuffers[i], 1);
+                    setFrameRefCountByType(&mVideoInBuffers[i], CameraFrame::REPROCESS_INPUT_FRAME, 1);
                 }
                 ret = useBuffers(CameraAdapter::CAMERA_REPROCESS,
                                  desc->mBuffers,
@@ -1072,14 +1188,15 @@ status_t BaseCameraAdapter::sendCommand(CameraCommands operation, int value1, in
                  android::AutoMutex lock(mVideoBufferLock);
                  mVideoBuffers = desc->mBuffers;
                  mVideoBuffersLength = desc->mLength;
-                 mVideoBuffersAvailable.clear();
+                 registerFrameRefBuffers(REF_SET_VIDEO, mVideoBuffers, desc->mCount);
+                 clearFrameRefCounts(CameraFrame::VIDEO_FRAME_SYNC);
                  for ( uint32_t i = 0 ; i < desc->mMaxQueueable ; i++ ) {
-                     mVideoBuffersAvailable.add(&mVideoBuffers[i], 1);
+                     setFrameRefCountByType(&mVideoBuffers[i], CameraFrame::VIDEO_FRAME_SYNC, 1);
                  }
                  // initial ref count for undeqeueued buffers is 1 since buffer provider
                  // is still holding on to it
                  for ( uint32_t i = desc->mMaxQueueable ; i < desc->mCount ; i++ ) {
-                     mVideoBuffersAvailable.add(&mVideoBuffers[i], 1);
+                     setFrameRefCountByType(&mVideoBuffers[i], CameraFrame::VIDEO_FRAME_SYNC, 1);
                  }
              }
 
@@ -1134,7 +1251,10 @@ status_t BaseCameraAdapter::notifyFocusSubscribers(CameraHalEvent::FocusStatus s
 
     LOG_FUNCTION_NAME;
 
-    if ( mFocusSubscribers.size() == 0 ) {
+    android::sp<Subscribers> subscribers = getSubscribers();
+    const android::KeyedVector<int, event_callback> &focusSubscribers = subscribers->mFocusSubscribers;
+
+    if ( focusSubscribers.size() == 0 ) {
         CAMHAL_LOGDA("No Focus Subscribers!");
         return NO_INIT;
     }
@@ -1156,10 +1276,10 @@ status_t BaseCameraAdapter::notifyFocusSubscribers(CameraHalEvent::FocusStatus s
     focusEvent.mEventType = CameraHalEvent::EVENT_FOCUS_LOCKED;
     focusEvent.mEventData->focusEvent.focusStatus = status;
 
-    for (unsigned int i = 0 ; i < mFocusSubscribers.size(); i++ )
+    for (unsigned int i = 0 ; i < focusSubscribers.size(); i++ )
         {
-        focusEvent.mCookie = (void *) mFocusSubscribers.keyAt(i);
-        eventCb = (event_callback) mFocusSubscribers.valueAt(i);
+        focusEvent.mCookie = (void *) focusSubscribers.keyAt(i);
+        eventCb = (event_callback) focusSubscribers.valueAt(i);
         eventCb ( &focusEvent );
         }
 
@@ -1178,7 +1298,10 @@ status_t BaseCameraAdapter::notifyShutterSubscribers()
 
     LOG_FUNCTION_NAME;
 
-    if ( mShutterSubscribers.size() == 0 )
+    android::sp<Subscribers> subscribers = getSubscribers();
+    const android::KeyedVector<int, event_callback> &shutterSubscribers = subscribers->mShutterSubscribers;
+
+    if ( shutterSubscribers.size() == 0 )
         {
         CAMHAL_LOGEA("No shutter Subscribers!");
         return NO_INIT;
@@ -1192,9 +1315,9 @@ status_t BaseCameraAdapter::notifyShutterSubscribers()
     shutterEvent.mEventType = CameraHalEvent::EVENT_SHUTTER;
     shutterEvent.mEventData->shutterEvent.shutterClosed = true;
 
-    for (unsigned int i = 0 ; i < mShutterSubscribers.size() ; i++ ) {
-        shutterEvent.mCookie = ( void * ) mShutterSubscribers.keyAt(i);
-        eventCb = ( event_callback ) mShutterSubscribers.valueAt(i);
+    for (unsigned int i = 0 ; i < shutterSubscribers.size() ; i++ ) {
+        shutterEvent.mCookie = ( void * ) shutterSubscribers.keyAt(i);
+        eventCb = ( event_callback ) shutterSubscribers.valueAt(i);
 
         CAMHAL_LOGD("Sending shutter callback");
 
@@ -1216,7 +1339,10 @@ status_t BaseCameraAdapter::notifyZoomSubscribers(int zoomIdx, bool targetReache
 
     LOG_FUNCTION_NAME;
 
-    if ( mZoomSubscribers.size() == 0 ) {
+    android::sp<Subscribers> subscribers = getSubscribers();
+    const android::KeyedVector<int, event_callback> &zoomSubscribers = subscribers->mZoomSubscribers;
+
+    if ( zoomSubscribers.size() == 0 ) {
         CAMHAL_LOGDA("No zoom Subscribers!");
         return NO_INIT;
     }
@@ -1230,9 +1356,9 @@ status_t BaseCameraAdapter::notifyZoomSubscribers(int zoomIdx, bool targetReache
     zoomEvent.mEventData->zoomEvent.currentZoomIndex = zoomIdx;
     zoomEvent.mEventData->zoomEvent.targetZoomIndexReached = targetReached;
 
-    for (unsigned int i = 0 ; i < mZoomSubscribers.size(); i++ ) {
-        zoomEvent.mCookie = (void *) mZoomSubscribers.keyAt(i);
-        eventCb = (event_callback) mZoomSubscribers.valueAt(i);
+    for (unsigned int i = 0 ; i < zoomSubscribers.size(); i++ ) {
+        zoomEvent.mCookie = (void *) zoomSubscribers.keyAt(i);
+        eventCb = (event_callback) zoomSubscribers.valueAt(i);
 
         eventCb ( &zoomEvent );
     }
@@ -1252,7 +1378,10 @@ status_t BaseCameraAdapter::notifyMetadataSubscribers(android::sp<CameraMetadata
 
     LOG_FUNCTION_NAME;
 
-    if ( mMetadataSubscribers.size() == 0 ) {
+    android::sp<Subscribers> subscribers = getSubscribers();
+    const android::KeyedVector<int, event_callback> &metadataSubscribers = subscribers->mMetadataSubscribers;
+
+    if ( metadataSubscribers.size() == 0 ) {
         CAMHAL_LOGDA("No preview metadata subscribers!");
         return NO_INIT;
     }
@@ -1265,9 +1394,9 @@ status_t BaseCameraAdapter::notifyMetadataSubscribers(android::sp<CameraMetadata
     metaEvent.mEventType = CameraHalEvent::EVENT_METADATA;
     metaEvent.mEventData->metadataEvent = meta;
 
-    for (unsigned int i = 0 ; i < mMetadataSubscribers.size(); i++ ) {
-        metaEvent.mCookie = (void *) mMetadataSubscribers.keyAt(i);
-        eventCb = (event_callback) mMetadataSubscribers.valueAt(i);
+    for (unsigned int i = 0 ; i < metadataSubscribers.size(); i++ ) {
+        metaEvent.mCookie = (void *) metadataSubscribers.keyAt(i);
+        eventCb = (event_callback) metadataSubscribers.valueAt(i);
 
         eventCb ( &metaEvent );
     }
@@ -1280,6 +1409,11 @@ status_t BaseCameraAdapter::notifyMetadataSubscribers(android::sp<CameraMetadata
 }
 
 status_t BaseCameraAdapter::sendFrameToSubscribers(CameraFrame *frame)
+{
+    return sendFrameToSubscribers(frame, getSubscribers());
+}
+
+status_t BaseCameraAdapter::sendFrameToSubscribers(CameraFrame *frame, const android::sp<Subscribers> &subscribers)
 {
     status_t ret = NO_ERROR;
     unsigned int mask;
@@ -1290,6 +1424,11 @@ status_t BaseCameraAdapter::sendFrameToSubscribers(CameraFrame *frame)
         return -EINVAL;
         }
 
+    if ( ( NULL != mFrameTimeline.get() ) &&
+         ( frame->mFrameMask & (CameraFrame::PREVIEW_FRAME_SYNC | CameraFrame::VIDEO_FRAME_SYNC) ) ) {
+        mFrameTimeline->frameReceived(frame->mBuffer, frame->mTimestamp);
+    }
+
     for( mask = 1; mask < CameraFrame::ALL_FRAMES; mask <<= 1){
       if( mask & frame->mFrameMask ){
         switch( mask ){
@@ -1299,37 +1438,37 @@ status_t BaseCameraAdapter::sendFrameToSubscribers(CameraFrame *frame)
 #if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
             CameraHal::PPM("Shot to Jpeg: ", &mStartCapture);
 #endif
-            ret = __sendFrameToSubscribers(frame, &mImageSubscribers, CameraFrame::IMAGE_FRAME);
+            ret = __sendFrameToSubscribers(frame, &subscribers->mImageSubscribers, CameraFrame::IMAGE_FRAME);
           }
           break;
         case CameraFrame::RAW_FRAME:
           {
-            ret = __sendFrameToSubscribers(frame, &mRawSubscribers, CameraFrame::RAW_FRAME);
+            ret = __sendFrameToSubscribers(frame, &subscribers->mRawSubscribers, CameraFrame::RAW_FRAME);
           }
           break;
         case CameraFrame::PREVIEW_FRAME_SYNC:
           {
-            ret = __sendFrameToSubscribers(frame, &mFrameSubscribers, CameraFrame::PREVIEW_FRAME_SYNC);
+            ret = __sendFrameToSubscribers(frame, &subscribers->mFrameSubscribers, CameraFrame::PREVIEW_FRAME_SYNC);
           }
           break;
         case CameraFrame::SNAPSHOT_FRAME:
           {
-            ret = __sendFrameToSubscribers(frame, &mSnapshotSubscribers, CameraFrame::SNAPSHOT_FRAME);
+            ret = __sendFrameToSubscribers(frame, &subscribers->mSnapshotSubscribers, CameraFrame::SNAPSHOT_FRAME);
           }
           break;
         case CameraFrame::VIDEO_FRAME_SYNC:
           {
-            ret = __sendFrameToSubscribers(frame, &mVideoSubscribers, CameraFrame::VIDEO_FRAME_SYNC);
+            ret = __sendFrameToSubscribers(frame, &subscribers->mVideoSubscribers, CameraFrame::VIDEO_FRAME_SYNC);
           }
           break;
         case CameraFrame::FRAME_DATA_SYNC:
           {
-            ret = __sendFrameToSubscribers(frame, &mFrameDataSubscribers, CameraFrame::FRAME_DATA_SYNC);
+            ret = __sendFrameToSubscribers(frame, &subscribers->mFrameDataSubscribers, CameraFrame::FRAME_DATA_SYNC);
           }
           break;
         case CameraFrame::REPROCESS_INPUT_FRAME:
           {
-            ret = __sendFrameToSubscribers(frame, &mVideoInSubscribers, CameraFrame::REPROCESS_INPUT_FRAME);
+            ret = __sendFrameToSubscribers(frame, &subscribers->mVideoInSubscribers, CameraFrame::REPROCESS_INPUT_FRAME);
           }
           break;
         default:
@@ -1349,7 +1488,7 @@ status_t BaseCameraAdapter::sendFrameToSubscribers(CameraFrame *frame)
 }
 
 status_t BaseCameraAdapter::__sendFrameToSubscribers(CameraFrame* frame,
-                                                     android::KeyedVector<int, frame_callback> *subscribers,
+                                                     const android::KeyedVector<int, frame_callback> *subscribers,
                                                      CameraFrame::FrameType frameType)
 {
     size_t refCount = 0;
@@ -1361,6 +1500,7 @@ status_t BaseCameraAdapter::__sendFrameToSubscribers(CameraFrame* frame,
     if ( (frameType == CameraFrame::PREVIEW_FRAME_SYNC) ||
          (frameType == CameraFrame::VIDEO_FRAME_SYNC) ||
          (frameType == CameraFrame::SNAPSHOT_FRAME) ){
+        android::AutoMutex lock(mFrameQueueLock);
         if (mFrameQueue.size() > 0){
           CameraFrame *lframe = (CameraFrame *)mFrameQueue.valueFor(frame->mBuffer);
           frame->mYuv[0] = lframe->mYuv[0];
@@ -1410,6 +1550,11 @@ status_t BaseCameraAdapter::__sendFrameToSubscribers(CameraFrame* frame,
 }
 
 int BaseCameraAdapter::setInitFrameRefCount(CameraBuffer * buf, unsigned int mask)
+{
+    return setInitFrameRefCount(buf, mask, getSubscribers());
+}
+
+int BaseCameraAdapter::setInitFrameRefCount(CameraBuffer * buf, unsigned int mask, const android::sp<Subscribers> &subscribers)
 {
   int ret = NO_ERROR;
   unsigned int lmask;
@@ -1427,37 +1572,37 @@ int BaseCameraAdapter::setInitFrameRefCount(CameraBuffer * buf, unsigned int mas
 
       case CameraFrame::IMAGE_FRAME:
         {
-            setFrameRefCountByType(buf, CameraFrame::IMAGE_FRAME, (int) mImageSubscribers.size());
+            setFrameRefCountByType(buf, CameraFrame::IMAGE_FRAME, (int) subscribers->mImageSubscribers.size());
         }
         break;
       case CameraFrame::RAW_FRAME:
         {
-            setFrameRefCountByType(buf, CameraFrame::RAW_FRAME, mRawSubscribers.size());
+            setFrameRefCountByType(buf, CameraFrame::RAW_FRAME, subscribers->mRawSubscribers.size());
         }
         break;
       case CameraFrame::PREVIEW_FRAME_SYNC:
         {
-            setFrameRefCountByType(buf, CameraFrame::PREVIEW_FRAME_SYNC, mFrameSubscribers.size());
+            setFrameRefCountByType(buf, CameraFrame::PREVIEW_FRAME_SYNC, subscribers->mFrameSubscribers.size());
         }
         break;
       case CameraFrame::SNAPSHOT_FRAME:
         {
-            setFrameRefCountByType(buf, CameraFrame::SNAPSHOT_FRAME, mSnapshotSubscribers.size());
+            setFrameRefCountByType(buf, CameraFrame::SNAPSHOT_FRAME, subscribers->mSnapshotSubscribers.size());
         }
         break;
       case CameraFrame::VIDEO_FRAME_SYNC:
         {
-            setFrameRefCountByType(buf,CameraFrame::VIDEO_FRAME_SYNC, mVideoSubscribers.size());
+            setFrameRefCountByType(buf,CameraFrame::VIDEO_FRAME_SYNC, subscribers->mVideoSubscribers.size());
         }
         break;
       case CameraFrame::FRAME_DATA_SYNC:
         {
-            setFrameRefCountByType(buf, CameraFrame::FRAME_DATA_SYNC, mFrameDataSubscribers.size());
+            setFrameRefCountByType(buf, CameraFrame::FRAME_DATA_SYNC, subscribers->mFrameDataSubscribers.size());
         }
         break;
       case CameraFrame::REPROCESS_INPUT_FRAME:
         {
-            setFrameRefCountByType(buf,CameraFrame::REPROCESS_INPUT_FRAME, mVideoInSubscribers.size());
+            setFrameRefCountByType(buf,CameraFrame::REPROCESS_INPUT_FRAME, subscribers->mVideoInSubscribers.size());
         }
         break;
       default:
@@ -1476,78 +1621,161 @@ int BaseCameraAdapter::getFrameRefCount(CameraBuffer * frameBuf)
     int res = 0, refCnt = 0;
 
     for (unsigned int frameType = 1; frameType < CameraFrame::ALL_FRAMES; frameType <<= 1) {
+        // image and raw frames share one count
+        if (frameType == CameraFrame::RAW_FRAME) {
+            continue;
+        }
         refCnt = getFrameRefCountByType(frameBuf, static_cast<CameraFrame::FrameType>(frameType));
         if (refCnt > 0) res += refCnt;
     }
     return res;
 }
 
-int BaseCameraAdapter::getFrameRefCountByType(CameraBuffer * frameBuf, CameraFrame::FrameType frameType)
+int BaseCameraAdapter::refTypeIndex(CameraFrame::FrameType frameType)
 {
-    int res = -1;
-    ssize_t index = NAME_NOT_FOUND;
-
-    LOG_FUNCTION_NAME;
-
     switch (frameType) {
+        case CameraFrame::PREVIEW_FRAME_SYNC:
+            return REF_TYPE_PREVIEW;
+        case CameraFrame::SNAPSHOT_FRAME:
+            return REF_TYPE_SNAPSHOT;
         case CameraFrame::IMAGE_FRAME:
         case CameraFrame::RAW_FRAME:
-        {
-            android::AutoMutex lock(mCaptureBufferLock);
-            index = mCaptureBuffersAvailable.indexOfKey(frameBuf);
-            if (index != NAME_NOT_FOUND) {
-                res = mCaptureBuffersAvailable[index];
+            return REF_TYPE_CAPTURE;
+        case CameraFrame::FRAME_DATA_SYNC:
+            return REF_TYPE_FRAME_DATA;
+        case CameraFrame::VIDEO_FRAME_SYNC:
+            return REF_TYPE_VIDEO;
+        case CameraFrame::REPROCESS_INPUT_FRAME:
+            return REF_TYPE_VIDEO_IN;
+        default:
+            return -1;
+    }
+}
+
+volatile int32_t *BaseCameraAdapter::frameRef(CameraBuffer * frameBuf, int typeIndex, volatile int32_t **total)
+{
+    for (int i = 0; i < REF_SET_COUNT; i++) {
+        RefBufferTable &table = mFrameRefs[i];
+        int count = android_atomic_acquire_load(&table.count);
+
+        if ((count > 0) && (frameBuf >= table.buffers) && (frameBuf < table.buffers + count)) {
+            int slot = frameBuf - table.buffers;
+            if (total) {
+                *total = &table.totals[slot];
             }
-            break;
+            return &table.refs[slot][typeIndex];
         }
-        case CameraFrame::SNAPSHOT_FRAME:
+    }
+
+    return NULL;
+}
+
+int32_t BaseCameraAdapter::swapFrameRef(volatile int32_t *ref, int32_t value)
+{
+    int32_t old;
+
+    do {
+        old = android_atomic_acquire_load(ref);
+    } while (android_atomic_release_cas(old, value, ref) != 0);
+
+    return old;
+}
+
+int32_t BaseCameraAdapter::releaseFrameRef(volatile int32_t *ref)
+{
+    int32_t old;
+
+    do {
+        old = android_atomic_acquire_load(ref);
+        if (old <= 0) {
+            return -1;
+        }
+    } while (android_atomic_release_cas(old, old - 1, ref) != 0);
+
+    return old - 1;
+}
+
+void BaseCameraAdapter::registerFrameRefBuffers(RefBufferSet set, CameraBuffer *buffers, int count)
+{
+    RefBufferTable &table = mFrameRefs[set];
+
+    if ( NULL == buffers )
         {
-            android::AutoMutex lock(mSnapshotBufferLock);
-            index = mSnapshotBuffersAvailable.indexOfKey(frameBuf);
-            if (index != NAME_NOT_FOUND) {
-                res = mSnapshotBuffersAvailable[index];
-            }
-            break;
+        count = 0;
         }
-        case CameraFrame::PREVIEW_FRAME_SYNC:
+
+    if ( MAX_REF_BUFFERS < count )
         {
-            android::AutoMutex lock(mPreviewBufferLock);
-            index = mPreviewBuffersAvailable.indexOfKey(frameBuf);
-            if (index != NAME_NOT_FOUND) {
-                res = mPreviewBuffersAvailable[index];
-            }
-            break;
+        CAMHAL_LOGWB("Only %d of %d buffers get lock-free reference counts", MAX_REF_BUFFERS, count);
+        count = MAX_REF_BUFFERS;
         }
-        case CameraFrame::FRAME_DATA_SYNC:
+
+    // buffers are handed over while none of them is in flight
+    android_atomic_release_store(0, &table.count);
+    table.buffers = buffers;
+    for ( int i = 0 ; i < count ; i++ )
         {
-            android::AutoMutex lock(mPreviewDataBufferLock);
-            index = mPreviewDataBuffersAvailable.indexOfKey(frameBuf);
-            if (index != NAME_NOT_FOUND) {
-                res = mPreviewDataBuffersAvailable[index];
+        for ( int type = 0 ; type < REF_TYPE_COUNT ; type++ )
+            {
+            table.refs[i][type] = -1;
             }
-            break;
+        table.totals[i] = 0;
         }
-        case CameraFrame::VIDEO_FRAME_SYNC:
+    android_atomic_release_store(count, &table.count);
+}
+
+void BaseCameraAdapter::clearFrameRefCounts(CameraFrame::FrameType frameType)
+{
+    int typeIndex = refTypeIndex(frameType);
+
+    if ( 0 > typeIndex )
         {
-            android::AutoMutex lock(mVideoBufferLock);
-            index = mVideoBuffersAvailable.indexOfKey(frameBuf);
-            if (index != NAME_NOT_FOUND) {
-                res = mVideoBuffersAvailable[index];
+        return;
+        }
+
+    for ( int i = 0 ; i < REF_SET_COUNT ; i++ )
+        {
+        RefBufferTable &table = mFrameRefs[i];
+        int count = android_atomic_acquire_load(&table.count);
+
+        for ( int slot = 0 ; slot < count ; slot++ )
+            {
+            int32_t old = swapFrameRef(&table.refs[slot][typeIndex], -1);
+            if ( 0 < old )
+                {
+                android_atomic_add(-old, &table.totals[slot]);
+                }
             }
-            break;
         }
-        case CameraFrame::REPROCESS_INPUT_FRAME:
+
+    android::AutoMutex lock(mFrameRefFallbackLock);
+    mFrameRefFallback[typeIndex].clear();
+}
+
+int BaseCameraAdapter::getFrameRefCountByType(CameraBuffer * frameBuf, CameraFrame::FrameType frameType)
+{
+    int res = -1;
+    int typeIndex = refTypeIndex(frameType);
+    volatile int32_t *ref = NULL;
+
+    LOG_FUNCTION_NAME;
+
+    if ( 0 <= typeIndex )
         {
-            android::AutoMutex lock(mVideoInBufferLock);
-            index = mVideoInBuffersAvailable.indexOfKey(frameBuf);
+        ref = frameRef(frameBuf, typeIndex, NULL);
+        if ( NULL != ref )
+            {
+            res = android_atomic_acquire_load(ref);
+            }
+        else
+            {
+            android::AutoMutex lock(mFrameRefFallbackLock);
+            ssize_t index = mFrameRefFallback[typeIndex].indexOfKey(frameBuf);
             if (index != NAME_NOT_FOUND) {
-                res = mVideoInBuffersAvailable[index];
+                res = mFrameRefFallback[typeIndex][index];
+            }
             }
-            break;
         }
-        default:
-            break;
-    }
 
     LOG_FUNCTION_NAME_EXIT;
 
@@ -1556,50 +1784,30 @@ int BaseCameraAdapter::getFrameRefCountByType(CameraBuffer * frameBuf, CameraFra
 
 void BaseCameraAdapter::setFrameRefCountByType(CameraBuffer * frameBuf, CameraFrame::FrameType frameType, int refCount)
 {
+    int typeIndex = refTypeIndex(frameType);
+    volatile int32_t *ref = NULL;
+    volatile int32_t *total = NULL;
 
     LOG_FUNCTION_NAME;
 
-    switch ( frameType )
+    if ( 0 <= typeIndex )
         {
-        case CameraFrame::IMAGE_FRAME:
-        case CameraFrame::RAW_FRAME:
-                {
-                android::AutoMutex lock(mCaptureBufferLock);
-                mCaptureBuffersAvailable.replaceValueFor(frameBuf, refCount);
-                }
-            break;
-        case CameraFrame::SNAPSHOT_FRAME:
-                {
-                android::AutoMutex lock(mSnapshotBufferLock);
-                mSnapshotBuffersAvailable.replaceValueFor(frameBuf, refCount);
-                }
-            break;
-        case CameraFrame::PREVIEW_FRAME_SYNC:
-                {
-                android::AutoMutex lock(mPreviewBufferLock);
-                mPreviewBuffersAvailable.replaceValueFor(frameBuf, refCount);
-                }
-            break;
-        case CameraFrame::FRAME_DATA_SYNC:
-                {
-                android::AutoMutex lock(mPreviewDataBufferLock);
-                mPreviewDataBuffersAvailable.replaceValueFor(frameBuf, refCount);
-                }
-            break;
-        case CameraFrame::VIDEO_FRAME_SYNC:
+        ref = frameRef(frameBuf, typeIndex, &total);
+        if ( NULL != ref )
+            {
+            int32_t old = swapFrameRef(ref, refCount);
+            int32_t delta = (refCount > 0 ? refCount : 0) - (old > 0 ? old : 0);
+            if ( 0 != delta )
                 {
-                android::AutoMutex lock(mVideoBufferLock);
-                mVideoBuffersAvailable.replaceValueFor(frameBuf, refCount);
+                android_atomic_add(delta, total);
                 }
-            break;
-        case CameraFrame::REPROCESS_INPUT_FRAME: {
-            android::AutoMutex lock(mVideoInBufferLock);
-            mVideoInBuffersAvailable.replaceValueFor(frameBuf, refCount);
+            }
+        else
+            {
+            android::AutoMutex lock(mFrameRefFallbackLock);
+            mFrameRefFallback[typeIndex].replaceValueFor(frameBuf, refCount);
+            }
         }
-            break;
-        default:
-            break;
-        };
 
     LOG_FUNCTION_NAME_EXIT;
 
@@ -1623,11 +1831,29 @@ status_t BaseCameraAdapter::startVideoCapture()
     if ( NO_ERROR == ret )
         {
 
-        mVideoBuffersAvailable.clear();
+        clearFrameRefCounts(CameraFrame::VIDEO_FRAME_SYNC);
 
-        for ( unsigned int i = 0 ; i < mPreviewBuffersAvailable.size() ; i++ )
+        // every preview buffer can also go to the video subscribers
+        for ( int i = 0 ; i < REF_SET_COUNT ; i++ )
             {
-            mVideoBuffersAvailable.add(mPreviewBuffersAvailable.keyAt(i), 0);
+            RefBufferTable &table = mFrameRefs[i];
+            int count = android_atomic_acquire_load(&table.count);
+            for ( int slot = 0 ; slot < count ; slot++ )
+                {
+                if ( 0 <= android_atomic_acquire_load(&table.refs[slot][REF_TYPE_PREVIEW]) )
+                    {
+                    android_atomic_release_store(0, &table.refs[slot][REF_TYPE_VIDEO]);
+                    }
+                }
+            }
+
+            {
+            android::AutoMutex lock(mFrameRefFallbackLock);
+            const android::KeyedVector<CameraBuffer *, int> &preview = mFrameRefFallback[REF_TYPE_PREVIEW];
+            for ( unsigned int i = 0 ; i < preview.size() ; i++ )
+                {
+                mFrameRefFallback[REF_TYPE_VIDEO].add(preview.keyAt(i), 0);
+                }
             }
 
         mRecording = true;
@@ -1651,9 +1877,33 @@ status_t BaseCameraAdapter::stopVideoCapture()
 
     if ( NO_ERROR == ret )
         {
-        for ( unsigned int i = 0 ; i < mVideoBuffersAvailable.size() ; i++ )
+        android::Vector<CameraBuffer *> videoBuffers;
+
+        for ( int i = 0 ; i < REF_SET_COUNT ; i++ )
+            {
+            RefBufferTable &table = mFrameRefs[i];
+            int count = android_atomic_acquire_load(&table.count);
+            for ( int slot = 0 ; slot < count ; slot++ )
+                {
+                if ( 0 <= android_atomic_acquire_load(&table.refs[slot][REF_TYPE_VIDEO]) )
+                    {
+                    videoBuffers.add(&table.buffers[slot]);
+                    }
+                }
+            }
+
+            {
+            android::AutoMutex lock(mFrameRefFallbackLock);
+            const android::KeyedVector<CameraBuffer *, int> &video = mFrameRefFallback[REF_TYPE_VIDEO];
+            for ( unsigned int i = 0 ; i < video.size() ; i++ )
+                {
+                videoBuffers.add(video.keyAt(i));
+                }
+            }
+
+        for ( unsigned int i = 0 ; i < videoBuffers.size() ; i++ )
             {
-            CameraBuffer *frameBuf = mVideoBuffersAvailable.keyAt(i);
+            CameraBuffer *frameBuf = videoBuffers[i];
             if( getFrameRefCountByType(frameBuf,  CameraFrame::VIDEO_FRAME_SYNC) > 0)
                 {
                 returnFrame(frameBuf, CameraFrame::VIDEO_FRAME_SYNC);
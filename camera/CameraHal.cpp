@@ -27,6 +27,7 @@
 #include "TICameraParameters.h"
 #include "CameraProperties.h"
 #include <cutils/properties.h>
+#include <cutils/atomic.h>
 
 #include <poll.h>
 #include <math.h>
@@ -64,6 +65,11 @@ extern const char * const kRawImagesOutputDirPath = "/data/misc/camera/RaW_PiCtU
 extern const char * const kYuvImagesOutputDirPath = "/data/misc/camera/YuV_PiCtUrEs";
 #endif
 
+// Written by dump() when kFrameTimelineExportProperty is set, the raw
+// per-frame timeline of a camera for offline analysis
+static const char * const kFrameTimelineExportProperty = "debug.camera.timeline.export";
+static const char * const kFrameTimelineExportPath = "/data/misc/camera/frame_timeline_%d.csv";
+
 /******************************************************************************/
 
 
@@ -164,6 +170,15 @@ DisplayAdapter::DisplayAdapter()
 #ifdef OMAP_ENHANCEMENT_CPCAM
     mExtendedOps = &dummyPreviewStreamExtendedOps;
 #endif
+    mFrameDisplayedCallback = NULL;
+    mFrameDisplayedUserData = NULL;
+}
+
+void DisplayAdapter::registerFrameDisplayedCallback(frame_displayed_callback callback,
+                                                    void *user_data)
+{
+    mFrameDisplayedCallback = callback;
+    mFrameDisplayedUserData = user_data;
 }
 
 #ifdef OMAP_ENHANCEMENT_CPCAM
@@ -360,14 +375,58 @@ int CameraHal::setParameters(const char* parameters)
 
     LOG_FUNCTION_NAME;
 
-    android::CameraParameters params;
+    const nsecs_t start = systemTime();
+    int state;
+    int ret;
 
     android::String8 str_params(parameters);
+
+    {
+        android::AutoMutex lock(mLock);
+
+        // Apps set the same parameters over and over, if neither they nor
+        // anything they are applied to changed since, there is nothing to do.
+        // A running adapter that may have moved on its own gets them again.
+        // Whatever changes mParameters outside of setParameters() drops
+        // mLastParameters, so it stands for the current mParameters.
+        state = getParametersState();
+        if ( !mLastParameters.isEmpty() && (mLastParameters == str_params) &&
+             (mLastParametersState == state) && !mBracketingEnabled &&
+             (!mPreviewEnabled || !mAdapterParameters.isEmpty()) ) {
+            android::AutoMutex statsLock(mSetParametersStatsLock);
+            mSetParametersStats.calls++;
+            mSetParametersStats.unchanged++;
+            mSetParametersStats.time += systemTime() - start;
+            LOG_FUNCTION_NAME_EXIT;
+            return NO_ERROR;
+        }
+    }
+
+    android::CameraParameters params;
     params.unflatten(str_params);
 
+    ret = setParameters(params);
+
+    {
+        android::AutoMutex lock(mLock);
+
+        if ( NO_ERROR == ret ) {
+            mLastParameters = str_params;
+            mLastParametersState = getParametersState();
+        } else {
+            mLastParameters.clear();
+        }
+    }
+
+    {
+        android::AutoMutex statsLock(mSetParametersStatsLock);
+        mSetParametersStats.calls++;
+        mSetParametersStats.time += systemTime() - start;
+    }
+
     LOG_FUNCTION_NAME_EXIT;
 
-    return setParameters(params);
+    return ret;
 }
 
 /**
@@ -409,7 +468,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
         if(!previewEnabled())
             {
             if ((valstr = params.getPreviewFormat()) != NULL) {
-                if ( isParameterValid(valstr, mCameraProperties->get(CameraProperties::SUPPORTED_PREVIEW_FORMATS))) {
+                if ( isCapabilitySupported(valstr, CameraProperties::SUPPORTED_PREVIEW_FORMATS)) {
                     mParameters.setPreviewFormat(valstr);
                     CAMHAL_LOGDB("PreviewFormat set %s", valstr);
                 } else {
@@ -493,7 +552,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
         }
 
         if ((valstr = params.get(TICameraParameters::KEY_IPP)) != NULL) {
-            if (isParameterValid(valstr,mCameraProperties->get(CameraProperties::SUPPORTED_IPP_MODES))) {
+            if (isCapabilitySupported(valstr, CameraProperties::SUPPORTED_IPP_MODES)) {
                 if ((mParameters.get(TICameraParameters::KEY_IPP) == NULL) ||
                         (strcmp(valstr, mParameters.get(TICameraParameters::KEY_IPP)))) {
                     CAMHAL_LOGDB("IPP mode set %s", params.get(TICameraParameters::KEY_IPP));
@@ -577,10 +636,10 @@ int CameraHal::setParameters(const android::CameraParameters& params)
             restartPreviewRequired |= resetVideoModeParameters();
             }
 
-        if ( (!isResolutionValid(w, h, mCameraProperties->get(CameraProperties::SUPPORTED_PREVIEW_SIZES)))
-                && (!isResolutionValid(w, h, mCameraProperties->get(CameraProperties::SUPPORTED_PREVIEW_SUBSAMPLED_SIZES)))
-                && (!isResolutionValid(w, h, mCameraProperties->get(CameraProperties::SUPPORTED_PREVIEW_SIDEBYSIDE_SIZES)))
-                && (!isResolutionValid(w, h, mCameraProperties->get(CameraProperties::SUPPORTED_PREVIEW_TOPBOTTOM_SIZES))) ) {
+        if ( (!isCapabilityResolution(w, h, CameraProperties::SUPPORTED_PREVIEW_SIZES))
+                && (!isCapabilityResolution(w, h, CameraProperties::SUPPORTED_PREVIEW_SUBSAMPLED_SIZES))
+                && (!isCapabilityResolution(w, h, CameraProperties::SUPPORTED_PREVIEW_SIDEBYSIDE_SIZES))
+                && (!isCapabilityResolution(w, h, CameraProperties::SUPPORTED_PREVIEW_TOPBOTTOM_SIZES)) ) {
             CAMHAL_LOGEB("Invalid preview resolution %d x %d", w, h);
             return BAD_VALUE;
         }
@@ -596,7 +655,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
         CAMHAL_LOGDB("Preview Resolution: %d x %d", w, h);
 
         if ((valstr = params.get(android::CameraParameters::KEY_FOCUS_MODE)) != NULL) {
-            if (isParameterValid(valstr, mCameraProperties->get(CameraProperties::SUPPORTED_FOCUS_MODES))) {
+            if (isCapabilitySupported(valstr, CameraProperties::SUPPORTED_FOCUS_MODES)) {
                 CAMHAL_LOGDB("Focus mode set %s", valstr);
 
 #ifdef CAMERAHAL_TUNA
@@ -639,10 +698,10 @@ int CameraHal::setParameters(const android::CameraParameters& params)
             }
 
         params.getPictureSize(&w, &h);
-        if ( (isResolutionValid(w, h, mCameraProperties->get(CameraProperties::SUPPORTED_PICTURE_SIZES)))
-                || (isResolutionValid(w, h, mCameraProperties->get(CameraProperties::SUPPORTED_PICTURE_SUBSAMPLED_SIZES)))
-                || (isResolutionValid(w, h, mCameraProperties->get(CameraProperties::SUPPORTED_PICTURE_TOPBOTTOM_SIZES)))
-                || (isResolutionValid(w, h, mCameraProperties->get(CameraProperties::SUPPORTED_PICTURE_SIDEBYSIDE_SIZES))) ) {
+        if ( (isCapabilityResolution(w, h, CameraProperties::SUPPORTED_PICTURE_SIZES))
+                || (isCapabilityResolution(w, h, CameraProperties::SUPPORTED_PICTURE_SUBSAMPLED_SIZES))
+                || (isCapabilityResolution(w, h, CameraProperties::SUPPORTED_PICTURE_TOPBOTTOM_SIZES))
+                || (isCapabilityResolution(w, h, CameraProperties::SUPPORTED_PICTURE_SIDEBYSIDE_SIZES)) ) {
             mParameters.setPictureSize(w, h);
         } else {
             CAMHAL_LOGEB("ERROR: Invalid picture resolution %d x %d", w, h);
@@ -652,7 +711,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
         CAMHAL_LOGDB("Picture Size by App %d x %d", w, h);
 
         if ( (valstr = params.getPictureFormat()) != NULL ) {
-            if (isParameterValid(valstr,mCameraProperties->get(CameraProperties::SUPPORTED_PICTURE_FORMATS))) {
+            if (isCapabilitySupported(valstr, CameraProperties::SUPPORTED_PICTURE_FORMATS)) {
                 if ((strcmp(valstr, android::CameraParameters::PIXEL_FORMAT_BAYER_RGGB) == 0) &&
                     mCameraProperties->get(CameraProperties::MAX_PICTURE_WIDTH) &&
                     mCameraProperties->get(CameraProperties::MAX_PICTURE_HEIGHT)) {
@@ -802,7 +861,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
         }
 
         if ((valstr = params.get(TICameraParameters::KEY_EXPOSURE_MODE)) != NULL) {
-            if (isParameterValid(valstr, mCameraProperties->get(CameraProperties::SUPPORTED_EXPOSURE_MODES))) {
+            if (isCapabilitySupported(valstr, CameraProperties::SUPPORTED_EXPOSURE_MODES)) {
                 CAMHAL_LOGDB("Exposure mode set = %s", valstr);
                 mParameters.set(TICameraParameters::KEY_EXPOSURE_MODE, valstr);
                 if (!strcmp(valstr, TICameraParameters::EXPOSURE_MODE_MANUAL)) {
@@ -860,7 +919,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
 #endif
 
         if ((valstr = params.get(android::CameraParameters::KEY_WHITE_BALANCE)) != NULL) {
-           if ( isParameterValid(valstr, mCameraProperties->get(CameraProperties::SUPPORTED_WHITE_BALANCE))) {
+           if ( isCapabilitySupported(valstr, CameraProperties::SUPPORTED_WHITE_BALANCE)) {
                CAMHAL_LOGDB("White balance set %s", valstr);
                mParameters.set(android::CameraParameters::KEY_WHITE_BALANCE, valstr);
             } else {
@@ -912,7 +971,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
 #endif
 
         if ((valstr = params.get(android::CameraParameters::KEY_ANTIBANDING)) != NULL) {
-            if (isParameterValid(valstr, mCameraProperties->get(CameraProperties::SUPPORTED_ANTIBANDING))) {
+            if (isCapabilitySupported(valstr, CameraProperties::SUPPORTED_ANTIBANDING)) {
                 CAMHAL_LOGDB("Antibanding set %s", valstr);
                 mParameters.set(android::CameraParameters::KEY_ANTIBANDING, valstr);
              } else {
@@ -923,7 +982,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
 
 #ifdef OMAP_ENHANCEMENT
         if ((valstr = params.get(TICameraParameters::KEY_ISO)) != NULL) {
-            if (isParameterValid(valstr, mCameraProperties->get(CameraProperties::SUPPORTED_ISO_VALUES))) {
+            if (isCapabilitySupported(valstr, CameraProperties::SUPPORTED_ISO_VALUES)) {
                 CAMHAL_LOGDB("ISO set %s", valstr);
                 mParameters.set(TICameraParameters::KEY_ISO, valstr);
             } else {
@@ -968,7 +1027,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
             }
 
         if ((valstr = params.get(android::CameraParameters::KEY_SCENE_MODE)) != NULL) {
-            if (isParameterValid(valstr, mCameraProperties->get(CameraProperties::SUPPORTED_SCENE_MODES))) {
+            if (isCapabilitySupported(valstr, CameraProperties::SUPPORTED_SCENE_MODES)) {
                 CAMHAL_LOGDB("Scene mode set %s", valstr);
                 doesSetParameterNeedUpdate(valstr,
                                            mParameters.get(android::CameraParameters::KEY_SCENE_MODE),
@@ -981,7 +1040,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
         }
 
         if ((valstr = params.get(android::CameraParameters::KEY_FLASH_MODE)) != NULL) {
-            if (isParameterValid(valstr, mCameraProperties->get(CameraProperties::SUPPORTED_FLASH_MODES))) {
+            if (isCapabilitySupported(valstr, CameraProperties::SUPPORTED_FLASH_MODES)) {
                 CAMHAL_LOGDB("Flash mode set %s", valstr);
                 mParameters.set(android::CameraParameters::KEY_FLASH_MODE, valstr);
             } else {
@@ -991,7 +1050,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
         }
 
         if ((valstr = params.get(android::CameraParameters::KEY_EFFECT)) != NULL) {
-            if (isParameterValid(valstr, mCameraProperties->get(CameraProperties::SUPPORTED_EFFECTS))) {
+            if (isCapabilitySupported(valstr, CameraProperties::SUPPORTED_EFFECTS)) {
                 CAMHAL_LOGDB("Effect set %s", valstr);
                 mParameters.set(android::CameraParameters::KEY_EFFECT, valstr);
              } else {
@@ -1328,7 +1387,7 @@ int CameraHal::setParameters(const android::CameraParameters& params)
         if ( (NULL != mCameraAdapter) &&
              (mPreviewEnabled || updateRequired) &&
              (!(mPreviewEnabled && restartPreviewRequired)) ) {
-            ret |= mCameraAdapter->setParameters(adapterParams);
+            ret |= setAdapterParameters(adapterParams, false);
         }
 
 #ifdef OMAP_ENHANCEMENT
@@ -1831,6 +1890,8 @@ status_t CameraHal::startPreview() {
     // calls startPreview twice or more.
     mPreviewInitializationDone = false;
 
+    nsecs_t phaseStart = systemTime();
+
     ///Enable the display adapter if present, actual overlay enable happens when we post the buffer
     if(mDisplayAdapter.get() != NULL) {
         CAMHAL_LOGDA("Enabling display");
@@ -1860,9 +1921,18 @@ status_t CameraHal::startPreview() {
 
     }
 
+    mStartupTimes.display = systemTime() - phaseStart;
+
+#if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
+
+    CameraHal::PPM("Preview display enabled: ", &mStartPreview);
+
+#endif
+
     ///Send START_PREVIEW command to adapter
     CAMHAL_LOGDA("Starting CameraAdapter preview mode");
 
+    phaseStart = systemTime();
     ret = mCameraAdapter->sendCommand(CameraAdapter::CAMERA_START_PREVIEW);
 
     if(ret!=NO_ERROR) {
@@ -1871,6 +1941,16 @@ status_t CameraHal::startPreview() {
     }
     CAMHAL_LOGDA("Started preview");
 
+    mStartupTimes.adapterStart = systemTime() - phaseStart;
+
+#if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
+
+    CameraHal::PPM("Preview adapter started: ", &mStartPreview);
+
+#endif
+
+    reportPreviewStartup();
+
     mPreviewEnabled = true;
     mPreviewStartInProgress = false;
     return ret;
@@ -1880,6 +1960,7 @@ status_t CameraHal::startPreview() {
         CAMHAL_LOGEA("Performing cleanup after error");
 
         //Do all the cleanup
+        android_atomic_release_store(0, &mStartupAwaitingFrame);
         freePreviewBufs();
         mCameraAdapter->sendCommand(CameraAdapter::CAMERA_STOP_PREVIEW);
         if(mDisplayAdapter.get() != NULL) {
@@ -1912,6 +1993,12 @@ status_t CameraHal::cameraPreviewInitialization()
     CameraFrame frame;
     unsigned int required_buffer_count;
     unsigned int max_queueble_buffers;
+    android::sp<PreviewStartThread> notifierThread;
+    status_t notifierRet;
+    const char *previewFormat;
+    int previewWidth, previewHeight;
+    const nsecs_t begin = systemTime();
+    nsecs_t phaseStart = begin;
 
 #if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
         gettimeofday(&mStartPreview, NULL);
@@ -1929,8 +2016,13 @@ status_t CameraHal::cameraPreviewInitialization()
       return ALREADY_EXISTS;
     }
 
+    // the pooled buffers are about to be reused
+    if ( NULL != mAppCallbackNotifier.get() ) {
+        mAppCallbackNotifier->scheduleMemoryTrim(NULL, 0);
+    }
+
     if ( NULL != mCameraAdapter ) {
-      ret = mCameraAdapter->setParameters(mParameters);
+      ret = setAdapterParameters(mParameters, true);
     }
 
     if ((mPreviewStartInProgress == false) && (mDisplayPaused == false)){
@@ -1982,9 +2074,26 @@ status_t CameraHal::cameraPreviewInitialization()
         return ret;
         }
 
+    mStartupBegin = begin;
+    memset(&mStartupTimes, 0, sizeof(mStartupTimes));
+    mStartupTimes.setup = systemTime() - phaseStart;
+    {
+        android::AutoMutex lock(mStartupLock);
+        mStartupAdapterStarted = 0;
+        mStartupFirstFrame = 0;
+    }
+    android_atomic_release_store(1, &mStartupAwaitingFrame);
+
+#if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
+
+    CameraHal::PPM("Preview parameters set: ", &mStartPreview);
+
+#endif
+
     required_buffer_count = atoi(mCameraProperties->get(CameraProperties::REQUIRED_PREVIEW_BUFS));
 
     ///Allocate the preview buffers
+    phaseStart = systemTime();
     ret = allocPreviewBufs(mPreviewWidth, mPreviewHeight, mParameters.getPreviewFormat(), required_buffer_count, max_queueble_buffers);
 
     if ( NO_ERROR != ret )
@@ -2026,6 +2135,25 @@ status_t CameraHal::cameraPreviewInitialization()
 
         }
 
+    mStartupTimes.alloc = systemTime() - phaseStart;
+
+#if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
+
+    CameraHal::PPM("Preview buffers allocated: ", &mStartPreview);
+
+#endif
+
+    ///Start the callback notifier and allocate its preview heap while the adapter
+    ///registers the buffers, the loaded to idle transition is the longest step here
+    previewFormat = mParameters.getPreviewFormat();
+    mParameters.getPreviewSize(&previewWidth, &previewHeight);
+    notifierThread = new PreviewStartThread(this, previewFormat, previewWidth, previewHeight);
+    if ( NO_ERROR != notifierThread->run("CameraPreviewStart", android::PRIORITY_URGENT_DISPLAY) )
+        {
+        CAMHAL_LOGW("Couldn't run preview start thread, starting AppCallbackNotifier inline");
+        notifierThread.clear();
+        }
+
     ///Pass the buffers to Camera Adapter
     desc.mBuffers = mPreviewBuffers;
     desc.mOffsets = mPreviewOffsets;
@@ -2034,38 +2162,66 @@ status_t CameraHal::cameraPreviewInitialization()
     desc.mCount = ( size_t ) required_buffer_count;
     desc.mMaxQueueable = (size_t) max_queueble_buffers;
 
+    phaseStart = systemTime();
     ret = mCameraAdapter->sendCommand(CameraAdapter::CAMERA_USE_BUFFERS_PREVIEW,
                                       ( int ) &desc);
+    mStartupTimes.useBuffers = systemTime() - phaseStart;
+
+#if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
+
+    CameraHal::PPM("Preview buffers registered: ", &mStartPreview);
+
+#endif
+
+    phaseStart = systemTime();
+    if ( NULL != notifierThread.get() )
+        {
+        notifierThread->join();
+        notifierRet = notifierThread->status();
+        mStartupTimes.notifier = notifierThread->duration();
+        mStartupTimes.notifierWait = systemTime() - phaseStart;
+        }
+    else
+        {
+        notifierRet = startAppCallbackNotifier(previewFormat, previewWidth, previewHeight);
+        mStartupTimes.notifier = systemTime() - phaseStart;
+        mStartupTimes.notifierWait = mStartupTimes.notifier;
+        }
 
     if ( NO_ERROR != ret )
         {
         CAMHAL_LOGEB("Failed to register preview buffers: 0x%x", ret);
+        if ( NO_ERROR == notifierRet )
+            {
+            //Started for this preview only, undo it
+            mAppCallbackNotifier->stop();
+            }
         freePreviewBufs();
         return ret;
         }
 
-    ///Start the callback notifier
-    ret = mAppCallbackNotifier->start();
-
-    if( ALREADY_EXISTS == ret )
+    if( ALREADY_EXISTS == notifierRet )
         {
         //Already running, do nothing
-        CAMHAL_LOGDA("AppCallbackNotifier already running");
         ret = NO_ERROR;
         }
-    else if ( NO_ERROR == ret ) {
-        CAMHAL_LOGDA("Started AppCallbackNotifier..");
-        mAppCallbackNotifier->setMeasurements(mMeasurementEnabled);
-        }
-    else
+    else if ( NO_ERROR != notifierRet )
         {
-        CAMHAL_LOGDA("Couldn't start AppCallbackNotifier");
+        ret = notifierRet;
         goto error;
         }
 
     if (ret == NO_ERROR) mPreviewInitializationDone = true;
 
+    phaseStart = systemTime();
     mAppCallbackNotifier->startPreviewCallbacks(mParameters, mPreviewBuffers, mPreviewOffsets, mPreviewFd, mPreviewLength, required_buffer_count);
+    mStartupTimes.callbacks = systemTime() - phaseStart;
+
+#if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
+
+    CameraHal::PPM("Preview callbacks started: ", &mStartPreview);
+
+#endif
 
     return ret;
 
@@ -2074,6 +2230,7 @@ status_t CameraHal::cameraPreviewInitialization()
         CAMHAL_LOGEA("Performing cleanup after error");
 
         //Do all the cleanup
+        android_atomic_release_store(0, &mStartupAwaitingFrame);
         freePreviewBufs();
         mCameraAdapter->sendCommand(CameraAdapter::CAMERA_STOP_PREVIEW);
         if(mDisplayAdapter.get() != NULL)
@@ -2088,6 +2245,134 @@ status_t CameraHal::cameraPreviewInitialization()
         return ret;
 }
 
+/**
+   @brief Starts the AppCallbackNotifier for preview
+
+   Runs on the preview start thread, concurrently with CAMERA_USE_BUFFERS_PREVIEW,
+   so it must not touch anything the adapter or cameraPreviewInitialization() use.
+   Allocating the callback heap here keeps it off the critical path of
+   startPreviewCallbacks().
+
+   @param format preview pixel format, as in CameraParameters
+   @param width preview width
+   @param height preview height
+   @return NO_ERROR if started, ALREADY_EXISTS if it was running already
+
+ */
+status_t CameraHal::startAppCallbackNotifier(const char *format, int width, int height)
+{
+    status_t ret;
+
+    LOG_FUNCTION_NAME;
+
+    ret = mAppCallbackNotifier->start();
+
+    if ( ALREADY_EXISTS == ret )
+        {
+        CAMHAL_LOGDA("AppCallbackNotifier already running");
+        }
+    else if ( NO_ERROR == ret )
+        {
+        CAMHAL_LOGDA("Started AppCallbackNotifier..");
+        mAppCallbackNotifier->setMeasurements(mMeasurementEnabled);
+        }
+    else
+        {
+        CAMHAL_LOGEA("Couldn't start AppCallbackNotifier");
+        LOG_FUNCTION_NAME_EXIT;
+        return ret;
+        }
+
+    // Not fatal, startPreviewCallbacks() allocates the heap itself then
+    if ( NO_ERROR != mAppCallbackNotifier->preparePreviewCallbacks(format, width, height) )
+        {
+        CAMHAL_LOGDA("Preview callback heap not allocated ahead");
+        }
+
+    LOG_FUNCTION_NAME_EXIT;
+
+    return ret;
+}
+
+/**
+   @brief Stamps the end of CAMERA_START_PREVIEW for the startup breakdown
+
+   The breakdown is logged once per startPreview() and kept for dump() when the
+   first preview frame has also been displayed or sent to the application,
+   whichever of the two happens last. The total runs from the beginning of
+   cameraPreviewInitialization(), so with a separate
+   CAMERA_CMD_PREVIEW_INITIALIZATION it includes the time until startPreview().
+
+ */
+void CameraHal::reportPreviewStartup()
+{
+    android::AutoMutex lock(mStartupLock);
+
+    mStartupAdapterStarted = systemTime();
+    if ( 0 != mStartupFirstFrame ) {
+        finishPreviewStartupLocked();
+    }
+}
+
+void CameraHal::previewFrameDeliveredRelay(void *userData)
+{
+    static_cast<CameraHal *>(userData)->previewFrameDelivered();
+}
+
+/**
+   @brief Stamps the first preview frame displayed or sent to the application
+
+   Called for every preview frame, only the first one after a startup takes
+   the lock.
+
+ */
+void CameraHal::previewFrameDelivered()
+{
+    if ( 0 == android_atomic_acquire_load(&mStartupAwaitingFrame) ) {
+        return;
+    }
+
+    // the display and the notifier threads may both get here
+    if ( 0 != android_atomic_cmpxchg(1, 0, &mStartupAwaitingFrame) ) {
+        return;
+    }
+
+    android::AutoMutex lock(mStartupLock);
+
+    mStartupFirstFrame = systemTime();
+    if ( 0 != mStartupAdapterStarted ) {
+        finishPreviewStartupLocked();
+    }
+}
+
+void CameraHal::finishPreviewStartupLocked()
+{
+    // the adapter may deliver the first frame before the start command returns
+    const nsecs_t end = ( mStartupFirstFrame > mStartupAdapterStarted ) ?
+                        mStartupFirstFrame : mStartupAdapterStarted;
+
+    mStartupTimes.firstFrame = end - mStartupAdapterStarted;
+    mStartupTimes.total = end - mStartupBegin;
+
+    CAMHAL_LOGI("Preview startup %lld us: setup %lld, alloc %lld, use buffers %lld "
+                "(notifier %lld, waited %lld), callbacks %lld, display %lld, adapter start %lld, "
+                "first frame %lld",
+                ns2us(mStartupTimes.total), ns2us(mStartupTimes.setup),
+                ns2us(mStartupTimes.alloc), ns2us(mStartupTimes.useBuffers),
+                ns2us(mStartupTimes.notifier), ns2us(mStartupTimes.notifierWait),
+                ns2us(mStartupTimes.callbacks), ns2us(mStartupTimes.display),
+                ns2us(mStartupTimes.adapterStart), ns2us(mStartupTimes.firstFrame));
+
+    mStartupAdapterStarted = 0;
+    mStartupFirstFrame = 0;
+    mStartupLast = mStartupTimes;
+    mStartupCount++;
+    mStartupTotalSum += mStartupTimes.total;
+    if ( mStartupTimes.total > mStartupTotalMax ) {
+        mStartupTotalMax = mStartupTimes.total;
+    }
+}
+
 /**
    @brief Sets ANativeWindow object.
 
@@ -2164,6 +2449,10 @@ status_t CameraHal::setPreviewWindow(struct preview_stream_ops *window)
         // Set it as the error handler for the DisplayAdapter
         mDisplayAdapter->setErrorHandler(mAppCallbackNotifier.get());
 
+        // The first frame it shows ends the preview startup measurement
+        mDisplayAdapter->registerFrameDisplayedCallback(previewFrameDeliveredRelay, this);
+        mDisplayAdapter->setFrameTimeline(mFrameTimeline);
+
         // Update the display adapter with the new window that is passed from CameraService
         ret  = mDisplayAdapter->setPreviewWindow(window);
         if(ret!=NO_ERROR)
@@ -2610,6 +2899,13 @@ void CameraHal::stopPreview()
     // to ImageCapture, CAPTURE_MODE is not left to VIDEO_MODE.
     CAMHAL_LOGDA("Resetting Capture-Mode to default");
     mParameters.set(TICameraParameters::KEY_CAP_MODE, "");
+    invalidateLastParameters();
+
+    // Keep the pooled buffers for a quick restart, but not while idle
+    if ( ( NULL != mAppCallbackNotifier.get() ) && ( NULL != mMemoryManager.get() ) ) {
+        mAppCallbackNotifier->scheduleMemoryTrim(mMemoryManager,
+                ms2ns(MemoryManager::POOL_IDLE_TIMEOUT_MS));
+    }
 
     LOG_FUNCTION_NAME_EXIT;
 }
@@ -2665,6 +2961,7 @@ status_t CameraHal::startRecording( )
     // set internal recording hint in case camera adapter needs to make some
     // decisions....(will only be sent to camera adapter if camera restart is required)
     mParameters.set(TICameraParameters::KEY_RECORDING_HINT, android::CameraParameters::TRUE);
+    invalidateLastParameters();
 
     // if application starts recording in continuous focus picture mode...
     // then we need to force default capture mode (as opposed to video mode)
@@ -2902,7 +3199,8 @@ status_t CameraHal::restartPreview()
         } else {
             mParameters.set(TICameraParameters::KEY_CAP_MODE, "");
         }
-        mCameraAdapter->setParameters(mParameters);
+        invalidateLastParameters();
+        setAdapterParameters(mParameters, true);
     }
 
     ret = startPreview();
@@ -2955,6 +3253,7 @@ void CameraHal::stopRecording()
     // reset internal recording hint in case camera adapter needs to make some
     // decisions....(will only be sent to camera adapter if camera restart is required)
     mParameters.remove(TICameraParameters::KEY_RECORDING_HINT);
+    invalidateLastParameters();
 
     LOG_FUNCTION_NAME_EXIT;
 }
@@ -3027,6 +3326,9 @@ status_t CameraHal::autoFocus()
 
     android::AutoMutex lock(mLock);
 
+    // The adapter changes focus state on its own from here on
+    invalidateAdapterParameters();
+
     mMsgEnabled |= CAMERA_MSG_FOCUS;
 
     if ( NULL == mCameraAdapter )
@@ -3089,8 +3391,9 @@ status_t CameraHal::cancelAutoFocus()
     if( NULL != mCameraAdapter )
     {
         adapterParams.set(TICameraParameters::KEY_AUTO_FOCUS_LOCK, android::CameraParameters::FALSE);
-        mCameraAdapter->setParameters(adapterParams);
+        setAdapterParameters(adapterParams, true);
         mCameraAdapter->sendCommand(CameraAdapter::CAMERA_CANCEL_AUTOFOCUS);
+        invalidateAdapterParameters();
         mAppCallbackNotifier->flushEventQueue();
     }
 
@@ -3319,6 +3622,9 @@ status_t CameraHal::__takePicture(const char *params, struct timeval *captureSta
 
     LOG_FUNCTION_NAME;
 
+    invalidateAdapterParameters();
+    invalidateLastParameters();
+
     if(!previewEnabled() && !mDisplayPaused)
         {
         LOG_FUNCTION_NAME_EXIT;
@@ -3413,7 +3719,7 @@ status_t CameraHal::__takePicture(const char *params, struct timeval *captureSta
             }
         }
 
-        mCameraAdapter->setParameters(mParameters);
+        setAdapterParameters(mParameters, true);
     } else
 #endif
     {
@@ -3691,7 +3997,9 @@ char* CameraHal::getParameters()
 
     if( NULL != mCameraAdapter )
     {
+        // the adapter reports the settings it ended up with
         mCameraAdapter->getParameters(mParameters);
+        invalidateLastParameters();
     }
 
     if ( (valstr = mParameters.get(TICameraParameters::KEY_S3D_CAP_FRAME_LAYOUT)) != NULL ) {
@@ -3765,6 +4073,8 @@ status_t CameraHal::reprocess(const char *params)
 
     LOG_FUNCTION_NAME;
 
+    invalidateAdapterParameters();
+
 #if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
 
     gettimeofday(&startReprocess, NULL);
@@ -3899,6 +4209,8 @@ status_t CameraHal::sendCommand(int32_t cmd, int32_t arg1, int32_t arg2)
 
     LOG_FUNCTION_NAME;
 
+    invalidateAdapterParameters();
+
     if ( ( NO_ERROR == ret ) && ( NULL == mCameraAdapter ) )
         {
         CAMHAL_LOGEA("No CameraAdapter instance");
@@ -4011,6 +4323,14 @@ void CameraHal::release()
     ///@todo Investigate on how release is used by CameraService. Vaguely remember that this is called
     ///just before CameraHal object destruction
     deinitialize();
+
+    // nothing is going to reuse the pooled buffers any more
+    if ( NULL != mAppCallbackNotifier.get() ) {
+        mAppCallbackNotifier->scheduleMemoryTrim(NULL, 0);
+    }
+    if ( NULL != mMemoryManager.get() ) {
+        mMemoryManager->trimPool(0);
+    }
     LOG_FUNCTION_NAME_EXIT;
 }
 
@@ -4028,6 +4348,79 @@ status_t  CameraHal::dump(int fd) const
 {
     LOG_FUNCTION_NAME;
     ///Implement this method when the h/w dump function is supported on Ducati side
+
+    if ( NULL != mMemoryManager.get() ) {
+        mMemoryManager->dump(fd);
+    }
+
+    {
+        android::AutoMutex lock(mSetParametersStatsLock);
+        const SetParametersStats &stats = mSetParametersStats;
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "setParameters: %u calls, %u unchanged, average %lld us, "
+                 "%u adapter updates, %u skipped\n",
+                 stats.calls, stats.unchanged,
+                 stats.calls ? (long long) ns2us(stats.time / stats.calls) : 0LL,
+                 stats.adapterUpdates, stats.adapterSkipped);
+        write(fd, line, strlen(line));
+    }
+
+    {
+        android::AutoMutex lock(mStartupLock);
+        if ( mStartupCount > 0 ) {
+            char line[512];
+            snprintf(line, sizeof(line),
+                     "Preview startup to first frame: %u starts, average %lld us, worst %lld us\n"
+                     "  last %lld us: setup %lld, alloc %lld, use buffers %lld "
+                     "(notifier %lld, waited %lld), callbacks %lld, display %lld, adapter start %lld, "
+                     "first frame %lld\n",
+                     mStartupCount, ns2us(mStartupTotalSum / mStartupCount), ns2us(mStartupTotalMax),
+                     ns2us(mStartupLast.total), ns2us(mStartupLast.setup),
+                     ns2us(mStartupLast.alloc), ns2us(mStartupLast.useBuffers),
+                     ns2us(mStartupLast.notifier), ns2us(mStartupLast.notifierWait),
+                     ns2us(mStartupLast.callbacks), ns2us(mStartupLast.display),
+                     ns2us(mStartupLast.adapterStart), ns2us(mStartupLast.firstFrame));
+            write(fd, line, strlen(line));
+        }
+    }
+
+    if ( NULL != mCameraAdapter ) {
+        mCameraAdapter->dump(fd);
+    }
+
+    if ( NULL != mDisplayAdapter.get() ) {
+        mDisplayAdapter->dump(fd);
+    }
+
+    if ( NULL != mAppCallbackNotifier.get() ) {
+        mAppCallbackNotifier->dump(fd);
+    }
+
+    if ( NULL != mFrameTimeline.get() ) {
+        char value[PROPERTY_VALUE_MAX];
+
+        mFrameTimeline->dump(fd);
+
+        property_get(kFrameTimelineExportProperty, value, "0");
+        if ( 0 != atoi(value) ) {
+            char path[64];
+            char line[256];
+
+            snprintf(path, sizeof(path), kFrameTimelineExportPath, mCameraIndex);
+            if ( NO_ERROR == mFrameTimeline->exportTo(path) ) {
+                snprintf(line, sizeof(line), "Frame timeline exported to %s\n", path);
+            } else {
+                snprintf(line, sizeof(line), "Frame timeline export to %s failed\n", path);
+            }
+            write(fd, line, strlen(line));
+        }
+    }
+
+#if TI_UTILS_TRACE_LEVEL > 0 || defined(TI_UTILS_FUNCTION_TRACER_ENABLE)
+    Ti::Trace::dump(fd);
+#endif
+
     return NO_ERROR;
 }
 
@@ -4105,6 +4498,19 @@ CameraHal::CameraHal(int cameraId)
 #endif
     mPreviewInitializationDone = false;
 
+    mLastParametersState = 0;
+    memset(&mSetParametersStats, 0, sizeof(mSetParametersStats));
+
+    mStartupBegin = 0;
+    memset(&mStartupTimes, 0, sizeof(mStartupTimes));
+    mStartupAwaitingFrame = 0;
+    mStartupAdapterStarted = 0;
+    mStartupFirstFrame = 0;
+    memset(&mStartupLast, 0, sizeof(mStartupLast));
+    mStartupCount = 0;
+    mStartupTotalSum = 0;
+    mStartupTotalMax = 0;
+
 #ifdef OMAP_ENHANCEMENT_CPCAM
     mExtendedPreviewStreamOps = 0;
 #endif
@@ -4125,6 +4531,9 @@ CameraHal::CameraHal(int cameraId)
 
     mExternalLocking = false;
 
+    // use all cores for NV12 resizing unless the adapter asks otherwise
+    mResizeThreads = 0;
+
     LOG_FUNCTION_NAME_EXIT;
 }
 
@@ -4238,6 +4647,11 @@ status_t CameraHal::initialize(CameraProperties::Properties* properties)
     mCameraAdapter->registerImageReleaseCallback(releaseImageBuffers, (void *) this);
     mCameraAdapter->registerEndCaptureCallback(endImageCapture, (void *)this);
 
+    if ( NULL == mFrameTimeline.get() ) {
+        mFrameTimeline = new FrameTimeline();
+    }
+    mCameraAdapter->setFrameTimeline(mFrameTimeline);
+
     if(!mAppCallbackNotifier.get())
         {
         /// Create the callback notifier
@@ -4249,6 +4663,9 @@ status_t CameraHal::initialize(CameraProperties::Properties* properties)
             }
         }
 
+    mAppCallbackNotifier->setResizeThreads(mResizeThreads);
+    mAppCallbackNotifier->setFrameTimeline(mFrameTimeline);
+
     if(!mMemoryManager.get())
         {
         /// Create Memory Manager
@@ -4463,6 +4880,139 @@ status_t CameraHal::doesSetParameterNeedUpdate(const char* new_param, const char
    return NO_ERROR;
 }
 
+const CapabilitySet & CameraHal::getCapabilitySet(const char *capability)
+{
+    ssize_t index = mCapabilities.indexOfKey(capability);
+
+    // Properties don't change after initialization, each list is parsed once
+    if ( index < 0 ) {
+        index = mCapabilities.add(capability, CapabilitySet());
+        mCapabilities.editValueAt(index).setTo(mCameraProperties->get(capability));
+    }
+
+    return mCapabilities.valueAt(index);
+}
+
+bool CameraHal::isCapabilitySupported(const char *value, const char *capability)
+{
+    return getCapabilitySet(capability).contains(value);
+}
+
+bool CameraHal::isCapabilityResolution(int width, int height, const char *capability)
+{
+    return getCapabilitySet(capability).containsResolution(width, height);
+}
+
+status_t CameraHal::setAdapterParameters(const android::CameraParameters &params, bool force)
+{
+    android::String8 flattened = params.flatten();
+
+    if ( !force && !mAdapterParameters.isEmpty() && !adapterParametersChanged(flattened) ) {
+        CAMHAL_LOGDA("No parameter the adapter uses changed");
+        // the adapter state matches these parameters just as well
+        mAdapterParameters = flattened;
+        android::AutoMutex statsLock(mSetParametersStatsLock);
+        mSetParametersStats.adapterSkipped++;
+        return NO_ERROR;
+    }
+
+    {
+        android::AutoMutex statsLock(mSetParametersStatsLock);
+        mSetParametersStats.adapterUpdates++;
+    }
+
+    status_t ret = mCameraAdapter->setParameters(params);
+    if ( NO_ERROR == ret ) {
+        mAdapterParameters = flattened;
+    } else {
+        mAdapterParameters.clear();
+    }
+
+    return ret;
+}
+
+void CameraHal::invalidateAdapterParameters()
+{
+    mAdapterParameters.clear();
+}
+
+// Both strings come from CameraParameters::flatten(), "key=value" entries
+// joined by ';' in key order, so a single merge pass finds the changes
+bool CameraHal::adapterParametersChanged(const android::String8 &flattened) const
+{
+    const char *a = mAdapterParameters.string();
+    const char *b = flattened.string();
+
+    while ( *a || *b ) {
+        const char *aEnd = strchr(a, ';');
+        const char *bEnd = strchr(b, ';');
+        if ( NULL == aEnd ) {
+            aEnd = a + strlen(a);
+        }
+        if ( NULL == bEnd ) {
+            bEnd = b + strlen(b);
+        }
+
+        const char *aKeyEnd = (const char *) memchr(a, '=', aEnd - a);
+        const char *bKeyEnd = (const char *) memchr(b, '=', bEnd - b);
+        size_t aKeyLen = aKeyEnd ? (size_t) (aKeyEnd - a) : (size_t) (aEnd - a);
+        size_t bKeyLen = bKeyEnd ? (size_t) (bKeyEnd - b) : (size_t) (bEnd - b);
+
+        int order;
+        if ( !*a ) {
+            order = 1;
+        } else if ( !*b ) {
+            order = -1;
+        } else {
+            order = strncmp(a, b, (aKeyLen < bKeyLen) ? aKeyLen : bKeyLen);
+            if ( 0 == order ) {
+                order = (int) aKeyLen - (int) bKeyLen;
+            }
+        }
+
+        if ( 0 == order ) {
+            // same key, changed value
+            if ( ((aEnd - a) != (bEnd - b)) || (0 != memcmp(a, b, aEnd - a)) ) {
+                if ( mCameraAdapter->isParameterUsed(android::String8(a, aKeyLen).string()) ) {
+                    return true;
+                }
+            }
+        } else if ( order < 0 ) {
+            // key removed
+            if ( mCameraAdapter->isParameterUsed(android::String8(a, aKeyLen).string()) ) {
+                return true;
+            }
+        } else {
+            // key added
+            if ( mCameraAdapter->isParameterUsed(android::String8(b, bKeyLen).string()) ) {
+                return true;
+            }
+        }
+
+        if ( order <= 0 ) {
+            a = *aEnd ? aEnd + 1 : aEnd;
+        }
+        if ( order >= 0 ) {
+            b = *bEnd ? bEnd + 1 : bEnd;
+        }
+    }
+
+    return false;
+}
+
+void CameraHal::invalidateLastParameters()
+{
+    mLastParameters.clear();
+}
+
+int CameraHal::getParametersState() const
+{
+    return ( mPreviewEnabled ? 1 : 0 ) |
+           ( mPreviewStartInProgress ? 2 : 0 ) |
+           ( mRecordingEnabled ? 4 : 0 ) |
+           ( mDisplayPaused ? 8 : 0 );
+}
+
 status_t CameraHal::parseResolution(const char *resStr, int &width, int &height)
 {
     status_t ret = NO_ERROR;
@@ -4716,6 +5266,11 @@ void CameraHal::forceStopPreview()
 {
     LOG_FUNCTION_NAME;
 
+    invalidateAdapterParameters();
+
+    // a preview stopped before showing anything has no startup to report
+    android_atomic_release_store(0, &mStartupAwaitingFrame);
+
     // stop bracketing if it is running
     if ( mBracketingRunning ) {
         stopImageBracketing();
@@ -4806,6 +5361,15 @@ void CameraHal::setExternalLocking(bool extBuffLocking)
     mExternalLocking = extBuffLocking;
 }
 
+void CameraHal::setResizeThreads(int threads)
+{
+    mResizeThreads = threads;
+
+    if ( NULL != mAppCallbackNotifier.get() ) {
+        mAppCallbackNotifier->setResizeThreads(threads);
+    }
+}
+
 void CameraHal::resetPreviewRes(android::CameraParameters *params)
 {
   LOG_FUNCTION_NAME;
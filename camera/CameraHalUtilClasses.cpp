@@ -357,5 +357,57 @@ bool CameraArea::compare(const android::sp<CameraArea> &area) {
 
 /*--------------------CameraArea Class ENDS here-----------------------------*/
 
+/*--------------------CapabilitySet Class STARTS here-----------------------------*/
+
+void CapabilitySet::setTo(const char *list)
+{
+    const char *pos, *end;
+
+    mValues.clear();
+
+    pos = list ? list : "";
+    while ( *pos ) {
+        end = strchr(pos, ',');
+        if ( NULL == end ) {
+            end = pos + strlen(pos);
+        }
+
+        if ( end > pos ) {
+            mValues.add(android::String8(pos, end - pos));
+        }
+
+        pos = *end ? end + 1 : end;
+    }
+}
+
+bool CapabilitySet::contains(const char *value) const
+{
+    if ( NULL == value ) {
+        return false;
+    }
+
+    return mValues.indexOf(android::String8(value)) >= 0;
+}
+
+bool CapabilitySet::contains(int value) const
+{
+    char tmpBuffer[16];
+
+    snprintf(tmpBuffer, sizeof(tmpBuffer), "%d", value);
+
+    return contains(tmpBuffer);
+}
+
+bool CapabilitySet::containsResolution(int width, int height) const
+{
+    char tmpBuffer[32];
+
+    snprintf(tmpBuffer, sizeof(tmpBuffer), "%dx%d", width, height);
+
+    return contains(tmpBuffer);
+}
+
+/*--------------------CapabilitySet Class ENDS here-----------------------------*/
+
 } // namespace Camera
 } // namespace Ti
@@ -15,6 +15,8 @@
  */
 
 #include "Decoder_libjpeg.h"
+#include "PixelConvert.h"
+#include "NV12_resize.h"
 
 extern "C" {
     #include "jpeglib.h"
@@ -23,6 +25,14 @@ extern "C" {
 
 #define NUM_COMPONENTS_IN_YUV 3
 
+#if JPEG_LIB_VERSION >= 70
+#define DCT_ROWS(comp) ((comp).DCT_v_scaled_size)
+#define DCT_COLS(comp) ((comp).DCT_h_scaled_size)
+#else
+#define DCT_ROWS(comp) ((comp).DCT_scaled_size)
+#define DCT_COLS(comp) ((comp).DCT_scaled_size)
+#endif
+
 namespace Ti {
 namespace Camera {
 
@@ -64,18 +74,34 @@ static unsigned char jpeg_odml_dht[0x1a6] = {
     0xf9, 0xfa
 };
 
+#define MAX_SOURCE_CHUNKS 2
+
+/**
+ * Source manager reading the compressed data from a chain of buffers, so
+ * that the default DHT segment can be presented in front of a frame
+ * without copying the frame.
+ */
 struct libjpeg_source_mgr : jpeg_source_mgr {
-    libjpeg_source_mgr(unsigned char *buffer_ptr, int len);
+    libjpeg_source_mgr();
     ~libjpeg_source_mgr();
 
-    unsigned char *mBufferPtr;
-    int mFilledLen;
+    bool addChunk(const unsigned char *buffer_ptr, int len);
+
+    const unsigned char *mChunkPtr[MAX_SOURCE_CHUNKS];
+    int mChunkLen[MAX_SOURCE_CHUNKS];
+    int mChunkCount;
+    int mNextChunk;
+    int mNextOffset;
 };
 
+static const JOCTET libjpeg_fake_eoi[2] = { 0xFF, JPEG_EOI };
+
 static void libjpeg_init_source(j_decompress_ptr cinfo) {
     libjpeg_source_mgr*  src = (libjpeg_source_mgr*)cinfo->src;
-    src->next_input_byte = (const JOCTET*)src->mBufferPtr;
+    src->next_input_byte = NULL;
     src->bytes_in_buffer = 0;
+    src->mNextChunk = 0;
+    src->mNextOffset = 0;
 #ifndef ANDROID_API_N_OR_LATER
     src->current_offset = 0;
 #endif
@@ -84,8 +110,17 @@ static void libjpeg_init_source(j_decompress_ptr cinfo) {
 #ifndef ANDROID_API_N_OR_LATER
 static boolean libjpeg_seek_input_data(j_decompress_ptr cinfo, long byte_offset) {
     libjpeg_source_mgr* src = (libjpeg_source_mgr*)cinfo->src;
+    long offset = byte_offset;
+    int i;
+
+    for (i = 0; (i < src->mChunkCount) && (offset >= src->mChunkLen[i]); i++) {
+        offset -= src->mChunkLen[i];
+    }
+
+    // the next fill_input_buffer() resumes at the requested offset
+    src->mNextChunk = i;
+    src->mNextOffset = (i < src->mChunkCount) ? offset : 0;
     src->current_offset = byte_offset;
-    src->next_input_byte = (const JOCTET*)src->mBufferPtr + byte_offset;
     src->bytes_in_buffer = 0;
     return TRUE;
 }
@@ -93,55 +128,74 @@ static boolean libjpeg_seek_input_data(j_decompress_ptr cinfo, long byte_offset)
 
 static boolean libjpeg_fill_input_buffer(j_decompress_ptr cinfo) {
     libjpeg_source_mgr* src = (libjpeg_source_mgr*)cinfo->src;
+
+    if (src->mNextChunk >= src->mChunkCount) {
+        // truncated frame, let libjpeg finish with what it has
+        WARNMS(cinfo, JWRN_JPEG_EOF);
+        src->next_input_byte = libjpeg_fake_eoi;
+        src->bytes_in_buffer = sizeof(libjpeg_fake_eoi);
+        return TRUE;
+    }
+
+    src->next_input_byte = src->mChunkPtr[src->mNextChunk] + src->mNextOffset;
+    src->bytes_in_buffer = src->mChunkLen[src->mNextChunk] - src->mNextOffset;
 #ifndef ANDROID_API_N_OR_LATER
-    src->current_offset += src->mFilledLen;
+    src->current_offset += src->bytes_in_buffer;
 #endif
-    src->next_input_byte = src->mBufferPtr;
-    src->bytes_in_buffer = src->mFilledLen;
+    src->mNextChunk++;
+    src->mNextOffset = 0;
     return TRUE;
 }
 
 static void libjpeg_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
     libjpeg_source_mgr*  src = (libjpeg_source_mgr*)cinfo->src;
 
-    if (num_bytes > (long)src->bytes_in_buffer) {
-        CAMHAL_LOGEA("\n\n\n libjpeg_skip_input_data - num_bytes > (long)src->bytes_in_buffer \n\n\n");
-    } else {
-        src->next_input_byte += num_bytes;
-        src->bytes_in_buffer -= num_bytes;
+    if (num_bytes <= 0) {
+        return;
     }
-}
 
-static boolean libjpeg_resync_to_restart(j_decompress_ptr cinfo, int desired) {
-    libjpeg_source_mgr*  src = (libjpeg_source_mgr*)cinfo->src;
-    src->next_input_byte = (const JOCTET*)src->mBufferPtr;
-    src->bytes_in_buffer = 0;
-    return TRUE;
+    // skipped segments may continue in the next chunk
+    while (num_bytes > (long)src->bytes_in_buffer) {
+        num_bytes -= src->bytes_in_buffer;
+        libjpeg_fill_input_buffer(cinfo);
+    }
+
+    src->next_input_byte += num_bytes;
+    src->bytes_in_buffer -= num_bytes;
 }
 
 static void libjpeg_term_source(j_decompress_ptr /*cinfo*/) {}
 
-libjpeg_source_mgr::libjpeg_source_mgr(unsigned char *buffer_ptr, int len) : mBufferPtr(buffer_ptr), mFilledLen(len) {
+libjpeg_source_mgr::libjpeg_source_mgr() : mChunkCount(0), mNextChunk(0), mNextOffset(0) {
     init_source = libjpeg_init_source;
     fill_input_buffer = libjpeg_fill_input_buffer;
     skip_input_data = libjpeg_skip_input_data;
-    resync_to_restart = libjpeg_resync_to_restart;
+    resync_to_restart = jpeg_resync_to_restart;
     term_source = libjpeg_term_source;
 #ifndef ANDROID_API_N_OR_LATER
     seek_input_data = libjpeg_seek_input_data;
 #endif
+    next_input_byte = NULL;
+    bytes_in_buffer = 0;
 }
 
 libjpeg_source_mgr::~libjpeg_source_mgr() {}
 
+bool libjpeg_source_mgr::addChunk(const unsigned char *buffer_ptr, int len) {
+    if ((mChunkCount >= MAX_SOURCE_CHUNKS) || (len <= 0)) {
+        return false;
+    }
+
+    mChunkPtr[mChunkCount] = buffer_ptr;
+    mChunkLen[mChunkCount] = len;
+    mChunkCount++;
+    return true;
+}
+
 Decoder_libjpeg::Decoder_libjpeg()
 {
-    mWidth = 0;
-    mHeight = 0;
-    Y_Plane = NULL;
-    U_Plane = NULL;
-    V_Plane = NULL;
-    UV_Plane = NULL;
+    mScratch = NULL;
+    mScratchSize = 0;
 }
 
 Decoder_libjpeg::~Decoder_libjpeg()
@@ -151,22 +205,11 @@ Decoder_libjpeg::~Decoder_libjpeg()
 
 void Decoder_libjpeg::release()
 {
-    if (Y_Plane) {
-        free(Y_Plane);
-        Y_Plane = NULL;
-    }
-    if (U_Plane) {
-        free(U_Plane);
-        U_Plane = NULL;
-    }
-    if (V_Plane) {
-        free(V_Plane);
-        V_Plane = NULL;
-    }
-    if (UV_Plane) {
-        free(UV_Plane);
-        UV_Plane = NULL;
+    if (mScratch) {
+        free(mScratch);
+        mScratch = NULL;
     }
+    mScratchSize = 0;
 }
 
 int Decoder_libjpeg::readDHTSize()
@@ -175,14 +218,53 @@ int Decoder_libjpeg::readDHTSize()
 }
 
 // 0xFF 0xC4 - DHT (Define Huffman Table) marker
-// 0xFF 0xD9 - SOI (Start Of Image) marker
+// 0xFF 0xD8 - SOI (Start Of Image) marker
+// 0xFF 0xDA - SOS (Start Of Scan) marker
 // 0xFF 0xD9 - EOI (End Of Image) marker
-// This function return true if if found DHT
+// This function return true if if found DHT. Tables must precede the scan,
+// so only the marker segments in front of SOS are looked at.
 bool Decoder_libjpeg::isDhtExist(unsigned char *jpeg_src,  int filled_len) {
     if (filled_len <= 0) {
         return false;
     }
 
+    if ((filled_len >= 2) && (jpeg_src[0] == 0xFF) && (jpeg_src[1] == 0xD8)) {
+        int i = 2;
+
+        while (i + 1 < filled_len) {
+            unsigned char marker;
+
+            if (jpeg_src[i] != 0xFF) {
+                break;
+            }
+
+            marker = jpeg_src[i + 1];
+            if (marker == 0xFF) {
+                // fill byte
+                i++;
+                continue;
+            }
+
+            if (marker == 0xC4) {
+                CAMHAL_LOGD("Found DHT (Define Huffman Table) marker");
+                return true;
+            }
+
+            if ((marker == 0xDA) || (marker == 0xD9)) {
+                return false;
+            }
+
+            if ((marker == 0x01) || ((marker >= 0xD0) && (marker <= 0xD7))) {
+                i += 2;
+            } else if (i + 3 < filled_len) {
+                i += 2 + ((jpeg_src[i + 2] << 8) | jpeg_src[i + 3]);
+            } else {
+                break;
+            }
+        }
+    }
+
+    // no well formed headers, look for the marker anywhere
     for (int i = 1; i < filled_len; i++) {
         if((jpeg_src[i - 1] == 0xFF) && (jpeg_src[i] == 0xC4)) {
             CAMHAL_LOGD("Found DHT (Define Huffman Table) marker");
@@ -208,15 +290,52 @@ int Decoder_libjpeg::appendDHT(unsigned char *jpeg_src, int filled_len, unsigned
 }
 
 
-bool Decoder_libjpeg::decode(unsigned char *jpeg_src, int filled_len, unsigned char *nv12_buffer, int stride)
+// Returns the largest libjpeg scaling (1/1, 1/2, 1/4 or 1/8) at which a
+// width x height frame still covers out_width x out_height
+int Decoder_libjpeg::scaleDenom(int width, int height, int out_width, int out_height)
+{
+    int denom = 1;
+
+    if ((out_width <= 0) || (out_height <= 0)) {
+        return denom;
+    }
+
+    while (denom < 8) {
+        int next = denom * 2;
+        if ((((width + next - 1) / next) < out_width) ||
+            (((height + next - 1) / next) < out_height)) {
+            break;
+        }
+        denom = next;
+    }
+
+    return denom;
+}
+
+// Decodes the frame to out_width x out_height NV12 at nv12_buffer. With
+// scale_denom > 1 libjpeg drops the high frequency coefficients and runs a
+// reduced IDCT, so a 1/N scaled frame costs a fraction of the full decode.
+// If the decoded frame does not match the output size, it is decoded whole
+// to scratch and resized to the output.
+bool Decoder_libjpeg::decode(unsigned char *jpeg_src, int filled_len, unsigned char *nv12_buffer, int stride,
+                             int out_width, int out_height, int scale_denom)
 {
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
-    struct libjpeg_source_mgr s_mgr(jpeg_src, filled_len);
+    struct libjpeg_source_mgr s_mgr;
 
-    if (filled_len == 0)
+    if (filled_len <= 2)
         return false;
 
+    // MJPEG frames usually omit the DHT segment, the default one is read
+    // in front of the frame, replacing its SOI, instead of copying the frame
+    if (!isDhtExist(jpeg_src, filled_len)) {
+        s_mgr.addChunk(jpeg_odml_dht, sizeof(jpeg_odml_dht));
+        s_mgr.addChunk(jpeg_src + 2, filled_len - 2);
+    } else {
+        s_mgr.addChunk(jpeg_src, filled_len);
+    }
+
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_decompress(&cinfo);
 
@@ -224,83 +343,196 @@ bool Decoder_libjpeg::decode(unsigned char *jpeg_src, int filled_len, unsigned c
     int status = jpeg_read_header(&cinfo, true);
     if (status != JPEG_HEADER_OK) {
         CAMHAL_LOGEA("jpeg header corrupted");
+        jpeg_destroy_decompress(&cinfo);
         return false;
     }
 
     cinfo.out_color_space = JCS_YCbCr;
     cinfo.raw_data_out = true;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale_denom;
     status = jpeg_start_decompress(&cinfo);
     if (!status){
         CAMHAL_LOGEA("jpeg_start_decompress failed");
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    // libjpeg may scale the chroma up through the IDCT, so the subsampling
+    // of the raw rows is taken from the scaled block sizes
+    jpeg_component_info *comp = cinfo.comp_info;
+    int rows = cinfo.max_v_samp_factor * DCT_ROWS(comp[0]);
+    int c_rows = comp[1].v_samp_factor * DCT_ROWS(comp[1]);
+    int y_width = comp[0].width_in_blocks * DCT_COLS(comp[0]);
+    int c_width = comp[1].width_in_blocks * DCT_COLS(comp[1]);
+    int h_ratio = (comp[0].h_samp_factor * DCT_COLS(comp[0])) / (comp[1].h_samp_factor * DCT_COLS(comp[1]));
+    int v_ratio = rows / c_rows;
+
+    if ((cinfo.num_components != NUM_COMPONENTS_IN_YUV) ||
+        (comp[0].v_samp_factor != cinfo.max_v_samp_factor) || (rows > MAX_RAW_ROWS) ||
+        ((h_ratio != 1) && (h_ratio != 2)) || ((v_ratio != 1) && (v_ratio != 2)) ||
+        (comp[2].h_samp_factor != comp[1].h_samp_factor) ||
+        (comp[2].v_samp_factor != comp[1].v_samp_factor)) {
+        CAMHAL_LOGEB("Unsupported jpeg sampling: %d components, Y %dx%d, Cb %dx%d",
+                cinfo.num_components, comp[0].h_samp_factor, comp[0].v_samp_factor,
+                comp[1].h_samp_factor, comp[1].v_samp_factor);
+        jpeg_destroy_decompress(&cinfo);
         return false;
     }
 
-    if (mWidth == 0){
-        mWidth = cinfo.output_width;
-        mHeight = cinfo.output_height;
-        CAMHAL_LOGEA("w x h = %d x %d. stride=%d", cinfo.output_width, cinfo.output_height, stride);
+    int width = cinfo.output_width;
+    int height = cinfo.output_height;
+    if (out_width <= 0) {
+        out_width = width;
     }
-    else if ((cinfo.output_width > mWidth) || (cinfo.output_height > mHeight)) {
-        CAMHAL_LOGEA(" Free the existing buffers so that they are reallocated for new w x h. Old WxH = %dx%d. New WxH = %dx%d",
-        mWidth, mHeight, cinfo.output_width, cinfo.output_height);
+    if (out_height <= 0) {
+        out_height = height;
+    }
+
+    // Frames matching the output are decoded straight into it, anything
+    // else goes to an NV12 frame in scratch which is resized afterwards
+    bool resize = (out_width != width) || (out_height != height);
+    int frame_stride = resize ? ((y_width + 1) & ~1) : stride;
+    unsigned int frame_size = resize ? (frame_stride * ((height + 1) & ~1) * 3 / 2) : 0;
+
+    // Luma rows are decoded straight into the destination, unless libjpeg
+    // hands out rows wider than its stride, then they go through scratch
+    bool direct = (y_width <= frame_stride);
+
+    // rows decoded to scratch and copied out, one row for the lines past
+    // the bottom of the frame, the planar chroma of one read and the frame
+    // to resize from
+    unsigned int scratch_size = (rows + 1) * y_width + 2 * c_rows * c_width + frame_size;
+    if (scratch_size > mScratchSize) {
+        CAMHAL_LOGDB("Scratch for %dx%d (1/%d) output to %dx%d, stride=%d",
+                width, height, scale_denom, out_width, out_height, stride);
         release();
-        mWidth = cinfo.output_width;
-        mHeight = cinfo.output_height;
+        mScratch = (unsigned char *)malloc(scratch_size);
+        if (mScratch == NULL) {
+            CAMHAL_LOGEB("Failed to allocate %u bytes of scratch", scratch_size);
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+        mScratchSize = scratch_size;
     }
 
-    unsigned int decoded_uv_buffer_size = cinfo.output_width * cinfo.output_height / 2;
-    if (Y_Plane == NULL)Y_Plane = (unsigned char **)malloc(cinfo.output_height * sizeof(unsigned char *));
-    if (U_Plane == NULL)U_Plane = (unsigned char **)malloc(cinfo.output_height * sizeof(unsigned char *));
-    if (V_Plane == NULL)V_Plane = (unsigned char **)malloc(cinfo.output_height * sizeof(unsigned char *));
-    if (UV_Plane == NULL) UV_Plane = (unsigned char *)malloc(decoded_uv_buffer_size);
+    unsigned char *copy_rows = mScratch;
+    unsigned char *discard_row = copy_rows + rows * y_width;
+    unsigned char *u_rows = discard_row + y_width;
+    unsigned char *v_rows = u_rows + c_rows * c_width;
+    unsigned char *frame = resize ? (v_rows + c_rows * c_width) : nv12_buffer;
+    unsigned char *uv_plane = frame + frame_stride * (resize ? ((height + 1) & ~1) : out_height);
+    // an odd frame in scratch still gets the chroma of its last row
+    int c_height = resize ? ((height + 1) & ~1) : height;
+    int copy_to[MAX_RAW_ROWS];
 
     unsigned char **YUV_Planes[NUM_COMPONENTS_IN_YUV];
     YUV_Planes[0] = Y_Plane;
     YUV_Planes[1] = U_Plane;
     YUV_Planes[2] = V_Plane;
 
-    unsigned char *row = &nv12_buffer[0];
-
-    // Y Component
-    for (unsigned int j = 0; j < cinfo.output_height; j++, row += stride)
-        YUV_Planes[0][j] = row;
+    for (int j = 0; j < c_rows; j++) {
+        U_Plane[j] = u_rows + j * c_width;
+        V_Plane[j] = v_rows + j * c_width;
+    }
 
-    row = &UV_Plane[0];
+    while (cinfo.output_scanline < cinfo.output_height) {
+        int base = cinfo.output_scanline;
+
+        // Y Component
+        for (int j = 0; j < rows; j++) {
+            int r = base + j;
+
+            copy_to[j] = -1;
+            if (r >= height) {
+                Y_Plane[j] = discard_row;
+            } else if (direct) {
+                Y_Plane[j] = frame + r * frame_stride;
+            } else {
+                Y_Plane[j] = copy_rows + j * y_width;
+                copy_to[j] = r;
+            }
+        }
 
-    // U Component
-    for (unsigned int j = 0; j < cinfo.output_height; j+=2, row += cinfo.output_width / 2){
-        YUV_Planes[1][j+0] = row;
-        YUV_Planes[1][j+1] = row;
-    }
+        if (jpeg_read_raw_data(&cinfo, YUV_Planes, rows) == 0) {
+            CAMHAL_LOGEA("jpeg_read_raw_data failed");
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
 
-    // V Component
-    for (unsigned int j = 0; j < cinfo.output_height; j+=2, row += cinfo.output_width / 2){
-        YUV_Planes[2][j+0] = row;
-        YUV_Planes[2][j+1] = row;
-    }
+        for (int j = 0; j < rows; j++) {
+            if (copy_to[j] >= 0) {
+                memcpy(frame + copy_to[j] * frame_stride, Y_Plane[j], width);
+            }
+        }
 
-    // Interleaving U and V
-    for (unsigned int i = 0; i < cinfo.output_height; i += 8) {
-        jpeg_read_raw_data(&cinfo, YUV_Planes, 8);
-        YUV_Planes[0] += 8;
-        YUV_Planes[1] += 8;
-        YUV_Planes[2] += 8;
-    }
+        // Interleaving U and V of the band while it is still in cache,
+        // every chroma row that ends on an odd output row gives one NV12
+        // chroma row, with 4:2:2 that is every other row of the band
+        int c_first = -1;
+        int c_count = 0;
+        int c_step = (v_ratio == 1) ? 2 : 1;
+        for (int j = 0; j < c_rows; j++) {
+            int r = base + (j + 1) * v_ratio - 1;
+            if ((r < c_height) && (r & 1)) {
+                if (c_first < 0) {
+                    c_first = j;
+                }
+                c_count++;
+            }
+        }
 
-    unsigned char *uv_ptr = nv12_buffer + (stride * cinfo.output_height);
-    unsigned char *u_ptr = UV_Plane;
-    unsigned char *v_ptr = UV_Plane + (decoded_uv_buffer_size / 2);
-    for(unsigned int i = 0; i < cinfo.output_height / 2; i++){
-        for(unsigned int j = 0; j < cinfo.output_width; j+=2){
-            *(uv_ptr + j) = *u_ptr; u_ptr++;
-            *(uv_ptr + j + 1) = *v_ptr; v_ptr++;
+        if (c_count > 0) {
+            int r = base + (c_first + 1) * v_ratio - 1;
+            unsigned char *uv_ptr = uv_plane + (r / 2) * frame_stride;
+
+            if (h_ratio == 2) {
+                Utils::PixelConvert::interleaveUV(U_Plane[c_first], c_step * c_width,
+                                                  V_Plane[c_first], c_step * c_width,
+                                                  uv_ptr, frame_stride, (width + 1) / 2, c_count);
+            } else {
+                // chroma upscaled by the IDCT, every other sample is used
+                for (int j = c_first; c_count > 0; j += c_step, c_count--, uv_ptr += frame_stride) {
+                    unsigned char *u_ptr = U_Plane[j];
+                    unsigned char *v_ptr = V_Plane[j];
+                    for (int i = 0; i < width; i += 2) {
+                        uv_ptr[i] = u_ptr[i];
+                        uv_ptr[i + 1] = v_ptr[i];
+                    }
+                }
+            }
         }
-        uv_ptr = uv_ptr + stride;
     }
 
     jpeg_finish_decompress(&cinfo);
     jpeg_destroy_decompress(&cinfo);
 
+    if (resize) {
+        structConvImage i_img, o_img;
+
+        i_img.uWidth = width;
+        i_img.uHeight = height;
+        i_img.uStride = frame_stride;
+        i_img.eFormat = IC_FORMAT_YCbCr420_lp;
+        i_img.imgPtr = frame;
+        i_img.clrPtr = uv_plane;
+        i_img.uOffset = 0;
+
+        o_img.uWidth = out_width;
+        o_img.uHeight = out_height;
+        o_img.uStride = stride;
+        o_img.eFormat = IC_FORMAT_YCbCr420_lp;
+        o_img.imgPtr = nv12_buffer;
+        o_img.clrPtr = nv12_buffer + (stride * out_height);
+        o_img.uOffset = 0;
+
+        if (!VT_resizeFrame_Video_simd_lp(&i_img, &o_img, NULL, 0)) {
+            CAMHAL_LOGEB("Failed to resize %dx%d (1/%d) to %dx%d",
+                    width, height, scale_denom, out_width, out_height);
+            return false;
+        }
+    }
+
     return true;
 }
 
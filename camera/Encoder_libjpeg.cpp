@@ -25,6 +25,7 @@
 
 #include "Encoder_libjpeg.h"
 #include "NV12_resize.h"
+#include "PixelConvert.h"
 #include "TICameraParameters.h"
 
 #include <stdlib.h>
@@ -44,6 +45,12 @@ extern "C" {
 #define ARRAY_SIZE(array) (sizeof((array)) / sizeof((array)[0]))
 #define MIN(x,y) ((x < y) ? x : y)
 
+// Parallel encode: 4:2:0 MCUs are 16x16, strips are whole MCU rows
+#define JPEG_MCU_SIZE 16
+#define JPEG_MAX_STRIPS 8
+#define JPEG_STRIP_MIN_PIXELS (1024 * 1024)
+#define JPEG_STRIP_SLACK (64 * 1024)
+
 namespace Ti {
 namespace Camera {
 
@@ -59,12 +66,88 @@ static integer_string_pair degress_to_exif_lut [] = {
     {180, "3"},
     {270, "8"},
 };
+// TIFF field types used by the EXIF elements
+enum {
+    EXIF_TYPE_BYTE = 1,
+    EXIF_TYPE_ASCII = 2,
+    EXIF_TYPE_SHORT = 3,
+    EXIF_TYPE_LONG = 4,
+    EXIF_TYPE_RATIONAL = 5,
+    EXIF_TYPE_UNDEFINED = 7,
+    EXIF_TYPE_SRATIONAL = 10,
+};
+
+enum {
+    EXIF_IFD_0,
+    EXIF_IFD_EXIF,
+    EXIF_IFD_GPS,
+    EXIF_IFD_1,
+    EXIF_IFD_MAX,
+};
+
+#define EXIF_TAG_EXIF_IFD_POINTER 0x8769
+#define EXIF_TAG_GPS_IFD_POINTER 0x8825
+#define EXIF_TAG_EXIF_VERSION 0x9000
+#define EXIF_TAG_COMPRESSION 0x0103
+#define EXIF_TAG_JPEG_IF_OFFSET 0x0201
+#define EXIF_TAG_JPEG_IF_BYTE_COUNT 0x0202
+#define EXIF_MAX_VALUE_SIZE 256
+
+struct exif_tag_info {
+    const char* name;
+    uint16_t tag;
+    uint16_t type;
+    uint8_t ifd;
+};
+
+// DateTime is also written as DateTimeOriginal and DateTimeDigitized
+static const exif_tag_info exif_tag_lut [] = {
+    {TAG_IMAGE_WIDTH,             0x0100, EXIF_TYPE_LONG,      EXIF_IFD_0},
+    {TAG_IMAGE_LENGTH,            0x0101, EXIF_TYPE_LONG,      EXIF_IFD_0},
+    {TAG_MAKE,                    0x010F, EXIF_TYPE_ASCII,     EXIF_IFD_0},
+    {TAG_MODEL,                   0x0110, EXIF_TYPE_ASCII,     EXIF_IFD_0},
+    {TAG_ORIENTATION,             0x0112, EXIF_TYPE_SHORT,     EXIF_IFD_0},
+    {TAG_DATETIME,                0x0132, EXIF_TYPE_ASCII,     EXIF_IFD_0},
+    {TAG_DATETIME,                0x9003, EXIF_TYPE_ASCII,     EXIF_IFD_EXIF},
+    {TAG_DATETIME,                0x9004, EXIF_TYPE_ASCII,     EXIF_IFD_EXIF},
+    {TAG_EXPOSURETIME,            0x829A, EXIF_TYPE_RATIONAL,  EXIF_IFD_EXIF},
+    {TAG_FNUMBER,                 0x829D, EXIF_TYPE_RATIONAL,  EXIF_IFD_EXIF},
+    {TAG_EXPOSURE_PROGRAM,        0x8822, EXIF_TYPE_SHORT,     EXIF_IFD_EXIF},
+    {TAG_ISO_EQUIVALENT,          0x8827, EXIF_TYPE_SHORT,     EXIF_IFD_EXIF},
+    {TAG_CPRS_BITS_PER_PIXEL,     0x9102, EXIF_TYPE_RATIONAL,  EXIF_IFD_EXIF},
+    {TAG_SHUTTERSPEED,            0x9201, EXIF_TYPE_SRATIONAL, EXIF_IFD_EXIF},
+    {TAG_APERTURE,                0x9202, EXIF_TYPE_RATIONAL,  EXIF_IFD_EXIF},
+    {TAG_METERING_MODE,           0x9207, EXIF_TYPE_SHORT,     EXIF_IFD_EXIF},
+    {TAG_LIGHT_SOURCE,            0x9208, EXIF_TYPE_SHORT,     EXIF_IFD_EXIF},
+    {TAG_FLASH,                   0x9209, EXIF_TYPE_SHORT,     EXIF_IFD_EXIF},
+    {TAG_FOCALLENGTH,             0x920A, EXIF_TYPE_RATIONAL,  EXIF_IFD_EXIF},
+    {TAG_COLOR_SPACE,             0xA001, EXIF_TYPE_SHORT,     EXIF_IFD_EXIF},
+    {TAG_EXIF_IMAGE_WIDTH,        0xA002, EXIF_TYPE_LONG,      EXIF_IFD_EXIF},
+    {TAG_EXIF_IMAGE_LENGTH,       0xA003, EXIF_TYPE_LONG,      EXIF_IFD_EXIF},
+    {TAG_SENSING_METHOD,          0xA217, EXIF_TYPE_SHORT,     EXIF_IFD_EXIF},
+    {TAG_CUSTOM_RENDERED,         0xA401, EXIF_TYPE_SHORT,     EXIF_IFD_EXIF},
+    {TAG_WHITEBALANCE,            0xA403, EXIF_TYPE_SHORT,     EXIF_IFD_EXIF},
+    {TAG_DIGITALZOOMRATIO,        0xA404, EXIF_TYPE_RATIONAL,  EXIF_IFD_EXIF},
+    {TAG_GPS_VERSION_ID,          0x0000, EXIF_TYPE_BYTE,      EXIF_IFD_GPS},
+    {TAG_GPS_LAT_REF,             0x0001, EXIF_TYPE_ASCII,     EXIF_IFD_GPS},
+    {TAG_GPS_LAT,                 0x0002, EXIF_TYPE_RATIONAL,  EXIF_IFD_GPS},
+    {TAG_GPS_LONG_REF,            0x0003, EXIF_TYPE_ASCII,     EXIF_IFD_GPS},
+    {TAG_GPS_LONG,                0x0004, EXIF_TYPE_RATIONAL,  EXIF_IFD_GPS},
+    {TAG_GPS_ALT_REF,             0x0005, EXIF_TYPE_BYTE,      EXIF_IFD_GPS},
+    {TAG_GPS_ALT,                 0x0006, EXIF_TYPE_RATIONAL,  EXIF_IFD_GPS},
+    {TAG_GPS_TIMESTAMP,           0x0007, EXIF_TYPE_RATIONAL,  EXIF_IFD_GPS},
+    {TAG_GPS_MAP_DATUM,           0x0012, EXIF_TYPE_ASCII,     EXIF_IFD_GPS},
+    {TAG_GPS_PROCESSING_METHOD,   0x001B, EXIF_TYPE_UNDEFINED, EXIF_IFD_GPS},
+    {TAG_GPS_DATESTAMP,           0x001D, EXIF_TYPE_ASCII,     EXIF_IFD_GPS},
+};
+
 struct libjpeg_destination_mgr : jpeg_destination_mgr {
     libjpeg_destination_mgr(uint8_t* input, int size);
 
     uint8_t* buf;
     int bufsize;
     size_t jpegsize;
+    bool overflow;
 };
 
 static void libjpeg_init_destination (j_compress_ptr cinfo) {
@@ -80,6 +163,7 @@ static boolean libjpeg_empty_output_buffer(j_compress_ptr cinfo) {
 
     dest->next_output_byte = dest->buf;
     dest->free_in_buffer = dest->bufsize;
+    dest->overflow = true;
     return TRUE; // ?
 }
 
@@ -97,143 +181,10 @@ libjpeg_destination_mgr::libjpeg_destination_mgr(uint8_t* input, int size) {
     this->bufsize = size;
 
     jpegsize = 0;
+    overflow = false;
 }
 
 /* private static functions */
-static void nv21_to_yuv(uint8_t* dst, uint8_t* y, uint8_t* uv, int width) {
-    if (!dst || !y || !uv) {
-        return;
-    }
-
-    while ((width--) > 0) {
-        uint8_t y0 = y[0];
-        uint8_t v0 = uv[0];
-        uint8_t u0 = *(uv+1);
-        dst[0] = y0;
-        dst[1] = u0;
-        dst[2] = v0;
-        dst += 3;
-        y++;
-        if(!(width % 2)) uv+=2;
-    }
-}
-
-static void uyvy_to_yuv(uint8_t* dst, uint32_t* src, int width) {
-    if (!dst || !src) {
-        return;
-    }
-
-    if (width % 2) {
-        return; // not supporting odd widths
-    }
-
-#ifdef ARCH_ARM_HAVE_NEON
-    // currently, neon routine only supports multiple of 16 width
-    if ((width % 16) == 0) {
-        int n = width;
-        asm volatile (
-        "   pld [%[src], %[src_stride], lsl #2]                         \n\t"
-        "   cmp %[n], #16                                               \n\t"
-        "   blt 5f                                                      \n\t"
-        "0: @ 16 pixel swap                                             \n\t"
-        "   vld2.8  {q0, q1} , [%[src]]! @ q0 = uv q1 = y               \n\t"
-        "   vuzp.8 q0, q2                @ d0 = u d4 = v                \n\t"
-        "   vmov d1, d0                  @ q0 = u0u1u2..u0u1u2...       \n\t"
-        "   vmov d5, d4                  @ q2 = v0v1v2..v0v1v2...       \n\t"
-        "   vzip.8 d0, d1                @ q0 = u0u0u1u1u2u2...         \n\t"
-        "   vzip.8 d4, d5                @ q2 = v0v0v1v1v2v2...         \n\t"
-        "   vswp q0, q1                  @ now q0 = y q1 = u q2 = v     \n\t"
-        "   vst3.8  {d0,d2,d4},[%[dst]]!                                \n\t"
-        "   vst3.8  {d1,d3,d5},[%[dst]]!                                \n\t"
-        "   sub %[n], %[n], #16                                         \n\t"
-        "   cmp %[n], #16                                               \n\t"
-        "   bge 0b                                                      \n\t"
-        "5: @ end                                                       \n\t"
-#ifdef NEEDS_ARM_ERRATA_754319_754320
-        "   vmov s0,s0  @ add noop for errata item                      \n\t"
-#endif
-        : [dst] "+r" (dst), [src] "+r" (src), [n] "+r" (n)
-        : [src_stride] "r" (width)
-        : "cc", "memory", "q0", "q1", "q2"
-        );
-    } else
-#endif
-    {
-        while ((width-=2) >= 0) {
-            uint8_t u0 = (src[0] >> 0) & 0xFF;
-            uint8_t y0 = (src[0] >> 8) & 0xFF;
-            uint8_t v0 = (src[0] >> 16) & 0xFF;
-            uint8_t y1 = (src[0] >> 24) & 0xFF;
-            dst[0] = y0;
-            dst[1] = u0;
-            dst[2] = v0;
-            dst[3] = y1;
-            dst[4] = u0;
-            dst[5] = v0;
-            dst += 6;
-            src++;
-        }
-    }
-}
-
-static void yuyv_to_yuv(uint8_t* dst, uint32_t* src, int width) {
-    if (!dst || !src) {
-        return;
-    }
-
-    if (width % 2) {
-        return; // not supporting odd widths
-    }
-
-#ifdef ARCH_ARM_HAVE_NEON
-    // currently, neon routine only supports multiple of 16 width
-    if ((width % 16) == 0) {
-        int n = width;
-        asm volatile (
-        "   pld [%[src], %[src_stride], lsl #2]                         \n\t"
-        "   cmp %[n], #16                                               \n\t"
-        "   blt 5f                                                      \n\t"
-        "0: @ 16 pixel swap                                             \n\t"
-        "   vld2.8  {q0, q1} , [%[src]]! @ q0 = yyyy.. q1 = uvuv..      \n\t"
-        "   vuzp.8 q1, q2                @ d2 = u d4 = v                \n\t"
-        "   vmov d3, d2                  @ q1 = u0u1u2..u0u1u2...       \n\t"
-        "   vmov d5, d4                  @ q2 = v0v1v2..v0v1v2...       \n\t"
-        "   vzip.8 d2, d3                @ q1 = u0u0u1u1u2u2...         \n\t"
-        "   vzip.8 d4, d5                @ q2 = v0v0v1v1v2v2...         \n\t"
-        "                                @ now q0 = y q1 = u q2 = v     \n\t"
-        "   vst3.8  {d0,d2,d4},[%[dst]]!                                \n\t"
-        "   vst3.8  {d1,d3,d5},[%[dst]]!                                \n\t"
-        "   sub %[n], %[n], #16                                         \n\t"
-        "   cmp %[n], #16                                               \n\t"
-        "   bge 0b                                                      \n\t"
-        "5: @ end                                                       \n\t"
-#ifdef NEEDS_ARM_ERRATA_754319_754320
-        "   vmov s0,s0  @ add noop for errata item                      \n\t"
-#endif
-        : [dst] "+r" (dst), [src] "+r" (src), [n] "+r" (n)
-        : [src_stride] "r" (width)
-        : "cc", "memory", "q0", "q1", "q2"
-        );
-    } else
-#endif
-    {
-        while ((width-=2) >= 0) {
-            uint8_t y0 = (src[0] >> 0) & 0xFF;
-            uint8_t u0 = (src[0] >> 8) & 0xFF;
-            uint8_t y1 = (src[0] >> 16) & 0xFF;
-            uint8_t v0 = (src[0] >> 24) & 0xFF;
-            dst[0] = y0;
-            dst[1] = u0;
-            dst[2] = v0;
-            dst[3] = y1;
-            dst[4] = u0;
-            dst[5] = v0;
-            dst += 6;
-            src++;
-        }
-    }
-}
-
 static void resize_nv12(Encoder_libjpeg::params* params, uint8_t* dst_buffer) {
     structConvImage o_img_ptr, i_img_ptr;
 
@@ -259,7 +210,128 @@ static void resize_nv12(Encoder_libjpeg::params* params, uint8_t* dst_buffer) {
     o_img_ptr.clrPtr = o_img_ptr.imgPtr + (o_img_ptr.uWidth * o_img_ptr.uHeight);
     o_img_ptr.uOffset = 0;
 
-    VT_resizeFrame_Video_opt2_lp(&i_img_ptr, &o_img_ptr, NULL, 0);
+    VT_resizeFrame_Video_parallel_lp(&i_img_ptr, &o_img_ptr, NULL, params->resize_threads);
+}
+
+// EXIF data is written little endian, as announced by the TIFF header
+static void exif_put16(uint8_t* p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void exif_put32(uint8_t* p, uint32_t value) {
+    exif_put16(p, value & 0xFFFF);
+    exif_put16(p + 2, value >> 16);
+}
+
+static unsigned int exif_type_size(uint16_t type) {
+    switch (type) {
+        case EXIF_TYPE_SHORT:
+            return 2;
+        case EXIF_TYPE_LONG:
+            return 4;
+        case EXIF_TYPE_RATIONAL:
+        case EXIF_TYPE_SRATIONAL:
+            return 8;
+        default:
+            return 1;
+    }
+}
+
+// Converts a comma separated list of numbers, rationals are given as
+// "num/den" or as decimals. Returns the number of bytes written or -1.
+static int parse_exif_numbers(uint16_t type, const char* value,
+                              uint8_t* out, size_t out_size, uint32_t* count) {
+    const unsigned int item_size = exif_type_size(type);
+    const char* p = value;
+    size_t size = 0;
+
+    *count = 0;
+    while (*p) {
+        char* end = NULL;
+
+        if (size + item_size > out_size) {
+            return -1;
+        }
+
+        if ((type == EXIF_TYPE_RATIONAL) || (type == EXIF_TYPE_SRATIONAL)) {
+            unsigned int num = 0, den = 1;
+
+            num = (type == EXIF_TYPE_SRATIONAL) ? (unsigned int) strtol(p, &end, 10) :
+                                                  (unsigned int) strtoul(p, &end, 10);
+            if (*end == '/') {
+                den = strtoul(end + 1, &end, 10);
+            } else if (*end == '.') {
+                char decimal[32];
+                size_t len = strcspn(p, ",");
+
+                if (len >= sizeof(decimal)) {
+                    return -1;
+                }
+                memcpy(decimal, p, len);
+                decimal[len] = '\0';
+                ExifElementsTable::stringToRational(decimal, &num, &den);
+                end = (char*) p + len;
+            }
+            exif_put32(out + size, num);
+            exif_put32(out + size + 4, den);
+        } else {
+            unsigned long number = strtoul(p, &end, 10);
+
+            if (type == EXIF_TYPE_LONG) {
+                exif_put32(out + size, number);
+            } else if (type == EXIF_TYPE_SHORT) {
+                exif_put16(out + size, number);
+            } else {
+                out[size] = number;
+            }
+        }
+
+        if (end == p) {
+            return -1;
+        }
+
+        size += item_size;
+        (*count)++;
+
+        p = end;
+        while (*p == ' ') p++;
+        if (*p == ',') p++;
+    }
+
+    return (*count > 0) ? (int) size : -1;
+}
+
+// Repeats the last sample of a row up to the padded width libjpeg reads
+static void replicate_right_edge(uint8_t* row, int width, int padded_width) {
+    if (padded_width > width) {
+        memset(row + width, row[width - 1], padded_width - width);
+    }
+}
+
+// Extracts the luma of a packed 4:2:2 row, y_offset is 0 for YUYV and 1 for UYVY
+static void packed_row_to_y(uint8_t* dst, const uint8_t* src, int width, int y_offset) {
+    src += y_offset;
+    for (int x = 0; x < width; x++) {
+        dst[x] = src[x * 2];
+    }
+}
+
+// Subsamples the chroma of two packed 4:2:2 rows vertically, rounding
+// the way libjpeg's h2v2 downsampler does so the encoded data is unchanged
+static void packed_rows_to_cbcr(uint8_t* cb, uint8_t* cr,
+                                const uint8_t* row0, const uint8_t* row1,
+                                int width, int padded_width,
+                                int u_offset, int v_offset) {
+    const int samples = (width + 1) / 2;
+
+    for (int x = 0; x < padded_width; x++) {
+        const int i = MIN(x, samples - 1) * 4;
+        const int bias = (x & 1) + 1;
+
+        cb[x] = (2 * (row0[i + u_offset] + row1[i + u_offset]) + bias) >> 2;
+        cr[x] = (2 * (row0[i + v_offset] + row1[i + v_offset]) + bias) >> 2;
+    }
 }
 
 /* public static functions */
@@ -324,157 +396,342 @@ bool ExifElementsTable::isAsciiTag(const char* tag) {
     return (strcmp(tag, TAG_GPS_PROCESSING_METHOD) == 0);
 }
 
-void ExifElementsTable::insertExifToJpeg(unsigned char* jpeg, size_t jpeg_size) {
-    ReadMode_t read_mode = (ReadMode_t)(READ_METADATA | READ_IMAGE);
+/* public functions */
+ExifElementsTable::ExifElementsTable() :
+    data_size(0), position(0)
+{
+}
 
-    ResetJpgfile();
-    if (ReadJpegSectionsFromBuffer(jpeg, jpeg_size, read_mode)) {
-        jpeg_opened = true;
-#ifdef ANDROID_API_JB_OR_LATER
-        create_EXIF(table, exif_tag_count, gps_tag_count, has_datetime_tag);
-#else
-        create_EXIF(table, exif_tag_count, gps_tag_count);
-#endif
+status_t ExifElementsTable::insertElement(const char* tag, const char* value) {
+    uint8_t parsed[EXIF_MAX_VALUE_SIZE];
+    int size = -1;
+    uint32_t count = 0;
+    status_t ret = BAD_VALUE;
+
+    if (!value || !tag) {
+        return -EINVAL;
     }
-}
 
-status_t ExifElementsTable::insertExifThumbnailImage(const char* thumb, int len) {
-    status_t ret = NO_ERROR;
+    for (unsigned int i = 0; i < ARRAY_SIZE(exif_tag_lut); i++) {
+        const exif_tag_info& info = exif_tag_lut[i];
+
+        if (strcmp(tag, info.name) != 0) {
+            continue;
+        }
 
-    if ((len > 0) && jpeg_opened) {
-        ret = ReplaceThumbnailFromBuffer(thumb, len) ? NO_ERROR : UNKNOWN_ERROR;
-        CAMHAL_LOGDB("insertExifThumbnailImage. ReplaceThumbnail(). ret=%d", ret);
+        // elements sharing a name share the type, convert only once
+        if (size < 0) {
+            if (isAsciiTag(tag)) {
+                size = sizeof(ExifAsciiPrefix) + strlen(value + sizeof(ExifAsciiPrefix));
+                count = size;
+            } else if (info.type == EXIF_TYPE_ASCII) {
+                size = strlen(value) + 1;
+                count = size;
+            } else {
+                size = parse_exif_numbers(info.type, value, parsed, sizeof(parsed), &count);
+                if (size < 0) {
+                    CAMHAL_LOGEB("Invalid value \"%s\" for EXIF tag %s", value, tag);
+                    return BAD_VALUE;
+                }
+            }
+
+            if ((info.type == EXIF_TYPE_ASCII) || (info.type == EXIF_TYPE_UNDEFINED)) {
+                if (size > (int) sizeof(parsed)) {
+                    CAMHAL_LOGEB("Value of EXIF tag %s is too long", tag);
+                    return BAD_VALUE;
+                }
+                memcpy(parsed, value, size);
+            }
+        }
+
+        ret = setElement(info.tag, info.ifd, info.type, count, parsed, size);
+        if (NO_ERROR != ret) {
+            break;
+        }
+    }
+
+    if (BAD_VALUE == ret) {
+        CAMHAL_LOGEB("Unsupported EXIF tag %s", tag);
     }
 
     return ret;
 }
 
-void ExifElementsTable::saveJpeg(unsigned char* jpeg, size_t jpeg_size) {
-    if (jpeg_opened) {
-       WriteJpegToBuffer(jpeg, jpeg_size);
-       DiscardData();
-       jpeg_opened = false;
+/**
+ * The APP1 segment is written in front of the first segment following the
+ * SOI of jpeg, into the EXIF_APP1_HEADROOM bytes the buffer must have
+ * before jpeg, together with a new SOI. The thumbnail is dropped when it
+ * would not fit in the segment. Returns the start of the image, or NULL if
+ * jpeg is not a JPEG stream.
+ */
+uint8_t* ExifElementsTable::insertExifToJpeg(uint8_t* jpeg, size_t jpeg_size,
+                                             const uint8_t* thumb, size_t thumb_size,
+                                             size_t* exif_jpeg_size) {
+    uint8_t* app1 = NULL;
+    size_t app1_size = 0;
+
+    if (!jpeg || (jpeg_size < 2) || (jpeg[0] != 0xFF) || (jpeg[1] != M_SOI)) {
+        CAMHAL_LOGEA("Not a JPEG stream, EXIF not inserted");
+        return NULL;
     }
-}
 
-/* public functions */
-ExifElementsTable::~ExifElementsTable() {
-    int num_elements = gps_tag_count + exif_tag_count;
+    if (!thumb) {
+        thumb_size = 0;
+    }
 
-    for (int i = 0; i < num_elements; i++) {
-        if (table[i].Value) {
-            free(table[i].Value);
-        }
+    app1_size = writeApp1(NULL, thumb, thumb_size);
+    if (!app1_size && thumb_size) {
+        CAMHAL_LOGEB("Thumbnail of %d bytes does not fit in APP1, dropping it", (int) thumb_size);
+        thumb = NULL;
+        thumb_size = 0;
+        app1_size = writeApp1(NULL, NULL, 0);
     }
 
-    if (jpeg_opened) {
-        DiscardData();
+    if (!app1_size) {
+        CAMHAL_LOGEA("EXIF elements do not fit in APP1");
+        return NULL;
     }
+
+    app1 = jpeg + 2 - app1_size;
+    writeApp1(app1, thumb, thumb_size);
+    app1[-2] = 0xFF;
+    app1[-1] = M_SOI;
+
+    if (exif_jpeg_size) {
+        *exif_jpeg_size = jpeg_size + app1_size;
+    }
+
+    return app1 - 2;
 }
 
-status_t ExifElementsTable::insertElement(const char* tag, const char* value) {
-    unsigned int value_length = 0;
-    status_t ret = NO_ERROR;
+/* private member functions */
+status_t ExifElementsTable::setElement(uint16_t tag, uint8_t ifd, uint16_t type,
+                                       uint32_t count, const uint8_t* value, size_t size) {
+    unsigned int i;
 
-    if (!value || !tag) {
-        return -EINVAL;
+    for (i = 0; i < position; i++) {
+        if ((table[i].tag == tag) && (table[i].ifd == ifd)) {
+            break;
+        }
     }
 
-    if (position >= MAX_EXIF_TAGS_SUPPORTED) {
+    if (i >= MAX_EXIF_TAGS_SUPPORTED) {
         CAMHAL_LOGEA("Max number of EXIF elements already inserted");
         return NO_MEMORY;
     }
 
-    if (isAsciiTag(tag)) {
-        value_length = sizeof(ExifAsciiPrefix) + strlen(value + sizeof(ExifAsciiPrefix));
-    } else {
-        value_length = strlen(value);
+    // a replaced value keeps its storage when the new one fits in it
+    if ((i == position) || (size > table[i].size)) {
+        if (data_size + size > MAX_EXIF_DATA_SIZE) {
+            CAMHAL_LOGEA("EXIF element storage is full");
+            return NO_MEMORY;
+        }
+        table[i].offset = data_size;
+        data_size += size;
     }
 
-    if (IsGpsTag(tag)) {
-        table[position].GpsTag = TRUE;
-        table[position].Tag = GpsTagNameToValue(tag);
-        gps_tag_count++;
-    } else {
-        table[position].GpsTag = FALSE;
-        table[position].Tag = TagNameToValue(tag);
-        exif_tag_count++;
+    memcpy(data + table[i].offset, value, size);
+    table[i].tag = tag;
+    table[i].type = type;
+    table[i].count = count;
+    table[i].size = size;
+    table[i].ifd = ifd;
 
-        if (strcmp(tag, TAG_DATETIME) == 0) {
-#ifdef ANDROID_API_JB_OR_LATER
-            has_datetime_tag = true;
-#else
-            // jhead isn't taking datetime tag...this is a WA
-            ImageInfo.numDateTimeTags = 1;
-            memcpy(ImageInfo.DateTime, value,
-                   MIN(ARRAY_SIZE(ImageInfo.DateTime), value_length + 1));
-#endif
+    if (i == position) {
+        position++;
+    }
+
+    return NO_ERROR;
+}
+
+/**
+ * Writes the APP1 segment: a little endian TIFF structure with IFD0, the
+ * Exif and GPS sub-IFDs and, with a thumbnail, IFD1 followed by the
+ * thumbnail. Entries are sorted by tag and values longer than four bytes
+ * follow their IFD. Returns the segment size, 0 if it is too large, and
+ * only computes the size when app1 is NULL.
+ */
+size_t ExifElementsTable::writeApp1(uint8_t* app1, const uint8_t* thumb, size_t thumb_size) const {
+    struct Entry {
+        uint16_t tag;
+        uint16_t type;
+        uint32_t count;
+        const uint8_t* value;
+        size_t size;
+    };
+
+    static const uint8_t exif_version[] = { '0', '2', '2', '0' };
+    static const uint8_t exif_header[] = { 'E', 'x', 'i', 'f', 0, 0 };
+    static const uint8_t compression_jpeg[] = { 6, 0 };
+
+    Entry entries[EXIF_IFD_MAX][MAX_EXIF_TAGS_SUPPORTED + 2];
+    unsigned int counts[EXIF_IFD_MAX];
+    uint32_t offsets[EXIF_IFD_MAX + 1];
+    uint8_t pointers[4][4];
+    uint32_t thumb_offset = 0;
+    size_t app1_size = 0;
+
+    memset(counts, 0, sizeof(counts));
+
+    for (unsigned int i = 0; i < position; i++) {
+        Entry& entry = entries[table[i].ifd][counts[table[i].ifd]++];
+
+        entry.tag = table[i].tag;
+        entry.type = table[i].type;
+        entry.count = table[i].count;
+        entry.value = data + table[i].offset;
+        entry.size = table[i].size;
+    }
+
+    // pointer values are patched once the layout is known
+    Entry version = { EXIF_TAG_EXIF_VERSION, EXIF_TYPE_UNDEFINED, 4, exif_version, 4 };
+    Entry exif_ifd = { EXIF_TAG_EXIF_IFD_POINTER, EXIF_TYPE_LONG, 1, pointers[0], 4 };
+    Entry gps_ifd = { EXIF_TAG_GPS_IFD_POINTER, EXIF_TYPE_LONG, 1, pointers[1], 4 };
+    Entry compression = { EXIF_TAG_COMPRESSION, EXIF_TYPE_SHORT, 1, compression_jpeg, 2 };
+    Entry thumb_start = { EXIF_TAG_JPEG_IF_OFFSET, EXIF_TYPE_LONG, 1, pointers[2], 4 };
+    Entry thumb_length = { EXIF_TAG_JPEG_IF_BYTE_COUNT, EXIF_TYPE_LONG, 1, pointers[3], 4 };
+
+    entries[EXIF_IFD_EXIF][counts[EXIF_IFD_EXIF]++] = version;
+    entries[EXIF_IFD_0][counts[EXIF_IFD_0]++] = exif_ifd;
+    if (counts[EXIF_IFD_GPS]) {
+        entries[EXIF_IFD_0][counts[EXIF_IFD_0]++] = gps_ifd;
+    }
+    if (thumb_size) {
+        entries[EXIF_IFD_1][counts[EXIF_IFD_1]++] = compression;
+        entries[EXIF_IFD_1][counts[EXIF_IFD_1]++] = thumb_start;
+        entries[EXIF_IFD_1][counts[EXIF_IFD_1]++] = thumb_length;
+    }
+
+    // IFDs follow the 8 byte TIFF header, values are kept word aligned
+    offsets[0] = 8;
+    for (int ifd = 0; ifd < EXIF_IFD_MAX; ifd++) {
+        size_t ifd_size = 0;
+
+        if (counts[ifd]) {
+            ifd_size = 2 + 12 * counts[ifd] + 4;
+            for (unsigned int i = 0; i < counts[ifd]; i++) {
+                if (entries[ifd][i].size > 4) {
+                    ifd_size += (entries[ifd][i].size + 1) & ~1;
+                }
+            }
         }
+        offsets[ifd + 1] = offsets[ifd] + ifd_size;
     }
 
-    table[position].DataLength = 0;
-    table[position].Value = (char*) malloc(sizeof(char) * (value_length + 1));
+    thumb_offset = offsets[EXIF_IFD_MAX];
+    app1_size = 2 + 2 + sizeof(exif_header) + thumb_offset + thumb_size;
+    if (app1_size - 2 > 0xFFFF) {
+        return 0;
+    }
 
-    if (table[position].Value) {
-        memcpy(table[position].Value, value, value_length + 1);
-        table[position].DataLength = value_length + 1;
+    if (!app1) {
+        return app1_size;
     }
 
-    position++;
-    return ret;
+    exif_put32(pointers[0], offsets[EXIF_IFD_EXIF]);
+    exif_put32(pointers[1], offsets[EXIF_IFD_GPS]);
+    exif_put32(pointers[2], thumb_offset);
+    exif_put32(pointers[3], thumb_size);
+
+    app1[0] = 0xFF;
+    app1[1] = M_EXIF;
+    app1[2] = (app1_size - 2) >> 8;
+    app1[3] = (app1_size - 2) & 0xFF;
+    memcpy(app1 + 4, exif_header, sizeof(exif_header));
+
+    uint8_t* tiff = app1 + 4 + sizeof(exif_header);
+    tiff[0] = 'I';
+    tiff[1] = 'I';
+    exif_put16(tiff + 2, 0x2A);
+    exif_put32(tiff + 4, offsets[0]);
+
+    for (int ifd = 0; ifd < EXIF_IFD_MAX; ifd++) {
+        Entry* list = entries[ifd];
+        uint8_t* p = tiff + offsets[ifd];
+        uint32_t value_offset = offsets[ifd] + 2 + 12 * counts[ifd] + 4;
+
+        if (!counts[ifd]) {
+            continue;
+        }
+
+        for (unsigned int i = 1; i < counts[ifd]; i++) {
+            Entry entry = list[i];
+            unsigned int j = i;
+
+            for (; (j > 0) && (list[j - 1].tag > entry.tag); j--) {
+                list[j] = list[j - 1];
+            }
+            list[j] = entry;
+        }
+
+        exif_put16(p, counts[ifd]);
+        p += 2;
+
+        for (unsigned int i = 0; i < counts[ifd]; i++) {
+            exif_put16(p, list[i].tag);
+            exif_put16(p + 2, list[i].type);
+            exif_put32(p + 4, list[i].count);
+            if (list[i].size > 4) {
+                exif_put32(p + 8, value_offset);
+                memcpy(tiff + value_offset, list[i].value, list[i].size);
+                if (list[i].size & 1) {
+                    tiff[value_offset + list[i].size] = 0;
+                }
+                value_offset += (list[i].size + 1) & ~1;
+            } else {
+                memset(p + 8, 0, 4);
+                memcpy(p + 8, list[i].value, list[i].size);
+            }
+            p += 12;
+        }
+
+        // only IFD0 links to the next one, the thumbnail IFD
+        exif_put32(p, ((ifd == EXIF_IFD_0) && thumb_size) ? offsets[EXIF_IFD_1] : 0);
+    }
+
+    if (thumb_size) {
+        memcpy(tiff + thumb_offset, thumb, thumb_size);
+    }
+
+    return app1_size;
 }
 
-/* private member functions */
-size_t Encoder_libjpeg::encode(params* input) {
+/**
+ * Rows are fed through libjpeg's raw data interface, one 16 row iMCU at a
+ * time: luma rows point straight into NV21 sources and chroma is split into
+ * small 4:2:0 planes, so no packed 4:4:4 copy of the image is made. Edges
+ * are padded the way libjpeg pads scanline input, which keeps the output
+ * identical to the scanline path.
+ */
+size_t Encoder_libjpeg::encodeRows(params* input, uint8_t* src, int first_row, int rows,
+                                   uint8_t* dst, int dst_size, unsigned int restart_interval,
+                                   bool* overflow) {
     jpeg_compress_struct    cinfo;
     jpeg_error_mgr jerr;
-    jpeg_destination_mgr jdest;
-    uint8_t* src = NULL, *resize_src = NULL;
-    uint8_t* row_tmp = NULL;
+    JSAMPROW y_rows[JPEG_MCU_SIZE];
+    JSAMPROW cb_rows[JPEG_MCU_SIZE / 2];
+    JSAMPROW cr_rows[JPEG_MCU_SIZE / 2];
+    JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+    uint8_t* scratch = NULL;
     uint8_t* row_src = NULL;
     uint8_t* row_uv = NULL; // used only for NV12
-    int out_width = 0, in_width = 0;
-    int out_height = 0, in_height = 0;
+    int out_width = input->out_width;
+    int out_height = input->out_height;
+    int right_crop = input->right_crop;
+    int width = out_width - right_crop;
+    int y_width = (width + JPEG_MCU_SIZE - 1) & ~(JPEG_MCU_SIZE - 1);
+    int c_width = y_width / 2;
     int bpp = 2; // for uyvy
-    int right_crop = 0, start_offset = 0;
+    int y_offset = 1, u_offset = 0, v_offset = 2;
 
-    if (!input) {
-        return 0;
-    }
-
-    out_width = input->out_width;
-    in_width = input->in_width;
-    out_height = input->out_height;
-    in_height = input->in_height;
-    right_crop = input->right_crop;
-    start_offset = input->start_offset;
-    src = input->src;
-    input->jpeg_size = 0;
-
-    libjpeg_destination_mgr dest_mgr(input->dst, input->dst_size);
-
-    // param check...
-    if ((in_width < 2) || (out_width < 2) || (in_height < 2) || (out_height < 2) ||
-         (src == NULL) || (input->dst == NULL) || (input->quality < 1) || (input->src_size < 1) ||
-         (input->dst_size < 1) || (input->format == NULL)) {
-        goto exit;
-    }
+    libjpeg_destination_mgr dest_mgr(dst, dst_size);
 
     if (strcmp(input->format, android::CameraParameters::PIXEL_FORMAT_YUV420SP) == 0) {
         bpp = 1;
-        if ((in_width != out_width) || (in_height != out_height)) {
-            resize_src = (uint8_t*) malloc(input->dst_size);
-            resize_nv12(input, resize_src);
-            if (resize_src) src = resize_src;
-        }
-    } else if (strcmp(input->format, android::CameraParameters::PIXEL_FORMAT_YUV422I) &&
-               strcmp(input->format, TICameraParameters::PIXEL_FORMAT_YUV422I_UYVY)) {
-        // we currently only support yuv422i and yuv420sp
-        CAMHAL_LOGEB("Encoder: format not supported: %s", input->format);
-        goto exit;
-    } else if ((in_width != out_width) || (in_height != out_height)) {
-        CAMHAL_LOGEB("Encoder: resizing is not supported for this format: %s", input->format);
-        goto exit;
+    } else if (strcmp(input->format, android::CameraParameters::PIXEL_FORMAT_YUV422I) == 0) {
+        y_offset = 0;
+        u_offset = 1;
+        v_offset = 3;
     }
 
     cinfo.err = jpeg_std_error(&jerr);
@@ -484,16 +741,17 @@ size_t Encoder_libjpeg::encode(params* input) {
     CAMHAL_LOGDB("encoding...  \n\t"
                  "width: %d    \n\t"
                  "height:%d    \n\t"
+                 "first row:%d \n\t"
                  "dest %p      \n\t"
                  "dest size:%d \n\t"
                  "mSrc %p \n\t"
                  "format: %s",
-                 out_width, out_height, input->dst,
-                 input->dst_size, src, input->format);
+                 out_width, rows, first_row, dst,
+                 dst_size, src, input->format);
 
     cinfo.dest = &dest_mgr;
-    cinfo.image_width = out_width - right_crop;
-    cinfo.image_height = out_height;
+    cinfo.image_width = width;
+    cinfo.image_height = rows;
     cinfo.input_components = 3;
     cinfo.in_color_space = JCS_YCbCr;
     cinfo.input_gamma = 1;
@@ -501,34 +759,78 @@ size_t Encoder_libjpeg::encode(params* input) {
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, input->quality, TRUE);
     cinfo.dct_method = JDCT_IFAST;
+    cinfo.restart_interval = restart_interval;
+
+    // 4:2:0 planes are supplied already subsampled
+    cinfo.raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo.do_fancy_downsampling = FALSE;
+#endif
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 2;
+    cinfo.comp_info[1].h_samp_factor = 1;
+    cinfo.comp_info[1].v_samp_factor = 1;
+    cinfo.comp_info[2].h_samp_factor = 1;
+    cinfo.comp_info[2].v_samp_factor = 1;
+
+    scratch = (uint8_t*)malloc(JPEG_MCU_SIZE * (y_width + c_width));
+    if (!scratch) {
+        CAMHAL_LOGEA("Failed to allocate raw data rows");
+        jpeg_destroy_compress(&cinfo);
+        return 0;
+    }
 
     jpeg_start_compress(&cinfo, TRUE);
 
-    row_tmp = (uint8_t*)malloc((out_width - right_crop) * 3);
-    row_src = src + start_offset;
-    row_uv = src + out_width * out_height * bpp;
+    row_src = src + input->start_offset + first_row * out_width * bpp;
+    row_uv = src + out_width * out_height * bpp + (first_row / 2) * out_width * bpp;
 
-    while ((cinfo.next_scanline < cinfo.image_height) && !mCancelEncoding) {
-        JSAMPROW row[1];    /* pointer to JSAMPLE row[s] */
+    for (int y = 0; (y < rows) && !mCancelEncoding; y += JPEG_MCU_SIZE) {
+        uint8_t* y_buf = scratch;
+        uint8_t* cb_buf = scratch + JPEG_MCU_SIZE * y_width;
+        uint8_t* cr_buf = cb_buf + (JPEG_MCU_SIZE / 2) * c_width;
 
-        // convert input yuv format to yuv444
-        if (strcmp(input->format, android::CameraParameters::PIXEL_FORMAT_YUV420SP) == 0) {
-            nv21_to_yuv(row_tmp, row_src, row_uv, out_width - right_crop);
-        } else if (strcmp(input->format, TICameraParameters::PIXEL_FORMAT_YUV422I_UYVY) == 0) {
-            uyvy_to_yuv(row_tmp, (uint32_t*)row_src, out_width - right_crop);
-        } else if (strcmp(input->format, android::CameraParameters::PIXEL_FORMAT_YUV422I) == 0) {
-            yuyv_to_yuv(row_tmp, (uint32_t*)row_src, out_width - right_crop);
-        }
+        // rows below the image repeat the last one
+        for (int i = 0; i < JPEG_MCU_SIZE; i++) {
+            uint8_t* line = row_src + MIN(y + i, rows - 1) * out_width * bpp;
+
+            if (bpp == 1 && width == y_width) {
+                y_rows[i] = line;
+                continue;
+            }
 
-        row[0] = row_tmp;
-        jpeg_write_scanlines(&cinfo, row, 1);
-        row_src = row_src + out_width*bpp;
+            y_rows[i] = y_buf + i * y_width;
+            if (bpp == 1) {
+                memcpy(y_rows[i], line, width);
+            } else {
+                packed_row_to_y(y_rows[i], line, width, y_offset);
+            }
+            replicate_right_edge(y_rows[i], width, y_width);
+        }
 
-        // move uv row if input format needs it
-        if (strcmp(input->format, android::CameraParameters::PIXEL_FORMAT_YUV420SP) == 0) {
-            if (!(cinfo.next_scanline % 2))
-                row_uv = row_uv +  out_width * bpp;
+        for (int i = 0; i < JPEG_MCU_SIZE / 2; i++) {
+            int c_row = MIN(y / 2 + i, (rows - 1) / 2);
+
+            cb_rows[i] = cb_buf + i * c_width;
+            cr_rows[i] = cr_buf + i * c_width;
+
+            if (bpp == 1) {
+                // YUV420SP buffers are NV21, V comes first
+                Utils::PixelConvert::deinterleaveUV(row_uv + c_row * out_width, 0,
+                                                    cr_rows[i], 0, cb_rows[i], 0,
+                                                    (width + 1) / 2, 1);
+                replicate_right_edge(cb_rows[i], (width + 1) / 2, c_width);
+                replicate_right_edge(cr_rows[i], (width + 1) / 2, c_width);
+            } else {
+                uint8_t* line0 = row_src + (c_row * 2) * out_width * bpp;
+                uint8_t* line1 = row_src + MIN(c_row * 2 + 1, rows - 1) * out_width * bpp;
+
+                packed_rows_to_cbcr(cb_rows[i], cr_rows[i], line0, line1,
+                                    width, c_width, u_offset, v_offset);
+            }
         }
+
+        jpeg_write_raw_data(&cinfo, planes, JPEG_MCU_SIZE);
     }
 
     // no need to finish encoding routine if we are prematurely stopping
@@ -537,12 +839,472 @@ size_t Encoder_libjpeg::encode(params* input) {
         jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
 
+    free(scratch);
+
+    if (overflow) {
+        *overflow = dest_mgr.overflow;
+    }
+
+    return dest_mgr.jpegsize;
+}
+
+/**
+ * Strips are encoded as standalone JPEGs sharing the default tables, with
+ * a restart interval equal to the MCU count of a strip. The stitched image
+ * keeps the headers of the first strip, with the frame height patched, and
+ * separates the entropy coded segments of the strips with RSTn markers.
+ */
+struct JpegStripContext {
+    Encoder_libjpeg* encoder;
+    Encoder_libjpeg::params* input;
+    uint8_t* src;
+    int strip_rows;
+    unsigned int restart_interval;
+    uint8_t* buf;
+    int buf_size;
+    size_t sizes[JPEG_MAX_STRIPS];
+};
+
+// Returns the offset of the first entropy coded byte, and of the SOF segment in sof
+static size_t findJpegScanData(const uint8_t* jpeg, size_t size, size_t* sof) {
+    size_t pos = 2;
+
+    if ((size < 4) || (jpeg[0] != 0xFF) || (jpeg[1] != M_SOI)) {
+        return 0;
+    }
+
+    while ((pos + 4) <= size) {
+        if (jpeg[pos] != 0xFF) {
+            return 0;
+        }
+
+        uint8_t marker = jpeg[pos + 1];
+        size_t length = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+
+        if ((marker == M_SOF0) || (marker == M_SOF1) || (marker == M_SOF2)) {
+            if (sof) *sof = pos;
+        }
+
+        pos += 2 + length;
+
+        if (marker == M_SOS) {
+            return (pos <= size) ? pos : 0;
+        }
+    }
+
+    return 0;
+}
+
+static size_t stitchJpegStrips(const JpegStripContext& ctx, int strips, int height,
+                               uint8_t* dst, size_t dst_size) {
+    size_t sof = 0, size = 0;
+    size_t header = findJpegScanData(ctx.buf, ctx.sizes[0], &sof);
+
+    if ((header == 0) || (sof == 0) || (header > dst_size)) {
+        return 0;
+    }
+
+    memcpy(dst, ctx.buf, header);
+    // SOF: marker, length, precision, then the image height
+    dst[sof + 5] = (height >> 8) & 0xFF;
+    dst[sof + 6] = height & 0xFF;
+    size = header;
+
+    for (int i = 0; i < strips; i++) {
+        const uint8_t* strip = ctx.buf + i * ctx.buf_size;
+        size_t start = findJpegScanData(strip, ctx.sizes[i], NULL);
+
+        // every strip must end with EOI right after its scan data
+        if ((start == 0) || (ctx.sizes[i] < start + 2) ||
+            (strip[ctx.sizes[i] - 2] != 0xFF) || (strip[ctx.sizes[i] - 1] != M_EOI)) {
+            return 0;
+        }
+
+        size_t length = ctx.sizes[i] - 2 - start;
+        if (size + length + 2 > dst_size) {
+            return 0;
+        }
+
+        memcpy(dst + size, strip + start, length);
+        size += length;
+
+        dst[size++] = 0xFF;
+        dst[size++] = (i < strips - 1) ? (0xD0 + (i % 8)) : M_EOI;
+    }
+
+    return size;
+}
+
+void Encoder_libjpeg::encodeStrip(void* cookie, int index) {
+    JpegStripContext* ctx = (JpegStripContext*) cookie;
+    int first_row = index * ctx->strip_rows;
+    int rows = MIN(ctx->strip_rows, ctx->input->out_height - first_row);
+    bool overflow = false;
+
+    size_t size = ctx->encoder->encodeRows(ctx->input, ctx->src, first_row, rows,
+                                           ctx->buf + index * ctx->buf_size, ctx->buf_size,
+                                           ctx->restart_interval, &overflow);
+
+    ctx->sizes[index] = overflow ? 0 : size;
+}
+
+size_t Encoder_libjpeg::encodeStrips(params* input, uint8_t* src) {
+    JpegStripContext ctx;
+    int width = input->out_width - input->right_crop;
+    int height = input->out_height;
+    int strips = MIN(input->strips, JPEG_MAX_STRIPS);
+    int mcu_rows = (height + JPEG_MCU_SIZE - 1) / JPEG_MCU_SIZE;
+    int mcu_cols = (width + JPEG_MCU_SIZE - 1) / JPEG_MCU_SIZE;
+    int strip_mcu_rows;
+    size_t size = 0;
+
+    if (!mPool || (strips < 2) || (width * height < JPEG_STRIP_MIN_PIXELS)) {
+        return 0;
+    }
+
+    // other captures may have taken workers since the strips were planned
+    int available = mPool->maxStrips();
+    strips = MIN(strips, available);
+    if ((strips < 2) || (mcu_rows < strips)) {
+        return 0;
+    }
+
+    strip_mcu_rows = (mcu_rows + strips - 1) / strips;
+    strips = (mcu_rows + strip_mcu_rows - 1) / strip_mcu_rows;
+
+    // DRI holds a 16 bit interval
+    if (strip_mcu_rows * mcu_cols > 0xFFFF) {
+        return 0;
+    }
+
+    ctx.encoder = this;
+    ctx.input = input;
+    ctx.src = src;
+    ctx.strip_rows = strip_mcu_rows * JPEG_MCU_SIZE;
+    ctx.restart_interval = strip_mcu_rows * mcu_cols;
+    ctx.buf_size = input->dst_size / strips + JPEG_STRIP_SLACK;
+    ctx.buf = (uint8_t*) malloc(ctx.buf_size * strips);
+    if (!ctx.buf) {
+        return 0;
+    }
+    memset(ctx.sizes, 0, sizeof(ctx.sizes));
+
+    mPool->parallelFor(encodeStrip, &ctx, strips);
+
+    if (!mCancelEncoding) {
+        size = stitchJpegStrips(ctx, strips, height, input->dst, input->dst_size);
+        if (0 == size) {
+            CAMHAL_LOGEA("Encoder: stitching JPEG strips failed, encoding serially");
+        }
+    }
+
+    free(ctx.buf);
+
+    return size;
+}
+
+size_t Encoder_libjpeg::encode(params* input) {
+    uint8_t* src = NULL, *resize_src = NULL;
+    size_t jpeg_size = 0;
+
+    if (!input) {
+        return 0;
+    }
+
+    src = input->src;
+    input->jpeg_size = 0;
+
+    // param check...
+    if ((input->in_width < 2) || (input->out_width < 2) || (input->in_height < 2) || (input->out_height < 2) ||
+         (src == NULL) || (input->dst == NULL) || (input->quality < 1) || (input->src_size < 1) ||
+         (input->dst_size < 1) || (input->format == NULL) || mCancelEncoding) {
+        goto exit;
+    }
+
+    if (strcmp(input->format, android::CameraParameters::PIXEL_FORMAT_YUV420SP) == 0) {
+        if ((input->in_width != input->out_width) || (input->in_height != input->out_height)) {
+            resize_src = (uint8_t*) malloc(input->dst_size);
+            resize_nv12(input, resize_src);
+            if (resize_src) src = resize_src;
+        }
+    } else if (strcmp(input->format, android::CameraParameters::PIXEL_FORMAT_YUV422I) &&
+               strcmp(input->format, TICameraParameters::PIXEL_FORMAT_YUV422I_UYVY)) {
+        // we currently only support yuv422i and yuv420sp
+        CAMHAL_LOGEB("Encoder: format not supported: %s", input->format);
+        goto exit;
+    } else if ((input->in_width != input->out_width) || (input->in_height != input->out_height)) {
+        CAMHAL_LOGEB("Encoder: resizing is not supported for this format: %s", input->format);
+        goto exit;
+    }
+
+    if (input->strips > 1) {
+        jpeg_size = encodeStrips(input, src);
+    }
+
+    if ((0 == jpeg_size) && !mCancelEncoding) {
+        jpeg_size = encodeRows(input, src, 0, input->out_height,
+                               input->dst, input->dst_size, 0, NULL);
+    }
+
     if (resize_src) free(resize_src);
-    if (row_tmp) free(row_tmp);
 
  exit:
-    input->jpeg_size = dest_mgr.jpegsize;
-    return dest_mgr.jpegsize;
+    input->jpeg_size = jpeg_size;
+    return jpeg_size;
+}
+
+void Encoder_libjpeg::encodePart(bool thumbnail) {
+    bool last = false;
+
+    encode(thumbnail ? mThumbnailInput : mMainInput);
+
+    {
+        android::AutoMutex lock(mDoneLock);
+        last = (0 == --mPendingParts);
+    }
+
+    if (!last) {
+        return;
+    }
+
+    if (mCb) {
+        mCb(mMainInput, mThumbnailInput, mType, mCookie1, mCookie2, mCookie3, mCookie4, mCancelEncoding);
+    }
+
+    android::AutoMutex lock(mDoneLock);
+    mDone = true;
+    mDoneCondition.broadcast();
+}
+
+void Encoder_libjpeg::cancel() {
+    android::AutoMutex lock(mDoneLock);
+
+    mCancelEncoding = true;
+
+    // parts still queued bail out as soon as a worker picks them up
+    if (!mDone) {
+        mDoneCondition.waitRelative(mDoneLock, (nsecs_t) CANCEL_TIMEOUT * 1000);
+    }
+}
+
+JpegEncoderPool::JpegEncoderPool()
+    : mIdleWorkers(0), mExiting(false) {
+}
+
+JpegEncoderPool::~JpegEncoderPool() {
+    release();
+}
+
+status_t JpegEncoderPool::initialize() {
+    status_t ret = NO_ERROR;
+    // the thread splitting an image into strips encodes one of them itself
+    int threads = onlineCores() - 1;
+
+    if (threads < ENCODER_THREADS) {
+        threads = ENCODER_THREADS;
+    } else if (threads > JPEG_MAX_STRIPS - 1) {
+        threads = JPEG_MAX_STRIPS - 1;
+    }
+
+    LOG_FUNCTION_NAME;
+
+    for (int i = 0; i < threads; i++) {
+        android::sp<WorkerThread> worker = new WorkerThread(this);
+#ifdef ANDROID_API_N_OR_LATER
+        ret = worker->run("jpeg_encoder");
+#else
+        ret = worker->run();
+#endif
+        if (NO_ERROR != ret) {
+            CAMHAL_LOGEB("Couldn't run JPEG encoder thread %d", i);
+            break;
+        }
+        mWorkers.push_back(worker);
+    }
+
+    // a single worker is still usable, thumbnails just run before main images
+    if (!mWorkers.isEmpty()) {
+        ret = NO_ERROR;
+    }
+
+    LOG_FUNCTION_NAME_EXIT;
+
+    return ret;
+}
+
+void JpegEncoderPool::release() {
+    {
+        android::AutoMutex lock(mLock);
+        mExiting = true;
+        mTaskCondition.broadcast();
+        mSlotCondition.broadcast();
+    }
+
+    for (size_t i = 0; i < mWorkers.size(); i++) {
+        mWorkers[i]->requestExit();
+        mWorkers[i]->join();
+    }
+    mWorkers.clear();
+}
+
+status_t JpegEncoderPool::waitForSlot() {
+    android::AutoMutex lock(mLock);
+
+    while (!mExiting && (mJobs.size() >= MAX_PENDING_JOBS)) {
+        if (NO_ERROR != mSlotCondition.waitRelative(mLock, (nsecs_t) CANCEL_TIMEOUT * 1000)) {
+            CAMHAL_LOGEB("JPEG encoder still busy with %d captures", (int) mJobs.size());
+            return TIMED_OUT;
+        }
+    }
+
+    return mExiting ? NO_INIT : NO_ERROR;
+}
+
+int JpegEncoderPool::onlineCores() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (cores < 1) ? 1 : (int) cores;
+}
+
+int JpegEncoderPool::maxStrips() {
+    android::AutoMutex lock(mLock);
+
+    // more strips than threads free to take them only serializes the encode
+    int strips = MIN(onlineCores(), mIdleWorkers + 1);
+
+    return MIN(strips, JPEG_MAX_STRIPS);
+}
+
+status_t JpegEncoderPool::queue(void *key, const android::sp<Encoder_libjpeg> &job) {
+    android::AutoMutex lock(mLock);
+
+    if (mExiting || mWorkers.isEmpty()) {
+        return NO_INIT;
+    }
+
+    job->setPool(this);
+    mJobs.add(key, job);
+
+    Task task;
+    task.job = job;
+    if (job->hasThumbnail()) {
+        task.thumbnail = true;
+        mThumbnailTasks.push_back(task);
+    }
+    task.thumbnail = false;
+    mMainTasks.push_back(task);
+
+    mTaskCondition.broadcast();
+
+    return NO_ERROR;
+}
+
+void JpegEncoderPool::remove(void *key) {
+    android::AutoMutex lock(mLock);
+
+    mJobs.removeItem(key);
+    mSlotCondition.signal();
+}
+
+void JpegEncoderPool::removeAll(android::Vector< android::sp<Encoder_libjpeg> > &jobs) {
+    android::AutoMutex lock(mLock);
+
+    for (size_t i = 0; i < mJobs.size(); i++) {
+        jobs.push_back(mJobs.valueAt(i));
+    }
+    mJobs.clear();
+    mSlotCondition.broadcast();
+}
+
+int JpegEncoderPool::claimLocked(ParallelJob *job) {
+    int index = job->next++;
+
+    if (job->next == job->count) {
+        for (size_t i = 0; i < mParallelJobs.size(); i++) {
+            if (mParallelJobs[i] == job) {
+                mParallelJobs.removeAt(i);
+                break;
+            }
+        }
+    }
+
+    return index;
+}
+
+void JpegEncoderPool::parallelFor(void (*fn)(void *, int), void *cookie, int count) {
+    ParallelJob job;
+    job.fn = fn;
+    job.cookie = cookie;
+    job.count = count;
+    job.next = 0;
+    job.done = 0;
+
+    android::AutoMutex lock(mLock);
+
+    mParallelJobs.push_back(&job);
+    mTaskCondition.broadcast();
+
+    // The caller takes part, so this completes even if every worker is busy
+    while (job.next < job.count) {
+        int index = claimLocked(&job);
+
+        mLock.unlock();
+        fn(cookie, index);
+        mLock.lock();
+
+        job.done++;
+    }
+
+    while (job.done < job.count) {
+        mParallelCondition.wait(mLock);
+    }
+}
+
+bool JpegEncoderPool::workerLoop() {
+    Task task;
+    ParallelJob *parallel = NULL;
+    int index = 0;
+
+    {
+        android::AutoMutex lock(mLock);
+
+        mIdleWorkers++;
+        while (mParallelJobs.isEmpty() && mThumbnailTasks.isEmpty() && mMainTasks.isEmpty()) {
+            if (mExiting) {
+                mIdleWorkers--;
+                return false;
+            }
+            mTaskCondition.wait(mLock);
+        }
+        mIdleWorkers--;
+
+        // strips of an image being encoded come first, they hold up a worker
+        // thumbnails are small and gate the callback, run them next
+        if (!mParallelJobs.isEmpty()) {
+            parallel = mParallelJobs[0];
+            index = claimLocked(parallel);
+        } else if (!mThumbnailTasks.isEmpty()) {
+            task = mThumbnailTasks[0];
+            mThumbnailTasks.removeAt(0);
+        } else {
+            task = mMainTasks[0];
+            mMainTasks.removeAt(0);
+        }
+    }
+
+    if (parallel) {
+        parallel->fn(parallel->cookie, index);
+
+        android::AutoMutex lock(mLock);
+        parallel->done++;
+        mParallelCondition.broadcast();
+
+        return true;
+    }
+
+    task.job->encodePart(task.thumbnail);
+
+    return true;
 }
 
 } // namespace Camera
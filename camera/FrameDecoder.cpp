@@ -22,7 +22,8 @@ namespace Ti {
 namespace Camera {
 
 FrameDecoder::FrameDecoder()
-: mCameraHal(NULL), mState(DecoderState_Uninitialized) {
+: mCameraHal(NULL), mOutputCallback(NULL), mOutputCallbackData(NULL),
+  mState(DecoderState_Uninitialized) {
 }
 
 FrameDecoder::~FrameDecoder() {
@@ -139,18 +140,29 @@ status_t FrameDecoder::dequeueOutputBuffer(int &id) {
         return INVALID_OPERATION;
     }
 
+    // decoders may fill the buffers out of order, the oldest frame goes first
+    ssize_t found = -1;
+    nsecs_t oldest = 0;
     for (size_t i = 0; i < mOutQueue.size(); i++) {
         int index = mOutQueue[i];
         android::sp<MediaBuffer>& out = mOutBuffers->editItemAt(index);
         android::AutoMutex bufferLock(out->getLock());
-        if (out->getStatus() == BufferStatus_OutFilled) {
-            id = index;
-            out->setStatus(BufferStatus_Unknown);
-            mOutQueue.removeAt(i);
-            return NO_ERROR;
+        if ((out->getStatus() == BufferStatus_OutFilled) &&
+            ((found < 0) || (out->getTimestamp() < oldest))) {
+            found = i;
+            oldest = out->getTimestamp();
         }
     }
 
+    if (found >= 0) {
+        id = mOutQueue[found];
+        android::sp<MediaBuffer>& out = mOutBuffers->editItemAt(id);
+        android::AutoMutex bufferLock(out->getLock());
+        out->setStatus(BufferStatus_Unknown);
+        mOutQueue.removeAt(found);
+        return NO_ERROR;
+    }
+
     LOG_FUNCTION_NAME_EXIT;
     return INVALID_OPERATION;
 }
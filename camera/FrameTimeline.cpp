@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+* @file FrameTimeline.cpp
+*
+* Per-frame timeline of preview and video buffers through the HAL
+*
+*/
+
+#include "FrameTimeline.h"
+#include "Common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace Ti {
+namespace Camera {
+
+static const char * const kStageNames[FrameTimeline::STAGE_COUNT] = {
+    "sensor",
+    "adapter receive",
+    "display enqueue",
+    "display dequeue",
+    "callback",
+    "encoder input",
+};
+
+// Sensor timestamps further off than this are on another clock
+static const nsecs_t kMaxSensorLatency = 1000000000LL;
+
+FrameTimeline::FrameTimeline()
+    : mWritten(0)
+{
+    memset(mFrames, 0, sizeof(mFrames));
+}
+
+void FrameTimeline::frameReceived(const void *buffer, nsecs_t sensorTime)
+{
+    const nsecs_t now = systemTime();
+
+    android::AutoMutex lock(mLock);
+
+    Frame &frame = mFrames[mWritten & (RING_SIZE - 1)];
+    memset(&frame, 0, sizeof(frame));
+    frame.buffer = buffer;
+    frame.stamps[STAGE_SENSOR] = sensorTime;
+    frame.stamps[STAGE_ADAPTER_RECEIVE] = now;
+    mWritten++;
+}
+
+void FrameTimeline::mark(const void *buffer, Stage stage)
+{
+    const nsecs_t now = systemTime();
+
+    android::AutoMutex lock(mLock);
+
+    const uint32_t depth = mWritten < (uint32_t) SEARCH_DEPTH ? mWritten : SEARCH_DEPTH;
+    for ( uint32_t i = 1; i <= depth; i++ ) {
+        Frame &frame = mFrames[(mWritten - i) & (RING_SIZE - 1)];
+        if ( frame.buffer == buffer ) {
+            // the first time a frame reaches a stage counts
+            if ( 0 == frame.stamps[stage] ) {
+                frame.stamps[stage] = now;
+            }
+            return;
+        }
+    }
+}
+
+int FrameTimeline::copyFrames(Frame *frames)
+{
+    android::AutoMutex lock(mLock);
+
+    const uint32_t count = mWritten < (uint32_t) RING_SIZE ? mWritten : RING_SIZE;
+    for ( uint32_t i = 0; i < count; i++ ) {
+        frames[i] = mFrames[(mWritten - count + i) & (RING_SIZE - 1)];
+    }
+
+    return count;
+}
+
+int FrameTimeline::compareLatency(const void *lhs, const void *rhs)
+{
+    const nsecs_t left = *static_cast<const nsecs_t *>(lhs);
+    const nsecs_t right = *static_cast<const nsecs_t *>(rhs);
+
+    if ( left < right ) {
+        return -1;
+    }
+
+    return left > right ? 1 : 0;
+}
+
+void FrameTimeline::dump(int fd)
+{
+    Frame *frames = new Frame[RING_SIZE];
+    nsecs_t *latencies = new nsecs_t[RING_SIZE];
+    char line[256];
+
+    const int count = copyFrames(frames);
+
+    snprintf(line, sizeof(line), "Frame timeline: %d frames, latency in ms p50/p95/p99\n", count);
+    write(fd, line, strlen(line));
+
+    for ( int stage = STAGE_ADAPTER_RECEIVE; stage < STAGE_COUNT; stage++ ) {
+        const int from = (STAGE_ADAPTER_RECEIVE == stage) ? STAGE_SENSOR : STAGE_ADAPTER_RECEIVE;
+        int n = 0;
+
+        for ( int i = 0; i < count; i++ ) {
+            const nsecs_t start = frames[i].stamps[from];
+            const nsecs_t end = frames[i].stamps[stage];
+            if ( (0 == start) || (0 == end) || (end < start) ) {
+                continue;
+            }
+            if ( (STAGE_SENSOR == from) && ((end - start) > kMaxSensorLatency) ) {
+                continue;
+            }
+            latencies[n++] = end - start;
+        }
+
+        if ( 0 == n ) {
+            snprintf(line, sizeof(line), "  %s -> %s: no samples\n",
+                     kStageNames[from], kStageNames[stage]);
+        } else {
+            qsort(latencies, n, sizeof(nsecs_t), compareLatency);
+            snprintf(line, sizeof(line), "  %s -> %s: %d samples, %.2f / %.2f / %.2f\n",
+                     kStageNames[from], kStageNames[stage], n,
+                     latencies[(n - 1) * 50 / 100] / 1000000.0,
+                     latencies[(n - 1) * 95 / 100] / 1000000.0,
+                     latencies[(n - 1) * 99 / 100] / 1000000.0);
+        }
+        write(fd, line, strlen(line));
+    }
+
+    delete [] latencies;
+    delete [] frames;
+}
+
+status_t FrameTimeline::exportTo(const char *path)
+{
+    Frame *frames = new Frame[RING_SIZE];
+    char line[256];
+    int length;
+
+    const int count = copyFrames(frames);
+
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if ( fd < 0 ) {
+        const int error = errno;
+        CAMHAL_LOGEB("Couldn't open %s: %s", path, strerror(error));
+        delete [] frames;
+        return -error;
+    }
+
+    length = snprintf(line, sizeof(line), "buffer");
+    for ( int stage = 0; stage < STAGE_COUNT; stage++ ) {
+        length += snprintf(line + length, sizeof(line) - length, ",%s", kStageNames[stage]);
+    }
+    length += snprintf(line + length, sizeof(line) - length, "\n");
+    write(fd, line, length);
+
+    for ( int i = 0; i < count; i++ ) {
+        length = snprintf(line, sizeof(line), "%p", frames[i].buffer);
+        for ( int stage = 0; stage < STAGE_COUNT; stage++ ) {
+            length += snprintf(line + length, sizeof(line) - length, ",%lld",
+                               (long long) frames[i].stamps[stage]);
+        }
+        length += snprintf(line + length, sizeof(line) - length, "\n");
+        write(fd, line, length);
+    }
+
+    close(fd);
+    delete [] frames;
+
+    return NO_ERROR;
+}
+
+} // namespace Camera
+} // namespace Ti
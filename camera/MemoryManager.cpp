@@ -17,6 +17,8 @@
 #include "CameraHal.h"
 #include "TICameraParameters.h"
 
+#include <cutils/properties.h>
+
 extern "C" {
 
 //#include <timm_osal_interfaces.h>
@@ -39,9 +41,16 @@ namespace Camera {
 /*--------------------MemoryManager Class STARTS here-----------------------------*/
 MemoryManager::MemoryManager() {
     mIonFd = -1;
+    mPoolBytes = 0;
+    mPoolMaxBytes = POOL_DEFAULT_MAX_MB * 1024 * 1024;
+    mPoolHits = 0;
+    mPoolMisses = 0;
+    mPoolTrimmed = 0;
 }
 
 MemoryManager::~MemoryManager() {
+    trimPool(0);
+
     if ( mIonFd >= 0 ) {
         ion_close(mIonFd);
         mIonFd = -1;
@@ -58,9 +67,117 @@ status_t MemoryManager::initialize() {
         }
     }
 
+    char value[PROPERTY_VALUE_MAX];
+    if ( property_get("camera.ionpool.maxsize", value, NULL) > 0 ) {
+        mPoolMaxBytes = (size_t)atoi(value) * 1024 * 1024;
+        CAMHAL_LOGD("ION buffer pool limited to %d MB", atoi(value));
+    }
+
     return OK;
 }
 
+status_t MemoryManager::allocateIonBuffer(int size, CameraBuffer &buffer)
+{
+    struct ion_handle *handle;
+    int mmap_fd;
+    size_t stride;
+    unsigned char *data;
+
+#ifdef USE_TI_LIBION
+    int ret = ion_alloc(mIonFd, size, 0, 1 << OMAP_ION_HEAP_SECURE_INPUT,
+            &handle);
+#else
+    int ret = ion_alloc(mIonFd, size, 0, 1 << OMAP_ION_HEAP_SECURE_INPUT, 0,
+            (ion_user_handle_t*)&handle);
+#endif
+    if((ret < 0) || ((int)handle == -ENOMEM)) {
+        ret = ion_alloc_tiler(mIonFd, (size_t)size, 1, TILER_PIXEL_FMT_PAGE,
+        OMAP_ION_HEAP_TILER_MASK, &handle, &stride);
+    }
+
+    if((ret < 0) || ((int)handle == -ENOMEM)) {
+        CAMHAL_LOGEB("FAILED to allocate ion buffer of size=%d. ret=%d(0x%x)", size, ret, ret);
+        return NO_MEMORY;
+    }
+
+    CAMHAL_LOGDB("Before mapping, handle = %p, nSize = %d", handle, size);
+#ifdef USE_TI_LIBION
+    if ((ret = ion_map(mIonFd, handle, size, PROT_READ | PROT_WRITE, MAP_SHARED, 0,
+#else
+    if ((ret = ion_map(mIonFd, (ion_user_handle_t)handle, size, PROT_READ | PROT_WRITE, MAP_SHARED, 0,
+#endif
+                  &data, &mmap_fd)) < 0) {
+        CAMHAL_LOGEB("Userspace mapping of ION buffers returned error %d", ret);
+#ifdef USE_TI_LIBION
+        ion_free(mIonFd, handle);
+#else
+        ion_free(mIonFd, (ion_user_handle_t)handle);
+#endif
+        return NO_MEMORY;
+    }
+
+    buffer.opaque = data;
+    buffer.mapped = data;
+    buffer.ion_handle = handle;
+    buffer.fd = mmap_fd;
+
+    return NO_ERROR;
+}
+
+void MemoryManager::freeIonBuffer(struct ion_handle *handle, int fd, void *data, int size)
+{
+    munmap(data, size);
+    close(fd);
+#ifdef USE_TI_LIBION
+    ion_free(mIonFd, handle);
+#else
+    ion_free(mIonFd, (ion_user_handle_t)handle);
+#endif
+}
+
+bool MemoryManager::takePooledBufferLocked(int size, const char *format, CameraBuffer &buffer)
+{
+    // newest first, it is the most likely to still be cache warm
+    for ( int i = (int)mPool.size() - 1; i >= 0; i-- ) {
+        const PooledBuffer &pooled = mPool.itemAt(i);
+        if ( ( pooled.size == size ) && ( pooled.format == format ) ) {
+            buffer.opaque = pooled.data;
+            buffer.mapped = pooled.data;
+            buffer.ion_handle = pooled.handle;
+            buffer.fd = pooled.fd;
+            mPoolBytes -= pooled.size;
+            mPool.removeAt(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void MemoryManager::trimPoolLocked(nsecs_t maxIdle, size_t maxBytes)
+{
+    const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    // mPool is in release order, the oldest buffers go first
+    while ( !mPool.isEmpty() ) {
+        const PooledBuffer &pooled = mPool.itemAt(0);
+        if ( ( mPoolBytes <= maxBytes ) && ( ( now - pooled.released ) <= maxIdle ) ) {
+            break;
+        }
+
+        freeIonBuffer(pooled.handle, pooled.fd, pooled.data, pooled.size);
+        mPoolBytes -= pooled.size;
+        mPoolTrimmed++;
+        mPool.removeAt(0);
+    }
+}
+
+void MemoryManager::trimPool(nsecs_t maxIdle)
+{
+    android::AutoMutex lock(mPoolLock);
+    trimPoolLocked(maxIdle, mPoolMaxBytes);
+}
+
 CameraBuffer* MemoryManager::allocateBufferList(int width, int height, const char* format, int &size, int numBufs)
 {
     LOG_FUNCTION_NAME;
@@ -84,54 +201,33 @@ CameraBuffer* MemoryManager::allocateBufferList(int width, int height, const cha
 
     //2D Allocations are not supported currently
     if(size != 0) {
-        struct ion_handle *handle;
-        int mmap_fd;
-        size_t stride;
+        const char *pixelFormat = CameraHal::getPixelFormatConstant(format);
+        android::AutoMutex lock(mPoolLock);
+
+        trimPoolLocked(ms2ns(POOL_IDLE_TIMEOUT_MS), mPoolMaxBytes);
 
         ///1D buffers
         for (int i = 0; i < numBufs; i++) {
-            unsigned char *data;
-#ifdef USE_TI_LIBION
-            int ret = ion_alloc(mIonFd, size, 0, 1 << OMAP_ION_HEAP_SECURE_INPUT,
-                    &handle);
-#else
-            int ret = ion_alloc(mIonFd, size, 0, 1 << OMAP_ION_HEAP_SECURE_INPUT, 0,
-                    (ion_user_handle_t*)&handle);
-#endif
-            if((ret < 0) || ((int)handle == -ENOMEM)) {
-                ret = ion_alloc_tiler(mIonFd, (size_t)size, 1, TILER_PIXEL_FMT_PAGE,
-                OMAP_ION_HEAP_TILER_MASK, &handle, &stride);
-            }
-
-            if((ret < 0) || ((int)handle == -ENOMEM)) {
-                CAMHAL_LOGEB("FAILED to allocate ion buffer of size=%d. ret=%d(0x%x)", size, ret, ret);
-                goto error;
-            }
-
-            CAMHAL_LOGDB("Before mapping, handle = %p, nSize = %d", handle, size);
-#ifdef USE_TI_LIBION
-            if ((ret = ion_map(mIonFd, handle, size, PROT_READ | PROT_WRITE, MAP_SHARED, 0,
-#else
-            if ((ret = ion_map(mIonFd, (ion_user_handle_t)handle, size, PROT_READ | PROT_WRITE, MAP_SHARED, 0,
-#endif
-                          &data, &mmap_fd)) < 0) {
-                CAMHAL_LOGEB("Userspace mapping of ION buffers returned error %d", ret);
-#ifdef USE_TI_LIBION
-                ion_free(mIonFd, handle);
-#else
-                ion_free(mIonFd, (ion_user_handle_t)handle);
-#endif
-                goto error;
+            if ( takePooledBufferLocked(size, pixelFormat, buffers[i]) ) {
+                mPoolHits++;
+            } else {
+                mPoolMisses++;
+                if ( NO_ERROR != allocateIonBuffer(size, buffers[i]) ) {
+                    ///Give back what the pool holds and retry once
+                    if ( mPool.isEmpty() ) {
+                        goto error;
+                    }
+                    trimPoolLocked(0, 0);
+                    if ( NO_ERROR != allocateIonBuffer(size, buffers[i]) ) {
+                        goto error;
+                    }
+                }
             }
 
             buffers[i].type = CAMERA_BUFFER_ION;
-            buffers[i].opaque = data;
-            buffers[i].mapped = data;
-            buffers[i].ion_handle = handle;
             buffers[i].ion_fd = mIonFd;
-            buffers[i].fd = mmap_fd;
             buffers[i].size = size;
-            buffers[i].format = CameraHal::getPixelFormatConstant(format);
+            buffers[i].format = pixelFormat;
 
         }
     }
@@ -194,18 +290,25 @@ int MemoryManager::freeBufferList(CameraBuffer *buffers)
         return BAD_VALUE;
         }
 
+    {
+    android::AutoMutex lock(mPoolLock);
+    const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+
     i = 0;
     while(buffers[i].type == CAMERA_BUFFER_ION)
         {
         if(buffers[i].size)
             {
-            munmap(buffers[i].opaque, buffers[i].size);
-            close(buffers[i].fd);
-#ifdef USE_TI_LIBION
-            ion_free(mIonFd, buffers[i].ion_handle);
-#else
-            ion_free(mIonFd, (ion_user_handle_t)buffers[i].ion_handle);
-#endif
+            ///Keep the buffer mapped for the next allocation of this size
+            PooledBuffer pooled;
+            pooled.handle = buffers[i].ion_handle;
+            pooled.fd = buffers[i].fd;
+            pooled.data = (unsigned char *) buffers[i].opaque;
+            pooled.size = buffers[i].size;
+            pooled.format = buffers[i].format;
+            pooled.released = now;
+            mPool.add(pooled);
+            mPoolBytes += pooled.size;
             }
         else
             {
@@ -214,12 +317,27 @@ int MemoryManager::freeBufferList(CameraBuffer *buffers)
         i++;
         }
 
+    trimPoolLocked(ms2ns(POOL_IDLE_TIMEOUT_MS), mPoolMaxBytes);
+    }
+
     delete [] buffers;
 
     LOG_FUNCTION_NAME_EXIT;
     return ret;
 }
 
+void MemoryManager::dump(int fd)
+{
+    android::AutoMutex lock(mPoolLock);
+    char line[256];
+
+    snprintf(line, sizeof(line),
+             "ION buffer pool: %d buffers, %d of %d KB, %u hits, %u misses, %u trimmed\n",
+             (int)mPool.size(), (int)(mPoolBytes / 1024), (int)(mPoolMaxBytes / 1024),
+             mPoolHits, mPoolMisses, mPoolTrimmed);
+    write(fd, line, strlen(line));
+}
+
 status_t MemoryManager::setErrorHandler(ErrorNotifier *errorNotifier)
 {
     status_t ret = NO_ERROR;
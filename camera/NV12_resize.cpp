@@ -16,6 +16,25 @@
 
 #include "NV12_resize.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(ARCH_ARM_HAVE_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#   define NV12_RESIZE_HAVE_NEON
+#   include <arm_neon.h>
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+#   define NV12_RESIZE_HAVE_SSE2
+#   include <emmintrin.h>
+#   if defined(__clang__) || (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9))
+#       define NV12_RESIZE_HAVE_AVX2
+#       include <immintrin.h>
+#   endif
+#endif
+
 #ifdef LOG_TAG
 #undef LOG_TAG
 #endif
@@ -288,3 +307,682 @@ VT_resizeFrame_Video_opt2_lp(
     CAMHAL_LOGV("success");
     return true;
 }
+
+
+/*
+ * Vectorized resize engine.
+ *
+ * bWeights[xf][yf] is the separable bilinear kernel
+ *     {(8-xf)*(8-yf), xf*(8-yf), xf*yf, (8-xf)*yf}
+ * so the 2x2 filter of VT_resizeFrame_Video_opt2_lp can be split into a
+ * vertical pass over contiguous input pixels (which vectorizes well) and a
+ * horizontal pass over the vertically blended row. All intermediate sums are
+ * exact integers below 2^16, so the result is bit-exact with the scalar code.
+ */
+
+/* vertical pass is skipped when it would blend this many times more pixels than needed */
+static const mmUint32 kDenseSpanRatio = 8;
+
+typedef void (*blendRowsFunc)(const mmUchar* row1, const mmUchar* row2,
+                              mmUint16* dst, mmInt32 count,
+                              mmUint16 w1, mmUint16 w2);
+
+static void blendRows_scalar(const mmUchar* row1, const mmUchar* row2,
+                             mmUint16* dst, mmInt32 count,
+                             mmUint16 w1, mmUint16 w2) {
+    for ( mmInt32 i = 0; i < count; i++ ) {
+        dst[i] = (mmUint16)(w1 * row1[i] + w2 * row2[i]);
+    }
+}
+
+#ifdef NV12_RESIZE_HAVE_NEON
+static void blendRows_neon(const mmUchar* row1, const mmUchar* row2,
+                           mmUint16* dst, mmInt32 count,
+                           mmUint16 w1, mmUint16 w2) {
+    const uint8x8_t vw1 = vdup_n_u8((mmUint8)w1);
+    const uint8x8_t vw2 = vdup_n_u8((mmUint8)w2);
+    mmInt32 i = 0;
+
+    for ( ; i + 16 <= count; i += 16 ) {
+        const uint8x16_t a = vld1q_u8(row1 + i);
+        const uint8x16_t b = vld1q_u8(row2 + i);
+        uint16x8_t lo = vmull_u8(vget_low_u8(a), vw1);
+        uint16x8_t hi = vmull_u8(vget_high_u8(a), vw1);
+        lo = vmlal_u8(lo, vget_low_u8(b), vw2);
+        hi = vmlal_u8(hi, vget_high_u8(b), vw2);
+        vst1q_u16(dst + i, lo);
+        vst1q_u16(dst + i + 8, hi);
+    }
+
+    blendRows_scalar(row1 + i, row2 + i, dst + i, count - i, w1, w2);
+}
+#endif
+
+#ifdef NV12_RESIZE_HAVE_SSE2
+__attribute__((target("sse2")))
+static void blendRows_sse2(const mmUchar* row1, const mmUchar* row2,
+                           mmUint16* dst, mmInt32 count,
+                           mmUint16 w1, mmUint16 w2) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vw1 = _mm_set1_epi16(w1);
+    const __m128i vw2 = _mm_set1_epi16(w2);
+    mmInt32 i = 0;
+
+    for ( ; i + 16 <= count; i += 16 ) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)(row1 + i));
+        const __m128i b = _mm_loadu_si128((const __m128i*)(row2 + i));
+        const __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), vw1),
+                                         _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), vw2));
+        const __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), vw1),
+                                         _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), vw2));
+        _mm_storeu_si128((__m128i*)(dst + i), lo);
+        _mm_storeu_si128((__m128i*)(dst + i + 8), hi);
+    }
+
+    blendRows_scalar(row1 + i, row2 + i, dst + i, count - i, w1, w2);
+}
+#endif
+
+#ifdef NV12_RESIZE_HAVE_AVX2
+__attribute__((target("avx2")))
+static void blendRows_avx2(const mmUchar* row1, const mmUchar* row2,
+                           mmUint16* dst, mmInt32 count,
+                           mmUint16 w1, mmUint16 w2) {
+    const __m256i vw1 = _mm256_set1_epi16(w1);
+    const __m256i vw2 = _mm256_set1_epi16(w2);
+    mmInt32 i = 0;
+
+    for ( ; i + 32 <= count; i += 32 ) {
+        const __m256i a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row1 + i)));
+        const __m256i a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row1 + i + 16)));
+        const __m256i b0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row2 + i)));
+        const __m256i b1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row2 + i + 16)));
+        _mm256_storeu_si256((__m256i*)(dst + i),
+                            _mm256_add_epi16(_mm256_mullo_epi16(a0, vw1), _mm256_mullo_epi16(b0, vw2)));
+        _mm256_storeu_si256((__m256i*)(dst + i + 16),
+                            _mm256_add_epi16(_mm256_mullo_epi16(a1, vw1), _mm256_mullo_epi16(b1, vw2)));
+    }
+
+    blendRows_scalar(row1 + i, row2 + i, dst + i, count - i, w1, w2);
+}
+#endif
+
+static mmBool isEngineSupported(enumResizeEngine engine) {
+    switch ( engine ) {
+        case IC_RESIZE_ENGINE_SCALAR:
+            return true;
+#ifdef NV12_RESIZE_HAVE_NEON
+        case IC_RESIZE_ENGINE_NEON:
+            // the HAL is built for NEON capable cores only when this is set
+            return true;
+#endif
+#ifdef NV12_RESIZE_HAVE_SSE2
+        case IC_RESIZE_ENGINE_SSE2:
+            return __builtin_cpu_supports("sse2") ? true : false;
+#endif
+#ifdef NV12_RESIZE_HAVE_AVX2
+        case IC_RESIZE_ENGINE_AVX2:
+            return __builtin_cpu_supports("avx2") ? true : false;
+#endif
+        default:
+            return false;
+    }
+}
+
+static blendRowsFunc getBlendRowsFunc(enumResizeEngine engine) {
+    switch ( engine ) {
+#ifdef NV12_RESIZE_HAVE_NEON
+        case IC_RESIZE_ENGINE_NEON:
+            return blendRows_neon;
+#endif
+#ifdef NV12_RESIZE_HAVE_SSE2
+        case IC_RESIZE_ENGINE_SSE2:
+            return blendRows_sse2;
+#endif
+#ifdef NV12_RESIZE_HAVE_AVX2
+        case IC_RESIZE_ENGINE_AVX2:
+            return blendRows_avx2;
+#endif
+        default:
+            return blendRows_scalar;
+    }
+}
+
+enumResizeEngine VT_resizeFrame_GetEngine() {
+    // picked once, all threads compute the same value so the race is benign
+    static volatile enumResizeEngine sEngine = IC_RESIZE_ENGINE_AUTO;
+
+    if ( sEngine == IC_RESIZE_ENGINE_AUTO ) {
+        static const enumResizeEngine kPreference[] = {
+            IC_RESIZE_ENGINE_AVX2,
+            IC_RESIZE_ENGINE_SSE2,
+            IC_RESIZE_ENGINE_NEON,
+            IC_RESIZE_ENGINE_SCALAR
+        };
+        enumResizeEngine engine = IC_RESIZE_ENGINE_SCALAR;
+
+        for ( unsigned int i = 0; i < sizeof(kPreference)/sizeof(kPreference[0]); i++ ) {
+            if ( isEngineSupported(kPreference[i]) ) {
+                engine = kPreference[i];
+                break;
+            }
+        }
+
+        CAMHAL_LOGDB("NV12 resize engine: %s", VT_resizeFrame_GetEngineName(engine));
+        sEngine = engine;
+    }
+
+    return sEngine;
+}
+
+mmBool VT_resizeFrame_IsEngineSupported(enumResizeEngine engine) {
+    if ( engine == IC_RESIZE_ENGINE_AUTO ) {
+        return true;
+    }
+
+    return isEngineSupported(engine);
+}
+
+const char* VT_resizeFrame_GetEngineName(enumResizeEngine engine) {
+    switch ( engine ) {
+        case IC_RESIZE_ENGINE_AUTO:   return "auto";
+        case IC_RESIZE_ENGINE_SCALAR: return "scalar";
+        case IC_RESIZE_ENGINE_NEON:   return "neon";
+        case IC_RESIZE_ENGINE_SSE2:   return "sse2";
+        case IC_RESIZE_ENGINE_AVX2:   return "avx2";
+        default:                      return "unknown";
+    }
+}
+
+/* state shared by all bands of one resize call */
+typedef struct {
+    blendRowsFunc blendRows;
+    mmUint32 resizeFactorY;
+    mmUint32 codx, cody;
+    mmUint32 inStride, outStride;
+    mmUchar* inImgPtrY;
+    mmUchar* inImgPtrUV;
+    mmUchar* outPtrY;
+    mmUchar* outPtrUV;
+    mmUint16* xTab;
+    mmUint8* xfTab;
+    mmUint32 spanY, spanUV;
+    mmBool sparse;
+} ResizeContext;
+
+static void resizeRelease(ResizeContext* ctx) {
+    free(ctx->xTab);
+    free(ctx->xfTab);
+    ctx->xTab = NULL;
+    ctx->xfTab = NULL;
+}
+
+static mmBool resizePrepare(ResizeContext* ctx,
+                            structConvImage* i_img_ptr,
+                            structConvImage* o_img_ptr,
+                            IC_rect_type* cropout,
+                            enumResizeEngine engine) {
+    mmUint32 resizeFactorX;
+    mmUint32 cox, coy;
+    mmUint32 idx, idy;
+    mmUint32 col;
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    if ( !i_img_ptr || !i_img_ptr->imgPtr || !o_img_ptr || !o_img_ptr->imgPtr ) {
+        CAMHAL_LOGE("Image Point NULL");
+        return false;
+    }
+
+    if ( engine == IC_RESIZE_ENGINE_AUTO ) {
+        engine = VT_resizeFrame_GetEngine();
+    } else if ( !isEngineSupported(engine) ) {
+        CAMHAL_LOGE("Resize engine %s not supported", VT_resizeFrame_GetEngineName(engine));
+        return false;
+    }
+    ctx->blendRows = getBlendRowsFunc(engine);
+
+    if ( !cropout ) {
+        cox = 0;
+        coy = 0;
+        ctx->codx = o_img_ptr->uWidth;
+        ctx->cody = o_img_ptr->uHeight;
+    } else {
+        cox = cropout->x;
+        coy = cropout->y;
+        ctx->codx = cropout->uWidth;
+        ctx->cody = cropout->uHeight;
+    }
+    idx = (mmUint16)i_img_ptr->uWidth;
+    idy = (mmUint16)i_img_ptr->uHeight;
+
+    /* make sure valid input size */
+    if ( idx < 1 || idy < 1 || i_img_ptr->uStride < 1 ) {
+        CAMHAL_LOGE("idx or idy less then 1 idx = %d idy = %d stride = %d", idx, idy, i_img_ptr->uStride);
+        return false;
+    }
+
+    if ( ctx->codx < 1 || ctx->cody < 1 ) {
+        CAMHAL_LOGE("Invalid output size %d x %d", ctx->codx, ctx->cody);
+        return false;
+    }
+
+    if( i_img_ptr->eFormat != IC_FORMAT_YCbCr420_lp ||
+            o_img_ptr->eFormat != IC_FORMAT_YCbCr420_lp ) {
+        CAMHAL_LOGE("eFormat not supported");
+        return false;
+    }
+
+    resizeFactorX = ((idx-1)<<9) / ctx->codx;
+    ctx->resizeFactorY = ((idy-1)<<9) / ctx->cody;
+
+    ctx->inStride = i_img_ptr->uStride;
+    ctx->outStride = o_img_ptr->uStride;
+    ctx->inImgPtrY = (mmUchar *) i_img_ptr->imgPtr + i_img_ptr->uOffset;
+    ctx->inImgPtrUV = (mmUchar *) i_img_ptr->clrPtr + i_img_ptr->uOffset/2;
+    ctx->outPtrY = (mmUchar*)o_img_ptr->imgPtr + cox + coy*o_img_ptr->uWidth;
+    ctx->outPtrUV = (mmUchar*)o_img_ptr->clrPtr + cox + coy*o_img_ptr->uWidth;
+
+    /* per column source index and horizontal weight, shared by Y and UV */
+    ctx->xTab = (mmUint16 *) malloc(ctx->codx * sizeof(mmUint16));
+    ctx->xfTab = (mmUint8 *) malloc(ctx->codx * sizeof(mmUint8));
+    if ( !ctx->xTab || !ctx->xfTab ) {
+        CAMHAL_LOGE("Unable to allocate resize tables");
+        resizeRelease(ctx);
+        return false;
+    }
+
+    for ( col = 0; col < ctx->codx; col++ ) {
+        ctx->xTab[col]  = (mmUint16) ((col*resizeFactorX) >> 9);
+        ctx->xfTab[col] = (mmUint8)  (((col*resizeFactorX) >> 6) & 0x7);
+    }
+
+    /* number of input pixels touched per row, (x+1) of the last column */
+    ctx->spanY = ctx->xTab[ctx->codx - 1] + 2;
+    ctx->spanUV = (ctx->codx >> 1) ? (mmUint32)(ctx->xTab[(ctx->codx >> 1) - 1] + 2) * 2 : 0;
+
+    /* strong downscales touch few input pixels, blend them directly */
+    ctx->sparse = (ctx->spanY > kDenseSpanRatio * ctx->codx);
+
+    return true;
+}
+
+/* size in elements of the scratch row needed by resizeLumaBand/resizeChromaBand */
+static mmUint32 resizeScratchSize(const ResizeContext* ctx) {
+    if ( ctx->sparse ) {
+        return 0;
+    }
+
+    return ((ctx->spanY > ctx->spanUV) ? ctx->spanY : ctx->spanUV) + 1;
+}
+
+static void resizeLumaBand(const ResizeContext* ctx, mmUint32 rowStart, mmUint32 rowEnd, mmUint16* vRow) {
+    const mmUint32 codx = ctx->codx;
+    const mmUint16* xTab = ctx->xTab;
+    const mmUint8* xfTab = ctx->xfTab;
+
+    for ( mmUint32 row = rowStart; row < rowEnd; row++ ) {
+        const mmUint32 y  = (mmUint16) ((row*ctx->resizeFactorY) >> 9);
+        const mmUint16 yf = (mmUint16) (((row*ctx->resizeFactorY) >> 6) & 0x7);
+        const mmUchar *pu8Yrow1 = ctx->inImgPtrY + y * ctx->inStride;
+        const mmUchar *pu8Yrow2 = pu8Yrow1 + ctx->inStride;
+        mmUchar *dst = ctx->outPtrY + row * ctx->outStride;
+
+        if ( ctx->sparse ) {
+            for ( mmUint32 col = 0; col < codx; col++ ) {
+                const mmUint32 x = xTab[col];
+                const mmUint32 xf = xfTab[col];
+                const mmUint32 v0 = (8 - yf) * pu8Yrow1[x] + yf * pu8Yrow2[x];
+                const mmUint32 v1 = (8 - yf) * pu8Yrow1[x + 1] + yf * pu8Yrow2[x + 1];
+                dst[col] = (mmUchar) (((8 - xf) * v0 + xf * v1) >> 6);
+            }
+            continue;
+        }
+
+        ctx->blendRows(pu8Yrow1, pu8Yrow2, vRow, ctx->spanY, 8 - yf, yf);
+
+        for ( mmUint32 col = 0; col < codx; col++ ) {
+            const mmUint16 *v = vRow + xTab[col];
+            const mmUint32 xf = xfTab[col];
+            dst[col] = (mmUchar) (((8 - xf) * v[0] + xf * v[1]) >> 6);
+        }
+    }
+}
+
+static void resizeChromaBand(const ResizeContext* ctx, mmUint32 rowStart, mmUint32 rowEnd, mmUint16* vRow) {
+    const mmUint32 codxC = ctx->codx >> 1;
+    const mmUint16* xTab = ctx->xTab;
+    const mmUint8* xfTab = ctx->xfTab;
+
+    for ( mmUint32 row = rowStart; row < rowEnd; row++ ) {
+        const mmUint32 y  = (mmUint16) ((row*ctx->resizeFactorY) >> 9);
+        const mmUint16 yf = (mmUint16) (((row*ctx->resizeFactorY) >> 6) & 0x7);
+        const mmUchar *pu8UVrow1 = ctx->inImgPtrUV + y * ctx->inStride;
+        const mmUchar *pu8UVrow2 = pu8UVrow1 + ctx->inStride;
+        mmUchar *dst = ctx->outPtrUV + row * ctx->outStride;
+
+        if ( ctx->sparse ) {
+            for ( mmUint32 col = 0; col < codxC; col++ ) {
+                const mmUint32 x = xTab[col] * 2;
+                const mmUint32 xf = xfTab[col];
+                const mmUint32 cb0 = (8 - yf) * pu8UVrow1[x]     + yf * pu8UVrow2[x];
+                const mmUint32 cr0 = (8 - yf) * pu8UVrow1[x + 1] + yf * pu8UVrow2[x + 1];
+                const mmUint32 cb1 = (8 - yf) * pu8UVrow1[x + 2] + yf * pu8UVrow2[x + 2];
+                const mmUint32 cr1 = (8 - yf) * pu8UVrow1[x + 3] + yf * pu8UVrow2[x + 3];
+                dst[0] = (mmUchar) (((8 - xf) * cb0 + xf * cb1) >> 6);
+                dst[1] = (mmUchar) (((8 - xf) * cr0 + xf * cr1) >> 6);
+                dst += 2;
+            }
+            continue;
+        }
+
+        ctx->blendRows(pu8UVrow1, pu8UVrow2, vRow, ctx->spanUV, 8 - yf, yf);
+
+        for ( mmUint32 col = 0; col < codxC; col++ ) {
+            const mmUint16 *v = vRow + xTab[col] * 2;
+            const mmUint32 xf = xfTab[col];
+            dst[0] = (mmUchar) (((8 - xf) * v[0] + xf * v[2]) >> 6);
+            dst[1] = (mmUchar) (((8 - xf) * v[1] + xf * v[3]) >> 6);
+            dst += 2;
+        }
+    }
+}
+
+mmBool
+VT_resizeFrame_Video_simd_lp(
+        structConvImage* i_img_ptr,      /* Points to the input image            */
+        structConvImage* o_img_ptr,      /* Points to the output image           */
+        IC_rect_type*  cropout,          /* how much to resize to in final image */
+        mmUint16 dummy                   /* Transparent pixel value              */
+        ) {
+    CAMHAL_UNUSED(dummy);
+    return VT_resizeFrame_Video_engine_lp(i_img_ptr, o_img_ptr, cropout, IC_RESIZE_ENGINE_AUTO);
+}
+
+mmBool
+VT_resizeFrame_Video_engine_lp(
+        structConvImage* i_img_ptr,      /* Points to the input image            */
+        structConvImage* o_img_ptr,      /* Points to the output image           */
+        IC_rect_type*  cropout,          /* how much to resize to in final image */
+        enumResizeEngine engine          /* Engine to run                        */
+        ) {
+    LOG_FUNCTION_NAME;
+
+    ResizeContext ctx;
+    mmUint16* vRow = NULL;
+
+    if ( !resizePrepare(&ctx, i_img_ptr, o_img_ptr, cropout, engine) ) {
+        return false;
+    }
+
+    if ( resizeScratchSize(&ctx) ) {
+        vRow = (mmUint16 *) malloc(resizeScratchSize(&ctx) * sizeof(mmUint16));
+        if ( !vRow ) {
+            CAMHAL_LOGE("Unable to allocate resize scratch row");
+            resizeRelease(&ctx);
+            return false;
+        }
+    }
+
+    resizeLumaBand(&ctx, 0, ctx.cody, vRow);
+    resizeChromaBand(&ctx, 0, ctx.cody >> 1, vRow);
+
+    free(vRow);
+    resizeRelease(&ctx);
+
+    CAMHAL_LOGV("success");
+    return true;
+}
+
+
+/*
+ * Band-parallel execution.
+ *
+ * Output rows of both planes are split into bands which are queued on a
+ * small pool of persistent workers. The calling thread takes part in the
+ * work, so a budget of N threads wakes at most N-1 workers. Luma and chroma
+ * bands are interleaved in the queue so both planes progress concurrently.
+ * The pool grows on demand and is never torn down.
+ */
+
+static const mmInt32 kMaxResizeThreads = 8;
+
+/* bands smaller than this are not worth a worker wakeup */
+static const mmUint32 kMinBandRows = 16;
+
+typedef struct {
+    mmInt32 pending;
+} ResizeJob;
+
+typedef struct ResizeBand {
+    const ResizeContext* ctx;
+    ResizeJob* job;
+    mmBool chroma;
+    mmUint32 rowStart;
+    mmUint32 rowEnd;
+    mmUint16* vRow;
+    struct ResizeBand* next;
+} ResizeBand;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t workCond;
+    pthread_cond_t doneCond;
+    ResizeBand* head;
+    ResizeBand* tail;
+    mmInt32 workers;
+} ResizePool;
+
+static ResizePool sResizePool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    NULL,
+    NULL,
+    0
+};
+
+static void runBand(const ResizeBand* band) {
+    if ( band->chroma ) {
+        resizeChromaBand(band->ctx, band->rowStart, band->rowEnd, band->vRow);
+    } else {
+        resizeLumaBand(band->ctx, band->rowStart, band->rowEnd, band->vRow);
+    }
+}
+
+static ResizeBand* popBandLocked(ResizePool* pool) {
+    ResizeBand* band = pool->head;
+
+    if ( band ) {
+        pool->head = band->next;
+        if ( !pool->head ) {
+            pool->tail = NULL;
+        }
+        band->next = NULL;
+    }
+
+    return band;
+}
+
+static void finishBandLocked(ResizePool* pool, ResizeBand* band) {
+    if ( --band->job->pending == 0 ) {
+        pthread_cond_broadcast(&pool->doneCond);
+    }
+}
+
+static void* resizeWorker(void* arg) {
+    ResizePool* pool = (ResizePool*) arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while ( true ) {
+        ResizeBand* band = popBandLocked(pool);
+        if ( !band ) {
+            pthread_cond_wait(&pool->workCond, &pool->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+        runBand(band);
+        pthread_mutex_lock(&pool->lock);
+
+        finishBandLocked(pool, band);
+    }
+
+    return NULL;
+}
+
+/* makes sure at least count workers exist, returns number of workers */
+static mmInt32 growPoolLocked(ResizePool* pool, mmInt32 count) {
+    while ( pool->workers < count ) {
+        pthread_attr_t attr;
+        pthread_t thread;
+        int ret;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        ret = pthread_create(&thread, &attr, resizeWorker, pool);
+        pthread_attr_destroy(&attr);
+
+        if ( ret != 0 ) {
+            CAMHAL_LOGE("Unable to create resize worker (%d)", ret);
+            break;
+        }
+
+        pool->workers++;
+    }
+
+    return pool->workers;
+}
+
+mmInt32 VT_resizeFrame_GetMaxThreads() {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ( cpus < 1 ) {
+        return 1;
+    }
+
+    return (cpus > kMaxResizeThreads) ? kMaxResizeThreads : (mmInt32) cpus;
+}
+
+mmBool
+VT_resizeFrame_Video_parallel_lp(
+        structConvImage* i_img_ptr,      /* Points to the input image            */
+        structConvImage* o_img_ptr,      /* Points to the output image           */
+        IC_rect_type*  cropout,          /* how much to resize to in final image */
+        mmInt32 numThreads               /* Thread budget, including caller      */
+        ) {
+    LOG_FUNCTION_NAME;
+
+    ResizePool* pool = &sResizePool;
+    ResizeContext ctx;
+    ResizeJob job;
+    ResizeBand* bands = NULL;
+    ResizeBand* head;
+    ResizeBand* tail;
+    mmUint16* scratch = NULL;
+    mmUint32 lumaBands, chromaBands, scratchSize;
+    mmUint32 i;
+
+    if ( (numThreads == IC_RESIZE_THREADS_AUTO) || (numThreads > kMaxResizeThreads) ) {
+        numThreads = VT_resizeFrame_GetMaxThreads();
+    }
+
+    if ( numThreads <= 1 ) {
+        return VT_resizeFrame_Video_engine_lp(i_img_ptr, o_img_ptr, cropout, IC_RESIZE_ENGINE_AUTO);
+    }
+
+    if ( !resizePrepare(&ctx, i_img_ptr, o_img_ptr, cropout, IC_RESIZE_ENGINE_AUTO) ) {
+        return false;
+    }
+
+    lumaBands = ctx.cody / kMinBandRows;
+    lumaBands = (lumaBands < 1) ? 1 : (lumaBands > (mmUint32) numThreads) ? numThreads : lumaBands;
+    chromaBands = (ctx.cody >> 1) / kMinBandRows;
+    chromaBands = (chromaBands < 1) ? 1 : (chromaBands > (mmUint32) (numThreads + 1) / 2) ? (numThreads + 1) / 2 : chromaBands;
+
+    scratchSize = resizeScratchSize(&ctx);
+    bands = (ResizeBand*) malloc((lumaBands + chromaBands) * sizeof(ResizeBand));
+    if ( scratchSize ) {
+        scratch = (mmUint16*) malloc((lumaBands + chromaBands) * scratchSize * sizeof(mmUint16));
+    }
+
+    if ( !bands || (scratchSize && !scratch) ) {
+        CAMHAL_LOGE("Unable to allocate resize bands, falling back to single thread");
+        free(bands);
+        free(scratch);
+        resizeRelease(&ctx);
+        return VT_resizeFrame_Video_engine_lp(i_img_ptr, o_img_ptr, cropout, IC_RESIZE_ENGINE_AUTO);
+    }
+
+    for ( i = 0; i < lumaBands + chromaBands; i++ ) {
+        const mmBool chroma = (i >= lumaBands);
+        const mmUint32 index = chroma ? i - lumaBands : i;
+        const mmUint32 count = chroma ? chromaBands : lumaBands;
+        const mmUint32 rows = chroma ? (ctx.cody >> 1) : ctx.cody;
+
+        bands[i].ctx = &ctx;
+        bands[i].job = &job;
+        bands[i].chroma = chroma;
+        bands[i].rowStart = rows * index / count;
+        bands[i].rowEnd = rows * (index + 1) / count;
+        bands[i].vRow = scratch ? scratch + i * scratchSize : NULL;
+        bands[i].next = NULL;
+    }
+
+    // interleave luma and chroma bands so both planes are worked on at once
+    for ( i = 0, head = NULL, tail = NULL; i < lumaBands || i < chromaBands; i++ ) {
+        ResizeBand* pair[2] = {
+            (i < lumaBands) ? &bands[i] : NULL,
+            (i < chromaBands) ? &bands[lumaBands + i] : NULL
+        };
+
+        for ( int j = 0; j < 2; j++ ) {
+            if ( !pair[j] ) {
+                continue;
+            }
+            if ( tail ) {
+                tail->next = pair[j];
+            } else {
+                head = pair[j];
+            }
+            tail = pair[j];
+        }
+    }
+    job.pending = lumaBands + chromaBands;
+
+    pthread_mutex_lock(&pool->lock);
+
+    growPoolLocked(pool, numThreads - 1);
+
+    if ( pool->tail ) {
+        pool->tail->next = head;
+    } else {
+        pool->head = head;
+    }
+    pool->tail = tail;
+    pthread_cond_broadcast(&pool->workCond);
+
+    // help out until our own bands are done
+    while ( job.pending > 0 ) {
+        ResizeBand* band = popBandLocked(pool);
+        if ( !band ) {
+            pthread_cond_wait(&pool->doneCond, &pool->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+        runBand(band);
+        pthread_mutex_lock(&pool->lock);
+
+        finishBandLocked(pool, band);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    free(bands);
+    free(scratch);
+    resizeRelease(&ctx);
+
+    CAMHAL_LOGV("success");
+    return true;
+}
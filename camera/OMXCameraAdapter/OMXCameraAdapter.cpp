@@ -263,6 +263,9 @@ status_t OMXCameraAdapter::initialize(CameraProperties::Properties* caps)
     mEXIFData.mGPSData.mTimeStampValid = false;
     mEXIFData.mModelValid = false;
     mEXIFData.mMakeValid = false;
+    mEXIFData.mFocalNum = 0;
+    mEXIFData.mFocalDen = 0;
+    mEXIFTemplateValid = false;
 
     mCapturedFrames = 0;
     mBurstFramesAccum = 0;
@@ -944,6 +947,28 @@ void OMXCameraAdapter::getParameters(android::CameraParameters& params)
     LOG_FUNCTION_NAME_EXIT;
 }
 
+// Parameters CameraHal keeps for itself or for other components, the
+// adapter doesn't read them
+bool OMXCameraAdapter::isParameterUsed(const char *key) const
+{
+    static const char *unusedKeys[] = {
+        TICameraParameters::KEY_SHUTTER_ENABLE,
+        TICameraParameters::KEY_VIDEO_ENCODER_HANDLE,
+        TICameraParameters::KEY_VIDEO_ENCODER_SLICE_HEIGHT,
+        TICameraParameters::KEY_VTC_HINT,
+        // passed on as TICameraParameters::KEY_PREVIEW_FRAME_RATE_RANGE
+        android::CameraParameters::KEY_PREVIEW_FPS_RANGE,
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(unusedKeys); i++) {
+        if (strcmp(key, unusedKeys[i]) == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 status_t OMXCameraAdapter::setupTunnel(uint32_t SliceHeight, uint32_t EncoderHandle, uint32_t width, uint32_t height) {
     LOG_FUNCTION_NAME;
 
@@ -1881,7 +1906,7 @@ status_t OMXCameraAdapter::switchToLoaded(bool bPortEnableRequired) {
 
             {
                 android::AutoMutex lock(mPreviewDataBufferLock);
-                mPreviewDataBuffersAvailable.clear();
+                clearFrameRefCounts(CameraFrame::FRAME_DATA_SYNC);
             }
 
         }
@@ -1924,7 +1949,7 @@ EXIT:
     {
         android::AutoMutex lock(mPreviewBufferLock);
         ///Clear all the available preview buffers
-        mPreviewBuffersAvailable.clear();
+        clearFrameRefCounts(CameraFrame::PREVIEW_FRAME_SYNC);
     }
     performCleanupAfterError();
     LOG_FUNCTION_NAME_EXIT;
@@ -2473,7 +2498,7 @@ EXIT:
     {
         android::AutoMutex lock(mPreviewBufferLock);
         ///Clear all the available preview buffers
-        mPreviewBuffersAvailable.clear();
+        clearFrameRefCounts(CameraFrame::PREVIEW_FRAME_SYNC);
     }
     performCleanupAfterError();
     LOG_FUNCTION_NAME_EXIT;
@@ -2507,7 +2532,7 @@ status_t OMXCameraAdapter::stopPreview() {
     {
         android::AutoMutex lock(mPreviewBufferLock);
         ///Clear all the available preview buffers
-        mPreviewBuffersAvailable.clear();
+        clearFrameRefCounts(CameraFrame::PREVIEW_FRAME_SYNC);
     }
 
     switchToLoaded();
@@ -3533,7 +3558,7 @@ OMX_ERRORTYPE OMXCameraAdapter::OMXCameraAdapterFillBufferDone(OMX_IN OMX_HANDLE
         if (mRecording)
             {
             mask |= (unsigned int)CameraFrame::VIDEO_FRAME_SYNC;
-            mFramesWithEncoder++;
+            android_atomic_inc(&mFramesWithEncoder);
             }
 
         //CAMHAL_LOGV("FBD pBuffer = 0x%x", pBuffHeader->pBuffer);
@@ -3550,7 +3575,7 @@ OMX_ERRORTYPE OMXCameraAdapter::OMXCameraAdapterFillBufferDone(OMX_IN OMX_HANDLE
             }
 
         stat = sendCallBacks(cameraFrame, pBuffHeader, mask, pPortParam);
-        mFramesWithDisplay++;
+        android_atomic_inc(&mFramesWithDisplay);
 
         mFramesWithDucati--;
 
@@ -3870,7 +3895,7 @@ status_t OMXCameraAdapter::sendCallBacks(CameraFrame frame, OMX_IN OMX_BUFFERHEA
       return -EINVAL;
     }
 
-  android::AutoMutex lock(mSubscriberLock);
+  android::sp<Subscribers> subscribers = getSubscribers();
 
   //frame.mFrameType = typeOfFrame;
   frame.mFrameMask = mask;
@@ -3883,6 +3908,9 @@ status_t OMXCameraAdapter::sendCallBacks(CameraFrame frame, OMX_IN OMX_BUFFERHEA
   frame.mYuv[0] = NULL;
   frame.mYuv[1] = NULL;
 
+  {
+  android::AutoMutex lock(mTimeSourceLock);
+
   if ( onlyOnce && mRecording )
     {
       mTimeSourceDelta = (pBuffHeader->nTimeStamp * 1000) - systemTime(SYSTEM_TIME_MONOTONIC);
@@ -3890,13 +3918,14 @@ status_t OMXCameraAdapter::sendCallBacks(CameraFrame frame, OMX_IN OMX_BUFFERHEA
     }
 
   frame.mTimestamp = (pBuffHeader->nTimeStamp * 1000) - mTimeSourceDelta;
+  }
 
-  ret = setInitFrameRefCount(frame.mBuffer, mask);
+  ret = setInitFrameRefCount(frame.mBuffer, mask, subscribers);
 
   if (ret != NO_ERROR) {
      CAMHAL_LOGDB("Error in setInitFrameRefCount %d", ret);
   } else {
-      ret = sendFrameToSubscribers(&frame);
+      ret = sendFrameToSubscribers(&frame, subscribers);
   }
 
   CAMHAL_LOGVB("B 0x%x T %llu", frame.mBuffer, pBuffHeader->nTimeStamp);
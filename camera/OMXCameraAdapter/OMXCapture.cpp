@@ -1912,15 +1912,15 @@ status_t OMXCameraAdapter::UseBuffersCapture(CameraBuffer * bufArr, int num)
         }
 #endif
 
-        mCaptureBuffersAvailable.clear();
+        clearFrameRefCounts(CameraFrame::IMAGE_FRAME);
         for (unsigned int i = 0; i < imgCaptureData->mMaxQueueable; i++ ) {
-            mCaptureBuffersAvailable.add(&mCaptureBuffers[i], 0);
+            setFrameRefCountByType(&mCaptureBuffers[i], CameraFrame::IMAGE_FRAME, 0);
         }
 
         // initial ref count for undeqeueued buffers is 1 since buffer provider
         // is still holding on to it
         for (unsigned int i = imgCaptureData->mMaxQueueable; i < imgCaptureData->mNumBufs; i++ ) {
-            mCaptureBuffersAvailable.add(&mCaptureBuffers[i], 1);
+            setFrameRefCountByType(&mCaptureBuffers[i], CameraFrame::IMAGE_FRAME, 1);
         }
     }
 
@@ -187,37 +187,62 @@ status_t OMXCameraAdapter::setParametersEXIF(const android::CameraParameters &pa
         mEXIFData.mGPSData.mVersionIdValid = false;
         }
 
+    // make, model and focal length are cached in the EXIF template,
+    // rebuild it only when one of them changes
     if( ( valstr = params.get(TICameraParameters::KEY_EXIF_MODEL ) ) != NULL )
         {
         CAMHAL_LOGVB("EXIF Model: %s", valstr);
+        if ( !mEXIFData.mModelValid ||
+             strncmp(mEXIFData.mModel, valstr, EXIF_MODEL_SIZE - 1) )
+            {
+            mEXIFTemplateValid = false;
+            }
         strncpy(mEXIFData.mModel, valstr, EXIF_MODEL_SIZE - 1);
         mEXIFData.mModelValid= true;
         }
     else
         {
+        if ( mEXIFData.mModelValid )
+            {
+            mEXIFTemplateValid = false;
+            }
         mEXIFData.mModelValid= false;
         }
 
     if( ( valstr = params.get(TICameraParameters::KEY_EXIF_MAKE ) ) != NULL )
         {
         CAMHAL_LOGVB("EXIF Make: %s", valstr);
+        if ( !mEXIFData.mMakeValid ||
+             strncmp(mEXIFData.mMake, valstr, EXIF_MAKE_SIZE - 1) )
+            {
+            mEXIFTemplateValid = false;
+            }
         strncpy(mEXIFData.mMake, valstr, EXIF_MAKE_SIZE - 1);
         mEXIFData.mMakeValid = true;
         }
     else
         {
+        if ( mEXIFData.mMakeValid )
+            {
+            mEXIFTemplateValid = false;
+            }
         mEXIFData.mMakeValid= false;
         }
 
 
+    {
+    unsigned int focalNum = 0, focalDen = 0;
+
     if( ( valstr = params.get(android::CameraParameters::KEY_FOCAL_LENGTH) ) != NULL ) {
         CAMHAL_LOGVB("EXIF Focal length: %s", valstr);
-        ExifElementsTable::stringToRational(valstr,
-                                            &mEXIFData.mFocalNum,
-                                            &mEXIFData.mFocalDen);
-    } else {
-        mEXIFData.mFocalNum = 0;
-        mEXIFData.mFocalDen = 0;
+        ExifElementsTable::stringToRational(valstr, &focalNum, &focalDen);
+    }
+
+    if ( ( focalNum != mEXIFData.mFocalNum ) || ( focalDen != mEXIFData.mFocalDen ) ) {
+        mEXIFData.mFocalNum = focalNum;
+        mEXIFData.mFocalDen = focalDen;
+        mEXIFTemplateValid = false;
+    }
     }
 
 
@@ -528,20 +553,12 @@ status_t OMXCameraAdapter::setupEXIF()
     return ret;
 }
 
-status_t OMXCameraAdapter::setupEXIF_libjpeg(ExifElementsTable* exifTable,
-                                             OMX_TI_ANCILLARYDATATYPE* pAncillaryData,
-                                             OMX_TI_WHITEBALANCERESULTTYPE* pWhiteBalanceData)
+status_t OMXCameraAdapter::setupEXIFTemplate_libjpeg(ExifElementsTable* exifTable)
 {
     status_t ret = NO_ERROR;
-    OMX_ERRORTYPE eError = OMX_ErrorNone;
-    struct timeval sTv;
-    struct tm *pTime;
-    OMXCameraPortParameters * capData = NULL;
 
     LOG_FUNCTION_NAME;
 
-    capData = &mCameraAdapterParameters.mCameraPortParams[mCameraAdapterParameters.mImagePortIndex];
-
     if ((NO_ERROR == ret) && (mEXIFData.mModelValid)) {
         ret = exifTable->insertElement(TAG_MODEL, mEXIFData.mModel);
     }
@@ -563,6 +580,62 @@ status_t OMXCameraAdapter::setupEXIF_libjpeg(ExifElementsTable* exifTable,
         }
     }
 
+    // fill in short and ushort tags
+    if (NO_ERROR == ret) {
+        char temp_value[2];
+        temp_value[1] = '\0';
+
+        // MeteringMode
+        // TODO(XXX): only supporting this metering mode at the moment, may change in future
+        temp_value[0] = '2';
+        exifTable->insertElement(TAG_METERING_MODE, temp_value);
+
+        // ExposureProgram
+        // TODO(XXX): only supporting this exposure program at the moment, may change in future
+        temp_value[0] = '3';
+        exifTable->insertElement(TAG_EXPOSURE_PROGRAM, temp_value);
+
+        // ColorSpace
+        temp_value[0] = '1';
+        exifTable->insertElement(TAG_COLOR_SPACE, temp_value);
+
+        temp_value[0] = '2';
+        exifTable->insertElement(TAG_SENSING_METHOD, temp_value);
+
+        temp_value[0] = '1';
+        exifTable->insertElement(TAG_CUSTOM_RENDERED, temp_value);
+    }
+
+    LOG_FUNCTION_NAME_EXIT;
+
+    return ret;
+}
+
+status_t OMXCameraAdapter::setupEXIF_libjpeg(ExifElementsTable* exifTable,
+                                             OMX_TI_ANCILLARYDATATYPE* pAncillaryData,
+                                             OMX_TI_WHITEBALANCERESULTTYPE* pWhiteBalanceData)
+{
+    status_t ret = NO_ERROR;
+    OMX_ERRORTYPE eError = OMX_ErrorNone;
+    struct timeval sTv;
+    struct tm *pTime;
+    OMXCameraPortParameters * capData = NULL;
+
+    LOG_FUNCTION_NAME;
+
+    capData = &mCameraAdapterParameters.mCameraPortParams[mCameraAdapterParameters.mImagePortIndex];
+
+    if (!mEXIFTemplateValid) {
+        mEXIFTemplate = ExifElementsTable();
+        ret = setupEXIFTemplate_libjpeg(&mEXIFTemplate);
+        mEXIFTemplateValid = (NO_ERROR == ret);
+    }
+
+    // per-shot elements are added to a copy of the session template
+    if (NO_ERROR == ret) {
+        *exifTable = mEXIFTemplate;
+    }
+
     if ((NO_ERROR == ret)) {
         int status = gettimeofday (&sTv, NULL);
         pTime = localtime (&sTv.tv_sec);
@@ -707,26 +780,6 @@ status_t OMXCameraAdapter::setupEXIF_libjpeg(ExifElementsTable* exifTable,
             temp_value[0] = '1';
         }
         exifTable->insertElement(TAG_WHITEBALANCE, temp_value);
-
-        // MeteringMode
-        // TODO(XXX): only supporting this metering mode at the moment, may change in future
-        temp_value[0] = '2';
-        exifTable->insertElement(TAG_METERING_MODE, temp_value);
-
-        // ExposureProgram
-        // TODO(XXX): only supporting this exposure program at the moment, may change in future
-        temp_value[0] = '3';
-        exifTable->insertElement(TAG_EXPOSURE_PROGRAM, temp_value);
-
-        // ColorSpace
-        temp_value[0] = '1';
-        exifTable->insertElement(TAG_COLOR_SPACE, temp_value);
-
-        temp_value[0] = '2';
-        exifTable->insertElement(TAG_SENSING_METHOD, temp_value);
-
-        temp_value[0] = '1';
-        exifTable->insertElement(TAG_CUSTOM_RENDERED, temp_value);
     }
 
     if (pAncillaryData && (NO_ERROR == ret)) {
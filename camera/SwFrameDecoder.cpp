@@ -21,25 +21,115 @@ namespace Ti {
 namespace Camera {
 
 SwFrameDecoder::SwFrameDecoder()
-: mjpegWithHdrSize(0), mJpegWithHeaderBuffer(NULL) {
+    : mScaleDenom(1), mOutputWidth(0), mOutputHeight(0), mOutputStride(4096),
+      mThreadCount(1), mExiting(false), mStatsFrames(0), mStatsDropped(0),
+      mStatsDecodeTime(0), mStatsDecodeMax(0), mStatsLatency(0), mStatsLatencyMax(0),
+      mTotalFrames(0), mTotalDropped(0), mTotalDecodeTime(0), mTotalDecodeMax(0),
+      mTotalLatency(0), mTotalLatencyMax(0) {
 }
 
 SwFrameDecoder::~SwFrameDecoder() {
-    delete [] mJpegWithHeaderBuffer;
-    mJpegWithHeaderBuffer = NULL;
+    doStop();
 }
 
 
 void SwFrameDecoder::doConfigure(const DecoderParameters& params) {
     LOG_FUNCTION_NAME;
 
-    mjpegWithHdrSize = (mParams.width * mParams.height / 2) +
-            mJpgdecoder.readDHTSize();
-    if (mJpegWithHeaderBuffer != NULL) {
-        delete [] mJpegWithHeaderBuffer;
-        mJpegWithHeaderBuffer = NULL;
+    mOutputWidth = params.outputWidth > 0 ? params.outputWidth : params.width;
+    mOutputHeight = params.outputHeight > 0 ? params.outputHeight : params.height;
+    mOutputStride = params.outputStride > 0 ? params.outputStride : 4096;
+
+    // A stream larger than the preview is scaled down in the DCT domain,
+    // which saves most of the IDCT work and the writes to the preview buffer
+    mScaleDenom = Decoder_libjpeg::scaleDenom(params.width, params.height,
+            mOutputWidth, mOutputHeight);
+    CAMHAL_LOGDB("Decoding %dx%d stream at 1/%d to %dx%d preview, stride=%d",
+            params.width, params.height, mScaleDenom,
+            mOutputWidth, mOutputHeight, mOutputStride);
+
+    // 0 uses all cores, a frame per thread needs an output buffer per thread
+    mThreadCount = params.decoderThreads;
+    if (mThreadCount <= 0) {
+        mThreadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (mThreadCount > MAX_DECODER_THREADS) {
+        mThreadCount = MAX_DECODER_THREADS;
+    }
+    if (mThreadCount > params.outputBufferCount - 1) {
+        mThreadCount = params.outputBufferCount - 1;
+    }
+    if (mThreadCount < 1) {
+        mThreadCount = 1;
+    }
+    CAMHAL_LOGDB("Using %d MJPEG decoder thread(s)", mThreadCount);
+
+    LOG_FUNCTION_NAME_EXIT;
+}
+
+status_t SwFrameDecoder::doStart() {
+    status_t ret = NO_ERROR;
+
+    LOG_FUNCTION_NAME;
+
+    {
+        android::AutoMutex lock(mJobLock);
+        mExiting = false;
+        mStatsFrames = 0;
+        mStatsDropped = 0;
+        mStatsDecodeTime = 0;
+        mStatsDecodeMax = 0;
+        mStatsLatency = 0;
+        mStatsLatencyMax = 0;
+        mTotalFrames = 0;
+        mTotalDropped = 0;
+        mTotalDecodeTime = 0;
+        mTotalDecodeMax = 0;
+        mTotalLatency = 0;
+        mTotalLatencyMax = 0;
+    }
+
+    for (int i = 0; (mThreadCount > 1) && (i < mThreadCount); i++) {
+        android::sp<DecoderThread> thread = new DecoderThread(this);
+#ifdef ANDROID_API_N_OR_LATER
+        ret = thread->run("mjpeg_decoder");
+#else
+        ret = thread->run();
+#endif
+        if (NO_ERROR != ret) {
+            CAMHAL_LOGEB("Couldn't run MJPEG decoder thread %d", i);
+            break;
+        }
+        mThreads.push_back(thread);
+    }
+
+    // whatever threads did start are used, none at all decodes inline
+    ret = NO_ERROR;
+
+    LOG_FUNCTION_NAME_EXIT;
+    return ret;
+}
+
+void SwFrameDecoder::doStop() {
+    LOG_FUNCTION_NAME;
+
+    {
+        android::AutoMutex lock(mJobLock);
+
+        // frames already handed to the threads are finished and delivered,
+        // the caller reclaims the buffers when flushing
+        while (!mJobs.isEmpty()) {
+            mIdleCondition.wait(mJobLock);
+        }
+        mExiting = true;
+        mJobCondition.broadcast();
     }
-    mJpegWithHeaderBuffer = new unsigned char[mjpegWithHdrSize];
+
+    for (size_t i = 0; i < mThreads.size(); i++) {
+        mThreads[i]->requestExit();
+        mThreads[i]->join();
+    }
+    mThreads.clear();
 
     LOG_FUNCTION_NAME_EXIT;
 }
@@ -47,39 +137,274 @@ void SwFrameDecoder::doConfigure(const DecoderParameters& params) {
 
 void SwFrameDecoder::doProcessInputBuffer() {
     LOG_FUNCTION_NAME;
+
+    if (mThreads.isEmpty()) {
+        processInline();
+    } else {
+        dispatchJobs();
+    }
+
+    LOG_FUNCTION_NAME_EXIT;
+}
+
+void SwFrameDecoder::processInline() {
     nsecs_t timestamp = 0;
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
 
-    CAMHAL_LOGV("Will add header to MJPEG");
-    int final_jpg_sz = 0;
-    {
-        int inIndex = mInQueue.itemAt(0);
-        android::sp<MediaBuffer>& inBuffer = mInBuffers->editItemAt(inIndex);
-        android::AutoMutex lock(inBuffer->getLock());
-        timestamp = inBuffer->getTimestamp();
-        final_jpg_sz = mJpgdecoder.appendDHT(
-                reinterpret_cast<unsigned char*>(inBuffer->buffer),
-                inBuffer->filledLen, mJpegWithHeaderBuffer, mjpegWithHdrSize);
-        inBuffer->setStatus(BufferStatus_InDecoded);
-    }
-    CAMHAL_LOGV("Added header to MJPEG");
+    // The frame is decoded straight from the input buffer, a missing DHT
+    // segment is supplied by the decoder without copying the frame
+    int inIndex = mInQueue.itemAt(0);
+    android::sp<MediaBuffer>& inBuffer = mInBuffers->editItemAt(inIndex);
+    android::AutoMutex inLock(inBuffer->getLock());
+    timestamp = inBuffer->getTimestamp();
     {
         int outIndex = mOutQueue.itemAt(0);
         android::sp<MediaBuffer>& outBuffer = mOutBuffers->editItemAt(outIndex);
         android::AutoMutex lock(outBuffer->getLock());
         CameraBuffer* buffer = reinterpret_cast<CameraBuffer*>(outBuffer->buffer);
-        if (!mJpgdecoder.decode(mJpegWithHeaderBuffer, final_jpg_sz,
-                reinterpret_cast<unsigned char*>(buffer->mapped), 4096)) {
+        if (!mJpgdecoder.decode(reinterpret_cast<unsigned char*>(inBuffer->buffer),
+                inBuffer->filledLen,
+                reinterpret_cast<unsigned char*>(buffer->mapped), mOutputStride,
+                mOutputWidth, mOutputHeight, mScaleDenom)) {
             CAMHAL_LOGEA("Error while decoding JPEG");
+            inBuffer->setStatus(BufferStatus_InDecoded);
             return;
         }
         outBuffer->setTimestamp(timestamp);
         outBuffer->setStatus(BufferStatus_OutFilled);
     }
+    inBuffer->setStatus(BufferStatus_InDecoded);
     CAMHAL_LOGV("JPEG decoded!");
 
-    LOG_FUNCTION_NAME_EXIT;
+    nsecs_t decodeTime = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    android::AutoMutex lock(mJobLock);
+    updateStatsLocked(decodeTime, decodeTime);
+}
+
+// Pairs every newly queued frame with a free output buffer and hands it to
+// the decoder threads. Runs under the FrameDecoder lock, the threads only
+// touch the buffers through their status, so the queues are not shared.
+void SwFrameDecoder::dispatchJobs() {
+    android::AutoMutex lock(mJobLock);
+
+    for (size_t i = 0; i < mInQueue.size(); i++) {
+        int inIndex = mInQueue[i];
+        android::sp<MediaBuffer>& inBuffer = mInBuffers->editItemAt(inIndex);
+        android::AutoMutex inLock(inBuffer->getLock());
+        if (inBuffer->getStatus() != BufferStatus_InQueued) {
+            continue;
+        }
+
+        int outIndex = -1;
+        for (size_t j = 0; j < mOutQueue.size(); j++) {
+            android::sp<MediaBuffer>& outBuffer = mOutBuffers->editItemAt(mOutQueue[j]);
+            android::AutoMutex outLock(outBuffer->getLock());
+            if (outBuffer->getStatus() == BufferStatus_OutQueued) {
+                outBuffer->setStatus(BufferStatus_OutWaitForFill);
+                outIndex = mOutQueue[j];
+                break;
+            }
+        }
+
+        if (outIndex < 0) {
+            // every preview buffer is busy, drop the frame rather than
+            // holding the capture buffer until one comes back
+            CAMHAL_LOGDB("No free output buffer, dropping frame %d", inIndex);
+            inBuffer->setStatus(BufferStatus_InDecoded);
+            mStatsDropped++;
+            mTotalDropped++;
+            continue;
+        }
+
+        inBuffer->setStatus(BufferStatus_InWaitForEmpty);
+
+        Job job;
+        job.inIndex = inIndex;
+        job.outIndex = outIndex;
+        job.queued = systemTime(SYSTEM_TIME_MONOTONIC);
+        job.decodeTime = 0;
+        job.claimed = false;
+        job.done = false;
+        job.decoded = false;
+        mJobs.push_back(job);
+        mJobCondition.signal();
+    }
+}
+
+bool SwFrameDecoder::decoderLoop(Decoder_libjpeg &decoder) {
+    int inIndex = -1;
+    int outIndex = -1;
+
+    {
+        android::AutoMutex lock(mJobLock);
+
+        for (;;) {
+            for (size_t i = 0; i < mJobs.size(); i++) {
+                Job &job = mJobs.editItemAt(i);
+                if (!job.claimed) {
+                    job.claimed = true;
+                    inIndex = job.inIndex;
+                    outIndex = job.outIndex;
+                    break;
+                }
+            }
+            if (inIndex >= 0) {
+                break;
+            }
+            if (mExiting) {
+                return false;
+            }
+            mJobCondition.wait(mJobLock);
+        }
+    }
+
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    bool decoded = decodeFrame(decoder, inIndex, outIndex);
+    nsecs_t decodeTime = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    android::AutoMutex lock(mJobLock);
+    for (size_t i = 0; i < mJobs.size(); i++) {
+        Job &job = mJobs.editItemAt(i);
+        if (job.inIndex == inIndex) {
+            job.done = true;
+            job.decoded = decoded;
+            job.decodeTime = decodeTime;
+            break;
+        }
+    }
+    deliverJobsLocked();
+
+    return true;
+}
+
+// Decodes without holding the buffer locks, the frame and the output are
+// owned by this job until their status changes in deliverJobsLocked()
+bool SwFrameDecoder::decodeFrame(Decoder_libjpeg &decoder, int inIndex, int outIndex) {
+    unsigned char *src;
+    unsigned char *dst;
+    int filledLen;
+
+    {
+        android::sp<MediaBuffer>& inBuffer = mInBuffers->editItemAt(inIndex);
+        android::AutoMutex inLock(inBuffer->getLock());
+        src = reinterpret_cast<unsigned char*>(inBuffer->buffer);
+        filledLen = inBuffer->filledLen;
+    }
+    {
+        android::sp<MediaBuffer>& outBuffer = mOutBuffers->editItemAt(outIndex);
+        android::AutoMutex outLock(outBuffer->getLock());
+        dst = reinterpret_cast<unsigned char*>(
+                reinterpret_cast<CameraBuffer*>(outBuffer->buffer)->mapped);
+    }
+
+    if (!decoder.decode(src, filledLen, dst, mOutputStride,
+            mOutputWidth, mOutputHeight, mScaleDenom)) {
+        CAMHAL_LOGEB("Error while decoding JPEG frame %d", inIndex);
+        return false;
+    }
+
+    return true;
 }
 
+// Hands out finished frames in the order they were queued, a frame decoded
+// ahead of an older one waits for it so the preview never goes back in time.
+// The owner is woken up to dequeue them right away instead of with the next
+// captured frame.
+void SwFrameDecoder::deliverJobsLocked() {
+    bool delivered = false;
+
+    while (!mJobs.isEmpty() && mJobs[0].done) {
+        const Job &job = mJobs[0];
+        nsecs_t timestamp;
+
+        {
+            android::sp<MediaBuffer>& inBuffer = mInBuffers->editItemAt(job.inIndex);
+            android::AutoMutex inLock(inBuffer->getLock());
+            timestamp = inBuffer->getTimestamp();
+            inBuffer->setStatus(BufferStatus_InDecoded);
+        }
+        {
+            android::sp<MediaBuffer>& outBuffer = mOutBuffers->editItemAt(job.outIndex);
+            android::AutoMutex outLock(outBuffer->getLock());
+            if (job.decoded) {
+                outBuffer->setTimestamp(timestamp);
+                outBuffer->setStatus(BufferStatus_OutFilled);
+            } else {
+                outBuffer->setStatus(BufferStatus_OutQueued);
+            }
+        }
+
+        if (job.decoded) {
+            updateStatsLocked(job.decodeTime, systemTime(SYSTEM_TIME_MONOTONIC) - job.queued);
+        }
+        mJobs.removeAt(0);
+        delivered = true;
+    }
+
+    if (delivered) {
+        notifyOutputReady();
+    }
+
+    if (mJobs.isEmpty()) {
+        mIdleCondition.broadcast();
+    }
+}
+
+void SwFrameDecoder::updateStatsLocked(nsecs_t decodeTime, nsecs_t latency) {
+    CAMHAL_LOGVB("Frame decoded in %llu us, delivered after %llu us",
+            (unsigned long long) (decodeTime / 1000), (unsigned long long) (latency / 1000));
+
+    mStatsFrames++;
+    mStatsDecodeTime += decodeTime;
+    mStatsLatency += latency;
+    if (decodeTime > mStatsDecodeMax) {
+        mStatsDecodeMax = decodeTime;
+    }
+    if (latency > mStatsLatencyMax) {
+        mStatsLatencyMax = latency;
+    }
+
+    mTotalFrames++;
+    mTotalDecodeTime += decodeTime;
+    mTotalLatency += latency;
+    if (decodeTime > mTotalDecodeMax) {
+        mTotalDecodeMax = decodeTime;
+    }
+    if (latency > mTotalLatencyMax) {
+        mTotalLatencyMax = latency;
+    }
+
+    if (mStatsFrames >= STATS_INTERVAL) {
+        CAMHAL_LOGI("MJPEG %d thread(s): decode avg %llu us max %llu us, "
+                "latency avg %llu us max %llu us, %d frames, %d dropped",
+                mThreadCount,
+                (unsigned long long) (mStatsDecodeTime / mStatsFrames / 1000),
+                (unsigned long long) (mStatsDecodeMax / 1000),
+                (unsigned long long) (mStatsLatency / mStatsFrames / 1000),
+                (unsigned long long) (mStatsLatencyMax / 1000),
+                mStatsFrames, mStatsDropped);
+        mStatsFrames = 0;
+        mStatsDropped = 0;
+        mStatsDecodeTime = 0;
+        mStatsDecodeMax = 0;
+        mStatsLatency = 0;
+        mStatsLatencyMax = 0;
+    }
+}
+
+void SwFrameDecoder::dump(int fd) {
+    char line[256];
+
+    android::AutoMutex lock(mJobLock);
+    snprintf(line, sizeof(line),
+             "MJPEG decoder: %d thread(s), 1/%d scale, %d frames, %d dropped, "
+             "decode average %lld us, worst %lld us, latency average %lld us, worst %lld us\n",
+             mThreadCount, mScaleDenom,
+             mTotalFrames, mTotalDropped,
+             mTotalFrames ? ns2us(mTotalDecodeTime / mTotalFrames) : 0LL, ns2us(mTotalDecodeMax),
+             mTotalFrames ? ns2us(mTotalLatency / mTotalFrames) : 0LL, ns2us(mTotalLatencyMax));
+    write(fd, line, strlen(line));
+}
 
 }  // namespace Camera
 }  // namespace Ti
@@ -26,6 +26,7 @@
 #include "CameraHal.h"
 #include "TICameraParameters.h"
 #include "DebugUtils.h"
+#include "PixelConvert.h"
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +37,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <linux/videodev.h>
 #include <cutils/properties.h>
 #include "DecoderFactory.h"
@@ -54,7 +56,6 @@ namespace Camera {
 #define FPS_PERIOD 30
 
 //Proto Types
-static void convertYUV422i_yuyvTouyvy(uint8_t *src, uint8_t *dest, size_t size );
 static void convertYUV422ToNV12Tiler(unsigned char *src, unsigned char *dest, int width, int height );
 static void convertYUV422ToNV12(unsigned char *src, unsigned char *dest, int width, int height );
 
@@ -86,7 +87,7 @@ static void debugShowFPS()
 /*--------------------V4L wrapper functions -------------------------------*/
 
 bool V4LCameraAdapter::isNeedToUseDecoder() const {
-    return mPixelFormat != V4L2_PIX_FMT_YUYV;
+    return (mPixelFormat != V4L2_PIX_FMT_YUYV) && (mPixelFormat != V4L2_PIX_FMT_NV12);
 }
 
 status_t V4LCameraAdapter::v4lIoctl (int fd, int req, void* argp) {
@@ -99,6 +100,12 @@ status_t V4LCameraAdapter::v4lIoctl (int fd, int req, void* argp) {
         ret = ioctl (fd, req, argp);
     }while (-1 == ret && EINTR == errno);
 
+    // the capture thread waits for this buffer when the driver ran dry
+    if ((ret == 0) && (req == VIDIOC_QBUF) && mWaitingForQueue) {
+        mWaitingForQueue = false;
+        wakeFrameWait();
+    }
+
     return ret;
 }
 
@@ -158,11 +165,18 @@ status_t V4LCameraAdapter::v4lInitMmap(int& count, int width, int height) {
 
     if (isNeedToUseDecoder()) {
         mDecoder->registerInputBuffers(&mInBuffers);
+        mDecoder->registerOutputCallback(decoderOutputReady, this);
+        // The driver may pick a larger frame size than the preview size
+        // asked for, the decoder scales it to the preview buffers
         DecoderParameters params;
-        params.width = width;
-        params.height = height;
+        params.width = mVideoInfo->format.fmt.pix.width;
+        params.height = mVideoInfo->format.fmt.pix.height;
         params.inputBufferCount = count;
         params.outputBufferCount = count;
+        params.outputWidth = width;
+        params.outputHeight = height;
+        params.outputStride = 4096;
+        params.decoderThreads = mDecoderThreads;
         mDecoder->configure(params);
     }
 
@@ -191,6 +205,92 @@ status_t V4LCameraAdapter::v4lInitUsrPtr(int& count) {
     return ret;
 }
 
+// Sets the driver up to capture NV12 straight into the preview buffers with
+// USERPTR I/O. The preview buffers are laid out with a 4096 byte stride, the
+// driver has to accept that stride and be able to pin the buffers, which is
+// tried with a first VIDIOC_QBUF.
+status_t V4LCameraAdapter::v4lInitDirect(int& count, int width, int height) {
+    status_t ret = NO_ERROR;
+    const int stride = 4096;
+    enum v4l2_buf_type bufType = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    LOG_FUNCTION_NAME;
+
+    if ((mVideoInfo->cap.capabilities & V4L2_CAP_STREAMING) == 0) {
+        return INVALID_OPERATION;
+    }
+
+    ret = v4lSetFormat(width, height, V4L2_PIX_FMT_NV12, stride);
+    if ((ret < 0) ||
+        (mVideoInfo->format.fmt.pix.pixelformat != V4L2_PIX_FMT_NV12) ||
+        ((int)mVideoInfo->format.fmt.pix.width != width) ||
+        ((int)mVideoInfo->format.fmt.pix.height != height) ||
+        ((int)mVideoInfo->format.fmt.pix.bytesperline != stride) ||
+        (mVideoInfo->format.fmt.pix.sizeimage > (unsigned int)(stride * height * 3 / 2))) {
+        CAMHAL_LOGDB("NV12 %dx%d with stride %d not supported for direct capture", width, height, stride);
+        return INVALID_OPERATION;
+    }
+
+    ret = v4lInitUsrPtr(count);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // The input buffers wrap the preview buffers the driver fills
+    mInBuffers.clear();
+    for (int i = 0; i < count; i++) {
+        mVideoInfo->mem[i] = mPreviewBufs[i]->mapped;
+        MediaBuffer* buffer = new MediaBuffer(i, mVideoInfo->mem[i], stride * height * 3 / 2);
+        mInBuffers.push_back(buffer);
+    }
+    mVideoInfo->buf.length = stride * height * 3 / 2;
+    mDirectCapture = true;
+
+    // Drivers that cannot pin the preview memory fail the first queue,
+    // stopping the stream returns the buffer without ever streaming
+    ret = returnBufferToV4L(0);
+    v4lIoctl(mCameraHandle, VIDIOC_STREAMOFF, &bufType);
+    if (ret != NO_ERROR) {
+        CAMHAL_LOGDA("Preview buffers can not be used for USERPTR capture");
+        mDirectCapture = false;
+        mInBuffers.clear();
+        mVideoInfo->rb.count = 0;
+        v4lIoctl(mCameraHandle, VIDIOC_REQBUFS, &mVideoInfo->rb);
+        return INVALID_OPERATION;
+    }
+
+    LOG_FUNCTION_NAME_EXIT;
+    return NO_ERROR;
+}
+
+// Allocates the capture buffers for preview. An NV12 camera is captured
+// straight into the preview buffers if possible, into driver buffers that
+// are copied otherwise, and a camera without NV12 falls back to YUYV.
+status_t V4LCameraAdapter::v4lInitPreviewBuffers(int& count, int width, int height) {
+    status_t ret = NO_ERROR;
+
+    mDirectCapture = false;
+
+    if (mPixelFormat == V4L2_PIX_FMT_NV12) {
+        if (v4lInitDirect(count, width, height) == NO_ERROR) {
+            CAMHAL_LOGDB("Capturing NV12 %dx%d directly to %d preview buffers", width, height, count);
+            return NO_ERROR;
+        }
+
+        ret = v4lSetFormat(width, height, V4L2_PIX_FMT_NV12);
+        if ((ret < 0) || (mVideoInfo->format.fmt.pix.pixelformat != V4L2_PIX_FMT_NV12)) {
+            CAMHAL_LOGI("Camera does not capture NV12, using V4L2_PIX_FMT_YUYV");
+            mPixelFormat = V4L2_PIX_FMT_YUYV;
+            ret = v4lSetFormat(width, height, mPixelFormat);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return v4lInitMmap(count, width, height);
+}
+
 status_t V4LCameraAdapter::v4lStartStreaming () {
     status_t ret = NO_ERROR;
     enum v4l2_buf_type bufType;
@@ -209,6 +309,18 @@ status_t V4LCameraAdapter::v4lStartStreaming () {
             return ret;
         }
         mVideoInfo->isStreaming = true;
+
+        {
+            android::AutoMutex lock(mV4LLock);
+            mWaitingForQueue = false;
+        }
+        {
+            android::AutoMutex lock(mDequeueStatsLock);
+            mDequeueFrames = 0;
+            mDequeueTimedFrames = 0;
+            mDequeueLatency = 0;
+            mDequeueLatencyMax = 0;
+        }
     }
 
     // This is WA for some cameras with incorrect driver behavior
@@ -242,12 +354,13 @@ status_t V4LCameraAdapter::v4lStopStreaming (int nBufferCount) {
             return ret;
         }
         mVideoInfo->isStreaming = false;
+        wakeFrameWait();
 
-        /* Unmap buffers */
+        /* Unmap buffers, preview buffers captured to directly are not ours */
         mVideoInfo->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         mVideoInfo->buf.memory = V4L2_MEMORY_MMAP;
         for (int i = 0; i < nBufferCount; i++) {
-            if (munmap(mVideoInfo->mem[i], mVideoInfo->buf.length) < 0) {
+            if (!mDirectCapture && (munmap(mVideoInfo->mem[i], mVideoInfo->buf.length) < 0)) {
                 CAMHAL_LOGEA("munmap() failed");
             }
             mVideoInfo->mem[i] = 0;
@@ -255,8 +368,9 @@ status_t V4LCameraAdapter::v4lStopStreaming (int nBufferCount) {
 
         //free the memory allocated during REQBUFS, by setting the count=0
         mVideoInfo->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        mVideoInfo->rb.memory = V4L2_MEMORY_MMAP;
+        mVideoInfo->rb.memory = mDirectCapture ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
         mVideoInfo->rb.count = 0;
+        mDirectCapture = false;
 
         ret = v4lIoctl(mCameraHandle, VIDIOC_REQBUFS, &mVideoInfo->rb);
         if (ret < 0) {
@@ -269,7 +383,7 @@ EXIT:
     return ret;
 }
 
-status_t V4LCameraAdapter::v4lSetFormat (int width, int height, uint32_t pix_format) {
+status_t V4LCameraAdapter::v4lSetFormat (int width, int height, uint32_t pix_format, int bytesperline) {
     status_t ret = NO_ERROR;
 
     LOG_FUNCTION_NAME;
@@ -289,6 +403,7 @@ status_t V4LCameraAdapter::v4lSetFormat (int width, int height, uint32_t pix_for
     mVideoInfo->format.fmt.pix.width = width;
     mVideoInfo->format.fmt.pix.height = height;
     mVideoInfo->format.fmt.pix.pixelformat = pix_format;
+    mVideoInfo->format.fmt.pix.bytesperline = bytesperline;
 
     ret = v4lIoctl(mCameraHandle, VIDIOC_S_FMT, &mVideoInfo->format);
     if (ret < 0) {
@@ -321,20 +436,14 @@ status_t V4LCameraAdapter::restartPreview ()
         goto EXIT;
     }
 
-    ret = v4lInitMmap(mPreviewBufferCount, width, height);
+    ret = v4lInitPreviewBuffers(mPreviewBufferCount, width, height);
     if (ret < 0) {
-        CAMHAL_LOGEB("v4lInitMmap Failed: %s", strerror(errno));
+        CAMHAL_LOGEB("v4lInitPreviewBuffers Failed: %s", strerror(errno));
         goto EXIT;
     }
 
     for (int i = 0; i < mPreviewBufferCountQueueable; i++) {
-
-        v4l2_buffer buf;
-        buf.index = i;
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-
-        ret = v4lIoctl(mCameraHandle, VIDIOC_QBUF, &buf);
+        ret = returnBufferToV4L(i);
         if (ret < 0) {
             CAMHAL_LOGEA("VIDIOC_QBUF Failed");
             goto EXIT;
@@ -384,6 +493,15 @@ status_t V4LCameraAdapter::initialize(CameraProperties::Properties* caps)
         goto EXIT;
     }
 
+    if (pipe(mWakeFds) < 0) {
+        CAMHAL_LOGEB("Error while creating the frame wait pipe: %s", strerror(errno));
+        mWakeFds[0] = mWakeFds[1] = -1;
+        ret = NO_INIT;
+        goto EXIT;
+    }
+    fcntl(mWakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(mWakeFds[1], F_SETFL, O_NONBLOCK);
+
     ret = v4lIoctl (mCameraHandle, VIDIOC_QUERYCAP, &mVideoInfo->cap);
     if (ret < 0) {
         CAMHAL_LOGEA("Error when querying the capabilities of the V4L Camera");
@@ -469,12 +587,8 @@ status_t V4LCameraAdapter::fillThisBuffer(CameraBuffer *frameBuf, CameraFrame::F
         }
 
     } else {
-        v4l2_buffer buf;
-        buf.index = idx;
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
         CAMHAL_LOGD("Will return buffer to V4L with id=%d", idx);
-        ret = v4lIoctl(mCameraHandle, VIDIOC_QBUF, &buf);
+        ret = returnBufferToV4L(idx);
         if (ret < 0) {
            CAMHAL_LOGEA("VIDIOC_QBUF Failed");
            goto EXIT;
@@ -610,15 +724,15 @@ status_t V4LCameraAdapter::UseBuffersCapture(CameraBuffer *bufArr, int num) {
         CAMHAL_LOGDB("capture- buff [%d] = 0x%x ",i, mCaptureBufs.keyAt(i));
     }
 
-    mCaptureBuffersAvailable.clear();
+    clearFrameRefCounts(CameraFrame::IMAGE_FRAME);
     for (int i = 0; i < mCaptureBufferCountQueueable; i++ ) {
-        mCaptureBuffersAvailable.add(&mCaptureBuffers[i], 0);
+        setFrameRefCountByType(&mCaptureBuffers[i], CameraFrame::IMAGE_FRAME, 0);
     }
 
     // initial ref count for undeqeueued buffers is 1 since buffer provider
     // is still holding on to it
     for (int i = mCaptureBufferCountQueueable; i < num; i++ ) {
-        mCaptureBuffersAvailable.add(&mCaptureBuffers[i], 1);
+        setFrameRefCountByType(&mCaptureBuffers[i], CameraFrame::IMAGE_FRAME, 1);
     }
 
     // Update the preview buffer count
@@ -642,14 +756,17 @@ status_t V4LCameraAdapter::UseBuffersPreview(CameraBuffer *bufArr, int num)
     }
 
     mParams.getPreviewSize(&width, &height);
-    ret = v4lInitMmap(num, width, height);
+
+    for (int i = 0; (i < num) && (i < NB_BUFFER); i++) {
+        mPreviewBufs[i] = &bufArr[i];
+    }
+    ret = v4lInitPreviewBuffers(num, width, height);
 
     mOutBuffers.clear();
 
     if (ret == NO_ERROR) {
         for (int i = 0; i < num; i++) {
             //Associate each Camera internal buffer with the one from Overlay
-            mPreviewBufs[i] = &bufArr[i];
             MediaBuffer* buffer = new MediaBuffer(i, mPreviewBufs[i]);
             mOutBuffers.push_back(buffer);
             CAMHAL_LOGDB("Preview- buff [%d] = 0x%x length=%d",i, mPreviewBufs[i], mFrameQueue.valueFor(mPreviewBufs[i])->mLength);
@@ -699,10 +816,15 @@ status_t V4LCameraAdapter::takePicture() {
     if (isNeedToUseDecoder()) {
         mDecoder->stop();
         mDecoder->flush();
+        android_atomic_release_store(0, &mDecoderOutputPending);
     }
     mLock.lock();
     mCapturing = true;
     mPreviewing = false;
+    // frames being delivered may be returned synchronously, which needs mLock
+    mLock.unlock();
+    flushPipeline();
+    mLock.lock();
 
     // Stop preview streaming
     ret = v4lStopStreaming(mPreviewBufferCount);
@@ -800,11 +922,12 @@ status_t V4LCameraAdapter::takePicture() {
     frame.mQuirks |= CameraFrame::ENCODE_RAW_YUV422I_TO_JPEG;
     frame.mQuirks |= CameraFrame::FORMAT_YUV422I_YUYV;
 
-    ret = setInitFrameRefCount(frame.mBuffer, frame.mFrameMask);
+    android::sp<Subscribers> subscribers = getSubscribers();
+    ret = setInitFrameRefCount(frame.mBuffer, frame.mFrameMask, subscribers);
     if (ret != NO_ERROR) {
         CAMHAL_LOGDB("Error in setInitFrameRefCount %d", ret);
     } else {
-        ret = sendFrameToSubscribers(&frame);
+        ret = sendFrameToSubscribers(&frame, subscribers);
     }
 
     // Stop streaming after image capture
@@ -862,25 +985,21 @@ status_t V4LCameraAdapter::startPreview()
     }
 
     for (int i = 0; i < mPreviewBufferCountQueueable; i++) {
-        v4l2_buffer buf;
+        if (!mDirectCapture) {
+            memset (&mVideoInfo->buf, 0, sizeof (struct v4l2_buffer));
 
-        memset (&mVideoInfo->buf, 0, sizeof (struct v4l2_buffer));
+            mVideoInfo->buf.index = i;
+            mVideoInfo->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            mVideoInfo->buf.memory = V4L2_MEMORY_MMAP;
 
-        mVideoInfo->buf.index = i;
-        mVideoInfo->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        mVideoInfo->buf.memory = V4L2_MEMORY_MMAP;
-
-        ret = v4lIoctl (mCameraHandle, VIDIOC_QUERYBUF, &mVideoInfo->buf);
-        if (ret < 0) {
-            CAMHAL_LOGEB("Unable to query buffer (%s)", strerror(errno));
-            return ret;
+            ret = v4lIoctl (mCameraHandle, VIDIOC_QUERYBUF, &mVideoInfo->buf);
+            if (ret < 0) {
+                CAMHAL_LOGEB("Unable to query buffer (%s)", strerror(errno));
+                return ret;
+            }
         }
 
-        buf.index = i;
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-
-        ret = v4lIoctl(mCameraHandle, VIDIOC_QBUF, &buf);
+        ret = returnBufferToV4L(i);
         if (ret < 0) {
             CAMHAL_LOGEA("VIDIOC_QBUF Failed");
             goto EXIT;
@@ -899,6 +1018,7 @@ status_t V4LCameraAdapter::startPreview()
 
     // Create and start preview thread for receiving buffers from V4L Camera
     if(!mCapturing) {
+        startPipeline();
         mPreviewThread = new PreviewThread(this);
         CAMHAL_LOGDA("Created preview thread");
     }
@@ -930,6 +1050,12 @@ status_t V4LCameraAdapter::stopPreview()
         mStopCondition.waitRelative(mStopLock, 100000000);
         mDecoder->stop();
         mDecoder->flush();
+        android_atomic_release_store(0, &mDecoderOutputPending);
+    } else {
+        // frames being delivered may be returned synchronously, which needs mLock
+        mLock.unlock();
+        flushPipeline();
+        mLock.lock();
     }
     ret = v4lStopStreaming(mPreviewBufferCount);
     if (ret < 0) {
@@ -944,6 +1070,7 @@ status_t V4LCameraAdapter::stopPreview()
 
     mPreviewThread->requestExitAndWait();
     mPreviewThread.clear();
+    stopPipeline();
 
 
     LOG_FUNCTION_NAME_EXIT;
@@ -977,19 +1104,129 @@ void saveFile(unsigned char* buff, int buff_size) {
     LOG_FUNCTION_NAME_EXIT;
 }
 
+// Sleeps until the camera has a frame ready, the streaming stops or the
+// driver runs out of buffers to fill. Returns false if the wait failed.
+bool V4LCameraAdapter::waitForFrame()
+{
+    struct pollfd fds[2];
+    int nfds = 2;
+
+    fds[0].fd = mWakeFds[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = mCameraHandle;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    {
+        // A driver with no queued buffer reports POLLERR until the next
+        // VIDIOC_QBUF, only the wake pipe is waited on until then
+        android::AutoMutex lock(mV4LLock);
+        if (mWaitingForQueue) {
+            nfds = 1;
+        }
+    }
+
+    int ret = poll(fds, nfds, FRAME_WAIT_TIMEOUT_MS);
+    if (ret < 0) {
+        if (errno == EINTR) {
+            return true;
+        }
+        CAMHAL_LOGEB("GetFrame: poll failed: %s", strerror(errno));
+        return false;
+    }
+
+    if (ret == 0) {
+        CAMHAL_LOGDB("GetFrame: no frame for %d ms", FRAME_WAIT_TIMEOUT_MS);
+        return true;
+    }
+
+    if (fds[0].revents & POLLIN) {
+        char drain[16];
+        while (read(mWakeFds[0], drain, sizeof(drain)) > 0) {
+        }
+    }
+
+    if ((nfds > 1) && (fds[1].revents & POLLERR) && !(fds[1].revents & POLLIN)) {
+        // checked again under the lock, a VIDIOC_QBUF issued since the
+        // poll() above would otherwise go unnoticed until the timeout
+        android::AutoMutex lock(mV4LLock);
+        fds[1].revents = 0;
+        if ((poll(&fds[1], 1, 0) > 0) && (fds[1].revents & POLLERR) && !(fds[1].revents & POLLIN)) {
+            mWaitingForQueue = true;
+        }
+    }
+
+    return true;
+}
+
+void V4LCameraAdapter::decoderOutputReady(void *user_data)
+{
+    V4LCameraAdapter *adapter = static_cast<V4LCameraAdapter *>(user_data);
+
+    android_atomic_release_store(1, &adapter->mDecoderOutputPending);
+    adapter->wakeFrameWait();
+}
+
+void V4LCameraAdapter::wakeFrameWait()
+{
+    if (mWakeFds[1] >= 0) {
+        char c = 0;
+        // a full pipe already has a wake up pending
+        write(mWakeFds[1], &c, 1);
+    }
+}
+
+void V4LCameraAdapter::updateDequeueStats(const v4l2_buffer &buf)
+{
+    nsecs_t ready = s2ns(buf.timestamp.tv_sec) + us2ns(buf.timestamp.tv_usec);
+    nsecs_t latency = systemTime(SYSTEM_TIME_MONOTONIC) - ready;
+
+    android::AutoMutex lock(mDequeueStatsLock);
+    mDequeueFrames++;
+
+    // drivers not stamping with the monotonic clock give nothing usable
+    if ((latency < 0) || (latency >= s2ns(1))) {
+        return;
+    }
+    mDequeueTimedFrames++;
+    mDequeueLatency += latency;
+    if (latency > mDequeueLatencyMax) {
+        mDequeueLatencyMax = latency;
+    }
+
+    if (mDebugFps && ((mDequeueFrames % FPS_PERIOD) == 0)) {
+        CAMHAL_LOGE("Camera dequeue latency avg %llu us max %llu us over %d frames",
+                (unsigned long long) ns2us(mDequeueLatency / mDequeueTimedFrames),
+                (unsigned long long) ns2us(mDequeueLatencyMax), mDequeueFrames);
+    }
+}
+
+void V4LCameraAdapter::getDequeueStats(int &frames, nsecs_t &avgLatency, nsecs_t &maxLatency) const
+{
+    android::AutoMutex lock(mDequeueStatsLock);
+    frames = mDequeueFrames;
+    avgLatency = mDequeueTimedFrames ? mDequeueLatency / mDequeueTimedFrames : 0;
+    maxLatency = mDequeueLatencyMax;
+}
+
 char * V4LCameraAdapter::GetFrame(int &index, int &filledLen)
 {
     int ret = NO_ERROR;
     LOG_FUNCTION_NAME;
 
     v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
+    buf.memory = mDirectCapture ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
 
     /* DQ */
     // Some V4L drivers, notably uvc, protect each incoming call with
-    // a driver-wide mutex.  If we use poll() or blocking VIDIOC_DQBUF ioctl
-    // here then we sometimes would run into a deadlock on VIDIO_QBUF ioctl.
+    // a driver-wide mutex.  If we use a blocking VIDIOC_DQBUF ioctl here
+    // then we sometimes would run into a deadlock on VIDIO_QBUF ioctl.
+    // The handle stays non-blocking, poll() sleeps outside of the driver
+    // and all ioctls are serialized by mV4LLock, so VIDIOC_DQBUF is only
+    // issued when it does not have to wait.
     while(true) {
       if(!mVideoInfo->isStreaming) {
         return NULL;
@@ -999,6 +1236,15 @@ char * V4LCameraAdapter::GetFrame(int &index, int &filledLen)
       if((ret == 0) || (errno != EAGAIN)) {
         break;
       }
+
+      // decoded frames are handed out as soon as the decoder has them
+      if (android_atomic_acquire_load(&mDecoderOutputPending)) {
+        return NULL;
+      }
+
+      if (!waitForFrame()) {
+        return NULL;
+      }
     }
 
     if (ret < 0) {
@@ -1008,6 +1254,7 @@ char * V4LCameraAdapter::GetFrame(int &index, int &filledLen)
 
     index = buf.index;
     filledLen = buf.bytesused;
+    updateDequeueStats(buf);
 
     android::sp<MediaBuffer>& inBuffer = mInBuffers.editItemAt(index);
     {
@@ -1122,6 +1369,14 @@ void V4LCameraAdapter::setupWorkingMode() {
     property_get("camera.v4l.mode", value, "3");
     v4lMode = atoi(value);
 
+    // thread budget for NV12 resizing done on behalf of this adapter, 0 uses all cores
+    property_get("camera.v4l.resize.threads", value, "0");
+    mCameraHal->setResizeThreads(atoi(value));
+
+    // frames the software MJPEG decoder works on in parallel, 0 uses all cores
+    property_get("camera.v4l.decoder.threads", value, "0");
+    mDecoderThreads = atoi(value);
+
     if (mDecoder) {
         delete mDecoder;
         mDecoder = NULL;
@@ -1151,6 +1406,13 @@ void V4LCameraAdapter::setupWorkingMode() {
             CAMHAL_LOGI("Using V4L preview format: V4L2_PIX_FMT_H264");
             break;
         }
+        case 4 : {
+            mCameraHal->setExternalLocking(false);
+            mPixelFormat = V4L2_PIX_FMT_NV12;
+            CAMHAL_LOGI("Using V4L preview format: V4L2_PIX_FMT_NV12 captured to preview buffers");
+            break;
+        }
+
         default:
         case 3 : {
             mCameraHal->setExternalLocking(false);
@@ -1174,6 +1436,26 @@ V4LCameraAdapter::V4LCameraAdapter(size_t sensor_index, CameraHal* hal)
     mDecoder = 0;
     nQueued = 0;
     nDequeued = 0;
+    mWakeFds[0] = mWakeFds[1] = -1;
+    mWaitingForQueue = false;
+    mDecoderOutputPending = 0;
+    mDirectCapture = false;
+    mDequeueFrames = 0;
+    mDequeueTimedFrames = 0;
+    mDequeueLatency = 0;
+    mDequeueLatencyMax = 0;
+    mPipelineExiting = false;
+    mPipelineFlushing = false;
+    mPipelineInFlight = 0;
+    for (int i = 0; i < NB_BUFFER; i++) {
+        mBufferOwner[i] = OWNER_CLIENT;
+    }
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        mStageFrames[i] = 0;
+        mStageQueueMax[i] = 0;
+        mStageLatency[i] = 0;
+        mStageLatencyMax[i] = 0;
+    }
 
     setupWorkingMode();
 
@@ -1190,6 +1472,11 @@ V4LCameraAdapter::~V4LCameraAdapter()
     // Close the camera handle and free the video info structure
     close(mCameraHandle);
 
+    if (mWakeFds[0] >= 0) {
+        close(mWakeFds[0]);
+        close(mWakeFds[1]);
+    }
+
     if (mVideoInfo)
       {
         free(mVideoInfo);
@@ -1204,33 +1491,9 @@ V4LCameraAdapter::~V4LCameraAdapter()
     LOG_FUNCTION_NAME_EXIT;
 }
 
-static void convertYUV422i_yuyvTouyvy(uint8_t *src, uint8_t *dest, size_t size ) {
-    //convert YUV422I yuyv to uyvy format.
-    uint32_t *bf = (uint32_t*)src;
-    uint32_t *dst = (uint32_t*)dest;
-
-    LOG_FUNCTION_NAME;
-
-    if (!src || !dest) {
-        return;
-    }
-
-    for(size_t i = 0; i < size; i = i+4)
-    {
-        dst[0] = ((bf[0] & 0x00FF00FF) << 8) | ((bf[0] & 0xFF00FF00) >> 8);
-        bf++;
-        dst++;
-    }
-
-    LOG_FUNCTION_NAME_EXIT;
-}
-
 static void convertYUV422ToNV12Tiler(unsigned char *src, unsigned char *dest, int width, int height ) {
     //convert YUV422I to YUV420 NV12 format and copies directly to preview buffers (Tiler memory).
-    int stride = 4096;
-    unsigned char *bf = src;
-    unsigned char *dst_y = dest;
-    unsigned char *dst_uv = dest + ( height * stride);
+    const int stride = 4096;
 #ifdef PPM_PER_FRAME_CONVERSION
     static int frameCount = 0;
     static nsecs_t ppm_diff = 0;
@@ -1239,61 +1502,10 @@ static void convertYUV422ToNV12Tiler(unsigned char *src, unsigned char *dest, in
 
     LOG_FUNCTION_NAME;
 
-    if (width % 16 ) {
-        for(int i = 0; i < height; i++) {
-            for(int j = 0; j < width; j++) {
-                *dst_y = *bf;
-                dst_y++;
-                bf = bf + 2;
-            }
-            dst_y += (stride - width);
-        }
-
-        bf = src;
-        bf++;  //UV sample
-        for(int i = 0; i < height/2; i++) {
-            for(int j=0; j<width; j++) {
-                *dst_uv = *bf;
-                dst_uv++;
-                bf = bf + 2;
-            }
-            bf = bf + width*2;
-            dst_uv = dst_uv + (stride - width);
-        }
-    } else {
-        //neon conversion
-        for(int i = 0; i < height; i++) {
-            int n = width;
-            int skip = i & 0x1;       // skip uv elements for the odd rows
-            asm volatile (
-                "   pld [%[src], %[src_stride], lsl #2]                         \n\t"
-                "   cmp %[n], #16                                               \n\t"
-                "   blt 5f                                                      \n\t"
-                "0: @ 16 pixel copy                                             \n\t"
-                "   vld2.8  {q0, q1} , [%[src]]! @ q0 = yyyy.. q1 = uvuv..      \n\t"
-                "                                @ now q0 = y q1 = uv           \n\t"
-                "   vst1.32   {d0,d1}, [%[dst_y]]!                              \n\t"
-                "   cmp    %[skip], #0                                          \n\t"
-                "   bne 1f                                                      \n\t"
-                "   vst1.32  {d2,d3},[%[dst_uv]]!                               \n\t"
-                "1: @ skip odd rows for UV                                      \n\t"
-                "   sub %[n], %[n], #16                                         \n\t"
-                "   cmp %[n], #16                                               \n\t"
-                "   bge 0b                                                      \n\t"
-                "5: @ end                                                       \n\t"
-#ifdef NEEDS_ARM_ERRATA_754319_754320
-                "   vmov s0,s0  @ add noop for errata item                      \n\t"
-#endif
-                : [dst_y] "+r" (dst_y), [dst_uv] "+r" (dst_uv), [src] "+r" (src), [n] "+r" (n)
-                : [src_stride] "r" (width), [skip] "r" (skip)
-                : "cc", "memory", "q0", "q1", "q2", "d0", "d1", "d2", "d3"
-            );
-            dst_y = dst_y + (stride - width);
-            if (skip == 0) {
-                dst_uv = dst_uv + (stride - width);
-            }
-        } //end of for()
-    }
+    Utils::PixelConvert::yuyvToNv12(src, width * 2,
+                                    dest, stride,
+                                    dest + (height * stride), stride,
+                                    width, height);
 
 #ifdef PPM_PER_FRAME_CONVERSION
     ppm_diff += (systemTime() - ppm_start);
@@ -1313,61 +1525,12 @@ static void convertYUV422ToNV12Tiler(unsigned char *src, unsigned char *dest, in
 
 static void convertYUV422ToNV12(unsigned char *src, unsigned char *dest, int width, int height ) {
     //convert YUV422I to YUV420 NV12 format.
-    unsigned char *bf = src;
-    unsigned char *dst_y = dest;
-    unsigned char *dst_uv = dest + (width * height);
-
     LOG_FUNCTION_NAME;
 
-    if (width % 16 ) {
-        for(int i = 0; i < height; i++) {
-            for(int j = 0; j < width; j++) {
-                *dst_y = *bf;
-                dst_y++;
-                bf = bf + 2;
-            }
-        }
-
-        bf = src;
-        bf++;  //UV sample
-        for(int i = 0; i < height/2; i++) {
-            for(int j=0; j<width; j++) {
-                *dst_uv = *bf;
-                dst_uv++;
-                bf = bf + 2;
-            }
-            bf = bf + width*2;
-        }
-    } else {
-        //neon conversion
-        for(int i = 0; i < height; i++) {
-            int n = width;
-            int skip = i & 0x1;       // skip uv elements for the odd rows
-            asm volatile (
-                "   pld [%[src], %[src_stride], lsl #2]                         \n\t"
-                "   cmp %[n], #16                                               \n\t"
-                "   blt 5f                                                      \n\t"
-                "0: @ 16 pixel copy                                             \n\t"
-                "   vld2.8  {q0, q1} , [%[src]]! @ q0 = yyyy.. q1 = uvuv..      \n\t"
-                "                                @ now q0 = y q1 = uv           \n\t"
-                "   vst1.32   {d0,d1}, [%[dst_y]]!                              \n\t"
-                "   cmp    %[skip], #0                                          \n\t"
-                "   bne 1f                                                      \n\t"
-                "   vst1.32  {d2,d3},[%[dst_uv]]!                               \n\t"
-                "1: @ skip odd rows for UV                                      \n\t"
-                "   sub %[n], %[n], #16                                         \n\t"
-                "   cmp %[n], #16                                               \n\t"
-                "   bge 0b                                                      \n\t"
-                "5: @ end                                                       \n\t"
-#ifdef NEEDS_ARM_ERRATA_754319_754320
-                "   vmov s0,s0  @ add noop for errata item                      \n\t"
-#endif
-                : [dst_y] "+r" (dst_y), [dst_uv] "+r" (dst_uv), [src] "+r" (src), [n] "+r" (n)
-                : [src_stride] "r" (width), [skip] "r" (skip)
-                : "cc", "memory", "q0", "q1", "q2", "d0", "d1", "d2", "d3"
-            );
-        }
-    }
+    Utils::PixelConvert::yuyvToNv12(src, width * 2,
+                                    dest, width,
+                                    dest + (width * height), width,
+                                    width, height);
 
     LOG_FUNCTION_NAME_EXIT;
 }
@@ -1389,7 +1552,7 @@ void V4LCameraAdapter::returnOutputBuffer(int index)
 
     getFrameSize(width, height);
 
-    android::Mutex::Autolock slock(mSubscriberLock);
+    android::sp<Subscribers> subscribers = getSubscribers();
 
     android::sp<MediaBuffer>& buffer = mOutBuffers.editItemAt(index);
 
@@ -1411,14 +1574,14 @@ void V4LCameraAdapter::returnOutputBuffer(int index)
     if (mRecording)
     {
         frame.mFrameMask |= (unsigned int)CameraFrame::VIDEO_FRAME_SYNC;
-        mFramesWithEncoder++;
+        android_atomic_inc(&mFramesWithEncoder);
     }
 
-    int ret = setInitFrameRefCount(frame.mBuffer, frame.mFrameMask);
+    int ret = setInitFrameRefCount(frame.mBuffer, frame.mFrameMask, subscribers);
     if (ret != NO_ERROR) {
         CAMHAL_LOGDB("Error in setInitFrameRefCount %d", ret);
     } else {
-        ret = sendFrameToSubscribers(&frame);
+        ret = sendFrameToSubscribers(&frame, subscribers);
     }
     //debugShowFPS();
     LOG_FUNCTION_NAME_EXIT;
@@ -1427,10 +1590,18 @@ void V4LCameraAdapter::returnOutputBuffer(int index)
 status_t V4LCameraAdapter::returnBufferToV4L(int id) {
     status_t ret = NO_ERROR;
     v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
     buf.index = id;
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     buf.memory = V4L2_MEMORY_MMAP;
 
+    if (mDirectCapture) {
+        buf.memory = V4L2_MEMORY_USERPTR;
+        buf.m.userptr = reinterpret_cast<unsigned long>(mVideoInfo->mem[id]);
+        buf.length = mVideoInfo->buf.length;
+    }
+    setBufferOwner(id, OWNER_DRIVER);
+
     ret = v4lIoctl(mCameraHandle, VIDIOC_QBUF, &buf);
     if (ret < 0) {
        CAMHAL_LOGEA("VIDIOC_QBUF Failed 0x%x", ret);
@@ -1443,16 +1614,10 @@ status_t V4LCameraAdapter::returnBufferToV4L(int id) {
 int V4LCameraAdapter::previewThread()
 {
     status_t ret = NO_ERROR;
-    int width, height;
-    CameraFrame frame;
-    void *y_uv[2];
     int index = 0;
     int filledLen = 0;
-    int stride = 4096;
     char *fp = NULL;
 
-    mParams.getPreviewSize(&width, &height);
-
     {
         android::AutoMutex lock(mLock);
         if (!mPreviewing) {
@@ -1463,11 +1628,8 @@ int V4LCameraAdapter::previewThread()
         }
     }
 
-    {
-        android::Mutex::Autolock lock(mSubscriberLock);
-        if ( mFrameSubscribers.size() == 0 ) {
-            return BAD_VALUE;
-        }
+    if ( getSubscribers()->mFrameSubscribers.size() == 0 ) {
+        return BAD_VALUE;
     }
 
     if (isNeedToUseDecoder()){
@@ -1477,9 +1639,19 @@ int V4LCameraAdapter::previewThread()
 
         if (GetFrame(index, filledLen) != NULL) {
             CAMHAL_LOGD("Dequeued buffer from V4L with ID=%d", index);
+            // decoded frames only go through the capture stage, the
+            // decoder keeps its own statistics
+            PipelineFrame pipelineFrame;
+            pipelineFrame.index = index;
+            pipelineFrame.data = NULL;
+            pipelineFrame.captured = systemTime(SYSTEM_TIME_MONOTONIC);
+            pipelineFrame.queued = pipelineFrame.captured;
+            updateStageStats(STAGE_CAPTURE, pipelineFrame, 0);
             mDecoder->queueInputBuffer(index);
         }
 
+        // cleared first, a frame finished while draining wakes us again
+        android_atomic_release_store(0, &mDecoderOutputPending);
         while (NO_ERROR == mDecoder->dequeueInputBuffer(inIndex)) {
             returnBufferToV4L(inIndex);
         }
@@ -1500,48 +1672,294 @@ int V4LCameraAdapter::previewThread()
            goto EXIT;
         }
         CAMHAL_LOGD("GOT IN frame with ID=%d",index);
+        setBufferOwner(index, OWNER_CAPTURE);
+
+        PipelineFrame pipelineFrame;
+        pipelineFrame.index = index;
+        pipelineFrame.data = fp;
+        pipelineFrame.captured = systemTime(SYSTEM_TIME_MONOTONIC);
+        pipelineFrame.queued = pipelineFrame.captured;
 
-        CameraBuffer *buffer = mPreviewBufs[index];
-        if (mPixelFormat == V4L2_PIX_FMT_YUYV) {
-            convertYUV422ToNV12Tiler(reinterpret_cast<unsigned char*>(fp), reinterpret_cast<unsigned char*>(buffer->mapped), width, height);
+        // stopping preview flushes the pipeline under mLock before the
+        // buffers go away, nothing may be queued after that
+        android::AutoMutex lock(mLock);
+        if (!mPreviewing) {
+            goto EXIT;
         }
-        CAMHAL_LOGVB("##...index= %d.;camera buffer= 0x%x; mapped= 0x%x.",index, buffer, buffer->mapped);
+
+        android_atomic_inc(&mPipelineInFlight);
+        updateStageStats(STAGE_CAPTURE, pipelineFrame, 0);
+        if (!queueToStage(STAGE_CONVERT, pipelineFrame)) {
+            returnBufferToV4L(index);
+            finishPipelineFrame();
+        }
+    }
+
+EXIT:
+
+    return ret;
+}
+
+bool V4LCameraAdapter::pipelineThread(PipelineStage stage)
+{
+    PipelineFrame frame;
+
+    mStageSems[stage].Wait();
+    if (mPipelineExiting) {
+        return false;
+    }
+
+    if (!mStageRings[stage].pop(frame)) {
+        return true;
+    }
+    int queued = mStageRings[stage].size() + 1;
+
+    // frames still in the pipeline when preview stops are dropped, the
+    // buffers have to be idle before streaming stops and unmaps them
+    if (mPipelineFlushing) {
+        returnBufferToV4L(frame.index);
+        finishPipelineFrame();
+        return true;
+    }
+
+    if (stage == STAGE_CONVERT) {
+        convertFrame(frame);
+        updateStageStats(stage, frame, queued);
+        frame.queued = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (!queueToStage(STAGE_DELIVER, frame)) {
+            returnBufferToV4L(frame.index);
+            finishPipelineFrame();
+        }
+    } else {
+        deliverFrame(frame);
+        updateStageStats(stage, frame, queued);
+        finishPipelineFrame();
+    }
+
+    return true;
+}
+
+void V4LCameraAdapter::convertFrame(const PipelineFrame &pipelineFrame)
+{
+    int width, height;
+    int stride = 4096;
+    char *fp = pipelineFrame.data;
+
+    mParams.getPreviewSize(&width, &height);
+
+    // Frames captured directly are already in the preview buffer,
+    // NV12 from driver buffers only needs a copy to the preview stride
+    CameraBuffer *buffer = mPreviewBufs[pipelineFrame.index];
+    if (mPixelFormat == V4L2_PIX_FMT_YUYV) {
+        convertYUV422ToNV12Tiler(reinterpret_cast<unsigned char*>(fp), reinterpret_cast<unsigned char*>(buffer->mapped), width, height);
+    } else if (!mDirectCapture) {
+        const uint8_t *src = reinterpret_cast<const uint8_t*>(fp);
+        uint8_t *dst = reinterpret_cast<uint8_t*>(buffer->mapped);
+        int srcStride = mVideoInfo->format.fmt.pix.bytesperline ? mVideoInfo->format.fmt.pix.bytesperline : width;
+        Utils::PixelConvert::copyPlane(src, srcStride, dst, stride, width, height);
+        Utils::PixelConvert::copyPlane(src + srcStride * height, srcStride,
+                                       dst + stride * height, stride, width, height / 2);
+    }
+    CAMHAL_LOGVB("##...index= %d.;camera buffer= 0x%x; mapped= 0x%x.",pipelineFrame.index, buffer, buffer->mapped);
 
 #ifdef SAVE_RAW_FRAMES
-        unsigned char* nv12_buff = (unsigned char*) malloc(width*height*3/2);
-        //Convert yuv422i to yuv420sp(NV12) & dump the frame to a file
-        convertYUV422ToNV12 ( (unsigned char*)fp, nv12_buff, width, height);
-        saveFile( nv12_buff, ((width*height)*3/2) );
-        free (nv12_buff);
+    unsigned char* nv12_buff = (unsigned char*) malloc(width*height*3/2);
+    //Convert yuv422i to yuv420sp(NV12) & dump the frame to a file
+    convertYUV422ToNV12 ( (unsigned char*)fp, nv12_buff, width, height);
+    saveFile( nv12_buff, ((width*height)*3/2) );
+    free (nv12_buff);
 #endif
+}
 
-        android::Mutex::Autolock lock(mSubscriberLock);
+void V4LCameraAdapter::deliverFrame(const PipelineFrame &pipelineFrame)
+{
+    status_t ret = NO_ERROR;
+    int width, height;
+    int stride = 4096;
+    CameraFrame frame;
 
-        frame.mFrameType = CameraFrame::PREVIEW_FRAME_SYNC;
-        frame.mBuffer = buffer;
-        frame.mLength = width*height*3/2;
-        frame.mAlignment = stride;
-        frame.mOffset = 0;
-        frame.mTimestamp = systemTime(SYSTEM_TIME_MONOTONIC);
-        frame.mFrameMask = (unsigned int)CameraFrame::PREVIEW_FRAME_SYNC;
+    mParams.getPreviewSize(&width, &height);
 
-        if (mRecording)
-        {
-            frame.mFrameMask |= (unsigned int)CameraFrame::VIDEO_FRAME_SYNC;
-            mFramesWithEncoder++;
+    android::sp<Subscribers> subscribers = getSubscribers();
+
+    frame.mFrameType = CameraFrame::PREVIEW_FRAME_SYNC;
+    frame.mBuffer = mPreviewBufs[pipelineFrame.index];
+    frame.mLength = width*height*3/2;
+    frame.mAlignment = stride;
+    frame.mOffset = 0;
+    frame.mTimestamp = pipelineFrame.captured;
+    frame.mFrameMask = (unsigned int)CameraFrame::PREVIEW_FRAME_SYNC;
+
+    if (mRecording)
+    {
+        frame.mFrameMask |= (unsigned int)CameraFrame::VIDEO_FRAME_SYNC;
+        android_atomic_inc(&mFramesWithEncoder);
+    }
+
+    setBufferOwner(pipelineFrame.index, OWNER_CLIENT);
+    TI_TRACE_V("deliver buffer %d captured %lld", pipelineFrame.index, pipelineFrame.captured);
+    ret = setInitFrameRefCount(frame.mBuffer, frame.mFrameMask, subscribers);
+    if (ret != NO_ERROR) {
+        CAMHAL_LOGDB("Error in setInitFrameRefCount %d", ret);
+    } else {
+        ret = sendFrameToSubscribers(&frame, subscribers);
+    }
+}
+
+bool V4LCameraAdapter::queueToStage(PipelineStage stage, PipelineFrame &frame)
+{
+    setBufferOwner(frame.index, (stage == STAGE_CONVERT) ? OWNER_CONVERT : OWNER_DELIVER);
+
+    if (!mStageRings[stage].push(frame)) {
+        CAMHAL_LOGEB("Pipeline stage %d full, dropping buffer %d", stage, frame.index);
+        TI_TRACE_W("pipeline stage %d full, dropped buffer %d", stage, frame.index);
+        return false;
+    }
+
+    mStageSems[stage].Signal();
+    return true;
+}
+
+void V4LCameraAdapter::finishPipelineFrame()
+{
+    if (android_atomic_dec(&mPipelineInFlight) == 1) {
+        android::AutoMutex lock(mPipelineIdleLock);
+        mPipelineIdleCondition.broadcast();
+    }
+}
+
+void V4LCameraAdapter::setBufferOwner(int index, BufferOwner owner)
+{
+    if ((index >= 0) && (index < NB_BUFFER)) {
+        android_atomic_release_store(owner, &mBufferOwner[index]);
+    }
+}
+
+void V4LCameraAdapter::startPipeline()
+{
+    mPipelineExiting = false;
+    mPipelineFlushing = false;
+    android_atomic_release_store(0, &mPipelineInFlight);
+
+    {
+        android::AutoMutex lock(mPipelineStatsLock);
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            mStageFrames[i] = 0;
+            mStageQueueMax[i] = 0;
+            mStageLatency[i] = 0;
+            mStageLatencyMax[i] = 0;
         }
+    }
 
-        ret = setInitFrameRefCount(frame.mBuffer, frame.mFrameMask);
-        if (ret != NO_ERROR) {
-            CAMHAL_LOGDB("Error in setInitFrameRefCount %d", ret);
-        } else {
-            ret = sendFrameToSubscribers(&frame);
+    // the capture stage reads from the driver, it has no input ring
+    for (int i = STAGE_CONVERT; i < STAGE_COUNT; i++) {
+        mStageRings[i].clear();
+        mStageSems[i].Create(0);
+        mPipelineThreads[i] = new PipelineThread(this, static_cast<PipelineStage>(i));
+    }
+}
+
+void V4LCameraAdapter::stopPipeline()
+{
+    mPipelineExiting = true;
+
+    for (int i = STAGE_CONVERT; i < STAGE_COUNT; i++) {
+        if (mPipelineThreads[i] != NULL) {
+            mPipelineThreads[i]->requestExit();
+            mStageSems[i].Signal();
+            mPipelineThreads[i]->requestExitAndWait();
+            mPipelineThreads[i].clear();
         }
     }
+}
 
-EXIT:
+void V4LCameraAdapter::flushPipeline()
+{
+    mPipelineFlushing = true;
+
+    // The stages may still be reading the V4L buffers, which are unmapped
+    // once streaming stops, so there is no giving up on a slow stage
+    android::AutoMutex lock(mPipelineIdleLock);
+    while (android_atomic_acquire_load(&mPipelineInFlight) > 0) {
+        if (mPipelineIdleCondition.waitRelative(mPipelineIdleLock, 100000000) != NO_ERROR) {
+            CAMHAL_LOGW("Still waiting for the preview pipeline to drain, %d frames left",
+                    android_atomic_acquire_load(&mPipelineInFlight));
+        }
+    }
+}
 
-    return ret;
+void V4LCameraAdapter::updateStageStats(PipelineStage stage, const PipelineFrame &frame, int queued)
+{
+    nsecs_t latency = systemTime(SYSTEM_TIME_MONOTONIC) - frame.queued;
+
+    android::AutoMutex lock(mPipelineStatsLock);
+    mStageFrames[stage]++;
+    mStageLatency[stage] += latency;
+    if (latency > mStageLatencyMax[stage]) {
+        mStageLatencyMax[stage] = latency;
+    }
+    if (queued > mStageQueueMax[stage]) {
+        mStageQueueMax[stage] = queued;
+    }
+
+    if (mDebugFps && (stage == STAGE_DELIVER) && ((mStageFrames[stage] % FPS_PERIOD) == 0)) {
+        CAMHAL_LOGE("Preview pipeline over %d frames: convert avg %llu us max %llu us queue %d, "
+                "deliver avg %llu us max %llu us queue %d",
+                mStageFrames[stage],
+                (unsigned long long) ns2us(mStageLatency[STAGE_CONVERT] / mStageFrames[STAGE_CONVERT]),
+                (unsigned long long) ns2us(mStageLatencyMax[STAGE_CONVERT]), mStageQueueMax[STAGE_CONVERT],
+                (unsigned long long) ns2us(mStageLatency[STAGE_DELIVER] / mStageFrames[STAGE_DELIVER]),
+                (unsigned long long) ns2us(mStageLatencyMax[STAGE_DELIVER]), mStageQueueMax[STAGE_DELIVER]);
+    }
+}
+
+void V4LCameraAdapter::getPipelineStats(PipelineStageStats stats[STAGE_COUNT]) const
+{
+    int dequeued;
+    nsecs_t dequeueLatency, dequeueLatencyMax;
+
+    getDequeueStats(dequeued, dequeueLatency, dequeueLatencyMax);
+
+    android::AutoMutex lock(mPipelineStatsLock);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        stats[i].frames = mStageFrames[i];
+        stats[i].occupancy = 0;
+        stats[i].queueMax = mStageQueueMax[i];
+        stats[i].latency = mStageFrames[i] ? mStageLatency[i] / mStageFrames[i] : 0;
+        stats[i].latencyMax = mStageLatencyMax[i];
+    }
+    stats[STAGE_CAPTURE].latency = dequeueLatency;
+    stats[STAGE_CAPTURE].latencyMax = dequeueLatencyMax;
+
+    for (int i = 0; i < NB_BUFFER; i++) {
+        int owner = android_atomic_acquire_load(&mBufferOwner[i]);
+        if ((owner >= OWNER_CAPTURE) && (owner <= OWNER_DELIVER)) {
+            stats[owner - OWNER_CAPTURE].occupancy++;
+        }
+    }
+}
+
+void V4LCameraAdapter::dump(int fd)
+{
+    static const char *stageNames[STAGE_COUNT] = { "capture", "convert", "deliver" };
+    PipelineStageStats stats[STAGE_COUNT];
+    char line[256];
+
+    getPipelineStats(stats);
+
+    snprintf(line, sizeof(line), "Preview pipeline:\n");
+    write(fd, line, strlen(line));
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        snprintf(line, sizeof(line),
+                 "  %s: %d frames, average %lld us, worst %lld us, %d buffers held, queue max %d\n",
+                 stageNames[i], stats[i].frames, ns2us(stats[i].latency), ns2us(stats[i].latencyMax),
+                 stats[i].occupancy, stats[i].queueMax);
+        write(fd, line, strlen(line));
+    }
+
+    if (isNeedToUseDecoder() && (mDecoder != NULL)) {
+        mDecoder->dump(fd);
+    }
 }
 
 //scan for video devices
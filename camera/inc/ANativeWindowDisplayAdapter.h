@@ -95,17 +95,43 @@ public:
 
     void displayThread();
 
+    ///Prints presentation and drop counts and the display latencies
+    virtual void dump(int fd);
+
     private:
     void destroy();
     bool processHalMsg();
     status_t PostFrame(ANativeWindowDisplayAdapter::DisplayFrame &dispFrame);
+    status_t presentFrameLocked(DisplayFrame &dispFrame, int index, nsecs_t arrival);
+    void presentPendingFrame();
+    void returnStaleFrames();
+    void retryFailedDequeue();
+    int nextWakeup();
     bool handleFrameReturn();
     status_t returnBuffersToWindow();
 
 public:
 
-    static const int DISPLAY_TIMEOUT;
-    static const int FAILED_DQS_TO_SUSPEND;
+    ///Refresh rate frames are paced to, unless camera.display.refresh is set
+    static const int DEFAULT_REFRESH_RATE;
+    ///Delay before a failed dequeue_buffer is retried
+    static const nsecs_t DEQUEUE_RETRY_DELAY;
+
+    ///Presentation counters and latencies, since the display was enabled
+    struct DisplayStats
+        {
+        unsigned int presented;
+        unsigned int dropped;
+        unsigned int cancelled;
+        unsigned int dequeueFailures;
+        ///Frame arrival to enqueue_buffer, the time spent waiting for a slot
+        nsecs_t pacingSum;
+        nsecs_t pacingMax;
+        ///enqueue_buffer to dequeue_buffer, the time the window kept a buffer
+        unsigned int windowCount;
+        nsecs_t windowSum;
+        nsecs_t windowMax;
+        };
 
     class DisplayThread : public android::Thread
         {
@@ -114,7 +140,11 @@ public:
 
         public:
             DisplayThread(ANativeWindowDisplayAdapter* da)
-            : Thread(false), mDisplayAdapter(da) { }
+            : Thread(false), mDisplayAdapter(da)
+                {
+                ///One wakeup for a waiting frame is enough
+                mDisplayThreadQ.setCoalescePolicy(DISPLAY_FRAME, Utils::MessageQueue::COALESCE_KEEP_LATEST);
+                }
 
         ///Returns a reference to the display message Q for display adapter to post messages
             Utils::MessageQueue& msgQ()
@@ -145,8 +175,6 @@ private:
 
 private:
     bool mFirstInit;
-    bool mSuspend;
-    int mFailedDQs;
     bool mPaused; //Pause state
     preview_stream_ops_t*  mANativeWindow;
     android::sp<DisplayThread> mDisplayThread;
@@ -164,6 +192,10 @@ private:
     int mFD;
     android::KeyedVector<buffer_handle_t *, int> mFramesWithCameraAdapterMap;
     android::KeyedVector<int, int> mFramesType;
+    ///Window handle to index in mBuffers
+    android::KeyedVector<buffer_handle_t *, int> mBufferIndex;
+    ///Time each buffer was last enqueued, indexed like mBuffers
+    android::Vector<nsecs_t> mEnqueueTimes;
     android::sp<ErrorNotifier> mErrorNotifier;
 
     uint32_t mFrameWidth;
@@ -180,6 +212,19 @@ private:
     //DOMX will handle lock/unlock of graphic buffers
     bool mUseExternalBufferLocking;
 
+    //Frame pacing, at most one preview frame waits for the next slot
+    //and a newer frame replaces it
+    nsecs_t mPresentInterval;
+    nsecs_t mLastPresent;
+    bool mHasPendingFrame;
+    DisplayFrame mPendingFrame;
+    nsecs_t mPendingArrival;
+    ///Replaced frames, returned to the camera adapter by the display thread
+    android::Vector<DisplayFrame> mStaleFrames;
+    int mFailedDequeues;
+    nsecs_t mDequeueRetryTime;
+    DisplayStats mStats;
+
 #if PPM_INSTRUMENTATION || PPM_INSTRUMENTATION_ABS
     //Used for calculating standby to first shot
     struct timeval mStandbyToShot;
@@ -19,6 +19,8 @@
 #ifndef BASE_CAMERA_ADAPTER_H
 #define BASE_CAMERA_ADAPTER_H
 
+#include <cutils/atomic.h>
+
 #include "CameraHal.h"
 
 namespace Ti {
@@ -72,10 +74,14 @@ public:
 
     virtual status_t setSharedAllocator(camera_request_memory shmem_alloc) { mSharedAllocator = shmem_alloc; return NO_ERROR; };
 
+    virtual void setFrameTimeline(const android::sp<FrameTimeline> &timeline) { mFrameTimeline = timeline; }
+
     // Rolls the state machine back to INTIALIZED_STATE from the current state
     virtual status_t rollbackToInitializedState();
 
 protected:
+    class Subscribers;
+
     //The first two methods will try to switch the adapter state.
     //Every call to setState() should be followed by a corresponding
     //call to commitState(). If the state switch fails, then it will
@@ -171,6 +177,7 @@ protected:
 
     //Send the frame to subscribers
     status_t sendFrameToSubscribers(CameraFrame *frame);
+    status_t sendFrameToSubscribers(CameraFrame *frame, const android::sp<Subscribers> &subscribers);
 
     //Resets the refCount for this particular frame
     status_t resetFrameRefCount(CameraFrame &frame);
@@ -180,15 +187,22 @@ protected:
     int getFrameRefCount(CameraBuffer* frameBuf);
     int getFrameRefCountByType(CameraBuffer* frameBuf, CameraFrame::FrameType frameType);
     int setInitFrameRefCount(CameraBuffer* buf, unsigned int mask);
+    int setInitFrameRefCount(CameraBuffer* buf, unsigned int mask, const android::sp<Subscribers> &subscribers);
     static const char* getLUTvalue_translateHAL(int Value, LUTtypeHAL LUT);
 
 // private member functions
 private:
     status_t __sendFrameToSubscribers(CameraFrame* frame,
-                                      android::KeyedVector<int, frame_callback> *subscribers,
+                                      const android::KeyedVector<int, frame_callback> *subscribers,
                                       CameraFrame::FrameType frameType);
     status_t rollbackToPreviousState();
 
+    static int refTypeIndex(CameraFrame::FrameType frameType);
+    volatile int32_t *frameRef(CameraBuffer *frameBuf, int typeIndex, volatile int32_t **total);
+    static int32_t swapFrameRef(volatile int32_t *ref, int32_t value);
+    static int32_t releaseFrameRef(volatile int32_t *ref);
+    int returnFallbackFrame(CameraBuffer *frameBuf, CameraFrame::FrameType frameType);
+
 // protected data types and variables
 protected:
     enum FrameState {
@@ -219,6 +233,48 @@ protected:
 
 #endif
 
+    // Frame reference counting. Every buffer set handed to the adapter gets
+    // a dense table of counts indexed by the position of the buffer in the
+    // set and by frame type, so counting and returning frames only takes
+    // atomics. A count of -1 means the buffer is not used for that frame
+    // type. Buffers outside the registered sets are counted in the fallback
+    // maps under mFrameRefFallbackLock, their returns are serialized by
+    // mReturnFrameLock.
+    enum RefBufferSet {
+        REF_SET_PREVIEW = 0,
+        REF_SET_PREVIEW_DATA,
+        REF_SET_VIDEO,
+        REF_SET_CAPTURE,
+        REF_SET_VIDEO_IN,
+        REF_SET_COUNT
+    };
+
+    enum RefType {
+        REF_TYPE_PREVIEW = 0,
+        REF_TYPE_SNAPSHOT,
+        REF_TYPE_CAPTURE,       ///< image and raw frames share a count
+        REF_TYPE_FRAME_DATA,
+        REF_TYPE_VIDEO,
+        REF_TYPE_VIDEO_IN,
+        REF_TYPE_COUNT
+    };
+
+    static const int MAX_REF_BUFFERS = 32;
+
+    struct RefBufferTable {
+        CameraBuffer *buffers;
+        volatile int32_t count;
+        volatile int32_t refs[MAX_REF_BUFFERS][REF_TYPE_COUNT];
+        ///sum of the positive counts of a buffer over all frame types
+        volatile int32_t totals[MAX_REF_BUFFERS];
+    };
+
+    void registerFrameRefBuffers(RefBufferSet set, CameraBuffer *buffers, int count);
+    void clearFrameRefCounts(CameraFrame::FrameType frameType);
+
+    RefBufferTable mFrameRefs[REF_SET_COUNT];
+    android::KeyedVector<CameraBuffer *, int> mFrameRefFallback[REF_TYPE_COUNT];
+    mutable android::Mutex mFrameRefFallbackLock;
     mutable android::Mutex mReturnFrameLock;
 
     //Lock protecting the Adapter state
@@ -226,54 +282,93 @@ protected:
     AdapterState mAdapterState;
     AdapterState mNextState;
 
-    //Different frame subscribers get stored using these
-    android::KeyedVector<int, frame_callback> mFrameSubscribers;
-    android::KeyedVector<int, frame_callback> mSnapshotSubscribers;
-    android::KeyedVector<int, frame_callback> mFrameDataSubscribers;
-    android::KeyedVector<int, frame_callback> mVideoSubscribers;
-    android::KeyedVector<int, frame_callback> mVideoInSubscribers;
-    android::KeyedVector<int, frame_callback> mImageSubscribers;
-    android::KeyedVector<int, frame_callback> mRawSubscribers;
-    android::KeyedVector<int, event_callback> mFocusSubscribers;
-    android::KeyedVector<int, event_callback> mZoomSubscribers;
-    android::KeyedVector<int, event_callback> mShutterSubscribers;
-    android::KeyedVector<int, event_callback> mMetadataSubscribers;
+    //Different frame subscribers get stored using these. A published set
+    //is never changed, enableMsgType()/disableMsgType() publish a changed
+    //copy under mSubscriberLock. Every dispatch holds a reference to the
+    //set it runs on, so the reference count tells whether callbacks are
+    //still running on a replaced set.
+    class Subscribers
+    {
+    public:
+        Subscribers() : mRefs(0) { }
+        Subscribers(const Subscribers &other);
+
+        void incStrong(const void *) const
+        {
+            android_atomic_inc(&mRefs);
+        }
+
+        void decStrong(const void *) const
+        {
+            if ( 1 == android_atomic_dec(&mRefs) ) {
+                delete this;
+            }
+        }
+
+        int32_t users() const
+        {
+            return android_atomic_acquire_load(&mRefs);
+        }
+
+        android::KeyedVector<int, frame_callback> mFrameSubscribers;
+        android::KeyedVector<int, frame_callback> mSnapshotSubscribers;
+        android::KeyedVector<int, frame_callback> mFrameDataSubscribers;
+        android::KeyedVector<int, frame_callback> mVideoSubscribers;
+        android::KeyedVector<int, frame_callback> mVideoInSubscribers;
+        android::KeyedVector<int, frame_callback> mImageSubscribers;
+        android::KeyedVector<int, frame_callback> mRawSubscribers;
+        android::KeyedVector<int, event_callback> mFocusSubscribers;
+        android::KeyedVector<int, event_callback> mZoomSubscribers;
+        android::KeyedVector<int, event_callback> mShutterSubscribers;
+        android::KeyedVector<int, event_callback> mMetadataSubscribers;
+
+    private:
+        Subscribers &operator=(const Subscribers &);
+
+        mutable volatile int32_t mRefs;
+    };
+
+    ///Current subscribers, without taking any lock
+    android::sp<Subscribers> getSubscribers() const;
+    void publishSubscribers(const android::sp<Subscribers> &subscribers);
+    void waitForRetiredSubscribers();
+
+    //The published set, mSubscriberReaders counts getSubscribers() calls
+    //between loading the pointer and taking a reference to it
+    Subscribers * volatile mSubscribers;
+    mutable volatile int32_t mSubscriberReaders;
+    //Reference held for mSubscribers, protected by mSubscriberLock
+    android::sp<Subscribers> mPublishedSubscribers;
+    //Replaced sets disableMsgType() has not waited for yet, protected by
+    //mSubscriberLock
+    android::Vector< android::sp<Subscribers> > mRetiredSubscribers;
 
     //Preview buffer management data
     CameraBuffer *mPreviewBuffers;
     int mPreviewBufferCount;
     size_t mPreviewBuffersLength;
-    android::KeyedVector<CameraBuffer *, int> mPreviewBuffersAvailable;
     mutable android::Mutex mPreviewBufferLock;
 
-    //Snapshot buffer management data
-    android::KeyedVector<CameraBuffer *, int> mSnapshotBuffersAvailable;
-    mutable android::Mutex mSnapshotBufferLock;
-
     //Video buffer management data
     CameraBuffer *mVideoBuffers;
-    android::KeyedVector<CameraBuffer *, int> mVideoBuffersAvailable;
     int mVideoBuffersCount;
     size_t mVideoBuffersLength;
     mutable android::Mutex mVideoBufferLock;
 
     //Image buffer management data
     CameraBuffer *mCaptureBuffers;
-    android::KeyedVector<CameraBuffer *, int> mCaptureBuffersAvailable;
     int mCaptureBuffersCount;
     size_t mCaptureBuffersLength;
     mutable android::Mutex mCaptureBufferLock;
 
     //Metadata buffermanagement
     CameraBuffer *mPreviewDataBuffers;
-    android::KeyedVector<CameraBuffer *, int> mPreviewDataBuffersAvailable;
     int mPreviewDataBuffersCount;
     size_t mPreviewDataBuffersLength;
     mutable android::Mutex mPreviewDataBufferLock;
 
     //Video input buffer management data (used for reproc pipe)
     CameraBuffer *mVideoInBuffers;
-    android::KeyedVector<CameraBuffer *, int> mVideoInBuffersAvailable;
     mutable android::Mutex mVideoInBufferLock;
 
     Utils::MessageQueue mFrameQ;
@@ -282,6 +377,7 @@ protected:
     ErrorNotifier *mErrorNotifier;
     release_image_buffers_callback mReleaseImageBuffersCallback;
     end_image_capture_callback mEndImageCaptureCallback;
+    android::sp<FrameTimeline> mFrameTimeline;
     void *mReleaseData;
     void *mEndCaptureData;
     bool mRecording;
@@ -289,8 +385,8 @@ protected:
     camera_request_memory mSharedAllocator;
 
     uint32_t mFramesWithDucati;
-    uint32_t mFramesWithDisplay;
-    uint32_t mFramesWithEncoder;
+    volatile int32_t mFramesWithDisplay;
+    volatile int32_t mFramesWithEncoder;
 
 #ifdef CAMERAHAL_DEBUG
     android::Mutex mBuffersWithDucatiLock;
@@ -298,6 +394,7 @@ protected:
 #endif
 
     android::KeyedVector<void *, CameraFrame *> mFrameQueue;
+    mutable android::Mutex mFrameQueueLock;
 };
 
 } // namespace Camera
@@ -34,6 +34,7 @@
 #include <utils/Log.h>
 #include <utils/threads.h>
 #include <utils/threads.h>
+#include <utils/SortedVector.h>
 #include <binder/MemoryBase.h>
 #include <binder/MemoryHeapBase.h>
 #include <camera/CameraParameters.h>
@@ -60,6 +61,7 @@
 #include "Semaphore.h"
 #include "CameraProperties.h"
 #include "SensorListener.h"
+#include "FrameTimeline.h"
 
 //temporarily define format here
 #define HAL_PIXEL_FORMAT_TI_NV12 0x100
@@ -136,6 +138,8 @@ class CameraHal;
 class CameraFrame;
 class CameraHalEvent;
 class DisplayFrame;
+class JpegEncoderPool;
+class MemoryManager;
 
 class FpsRange {
 public:
@@ -264,6 +268,23 @@ protected:
     size_t mWeight;
 };
 
+///Comma separated capability list, e.g. "auto,macro" or "640x480,320x240",
+///split once so a lookup is a binary search instead of a strtok() pass
+class CapabilitySet
+{
+public:
+    CapabilitySet() {}
+
+    void setTo(const char *list);
+
+    bool contains(const char *value) const;
+    bool contains(int value) const;
+    bool containsResolution(int width, int height) const;
+
+private:
+    android::SortedVector<android::String8> mValues;
+};
+
 class CameraMetadataResult : public android::RefBase
 {
 public:
@@ -546,6 +567,8 @@ typedef void (*event_callback) (CameraHalEvent *event);
 //signals CameraHAL to relase image buffers
 typedef void (*release_image_buffers_callback) (void *userData);
 typedef void (*end_image_capture_callback) (void *userData);
+//signals CameraHAL that a preview frame reached the display
+typedef void (*frame_displayed_callback) (void *userData);
 
 /**
   * Interface class implemented by classes that have some events to communicate to dependendent classes
@@ -663,12 +686,19 @@ public:
     ///Constants
     static const int NOTIFIER_TIMEOUT;
     static const int32_t MAX_BUFFERS = 8;
+    ///Buffers the adapter keeps while frames are lent to the application
+    static const int32_t MIN_UNLENT_PREVIEW_BUFFERS = 2;
+    ///Frame messages dequeued at once when flushing mFrameQ
+    static const int FLUSH_BATCH_SIZE = 16;
+    ///Preview frames waiting in mFrameQ before the oldest is returned unsent
+    static const int MAX_QUEUED_PREVIEW_FRAMES = 2;
 
     enum NotifierCommands
         {
         NOTIFIER_CMD_PROCESS_EVENT,
         NOTIFIER_CMD_PROCESS_FRAME,
-        NOTIFIER_CMD_PROCESS_ERROR
+        NOTIFIER_CMD_PROCESS_ERROR,
+        NOTIFIER_CMD_PROCESS_PREVIEW_FRAME
         };
 
     enum NotifierState
@@ -697,6 +727,9 @@ public:
     //All sub-components of Camera HAL call this whenever any error happens
     virtual void errorNotify(int error);
 
+    //Allocates the preview callback heap ahead of startPreviewCallbacks(),
+    // so it can be done while the adapter is still busy with its buffers
+    status_t preparePreviewCallbacks(const char *format, int width, int height);
     status_t startPreviewCallbacks(android::CameraParameters &params, CameraBuffer *buffers, uint32_t *offsets, int fd, size_t length, size_t count);
     status_t stopPreviewCallbacks();
 
@@ -712,6 +745,7 @@ public:
     ///Notification callback functions
     static void frameCallbackRelay(CameraFrame* caFrame);
     static void eventCallbackRelay(CameraHalEvent* chEvt);
+    static void frameDropRelay(Utils::Message *msg, void *cookie);
     void frameCallback(CameraFrame* caFrame);
     void eventCallback(CameraHalEvent* chEvt);
     void flushAndReturnFrames();
@@ -743,6 +777,16 @@ public:
 
     void flushEventQueue();
     void setExternalLocking(bool extBuffLocking);
+    void setResizeThreads(int threads);
+
+    ///Trims the buffer pool of memoryManager once delay passes, NULL cancels
+    void scheduleMemoryTrim(const android::sp<MemoryManager> &memoryManager, nsecs_t delay);
+
+    ///Prints the frame and event queue statistics
+    void dump(int fd);
+
+    ///Timeline the callback and encoder input stages are stamped in
+    void setFrameTimeline(const android::sp<FrameTimeline> &timeline);
 
     //Internal class definitions
     class NotificationThread : public android::Thread {
@@ -754,6 +798,7 @@ public:
         NOTIFIER_START,
         NOTIFIER_STOP,
         NOTIFIER_EXIT,
+        NOTIFIER_TRIM_SCHEDULED,
         };
     public:
         NotificationThread(AppCallbackNotifier* nh)
@@ -772,10 +817,18 @@ private:
     void notifyEvent();
     void notifyFrame();
     bool processMessage();
+    int memoryTrimTimeout();
+    void trimIdleMemory();
     void releaseSharedVideoBuffers();
     status_t dummyRaw();
     void copyAndSendPictureFrame(CameraFrame* frame, int32_t msgType);
     void copyAndSendPreviewFrame(CameraFrame* frame, int32_t msgType);
+    bool canSendPreviewFrameInPlace(CameraFrame* frame, size_t &size);
+    camera_memory_t* getInPlacePreviewMemory(CameraBuffer *buffer, size_t size);
+    void returnLentPreviewFrames(size_t keep);
+    void returnDroppedFrames();
+    void releaseInPlacePreviewMemory();
+    void releasePreparedPreviewMemory();
     size_t calculateBufferSize(size_t width, size_t height, const char *pixelFormat);
     const char* getContstantForPixelFormat(const char *pixelFormat);
     void lockBufferAndUpdatePtrs(CameraFrame* frame);
@@ -804,6 +857,7 @@ private:
     bool mBufferReleased;
 
     android::sp< NotificationThread> mNotificationThread;
+    android::sp<JpegEncoderPool> mEncoderPool;
     EventProvider *mEventProvider;
     FrameProvider *mFrameProvider;
     Utils::MessageQueue mEventQ;
@@ -812,6 +866,9 @@ private:
 
     bool mPreviewing;
     camera_memory_t* mPreviewMemory;
+    //Heap from preparePreviewCallbacks() not yet taken by startPreviewCallbacks()
+    camera_memory_t* mPreparedPreviewMemory;
+    size_t mPreparedPreviewSize;
     CameraBuffer mPreviewBuffers[MAX_BUFFERS];
     int mPreviewBufCount;
     int mPreviewWidth;
@@ -821,6 +878,24 @@ private:
     android::KeyedVector<unsigned int, android::sp<android::MemoryHeapBase> > mSharedPreviewHeaps;
     android::KeyedVector<unsigned int, android::sp<android::MemoryBase> > mSharedPreviewBuffers;
 
+    //Zero-copy preview callbacks: frames whose layout already matches the
+    //requested one are sent straight from the mapped ION buffer. Like a slot
+    //of the copied ring, a lent frame stays valid until MAX_BUFFERS newer
+    //frames are sent, fewer if the adapter has not enough buffers to spare.
+    struct LentPreviewFrame {
+        CameraBuffer *mBuffer;
+        int mFrameType;
+    };
+    bool mZeroCopyPreview;
+    android::KeyedVector<CameraBuffer *, camera_memory_t *> mInPlacePreviewMemory;
+    android::Vector<LentPreviewFrame> mLentPreviewFrames;
+    size_t mLentPreviewLimit;
+
+    //Preview frames coalesced out of mFrameQ. The drop happens inside the
+    //adapter's frame dispatch, so they are returned from the notifier thread.
+    android::Mutex mDroppedFramesLock;
+    android::Vector<CameraFrame *> mDroppedFrames;
+
     //Burst mode active
     bool mBurst;
     mutable android::Mutex mRecordingLock;
@@ -837,6 +912,14 @@ private:
 
     bool mExternalLocking;
 
+    int mResizeThreads;
+
+    //Pool trimmed by the notifier thread once the camera has been idle
+    android::sp<MemoryManager> mTrimMemoryManager;
+    nsecs_t mTrimDeadline;
+
+    android::sp<FrameTimeline> mFrameTimeline;
+
 };
 
 
@@ -846,6 +929,11 @@ private:
 class MemoryManager : public BufferProvider, public virtual android::RefBase
 {
 public:
+    ///Memory kept mapped in the buffer pool, "camera.ionpool.maxsize" (MB) overrides it
+    static const int POOL_DEFAULT_MAX_MB = 32;
+    ///Pooled buffers unused for longer than this are released by trimPool()
+    static const int POOL_IDLE_TIMEOUT_MS = 10000;
+
     MemoryManager();
     ~MemoryManager();
 
@@ -858,9 +946,37 @@ public:
     virtual int getFd() ;
     virtual int freeBufferList(CameraBuffer * buflist);
 
+    ///Releases pooled buffers unused for longer than maxIdle, all of them for 0
+    void trimPool(nsecs_t maxIdle);
+    void dump(int fd);
+
 private:
+    ///Freed ION buffer kept allocated and mapped for the next request of
+    ///the same size and format
+    struct PooledBuffer {
+        struct ion_handle *handle;
+        int fd;
+        unsigned char *data;
+        int size;
+        const char *format;
+        nsecs_t released;
+    };
+
+    status_t allocateIonBuffer(int size, CameraBuffer &buffer);
+    void freeIonBuffer(struct ion_handle *handle, int fd, void *data, int size);
+    bool takePooledBufferLocked(int size, const char *format, CameraBuffer &buffer);
+    void trimPoolLocked(nsecs_t maxIdle, size_t maxBytes);
+
     android::sp<ErrorNotifier> mErrorNotifier;
     int mIonFd;
+
+    android::Mutex mPoolLock;
+    android::Vector<PooledBuffer> mPool;
+    size_t mPoolBytes;
+    size_t mPoolMaxBytes;
+    uint32_t mPoolHits;
+    uint32_t mPoolMisses;
+    uint32_t mPoolTrimmed;
 };
 
 
@@ -1019,6 +1135,16 @@ public:
 
     virtual status_t setSharedAllocator(camera_request_memory shmem_alloc) = 0;
 
+    // Print adapter statistics, if the adapter keeps any
+    virtual void dump(int fd) { }
+
+    // Timeline the adapter starts every preview and video frame in
+    virtual void setFrameTimeline(const android::sp<FrameTimeline> &timeline) { }
+
+    // False for parameter keys the adapter never reads, changing only those
+    // doesn't need a setParameters() call
+    virtual bool isParameterUsed(const char *key) const { return true; }
+
 protected:
     //The first two methods will try to switch the adapter state.
     //Every call to setState() should be followed by a corresponding
@@ -1071,10 +1197,30 @@ public:
     // Given a vector of DisplayAdapters find the one corresponding to str
     virtual bool match(const char * str) { return false; }
 
+    // Print display statistics, if the adapter keeps any
+    virtual void dump(int fd) { }
+
+    // Called every time a preview frame is queued to the window
+    void registerFrameDisplayedCallback(frame_displayed_callback callback, void *user_data);
+
+    // Timeline of the camera the displayed frames come from
+    void setFrameTimeline(const android::sp<FrameTimeline> &timeline) { mFrameTimeline = timeline; }
+
+protected:
+    void notifyFrameDisplayed() {
+        if ( NULL != mFrameDisplayedCallback ) {
+            mFrameDisplayedCallback(mFrameDisplayedUserData);
+        }
+    }
+
+    android::sp<FrameTimeline> mFrameTimeline;
+
 private:
 #ifdef OMAP_ENHANCEMENT_CPCAM
     preview_stream_extended_ops_t * mExtendedOps;
 #endif
+    frame_displayed_callback mFrameDisplayedCallback;
+    void *mFrameDisplayedUserData;
 };
 
 static void releaseImageBuffers(void *userData);
@@ -1279,6 +1425,9 @@ public:
     // Use external locking for graphic buffers
     void setExternalLocking(bool extBuffLocking);
 
+    // Thread budget for NV12 resizing, 0 uses all cores
+    void setResizeThreads(int threads);
+
      //@}
 
 /*--------------------Internal Member functions - Public---------------------------------*/
@@ -1321,6 +1470,11 @@ public:
     void eventCallback(CameraHalEvent* event);
     void setEventProvider(int32_t eventMask, MessageNotifier * eventProvider);
 
+    //Ends the startup measurement on the first preview frame displayed or
+    //sent to the application
+    static void previewFrameDeliveredRelay(void *userData);
+    void previewFrameDelivered();
+
     static const char* getPixelFormatConstant(const char* parameters_format);
     static size_t calculateBufferSize(const char* parameters_format, int width, int height);
     static void getXYFromOffset(unsigned int *x, unsigned int *y,
@@ -1354,6 +1508,15 @@ private:
     /** Free preview data buffers */
     status_t freePreviewDataBufs();
 
+    /** Start the callback notifier and allocate its preview heap */
+    status_t startAppCallbackNotifier(const char *format, int width, int height);
+
+    /** Stamp the end of CAMERA_START_PREVIEW, the report waits for the first frame */
+    void reportPreviewStartup();
+
+    /** Log and keep the startup latency once both ends are stamped */
+    void finishPreviewStartupLocked();
+
     /** Allocate preview buffers */
     status_t allocPreviewBufs(int width, int height, const char* previewFormat, unsigned int bufferCount, unsigned int &max_queueable);
 
@@ -1390,6 +1553,25 @@ private:
     bool isParameterValid(int param, const char *supportedParams);
     status_t doesSetParameterNeedUpdate(const char *new_param, const char *old_params, bool &update);
 
+    //Same checks against a capability of mCameraProperties, the list is
+    // parsed on first use and kept in mCapabilities
+    const CapabilitySet &getCapabilitySet(const char *capability);
+    bool isCapabilitySupported(const char *value, const char *capability);
+    bool isCapabilityResolution(int width, int height, const char *capability);
+
+    //Passes parameters to the adapter unless they are exactly what it got
+    // last time, force always passes them
+    status_t setAdapterParameters(const android::CameraParameters &params, bool force);
+    //Next setAdapterParameters() passes the parameters whatever they are
+    void invalidateAdapterParameters();
+    //True if a key the adapter uses differs from what it got last time
+    bool adapterParametersChanged(const android::String8 &flattened) const;
+    //mParameters changed outside of setParameters(), the next call is applied
+    void invalidateLastParameters();
+
+    //Preview, recording and paused display flags, setParameters() depends on them
+    int getParametersState() const;
+
     /** Initialize default parameters */
     void initDefaultParameters();
 
@@ -1497,6 +1679,8 @@ private:
 
     //Index of current camera adapter
     int mCameraIndex;
+    ///Preview and video frames of this camera through the HAL
+    android::sp<FrameTimeline> mFrameTimeline;
 
     mutable android::Mutex mLock;
 
@@ -1541,6 +1725,82 @@ private:
     bool mPreviewStartInProgress;
     bool mPreviewInitializationDone;
 
+    ///Runs startAppCallbackNotifier() while the adapter registers the preview buffers
+    class PreviewStartThread : public android::Thread {
+    public:
+        PreviewStartThread(CameraHal *hal, const char *format, int width, int height)
+            : Thread(false), mHal(hal), mFormat(format), mWidth(width), mHeight(height),
+              mStatus(NO_INIT), mDuration(0) { }
+
+        virtual bool threadLoop() {
+            const nsecs_t start = systemTime();
+            mStatus = mHal->startAppCallbackNotifier(mFormat, mWidth, mHeight);
+            mDuration = systemTime() - start;
+            return false;
+        }
+
+        ///Valid once join() returned
+        status_t status() const { return mStatus; }
+        nsecs_t duration() const { return mDuration; }
+
+    private:
+        CameraHal *mHal;
+        const char *mFormat;
+        int mWidth;
+        int mHeight;
+        status_t mStatus;
+        nsecs_t mDuration;
+    };
+
+    ///Duration of each startPreview phase, in nanoseconds
+    struct PreviewStartupTimes {
+        nsecs_t setup;          // adapter parameters and resolution query
+        nsecs_t alloc;          // preview and measurement buffers
+        nsecs_t useBuffers;     // CAMERA_USE_BUFFERS_PREVIEW, adapter loaded to idle
+        nsecs_t notifier;       // notifier start, overlaps useBuffers
+        nsecs_t notifierWait;   // left waiting for the notifier after useBuffers
+        nsecs_t callbacks;      // preview callbacks registration
+        nsecs_t display;        // display adapter enable
+        nsecs_t adapterStart;   // CAMERA_START_PREVIEW
+        nsecs_t firstFrame;     // from there to the first frame displayed or sent
+        nsecs_t total;
+    };
+
+    ///Pre-parsed capability lists, keyed by the CameraProperties key
+    android::KeyedVector<const char *, CapabilitySet> mCapabilities;
+
+    ///Parameters string of the last successful setParameters() and the preview
+    ///state it was applied in. A repeated call finding the same returns without
+    ///applying anything.
+    android::String8 mLastParameters;
+    int mLastParametersState;
+    ///Flattened parameters as last passed to the adapter, empty if unknown
+    android::String8 mAdapterParameters;
+
+    struct SetParametersStats {
+        unsigned int calls;
+        unsigned int unchanged;         // returned early, nothing changed
+        unsigned int adapterUpdates;
+        unsigned int adapterSkipped;    // adapter already had these parameters
+        nsecs_t time;
+    };
+    ///Taken on its own, so dump() doesn't wait behind mLock
+    mutable android::Mutex mSetParametersStatsLock;
+    SetParametersStats mSetParametersStats;
+
+    nsecs_t mStartupBegin;
+    PreviewStartupTimes mStartupTimes;
+    ///Set while the first preview frame of a startup is awaited
+    volatile int32_t mStartupAwaitingFrame;
+    ///Last startup and statistics over all of them, for dump()
+    mutable android::Mutex mStartupLock;
+    nsecs_t mStartupAdapterStarted;
+    nsecs_t mStartupFirstFrame;
+    PreviewStartupTimes mStartupLast;
+    unsigned int mStartupCount;
+    nsecs_t mStartupTotalSum;
+    nsecs_t mStartupTotalMax;
+
     bool mSetPreviewWindowCalled;
 
     uint32_t mPreviewWidth;
@@ -1554,6 +1814,8 @@ private:
 
     bool mExternalLocking;
 
+    int mResizeThreads;
+
     const SocFamily mSocFamily;
 };
 
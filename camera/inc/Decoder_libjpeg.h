@@ -27,6 +27,9 @@ extern "C" {
 
 }
 
+// rows of one iMCU row of a 2x2 subsampled image, the most jpeg_read_raw_data
+// hands out per call
+#define MAX_RAW_ROWS 16
 
 namespace Ti {
 namespace Camera {
@@ -40,15 +43,17 @@ public:
     static int readDHTSize();
     static bool isDhtExist(unsigned char *jpeg_src,  int filled_len);
     static int appendDHT(unsigned char *jpeg_src, int filled_len, unsigned char *jpeg_with_dht_buffer, int buff_size);
-    bool decode(unsigned char *jpeg_src, int filled_len, unsigned char *nv12_buffer, int stride);
+    static int scaleDenom(int width, int height, int out_width, int out_height);
+    bool decode(unsigned char *jpeg_src, int filled_len, unsigned char *nv12_buffer, int stride,
+                int out_width = 0, int out_height = 0, int scale_denom = 1);
 
 private:
     void release();
-    unsigned char **Y_Plane;
-    unsigned char **U_Plane;
-    unsigned char **V_Plane;
-    unsigned char *UV_Plane;
-    unsigned int mWidth, mHeight;
+    unsigned char *Y_Plane[MAX_RAW_ROWS];
+    unsigned char *U_Plane[MAX_RAW_ROWS];
+    unsigned char *V_Plane[MAX_RAW_ROWS];
+    unsigned char *mScratch;
+    unsigned int mScratchSize;
 };
 
 } // namespace Camera
@@ -42,11 +42,17 @@ extern "C" {
 namespace Ti {
 namespace Camera {
 
+class JpegEncoderPool;
+
 /**
  * libjpeg encoder class - uses libjpeg to encode yuv
  */
 
-#define MAX_EXIF_TAGS_SUPPORTED 30
+#define MAX_EXIF_TAGS_SUPPORTED 48
+#define MAX_EXIF_DATA_SIZE 2048
+
+// room left in front of the main JPEG for SOI and the largest APP1 segment
+#define EXIF_APP1_HEADROOM (2 + 0xFFFF)
 typedef void (*encoder_libjpeg_callback_t) (void* main_jpeg,
                                             void* thumb_jpeg,
                                             CameraFrame::FrameType type,
@@ -56,7 +62,7 @@ typedef void (*encoder_libjpeg_callback_t) (void* main_jpeg,
                                             void* cookie4,
                                             bool canceled);
 
-// these have to match strings defined in external/jhead/exif.c
+// names of the elements understood by ExifElementsTable::insertElement
 static const char TAG_MODEL[] = "Model";
 static const char TAG_MAKE[] = "Make";
 static const char TAG_FOCALLENGTH[] = "FocalLength";
@@ -93,37 +99,49 @@ static const char TAG_SHUTTERSPEED[] = "ShutterSpeedValue";
 static const char TAG_SENSING_METHOD[] = "SensingMethod";
 static const char TAG_CUSTOM_RENDERED[] = "CustomRendered";
 
+/**
+ * EXIF elements of a capture, converted to their binary TIFF form as they
+ * are inserted. Tables are plain data, so a table holding the elements that
+ * do not change between shots can be kept per session and copied for every
+ * capture, which then only inserts or replaces the per-shot elements.
+ */
 class ExifElementsTable {
     public:
-        ExifElementsTable() :
-           gps_tag_count(0), exif_tag_count(0), position(0),
-           jpeg_opened(false)
-        {
-#ifdef ANDROID_API_JB_OR_LATER
-            has_datetime_tag = false;
-#endif
-        }
-        ~ExifElementsTable();
+        ExifElementsTable();
 
         status_t insertElement(const char* tag, const char* value);
-        void insertExifToJpeg(unsigned char* jpeg, size_t jpeg_size);
-        status_t insertExifThumbnailImage(const char*, int);
-        void saveJpeg(unsigned char* picture, size_t jpeg_size);
+        uint8_t* insertExifToJpeg(uint8_t* jpeg, size_t jpeg_size,
+                                  const uint8_t* thumb, size_t thumb_size,
+                                  size_t* exif_jpeg_size);
         static const char* degreesToExifOrientation(unsigned int);
         static void stringToRational(const char*, unsigned int*, unsigned int*);
         static bool isAsciiTag(const char* tag);
     private:
-        ExifElement_t table[MAX_EXIF_TAGS_SUPPORTED];
-        unsigned int gps_tag_count;
-        unsigned int exif_tag_count;
+        struct Element {
+            uint16_t tag;
+            uint16_t type;
+            uint32_t count;
+            uint16_t offset;
+            uint16_t size;
+            uint8_t ifd;
+        };
+
+        Element table[MAX_EXIF_TAGS_SUPPORTED];
+        uint8_t data[MAX_EXIF_DATA_SIZE];
+        unsigned int data_size;
         unsigned int position;
-        bool jpeg_opened;
-#ifdef ANDROID_API_JB_OR_LATER
-        bool has_datetime_tag;
-#endif
+
+        status_t setElement(uint16_t tag, uint8_t ifd, uint16_t type,
+                            uint32_t count, const uint8_t* value, size_t size);
+        size_t writeApp1(uint8_t* app1, const uint8_t* thumb, size_t thumb_size) const;
 };
 
-class Encoder_libjpeg : public android::Thread {
+/**
+ * One capture worth of JPEG encoding: the main image and an optional
+ * thumbnail. Both parts run on JpegEncoderPool workers and the completion
+ * callback is invoked by whichever part finishes last.
+ */
+class Encoder_libjpeg : public virtual android::RefBase {
     /* public member types and variables */
     public:
         struct params {
@@ -140,6 +158,8 @@ class Encoder_libjpeg : public android::Thread {
             int start_offset;
             const char* format;
             size_t jpeg_size;
+            int resize_threads; // thread budget for NV12 resizing, 0 uses all cores
+            int strips; // MCU strips encoded in parallel for large images, 1 encodes serially
          };
     /* public member functions */
     public:
@@ -150,60 +170,29 @@ class Encoder_libjpeg : public android::Thread {
                         void* cookie1,
                         void* cookie2,
                         void* cookie3, void *cookie4)
-            : android::Thread(false), mMainInput(main_jpeg), mThumbnailInput(tn_jpeg), mCb(cb),
+            : mMainInput(main_jpeg), mThumbnailInput(tn_jpeg), mCb(cb),
               mCancelEncoding(false), mCookie1(cookie1), mCookie2(cookie2), mCookie3(cookie3), mCookie4(cookie4),
-              mType(type), mThumb(NULL) {
-            this->incStrong(this);
-            mCancelSem.Create(0);
+              mType(type), mPool(NULL), mPendingParts(tn_jpeg ? 2 : 1), mDone(false) {
         }
 
         ~Encoder_libjpeg() {
             CAMHAL_LOGVB("~Encoder_libjpeg(%p)", this);
         }
 
-        virtual bool threadLoop() {
-            size_t size = 0;
-            if (mThumbnailInput) {
-                // start thread to encode thumbnail
-                mThumb = new Encoder_libjpeg(mThumbnailInput, NULL, NULL, mType, NULL, NULL, NULL, NULL);
-#ifdef ANDROID_API_N_OR_LATER
-                mThumb->run("thumbnail_encoder");
-#else
-                mThumb->run();
-#endif
-            }
-
-            // encode our main image
-            size = encode(mMainInput);
-
-            // signal cancel semaphore incase somebody is waiting
-            mCancelSem.Signal();
-
-            // check if it is main jpeg thread
-            if(mThumb.get()) {
-                // wait until tn jpeg thread exits.
-                mThumb->join();
-                mThumb.clear();
-                mThumb = NULL;
-            }
-
-            if(mCb) {
-                mCb(mMainInput, mThumbnailInput, mType, mCookie1, mCookie2, mCookie3, mCookie4, mCancelEncoding);
-            }
-
-            // encoder thread runs, self-destructs, and then exits
-            this->decStrong(this);
-            return false;
+        void setPool(JpegEncoderPool *pool) {
+            mPool = pool;
         }
 
-        void cancel() {
-           mCancelEncoding = true;
-           if (mThumb.get()) {
-               mThumb->cancel();
-               mCancelSem.WaitTimeout(CANCEL_TIMEOUT);
-           }
+        bool hasThumbnail() const {
+            return (NULL != mThumbnailInput);
         }
 
+        ///Encodes the main image or the thumbnail, the last part to finish runs the callback
+        void encodePart(bool thumbnail);
+
+        ///Stops encoding and waits up to CANCEL_TIMEOUT for the running parts to finish
+        void cancel();
+
         void getCookies(void **cookie1, void **cookie2, void **cookie3) {
             if (cookie1) *cookie1 = mCookie1;
             if (cookie2) *cookie2 = mCookie2;
@@ -214,16 +203,104 @@ class Encoder_libjpeg : public android::Thread {
         params* mMainInput;
         params* mThumbnailInput;
         encoder_libjpeg_callback_t mCb;
-        bool mCancelEncoding;
+        volatile bool mCancelEncoding;
         void* mCookie1;
         void* mCookie2;
         void* mCookie3;
         void* mCookie4;
         CameraFrame::FrameType mType;
-        android::sp<Encoder_libjpeg> mThumb;
-        Utils::Semaphore mCancelSem;
+        JpegEncoderPool *mPool;
+
+        android::Mutex mDoneLock;
+        android::Condition mDoneCondition;
+        int mPendingParts;
+        bool mDone;
 
         size_t encode(params*);
+        size_t encodeRows(params* input, uint8_t* src, int first_row, int rows,
+                          uint8_t* dst, int dst_size, unsigned int restart_interval,
+                          bool* overflow);
+        size_t encodeStrips(params* input, uint8_t* src);
+        static void encodeStrip(void* cookie, int index);
+};
+
+/**
+ * Persistent, bounded pool of JPEG encoder threads shared by all captures.
+ * Thumbnails are encoded ahead of main images, and the number of captures
+ * in flight is bounded so that callers can be throttled with waitForSlot().
+ */
+class JpegEncoderPool : public virtual android::RefBase {
+    public:
+        ///Minimum number of workers, one less than the cores are started
+        static const int ENCODER_THREADS = 2;
+        static const size_t MAX_PENDING_JOBS = 4;
+
+        JpegEncoderPool();
+        ~JpegEncoderPool();
+
+        ///Starts the worker threads
+        status_t initialize();
+
+        ///Finishes the queued work and joins the worker threads
+        void release();
+
+        ///Blocks while MAX_PENDING_JOBS captures are in flight
+        status_t waitForSlot();
+
+        ///Schedules both parts of a job, key identifies it for remove()
+        status_t queue(void *key, const android::sp<Encoder_libjpeg> &job);
+
+        ///Stops tracking a finished job and frees its slot
+        void remove(void *key);
+
+        ///Stops tracking every job and hands them to the caller
+        void removeAll(android::Vector< android::sp<Encoder_libjpeg> > &jobs);
+
+        ///Runs fn(cookie, i) for every i below count on the workers and the caller
+        void parallelFor(void (*fn)(void *, int), void *cookie, int count);
+
+        ///Number of strips the idle workers and the caller can encode at once
+        int maxStrips();
+
+    private:
+        class WorkerThread : public android::Thread {
+            JpegEncoderPool *mPool;
+        public:
+            WorkerThread(JpegEncoderPool *pool)
+                : Thread(false), mPool(pool) { }
+            virtual bool threadLoop() {
+                return mPool->workerLoop();
+            }
+        };
+
+        struct Task {
+            android::sp<Encoder_libjpeg> job;
+            bool thumbnail;
+        };
+
+        struct ParallelJob {
+            void (*fn)(void *, int);
+            void *cookie;
+            int count;
+            int next;
+            int done;
+        };
+
+        bool workerLoop();
+        int claimLocked(ParallelJob *job);
+        static int onlineCores();
+
+        android::Mutex mLock;
+        android::Condition mTaskCondition;
+        android::Condition mSlotCondition;
+        android::Condition mParallelCondition;
+        android::Vector<ParallelJob *> mParallelJobs;
+        android::Vector<Task> mThumbnailTasks;
+        android::Vector<Task> mMainTasks;
+        android::KeyedVector<void *, android::sp<Encoder_libjpeg> > mJobs;
+        android::Vector< android::sp<WorkerThread> > mWorkers;
+        int mIdleWorkers;
+        bool mExiting;
 };
 
 } // namespace Camera
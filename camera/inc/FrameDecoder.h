@@ -104,12 +104,24 @@ private:
 };
 
 struct DecoderParameters {
+    // size of the stream delivered by the camera
     int width;
     int height;
     int inputBufferCount;
     int outputBufferCount;
+    // size and line stride of the preview buffers the frames are decoded to,
+    // a zero size means the same as the stream
+    int outputWidth;
+    int outputHeight;
+    int outputStride;
+    // frames decoded in parallel by a software decoder, 0 uses all cores
+    int decoderThreads;
 };
 
+// Called by decoders that finish frames on their own threads, whenever
+// there is output or a consumed input to dequeue
+typedef void (*decoder_output_callback)(void *user_data);
+
 class FrameDecoder {
 public:
     FrameDecoder();
@@ -144,6 +156,15 @@ public:
         mCameraHal = hal;
     }
 
+    void registerOutputCallback(decoder_output_callback callback, void *user_data) {
+        android::AutoMutex lock(mLock);
+        mOutputCallback = callback;
+        mOutputCallbackData = user_data;
+    }
+
+    // Print decoder statistics, if the decoder keeps any
+    virtual void dump(int fd) { }
+
 protected:
     virtual void doConfigure(const DecoderParameters& config) = 0;
     virtual void doProcessInputBuffer() = 0;
@@ -152,6 +173,12 @@ protected:
     virtual void doFlush() = 0;
     virtual void doRelease() = 0;
 
+    void notifyOutputReady() {
+        if (mOutputCallback) {
+            mOutputCallback(mOutputCallbackData);
+        }
+    }
+
     DecoderParameters mParams;
 
     android::Vector<int> mInQueue;
@@ -162,6 +189,9 @@ protected:
 
     CameraHal* mCameraHal;
 
+    decoder_output_callback mOutputCallback;
+    void *mOutputCallbackData;
+
 private:
     DecoderState mState;
     android::Mutex mLock;
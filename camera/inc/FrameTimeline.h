@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+* @file FrameTimeline.h
+*
+* Per-frame timeline of preview and video buffers through the HAL
+*
+*/
+
+#ifndef ANDROID_CAMERA_HARDWARE_FRAME_TIMELINE_H
+#define ANDROID_CAMERA_HARDWARE_FRAME_TIMELINE_H
+
+#include <stdint.h>
+#include <utils/Errors.h>
+#include <utils/RefBase.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>
+
+namespace Ti {
+namespace Camera {
+
+/**
+ * Ring of the last RING_SIZE frames of one camera, each with the time it
+ * reached every stage. CameraHal owns it and hands it to its adapters and
+ * notifier. Frames are identified by their buffer: the adapter starts a
+ * frame when it sends a buffer to its subscribers, later stages stamp the
+ * newest frame of the same buffer. Always enabled, a mark costs an
+ * uncontended lock and a short search. dump() prints the percentiles of
+ * every stage, exportTo() writes the raw ring as CSV.
+ */
+class FrameTimeline : public virtual android::RefBase
+{
+public:
+    enum Stage {
+        STAGE_SENSOR = 0,
+        STAGE_ADAPTER_RECEIVE,
+        STAGE_DISPLAY_ENQUEUE,
+        STAGE_DISPLAY_DEQUEUE,
+        STAGE_CALLBACK,
+        STAGE_ENCODER_INPUT,
+        STAGE_COUNT
+    };
+
+    ///Frames kept, power of two
+    static const int RING_SIZE = 512;
+    ///Newest frames searched for the buffer of a mark()
+    static const int SEARCH_DEPTH = 32;
+
+    FrameTimeline();
+
+    ///Starts a frame, sensorTime is the timestamp the adapter got with it
+    void frameReceived(const void *buffer, nsecs_t sensorTime);
+
+    ///Stamps the newest frame of buffer with the current time
+    void mark(const void *buffer, Stage stage);
+
+    ///Prints p50/p95/p99 of each stage, sensor to adapter receive and the
+    ///later stages from adapter receive
+    void dump(int fd);
+
+    ///Writes all frames in the ring to path as CSV, times in ns
+    status_t exportTo(const char *path);
+
+private:
+    struct Frame {
+        const void *buffer;
+        nsecs_t stamps[STAGE_COUNT];
+    };
+
+    int copyFrames(Frame *frames);
+    static int compareLatency(const void *lhs, const void *rhs);
+
+    android::Mutex mLock;
+    Frame mFrames[RING_SIZE];
+    uint32_t mWritten;
+};
+
+} // namespace Camera
+} // namespace Ti
+
+#endif //ANDROID_CAMERA_HARDWARE_FRAME_TIMELINE_H
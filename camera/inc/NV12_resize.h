@@ -132,4 +132,93 @@ VT_resizeFrame_Video_opt2_lp(
         mmUint16 dummy                         /* Transparent pixel value              */
         );
 
+typedef enum {
+    IC_RESIZE_ENGINE_AUTO,
+    IC_RESIZE_ENGINE_SCALAR,
+    IC_RESIZE_ENGINE_NEON,
+    IC_RESIZE_ENGINE_SSE2,
+    IC_RESIZE_ENGINE_AVX2,
+    IC_RESIZE_ENGINE_MAX
+} enumResizeEngine;
+
+/*==========================================================================
+* Function Name  : VT_resizeFrame_Video_simd_lp
+*
+* Description    : Resize a yuv frame using the fastest engine available
+*                  on the running CPU.
+*
+* Input(s)       : input_img_ptr        -> Input Image Structure
+*                : output_img_ptr       -> Output Image Structure
+*                : cropout             -> crop structure
+*
+* Value Returned : mmBool               -> FALSE on error TRUE on success
+* NOTE:
+*            Output is bit-exact with VT_resizeFrame_Video_opt2_lp.
+============================================================================*/
+mmBool
+VT_resizeFrame_Video_simd_lp(
+        structConvImage* i_img_ptr,        /* Points to the input image           */
+        structConvImage* o_img_ptr,        /* Points to the output image          */
+        IC_rect_type*  cropout,          /* how much to resize to in final image */
+        mmUint16 dummy                         /* Transparent pixel value              */
+        );
+
+/*==========================================================================
+* Function Name  : VT_resizeFrame_Video_engine_lp
+*
+* Description    : Same as VT_resizeFrame_Video_simd_lp, but runs the
+*                  requested engine. Used for testing and benchmarking.
+*
+* Value Returned : mmBool               -> FALSE on error or if the engine
+*                                          is not supported, TRUE on success
+============================================================================*/
+mmBool
+VT_resizeFrame_Video_engine_lp(
+        structConvImage* i_img_ptr,        /* Points to the input image           */
+        structConvImage* o_img_ptr,        /* Points to the output image          */
+        IC_rect_type*  cropout,          /* how much to resize to in final image */
+        enumResizeEngine engine                /* Engine to run                        */
+        );
+
+/* Thread budget that uses every online core, up to an internal limit */
+#define IC_RESIZE_THREADS_AUTO 0
+
+/*==========================================================================
+* Function Name  : VT_resizeFrame_Video_parallel_lp
+*
+* Description    : Resize a yuv frame splitting the output rows of both
+*                  planes into bands, which run on a persistent worker pool.
+*
+* Input(s)       : input_img_ptr        -> Input Image Structure
+*                : output_img_ptr       -> Output Image Structure
+*                : cropout             -> crop structure
+*                : numThreads          -> thread budget including the
+*                                         calling thread, 1 runs inline,
+*                                         IC_RESIZE_THREADS_AUTO uses
+*                                         all cores
+*
+* Value Returned : mmBool               -> FALSE on error TRUE on success
+* NOTE:
+*            Output is bit-exact with VT_resizeFrame_Video_opt2_lp.
+============================================================================*/
+mmBool
+VT_resizeFrame_Video_parallel_lp(
+        structConvImage* i_img_ptr,        /* Points to the input image           */
+        structConvImage* o_img_ptr,        /* Points to the output image          */
+        IC_rect_type*  cropout,          /* how much to resize to in final image */
+        mmInt32 numThreads                     /* Thread budget, including caller     */
+        );
+
+/* Returns thread budget used by IC_RESIZE_THREADS_AUTO */
+mmInt32 VT_resizeFrame_GetMaxThreads();
+
+/* Returns engine picked by IC_RESIZE_ENGINE_AUTO on the running CPU */
+enumResizeEngine VT_resizeFrame_GetEngine();
+
+/* Returns true if the engine can run on the running CPU */
+mmBool VT_resizeFrame_IsEngineSupported(enumResizeEngine engine);
+
+/* Returns printable engine name */
+const char* VT_resizeFrame_GetEngineName(enumResizeEngine engine);
+
 #endif //#define NV12_RESIZE_H_
@@ -402,6 +402,7 @@ public:
     //APIs to configure Camera adapter and get the current parameter set
     virtual status_t setParameters(const android::CameraParameters& params);
     virtual void getParameters(android::CameraParameters& params);
+    virtual bool isParameterUsed(const char *key) const;
 
     // API
     status_t UseBuffersPreview(CameraBuffer *bufArr, int num);
@@ -507,6 +508,7 @@ private:
                                BaseCameraAdapter::AdapterState state);
     status_t convertGPSCoord(double coord, int &deg, int &min, int &sec, int &secDivisor);
     status_t setupEXIF();
+    status_t setupEXIFTemplate_libjpeg(ExifElementsTable*);
     status_t setupEXIF_libjpeg(ExifElementsTable*, OMX_TI_ANCILLARYDATATYPE*,
                                OMX_TI_WHITEBALANCERESULTTYPE*);
 
@@ -1067,6 +1069,10 @@ private:
     //Geo-tagging
     EXIFData mEXIFData;
 
+    // session invariant EXIF elements, copied for every libjpeg capture
+    ExifElementsTable mEXIFTemplate;
+    bool mEXIFTemplateValid;
+
     //Image post-processing
     IPPMode mIPP;
 
@@ -1203,6 +1209,7 @@ private:
     // Time source delta of ducati & system time
     OMX_TICKS mTimeSourceDelta;
     bool onlyOnce;
+    android::Mutex mTimeSourceLock;
 
     Utils::Semaphore mCaptureSem;
     bool mCaptureSignalled;
@@ -23,23 +23,88 @@
 namespace Ti {
 namespace Camera {
 
+/**
+ * libjpeg MJPEG decoder. With a single thread frames are decoded as they are
+ * queued. With more threads every worker runs its own Decoder_libjpeg on a
+ * frame of its own, outputs are handed out in timestamp order.
+ */
 class SwFrameDecoder: public FrameDecoder {
 public:
+    static const int MAX_DECODER_THREADS = 4;
+    // decode time and latency summary is logged every this many frames
+    static const int STATS_INTERVAL = 300;
+
     SwFrameDecoder();
     virtual ~SwFrameDecoder();
 
+    // Prints decode time and latency since the decoder was started
+    virtual void dump(int fd);
+
 protected:
     virtual void doConfigure(const DecoderParameters& config);
     virtual void doProcessInputBuffer();
-    virtual status_t doStart() { return NO_ERROR; }
-    virtual void doStop() { }
+    virtual status_t doStart();
+    virtual void doStop();
     virtual void doFlush() { }
     virtual void doRelease() { }
 
 private:
-    int mjpegWithHdrSize;
+    class DecoderThread : public android::Thread {
+        SwFrameDecoder *mOwner;
+        Decoder_libjpeg mJpgdecoder;
+    public:
+        DecoderThread(SwFrameDecoder *owner)
+            : Thread(false), mOwner(owner) { }
+        virtual bool threadLoop() {
+            return mOwner->decoderLoop(mJpgdecoder);
+        }
+    };
+
+    struct Job {
+        int inIndex;
+        int outIndex;
+        nsecs_t queued;
+        nsecs_t decodeTime;
+        bool claimed;
+        bool done;
+        bool decoded;
+    };
+
+    void processInline();
+    void dispatchJobs();
+    bool decoderLoop(Decoder_libjpeg &decoder);
+    bool decodeFrame(Decoder_libjpeg &decoder, int inIndex, int outIndex);
+    void deliverJobsLocked();
+    void updateStatsLocked(nsecs_t decodeTime, nsecs_t latency);
+
     Decoder_libjpeg mJpgdecoder;
-    unsigned char* mJpegWithHeaderBuffer;
+    int mScaleDenom;
+    int mOutputWidth;
+    int mOutputHeight;
+    int mOutputStride;
+    int mThreadCount;
+
+    android::Mutex mJobLock;
+    android::Condition mJobCondition;
+    android::Condition mIdleCondition;
+    android::Vector<Job> mJobs;
+    android::Vector< android::sp<DecoderThread> > mThreads;
+    bool mExiting;
+
+    int mStatsFrames;
+    int mStatsDropped;
+    nsecs_t mStatsDecodeTime;
+    nsecs_t mStatsDecodeMax;
+    nsecs_t mStatsLatency;
+    nsecs_t mStatsLatencyMax;
+
+    // the same since start, for dump()
+    int mTotalFrames;
+    int mTotalDropped;
+    nsecs_t mTotalDecodeTime;
+    nsecs_t mTotalDecodeMax;
+    nsecs_t mTotalLatency;
+    nsecs_t mTotalLatencyMax;
 };
 
 }  // namespace Camera
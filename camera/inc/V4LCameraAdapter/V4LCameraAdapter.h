@@ -26,6 +26,8 @@
 #include "DebugUtils.h"
 #include "Decoder_libjpeg.h"
 #include "FrameDecoder.h"
+#include "Semaphore.h"
+#include "SpscRing.h"
 
 
 namespace Ti {
@@ -105,6 +107,29 @@ public:
     ///Five second timeout
     static const int CAMERA_ADAPTER_TIMEOUT = 5000*1000;
 
+    ///Longest single wait for a frame before the streaming state is checked again
+    static const int FRAME_WAIT_TIMEOUT_MS = 1000;
+
+    ///Ring size between preview pipeline stages, at least NB_BUFFER
+    static const int PIPELINE_RING_SIZE = 16;
+
+    ///Preview frames without a decoder go through these stages, each one
+    ///on its own thread
+    enum PipelineStage {
+        STAGE_CAPTURE = 0,
+        STAGE_CONVERT,
+        STAGE_DELIVER,
+        STAGE_COUNT
+    };
+
+    struct PipelineStageStats {
+        int frames;             ///< frames passed on by the stage
+        int occupancy;          ///< preview buffers held by the stage right now
+        int queueMax;           ///< deepest the input ring of the stage has been
+        nsecs_t latency;        ///< average time from entering to leaving the stage
+        nsecs_t latencyMax;
+    };
+
 public:
 
     V4LCameraAdapter(size_t sensor_index, CameraHal* hal);
@@ -126,6 +151,17 @@ public:
 
     void setupWorkingMode();
 
+    ///Frames dequeued since streaming started, with the average and worst
+    ///time from the driver timestamp to VIDIOC_DQBUF returning
+    void getDequeueStats(int &frames, nsecs_t &avgLatency, nsecs_t &maxLatency) const;
+
+    ///Per stage statistics of the preview pipeline since preview started,
+    ///capture latency is the time from the driver timestamp to dequeue
+    void getPipelineStats(PipelineStageStats stats[STAGE_COUNT]) const;
+
+    ///Prints the preview pipeline and decoder statistics
+    virtual void dump(int fd);
+
 protected:
 
 //----------Parent class method implementation------------------------------------
@@ -160,12 +196,58 @@ private:
             }
         };
 
+    class PipelineThread : public android::Thread {
+            V4LCameraAdapter* mAdapter;
+            PipelineStage mStage;
+        public:
+            PipelineThread(V4LCameraAdapter* hw, PipelineStage stage) :
+                    Thread(false), mAdapter(hw), mStage(stage) { }
+            virtual void onFirstRef() {
+                run((mStage == STAGE_CONVERT) ? "CameraConvertThread" : "CameraDeliverThread",
+                        android::PRIORITY_URGENT_DISPLAY);
+            }
+            virtual bool threadLoop() {
+                return mAdapter->pipelineThread(mStage);
+            }
+        };
+
+    // preview buffer handed from one pipeline stage to the next
+    struct PipelineFrame {
+        int index;
+        char *data;
+        nsecs_t captured;
+        nsecs_t queued;
+    };
+
+    // who holds a preview buffer, a buffer queued to a stage belongs to it
+    enum BufferOwner {
+        OWNER_DRIVER = 0,
+        OWNER_CAPTURE,
+        OWNER_CONVERT,
+        OWNER_DELIVER,
+        OWNER_CLIENT
+    };
+
     //Used for calculation of the average frame rate during preview
     status_t recalculateFPS();
 
     char * GetFrame(int &index, int &filledLen);
+    bool waitForFrame();
+    void wakeFrameWait();
+    static void decoderOutputReady(void *user_data);
+    void updateDequeueStats(const v4l2_buffer &buf);
 
     int previewThread();
+    bool pipelineThread(PipelineStage stage);
+    void startPipeline();
+    void stopPipeline();
+    void flushPipeline();
+    bool queueToStage(PipelineStage stage, PipelineFrame &frame);
+    void finishPipelineFrame();
+    void convertFrame(const PipelineFrame &frame);
+    void deliverFrame(const PipelineFrame &frame);
+    void updateStageStats(PipelineStage stage, const PipelineFrame &frame, int queued);
+    void setBufferOwner(int index, BufferOwner owner);
 
 private:
     //capabilities data
@@ -198,9 +280,11 @@ private:
     status_t v4lIoctl(int, int, void*);
     status_t v4lInitMmap(int& count, int width, int height);
     status_t v4lInitUsrPtr(int&);
+    status_t v4lInitDirect(int& count, int width, int height);
+    status_t v4lInitPreviewBuffers(int& count, int width, int height);
     status_t v4lStartStreaming();
     status_t v4lStopStreaming(int nBufferCount);
-    status_t v4lSetFormat(int, int, uint32_t);
+    status_t v4lSetFormat(int, int, uint32_t, int bytesperline = 0);
     status_t restartPreview();
     status_t applyFpsValue();
     status_t returnBufferToV4L(int id);
@@ -246,6 +330,48 @@ private:
 
     android::Mutex mV4LLock;
 
+    // GetFrame() sleeps in poll() on the camera and the read end of this
+    // pipe, the write end wakes it up on stop and on VIDIOC_QBUF while the
+    // driver had no buffer to fill. mWaitingForQueue is protected by mV4LLock.
+    int mWakeFds[2];
+    bool mWaitingForQueue;
+
+    // set by the decoder threads when a frame is decoded, GetFrame() then
+    // returns early so the preview thread dequeues it
+    volatile int32_t mDecoderOutputPending;
+
+    // preview frames are captured with USERPTR I/O into mPreviewBufs
+    bool mDirectCapture;
+
+    mutable android::Mutex mDequeueStatsLock;
+    int mDequeueFrames;
+    int mDequeueTimedFrames;
+    nsecs_t mDequeueLatency;
+    nsecs_t mDequeueLatencyMax;
+
+    // Capture, convert and deliver stages of the preview. Each ring has
+    // exactly one producer and one consumer, the semaphore counts its items.
+    // Frames are only queued to the convert stage under mLock while
+    // previewing. Once mPreviewing is cleared flushPipeline() has the stages
+    // drop what they still hold and waits until the pipeline is empty. It
+    // runs without mLock because delivering a frame may return it
+    // synchronously through fillThisBuffer().
+    android::sp<PipelineThread> mPipelineThreads[STAGE_COUNT];
+    Utils::SpscRing<PipelineFrame, PIPELINE_RING_SIZE> mStageRings[STAGE_COUNT];
+    Utils::Semaphore mStageSems[STAGE_COUNT];
+    volatile bool mPipelineExiting;
+    volatile bool mPipelineFlushing;
+    volatile int32_t mPipelineInFlight;
+    android::Mutex mPipelineIdleLock;
+    android::Condition mPipelineIdleCondition;
+    volatile int32_t mBufferOwner[NB_BUFFER];
+
+    mutable android::Mutex mPipelineStatsLock;
+    int mStageFrames[STAGE_COUNT];
+    int mStageQueueMax[STAGE_COUNT];
+    nsecs_t mStageLatency[STAGE_COUNT];
+    nsecs_t mStageLatencyMax[STAGE_COUNT];
+
     int mPixelFormat;
     int mFrameRate;
 
@@ -254,6 +380,7 @@ private:
 
     CameraHal* mCameraHal;
     int mSkipFramesCount;
+    int mDecoderThreads;
 };
 
 } // namespace Camera
@@ -6,7 +6,11 @@ LOCAL_SRC_FILES := \
 
 LOCAL_C_INCLUDES:= \
         $(TOP)/frameworks/native/include/media/openmax \
-        $(TOP)/frameworks/native/include/media/editor
+        $(TOP)/frameworks/native/include/media/editor \
+        $(LOCAL_PATH)/../libtiutils
+
+LOCAL_SHARED_LIBRARIES := \
+        libtiutils
 
 LOCAL_CFLAGS := -Wall -Werror
 
@@ -7,9 +7,11 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
     DebugUtils.cpp \
+    DebugTrace.cpp \
     MessageQueue.cpp \
     Semaphore.cpp \
-    ErrorUtils.cpp
+    ErrorUtils.cpp \
+    PixelConvert.cpp
 
 LOCAL_SHARED_LIBRARIES:= \
     libdl \
@@ -44,6 +46,10 @@ endif
 
 LOCAL_CFLAGS += -fno-short-enums $(ANDROID_API_CFLAGS)
 
+ifdef ARCH_ARM_HAVE_NEON
+    LOCAL_CFLAGS += -DARCH_ARM_HAVE_NEON
+endif
+
 ifdef TI_UTILS_MESSAGE_QUEUE_DEBUG_ENABLED
     # Enable debug logs
     LOCAL_CFLAGS += -DMSGQ_DEBUG
@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DebugUtils.h"
+
+#include <cutils/atomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+
+
+namespace Ti {
+
+
+
+
+class Trace::Buffer
+{
+public:
+    Buffer() :
+        threadId(0), inUse(false), claimed(0), written(0), depth(0), next(0)
+    {}
+
+    int32_t threadId;
+    bool inUse;
+    // Only the owning thread writes records and the counters, both count
+    // records modulo 2^32. claimed is bumped before a slot is rewritten,
+    // written once the record in it is complete.
+    volatile uint32_t claimed;
+    volatile uint32_t written;
+    int depth;
+    Buffer * next;
+    Record records[kRingSize];
+};
+
+
+
+
+pthread_key_t Trace::sKey;
+pthread_once_t Trace::sKeyOnce = PTHREAD_ONCE_INIT;
+Trace::Buffer * Trace::sBuffers = 0;
+
+// protects sBuffers and Buffer::inUse, taken once per thread and by dump()
+static android::Mutex sBufferLock;
+
+static const char kLevelNames[] = "?EWIDV";
+
+
+// the atomics take int32_t, the counters wrap as uint32_t
+static inline uint32_t loadCounter(volatile uint32_t * const counter)
+{
+    return static_cast<uint32_t>(android_atomic_acquire_load(
+            reinterpret_cast<volatile int32_t*>(counter)));
+}
+
+
+static inline void storeCounter(volatile uint32_t * const counter, const uint32_t value)
+{
+    android_atomic_release_store(static_cast<int32_t>(value),
+            reinterpret_cast<volatile int32_t*>(counter));
+}
+
+
+
+
+void Trace::createKey()
+{
+    pthread_key_create(&sKey, releaseBuffer);
+}
+
+
+void Trace::releaseBuffer(void * const buffer)
+{
+    android::AutoMutex locker(sBufferLock);
+    (void)locker;
+
+    static_cast<Buffer*>(buffer)->inUse = false;
+}
+
+
+Trace::Buffer * Trace::currentBuffer()
+{
+    pthread_once(&sKeyOnce, createKey);
+
+    Buffer * buffer = static_cast<Buffer*>(pthread_getspecific(sKey));
+    if ( buffer )
+        return buffer;
+
+    {
+        android::AutoMutex locker(sBufferLock);
+        (void)locker;
+
+        for ( Buffer * it = sBuffers; it; it = it->next )
+        {
+            if ( !it->inUse )
+            {
+                buffer = it;
+                break;
+            }
+        }
+
+        if ( !buffer )
+        {
+            buffer = new Buffer;
+            buffer->next = sBuffers;
+            sBuffers = buffer;
+        }
+
+        buffer->inUse = true;
+        buffer->depth = 0;
+        buffer->threadId = static_cast<int32_t>(reinterpret_cast<intptr_t>(androidGetThreadId()));
+    }
+
+    pthread_setspecific(sKey, buffer);
+    return buffer;
+}
+
+
+Trace::Buffer * Trace::append(const Level level, const char * const format,
+        const Arg * const * const args, const int count)
+{
+    Buffer * const buffer = currentBuffer();
+    const uint32_t index = buffer->written;
+    Record & record = buffer->records[index & (kRingSize - 1)];
+
+    // tell dump() the slot is being rewritten before touching it
+    storeCounter(&buffer->claimed, index + 1);
+    android_memory_barrier();
+
+    record.timestamp = systemTime(SYSTEM_TIME_MONOTONIC);
+    record.format = format;
+    record.threadId = buffer->threadId;
+    record.level = level;
+    record.depth = buffer->depth;
+    record.argCount = count;
+    for ( int i = 0; i < count; ++i )
+    {
+        record.types[i] = args[i]->mType;
+        record.args[i] = args[i]->mValue;
+    }
+
+    // publish the record to dump()
+    storeCounter(&buffer->written, index + 1);
+    return buffer;
+}
+
+
+
+
+void Trace::record(const Level level, const char * const format)
+{
+    append(level, format, 0, 0);
+}
+
+
+void Trace::record(const Level level, const char * const format, const Arg & a1)
+{
+    const Arg * const args[] = { &a1 };
+    append(level, format, args, 1);
+}
+
+
+void Trace::record(const Level level, const char * const format, const Arg & a1, const Arg & a2)
+{
+    const Arg * const args[] = { &a1, &a2 };
+    append(level, format, args, 2);
+}
+
+
+void Trace::record(const Level level, const char * const format, const Arg & a1, const Arg & a2,
+        const Arg & a3)
+{
+    const Arg * const args[] = { &a1, &a2, &a3 };
+    append(level, format, args, 3);
+}
+
+
+void Trace::record(const Level level, const char * const format, const Arg & a1, const Arg & a2,
+        const Arg & a3, const Arg & a4)
+{
+    const Arg * const args[] = { &a1, &a2, &a3, &a4 };
+    append(level, format, args, 4);
+}
+
+
+void Trace::record(const Level level, const char * const format, const Arg & a1, const Arg & a2,
+        const Arg & a3, const Arg & a4, const Arg & a5)
+{
+    const Arg * const args[] = { &a1, &a2, &a3, &a4, &a5 };
+    append(level, format, args, 5);
+}
+
+
+void Trace::record(const Level level, const char * const format, const Arg & a1, const Arg & a2,
+        const Arg & a3, const Arg & a4, const Arg & a5, const Arg & a6)
+{
+    const Arg * const args[] = { &a1, &a2, &a3, &a4, &a5, &a6 };
+    append(level, format, args, 6);
+}
+
+
+void Trace::enter(const char * const function)
+{
+    const Arg arg(function);
+    const Arg * const args[] = { &arg };
+    Buffer * const buffer = append(LEVEL_VERBOSE, "+ %s", args, 1);
+    ++buffer->depth;
+}
+
+
+void Trace::exit(const char * const function)
+{
+    Buffer * const buffer = currentBuffer();
+    if ( buffer->depth > 0 )
+        --buffer->depth;
+
+    const Arg arg(function);
+    const Arg * const args[] = { &arg };
+    append(LEVEL_VERBOSE, "- %s", args, 1);
+}
+
+
+
+
+int Trace::compareRecords(const Record * const lhs, const Record * const rhs)
+{
+    if ( lhs->timestamp < rhs->timestamp )
+        return -1;
+    return lhs->timestamp > rhs->timestamp ? 1 : 0;
+}
+
+
+static int64_t traceArgAsSigned(const Trace::Arg::Value & value, const int type)
+{
+    switch ( type )
+    {
+        case Trace::Arg::TYPE_SIGNED:   return value.i;
+        case Trace::Arg::TYPE_UNSIGNED: return static_cast<int64_t>(value.u);
+        case Trace::Arg::TYPE_DOUBLE:   return static_cast<int64_t>(value.d);
+        default:                        return reinterpret_cast<intptr_t>(value.p);
+    }
+}
+
+
+static double traceArgAsDouble(const Trace::Arg::Value & value, const int type)
+{
+    if ( type == Trace::Arg::TYPE_DOUBLE )
+        return value.d;
+    if ( type == Trace::Arg::TYPE_UNSIGNED )
+        return static_cast<double>(value.u);
+    return static_cast<double>(traceArgAsSigned(value, type));
+}
+
+
+void Trace::formatRecord(const Record & record, char * const text, const int size)
+{
+    int length = 0;
+    int arg = 0;
+    const char * p = record.format;
+
+    while ( *p && length < size - 1 )
+    {
+        if ( *p != '%' )
+        {
+            text[length++] = *p++;
+            continue;
+        }
+
+        if ( p[1] == '%' )
+        {
+            text[length++] = '%';
+            p += 2;
+            continue;
+        }
+
+        // keep flags, width and precision, length modifiers are
+        // replaced to match the recorded argument
+        char spec[32];
+        int specLength = 0;
+        spec[specLength++] = *p++;
+        while ( *p && strchr("-+ #0123456789.", *p) && specLength < 24 )
+            spec[specLength++] = *p++;
+        while ( *p && strchr("hlLqjzt", *p) )
+            ++p;
+
+        const char conversion = *p;
+        if ( !conversion )
+            break;
+        ++p;
+
+        if ( arg >= record.argCount )
+        {
+            length += snprintf(text + length, size - length, "<?>");
+            continue;
+        }
+
+        const Arg::Value & value = record.args[arg];
+        const int type = record.types[arg];
+        ++arg;
+
+        int written = 0;
+        switch ( conversion )
+        {
+            case 'd':
+            case 'i':
+                strcpy(spec + specLength, "lld");
+                written = snprintf(text + length, size - length, spec,
+                        static_cast<long long>(traceArgAsSigned(value, type)));
+                break;
+
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                spec[specLength++] = 'l';
+                spec[specLength++] = 'l';
+                spec[specLength++] = conversion;
+                spec[specLength] = 0;
+                written = snprintf(text + length, size - length, spec,
+                        static_cast<unsigned long long>(traceArgAsSigned(value, type)));
+                break;
+
+            case 'c':
+                strcpy(spec + specLength, "c");
+                written = snprintf(text + length, size - length, spec,
+                        static_cast<int>(traceArgAsSigned(value, type)));
+                break;
+
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+                spec[specLength++] = conversion;
+                spec[specLength] = 0;
+                written = snprintf(text + length, size - length, spec,
+                        traceArgAsDouble(value, type));
+                break;
+
+            case 's':
+                strcpy(spec + specLength, "s");
+                written = snprintf(text + length, size - length, spec,
+                        type == Arg::TYPE_STRING && value.s ? value.s : "(null)");
+                break;
+
+            default:
+                strcpy(spec + specLength, "p");
+                written = snprintf(text + length, size - length, spec,
+                        type == Arg::TYPE_POINTER || type == Arg::TYPE_STRING ?
+                        value.p : reinterpret_cast<const void*>(traceArgAsSigned(value, type)));
+                break;
+        }
+
+        if ( written > 0 )
+            length += written;
+    }
+
+    if ( length > size - 1 )
+        length = size - 1;
+    text[length] = 0;
+}
+
+
+void Trace::dump(const int fd)
+{
+    android::Vector<Record> records;
+
+    {
+        android::AutoMutex locker(sBufferLock);
+        (void)locker;
+
+        for ( Buffer * buffer = sBuffers; buffer; buffer = buffer->next )
+        {
+            // right after the counter wraps only the records since are shown
+            const uint32_t written = loadCounter(&buffer->written);
+            const uint32_t count = written < uint32_t(kRingSize) ? written : uint32_t(kRingSize);
+            const uint32_t first = written - count;
+            const int start = records.size();
+
+            for ( uint32_t i = 0; i < count; ++i )
+                records.add(buffer->records[(first + i) & (kRingSize - 1)]);
+
+            // The owner kept writing meanwhile, drop the slots it has claimed
+            // since. The copies must be complete before claimed is read.
+            android_memory_barrier();
+            const uint32_t ahead = loadCounter(&buffer->claimed) - first;
+            if ( ahead > uint32_t(kRingSize) )
+            {
+                const uint32_t stale = ahead - kRingSize;
+                records.removeItemsAt(start, stale < count ? stale : count);
+            }
+        }
+    }
+
+    records.sort(compareRecords);
+
+    char line[512];
+    int length = snprintf(line, sizeof(line), "Trace: %d records\n", int(records.size()));
+    write(fd, line, length);
+
+    for ( size_t i = 0; i < records.size(); ++i )
+    {
+        const Record & record = records.itemAt(i);
+        char text[384];
+        formatRecord(record, text, sizeof(text));
+
+        const int level = record.level < sizeof(kLevelNames) - 1 ? record.level : 0;
+        length = snprintf(line, sizeof(line), "[%lld.%06lld] (%x) %c %s%s\n",
+                static_cast<long long>(record.timestamp / 1000000000LL),
+                static_cast<long long>((record.timestamp / 1000LL) % 1000000LL),
+                record.threadId, kLevelNames[level],
+                IndentString<>(record.depth).string(), text);
+        if ( length > int(sizeof(line)) - 1 )
+            length = sizeof(line) - 1;
+        write(fd, line, length);
+    }
+}
+
+
+
+
+} // namespace Ti
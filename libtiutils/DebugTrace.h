@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEBUG_TRACE_H
+#define DEBUG_TRACE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <utils/Timers.h>
+
+
+
+
+// Highest trace level compiled in: 0 disables tracing, 1 errors, 2 warnings,
+// 3 info, 4 debug, 5 verbose. Calls above the level expand to nothing.
+#ifndef TI_UTILS_TRACE_LEVEL
+#   define TI_UTILS_TRACE_LEVEL 0
+#endif
+
+
+
+
+namespace Ti {
+
+
+
+
+// Binary tracer. Every thread appends fixed size records (timestamp, format
+// pointer, raw arguments) to a ring of its own without locking, the text is
+// only produced by dump(). Formats must be string literals and %s arguments
+// must point to strings living as long as the process, e.g. __FUNCTION__.
+class Trace
+{
+public:
+    enum Level
+    {
+        LEVEL_ERROR = 1,
+        LEVEL_WARN,
+        LEVEL_INFO,
+        LEVEL_DEBUG,
+        LEVEL_VERBOSE
+    };
+
+    static const int kMaxArgs = 6;
+    // records kept per thread, power of two
+    static const int kRingSize = 1024;
+
+    class Arg
+    {
+    public:
+        enum Type
+        {
+            TYPE_SIGNED,
+            TYPE_UNSIGNED,
+            TYPE_DOUBLE,
+            TYPE_POINTER,
+            TYPE_STRING
+        };
+
+        Arg(int value) : mType(TYPE_SIGNED) { mValue.i = value; }
+        Arg(long value) : mType(TYPE_SIGNED) { mValue.i = value; }
+        Arg(long long value) : mType(TYPE_SIGNED) { mValue.i = value; }
+        Arg(unsigned int value) : mType(TYPE_UNSIGNED) { mValue.u = value; }
+        Arg(unsigned long value) : mType(TYPE_UNSIGNED) { mValue.u = value; }
+        Arg(unsigned long long value) : mType(TYPE_UNSIGNED) { mValue.u = value; }
+        Arg(double value) : mType(TYPE_DOUBLE) { mValue.d = value; }
+        Arg(const void * value) : mType(TYPE_POINTER) { mValue.p = value; }
+        Arg(const char * value) : mType(TYPE_STRING) { mValue.s = value; }
+
+        union Value
+        {
+            int64_t i;
+            uint64_t u;
+            double d;
+            const void * p;
+            const char * s;
+        };
+
+    private:
+        uint8_t mType;
+        Value mValue;
+
+        friend class Trace;
+    };
+
+    static void record(Level level, const char * format);
+    static void record(Level level, const char * format, const Arg & a1);
+    static void record(Level level, const char * format, const Arg & a1, const Arg & a2);
+    static void record(Level level, const char * format, const Arg & a1, const Arg & a2,
+            const Arg & a3);
+    static void record(Level level, const char * format, const Arg & a1, const Arg & a2,
+            const Arg & a3, const Arg & a4);
+    static void record(Level level, const char * format, const Arg & a1, const Arg & a2,
+            const Arg & a3, const Arg & a4, const Arg & a5);
+    static void record(Level level, const char * format, const Arg & a1, const Arg & a2,
+            const Arg & a3, const Arg & a4, const Arg & a5, const Arg & a6);
+
+    // called from FunctionTracer, nest the records of the calling thread
+    static void enter(const char * function);
+    static void exit(const char * function);
+
+    // formats the records of all threads, oldest first
+    static void dump(int fd);
+
+private:
+    struct Record
+    {
+        nsecs_t timestamp;
+        const char * format;
+        int32_t threadId;
+        uint8_t level;
+        uint8_t depth;
+        uint8_t argCount;
+        uint8_t types[kMaxArgs];
+        Arg::Value args[kMaxArgs];
+    };
+
+    class Buffer;
+
+    static Buffer * currentBuffer();
+    static Buffer * append(Level level, const char * format, const Arg * const * args, int count);
+    static void createKey();
+    static void releaseBuffer(void * buffer);
+    static int compareRecords(const Record * lhs, const Record * rhs);
+    static void formatRecord(const Record & record, char * text, int size);
+
+    static pthread_key_t sKey;
+    static pthread_once_t sKeyOnce;
+    // every buffer ever created, buffers of exited threads get reused
+    static Buffer * sBuffers;
+};
+
+
+
+
+class FunctionTracer
+{
+public:
+    FunctionTracer(const char * function) : mFunction(function)
+    { Trace::enter(mFunction); }
+
+    ~FunctionTracer()
+    { Trace::exit(mFunction); }
+
+    void setExitLine(int)
+    {}
+
+private:
+    const char * const mFunction;
+};
+
+
+
+
+} // namespace Ti
+
+
+
+
+#if TI_UTILS_TRACE_LEVEL >= 1
+#   define TI_TRACE_E(...) Ti::Trace::record(Ti::Trace::LEVEL_ERROR, __VA_ARGS__)
+#else
+#   define TI_TRACE_E(...)
+#endif
+
+#if TI_UTILS_TRACE_LEVEL >= 2
+#   define TI_TRACE_W(...) Ti::Trace::record(Ti::Trace::LEVEL_WARN, __VA_ARGS__)
+#else
+#   define TI_TRACE_W(...)
+#endif
+
+#if TI_UTILS_TRACE_LEVEL >= 3
+#   define TI_TRACE_I(...) Ti::Trace::record(Ti::Trace::LEVEL_INFO, __VA_ARGS__)
+#else
+#   define TI_TRACE_I(...)
+#endif
+
+#if TI_UTILS_TRACE_LEVEL >= 4
+#   define TI_TRACE_D(...) Ti::Trace::record(Ti::Trace::LEVEL_DEBUG, __VA_ARGS__)
+#else
+#   define TI_TRACE_D(...)
+#endif
+
+#if TI_UTILS_TRACE_LEVEL >= 5
+#   define TI_TRACE_V(...) Ti::Trace::record(Ti::Trace::LEVEL_VERBOSE, __VA_ARGS__)
+#else
+#   define TI_TRACE_V(...)
+#endif
+
+
+
+
+#endif //DEBUG_TRACE_H
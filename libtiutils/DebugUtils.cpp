@@ -41,11 +41,6 @@ COMPILE_TIME_ASSERT_TI(sizeof(sIndentStringBuffer) - 1 == kIndentStringMaxLength
 
 
 
-static const int kDebugThreadInfoGrowSize = 16;
-
-
-
-
 Debug Debug::sInstance;
 
 
@@ -53,47 +48,22 @@ Debug Debug::sInstance;
 
 Debug::Debug()
 {
-    grow();
+    const int err = pthread_key_create(&mThreadKey, releaseThread);
+    _DBGUTILS_PLAIN_ASSERT_X(err == 0, "pthread_key_create() failed: %d", err);
 }
 
 
-void Debug::grow()
+Debug::ThreadInfo * Debug::registerThread()
 {
-    android::AutoMutex locker(mMutex);
-    (void)locker;
-
-    const int size = kDebugThreadInfoGrowSize;
-
-    const int newSize = (mData.get() ? mData->threads.size() : 0) + size;
-
-    Data * const newData = new Data;
-    newData->threads.setCapacity(newSize);
-
-    // insert previous thread info pointers
-    if ( mData.get() )
-        newData->threads.insertVectorAt(mData->threads, 0);
-
-    // populate data with new thread infos
-    for ( int i = 0; i < size; ++i )
-        newData->threads.add(new ThreadInfo);
-
-    // replace old data with new one
-    mData = newData;
+    ThreadInfo * const threadInfo = new ThreadInfo;
+    pthread_setspecific(mThreadKey, threadInfo);
+    return threadInfo;
 }
 
 
-Debug::ThreadInfo * Debug::registerThread(Data * const data, const int32_t threadId)
+void Debug::releaseThread(void * const threadInfo)
 {
-    const int size = data->threads.size();
-    for ( int i = 0; i < size; ++i )
-    {
-        ThreadInfo * const threadInfo = data->threads.itemAt(i);
-        if ( android_atomic_acquire_cas(0, threadId, &threadInfo->threadId) == 0 )
-            return threadInfo;
-    }
-
-    // failed to find empty slot for thread
-    return 0;
+    delete static_cast<ThreadInfo*>(threadInfo);
 }
 
 
@@ -18,6 +18,7 @@
 #define DEBUG_UTILS_H
 
 #include <android/log.h>
+#include <pthread.h>
 #include <utils/threads.h>
 #include <utils/Vector.h>
 
@@ -66,19 +67,12 @@ private:
     {
     public:
         ThreadInfo() :
-            threadId(0), callOffset(0)
+            callOffset(0)
         {}
 
-        volatile int32_t threadId;
         int callOffset;
     };
 
-    class Data : public android::RefBase
-    {
-    public:
-        android::Vector<ThreadInfo*> threads;
-    };
-
 private:
     // called from FunctionLogger
     void increaseOffsetForCurrentThread();
@@ -87,16 +81,17 @@ private:
 private:
     Debug();
 
-    void grow();
-    ThreadInfo * registerThread(Data * data, int32_t threadId);
+    ThreadInfo * registerThread();
     ThreadInfo * findCurrentThreadInfo();
     void addOffsetForCurrentThread(int offset);
 
+    static void releaseThread(void * threadInfo);
+
 private:
     static Debug sInstance;
 
-    mutable android::Mutex mMutex;
-    android::sp<Data> mData;
+    // each thread keeps its own ThreadInfo, no lookup among other threads
+    pthread_key_t mThreadKey;
 
     friend class FunctionLogger;
 };
@@ -123,7 +118,11 @@ private:
 
 
 
-#ifdef TI_UTILS_FUNCTION_LOGGER_ENABLE
+#if defined(TI_UTILS_FUNCTION_TRACER_ENABLE)
+    // binary enter/exit records, see DebugTrace.h
+#   define LOG_FUNCTION_NAME Ti::FunctionTracer __function_logger_instance(__FUNCTION__);
+#   define LOG_FUNCTION_NAME_EXIT __function_logger_instance.setExitLine(__LINE__);
+#elif defined(TI_UTILS_FUNCTION_LOGGER_ENABLE)
 #   define LOG_FUNCTION_NAME Ti::FunctionLogger __function_logger_instance(__FILE__, __LINE__, __FUNCTION__);
 #   define LOG_FUNCTION_NAME_EXIT __function_logger_instance.setExitLine(__LINE__);
 #else
@@ -252,39 +251,12 @@ inline Debug * Debug::instance()
 
 inline Debug::ThreadInfo * Debug::findCurrentThreadInfo()
 {
-    // retain reference to threads data
-    android::sp<Data> data = mData;
-
-    // iterate over threads to locate thread id,
-    // this is safe from race conditions because each thread
-    // is able to modify only his own ThreadInfo structure
-    const int32_t threadId = reinterpret_cast<int32_t>(androidGetThreadId());
-    const int size = int(data->threads.size());
-    for ( int i = 0; i < size; ++i )
-    {
-        ThreadInfo * const threadInfo = data->threads.itemAt(i);
-        if ( threadInfo->threadId == threadId )
-            return threadInfo;
-    }
-
-    // this thread has not been registered yet,
-    // try to fing empty thread info slot
-    while ( true )
-    {
-        ThreadInfo * const threadInfo = registerThread(data.get(), threadId);
-        if ( threadInfo )
-            return threadInfo;
+    ThreadInfo * const threadInfo = static_cast<ThreadInfo*>(pthread_getspecific(mThreadKey));
+    if ( threadInfo )
+        return threadInfo;
 
-        // failed registering thread, because all slots are occupied
-        // grow the data and try again
-        grow();
-
-        data = mData;
-    }
-
-    // should never reach here
-    _DBGUTILS_PLAIN_ASSERT(false);
-    return 0;
+    // this thread has not been registered yet
+    return registerThread();
 }
 
 
@@ -297,12 +269,6 @@ inline void Debug::addOffsetForCurrentThread(const int offset)
     _DBGUTILS_PLAIN_ASSERT(threadInfo);
 
     threadInfo->callOffset += offset;
-
-    if ( threadInfo->callOffset == 0 )
-    {
-        // thread call stack has dropped to zero, unregister it
-        android_atomic_acquire_store(0, &threadInfo->threadId);
-    }
 }
 
 
@@ -394,4 +360,9 @@ inline void FunctionLogger::setExitLine(const int line)
 
 
 
+#include "DebugTrace.h"
+
+
+
+
 #endif //DEBUG_UTILS_H
@@ -16,9 +16,11 @@
 
 
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/poll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <utils/Errors.h>
 
@@ -42,24 +44,29 @@ MessageQueue::MessageQueue()
 {
     LOG_FUNCTION_NAME;
 
-    int fds[2] = {-1,-1};
-    android::status_t stat;
+    mHead = 0;
+    mCount = 0;
+    mUrgentHead = 0;
+    mUrgentCount = 0;
+    mSignaled = false;
+    mHasMsg = false;
+
+    mDropCallback = NULL;
+    mDropCookie = NULL;
+    mMaxDepth = 0;
+    mQueued = 0;
+    mDropped = 0;
 
-    stat = pipe(fds);
+    this->fd_read = eventfd(0, 0);
 
-    if ( 0 > stat )
+    if ( 0 > this->fd_read )
         {
-        MSGQ_LOGEB("Error while openning pipe: %s", strerror(stat) );
-        this->fd_read = 0;
-        this->fd_write = 0;
-        mHasMsg = false;
+        MSGQ_LOGEB("Error while creating eventfd: %s", strerror(errno) );
+        this->fd_read = -1;
         }
-    else
+    else if ( 0 > fcntl(this->fd_read, F_SETFL, O_NONBLOCK) )
         {
-        this->fd_read = fds[0];
-        this->fd_write = fds[1];
-
-        mHasMsg = false;
+        MSGQ_LOGEB("Error while setting eventfd non-blocking: %s", strerror(errno) );
         }
 
     LOG_FUNCTION_NAME_EXIT;
@@ -80,12 +87,123 @@ MessageQueue::~MessageQueue()
         close(this->fd_read);
         }
 
-    if(this->fd_write >= 0)
+    LOG_FUNCTION_NAME_EXIT;
+}
+
+/**
+   @brief Make the input descriptor readable, unless it is already
+
+   @param none
+   @return none
+ */
+void MessageQueue::signalLocked()
+{
+    if ( mSignaled || ( 0 > this->fd_read ) )
         {
-        close(this->fd_write);
+        return;
         }
 
-    LOG_FUNCTION_NAME_EXIT;
+    uint64_t one = 1;
+    if ( (ssize_t)sizeof(one) != write(this->fd_read, &one, sizeof(one)) )
+        {
+        MSGQ_LOGEB("eventfd write() error: %s", strerror(errno));
+        return;
+        }
+
+    mSignaled = true;
+}
+
+/**
+   @brief Reset a pending wakeup on the input descriptor
+
+   @param none
+   @return none
+ */
+void MessageQueue::drainSignalLocked()
+{
+    if ( !mSignaled )
+        {
+        return;
+        }
+
+    uint64_t count;
+    if ( (ssize_t)sizeof(count) != read(this->fd_read, &count, sizeof(count)) )
+        {
+        MSGQ_LOGEB("eventfd read() error: %s", strerror(errno));
+        }
+
+    mSignaled = false;
+}
+
+/**
+   @brief Dequeue the next message, urgent ones first
+
+   @param msg Message structure to hold the message, the queue must not be empty
+   @return none
+ */
+void MessageQueue::popLocked(Message *msg)
+{
+    if ( 0 < mUrgentCount )
+        {
+        *msg = mUrgent[mUrgentHead];
+        mUrgentHead = ( mUrgentHead + 1 ) % URGENT_QUEUE_SIZE;
+        if ( URGENT_QUEUE_SIZE == mUrgentCount-- )
+            {
+            mNotFull.broadcast();
+            }
+        return;
+        }
+
+    *msg = mMessages[mHead];
+    mHead = ( mHead + 1 ) % QUEUE_SIZE;
+    if ( QUEUE_SIZE == mCount-- )
+        {
+        mNotFull.broadcast();
+        }
+
+    if ( !mPolicies.isEmpty() )
+        {
+        ssize_t index = mPolicies.indexOfKey(msg->command);
+        if ( 0 <= index )
+            {
+            mPolicies.editValueAt(index).queued--;
+            }
+        }
+}
+
+/**
+   @brief Find the oldest regular message with the given command
+
+   @param command Message command
+   @return Position relative to the ring head, -1 if there is none
+ */
+int MessageQueue::findLocked(int command) const
+{
+    for ( int i = 0 ; i < mCount ; i++ )
+        {
+        if ( command == mMessages[( mHead + i ) % QUEUE_SIZE].command )
+            {
+            return i;
+            }
+        }
+
+    return -1;
+}
+
+/**
+   @brief Remove a regular message, keeping the order of the others
+
+   @param pos Position relative to the ring head
+   @return none
+ */
+void MessageQueue::removeLocked(int pos)
+{
+    for ( int i = pos ; i < ( mCount - 1 ) ; i++ )
+        {
+        mMessages[( mHead + i ) % QUEUE_SIZE] = mMessages[( mHead + i + 1 ) % QUEUE_SIZE];
+        }
+
+    mCount--;
 }
 
 /**
@@ -95,7 +213,7 @@ MessageQueue::~MessageQueue()
    @return android::NO_ERROR On success
    @return android::BAD_VALUE if the message pointer is NULL
    @return android::NO_INIT If the file read descriptor is not set
-   @return android::UNKNOWN_ERROR if the read operation fromthe file read descriptor fails
+   @return android::UNKNOWN_ERROR if waiting on the file read descriptor fails
  */
 android::status_t MessageQueue::get(Message* msg)
 {
@@ -108,31 +226,38 @@ android::status_t MessageQueue::get(Message* msg)
         return android::BAD_VALUE;
         }
 
-    if(!this->fd_read)
+    android::AutoMutex lock(mLock);
+
+    while ( 0 == pendingLocked() )
         {
-        MSGQ_LOGEA("read descriptor not initialized for message queue");
-        LOG_FUNCTION_NAME_EXIT;
-        return android::NO_INIT;
-        }
+        if ( 0 > this->fd_read )
+            {
+            MSGQ_LOGEA("read descriptor not initialized for message queue");
+            LOG_FUNCTION_NAME_EXIT;
+            return android::NO_INIT;
+            }
 
-    char* p = (char*) msg;
-    size_t read_bytes = 0;
+        struct pollfd pfd;
+        pfd.fd = this->fd_read;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
 
-    while( read_bytes  < sizeof(*msg) )
-        {
-        int err = read(this->fd_read, p, sizeof(*msg) - read_bytes);
+        drainSignalLocked();
 
-        if( err < 0 )
+        mLock.unlock();
+        int err = poll(&pfd, 1, -1);
+        mLock.lock();
+
+        if ( ( 0 > err ) && ( EINTR != errno ) )
             {
-            MSGQ_LOGEB("read() error: %s", strerror(errno));
+            MSGQ_LOGEB("poll() error: %s", strerror(errno));
+            LOG_FUNCTION_NAME_EXIT;
             return android::UNKNOWN_ERROR;
             }
-        else
-            {
-            read_bytes += err;
-            }
         }
 
+    popLocked(msg);
+
     MSGQ_LOGDB("MQ.get(%d,%p,%p,%p,%p)", msg->command, msg->arg1,msg->arg2,msg->arg3,msg->arg4);
 
     mHasMsg = false;
@@ -142,6 +267,42 @@ android::status_t MessageQueue::get(Message* msg)
     return 0;
 }
 
+/**
+   @brief Get all queued messages, up to a limit, without blocking
+
+   @param msgs Array to hold the retrieved messages
+   @param maxCount Size of the msgs array
+   @return Number of messages retrieved, 0 if the queue is empty
+   @return android::BAD_VALUE if the message array is NULL
+ */
+int MessageQueue::getBatch(Message *msgs, int maxCount)
+{
+    LOG_FUNCTION_NAME;
+
+    if ( !msgs || ( 0 > maxCount ) )
+        {
+        MSGQ_LOGEA("msgs is NULL");
+        LOG_FUNCTION_NAME_EXIT;
+        return android::BAD_VALUE;
+        }
+
+    android::AutoMutex lock(mLock);
+
+    int count = 0;
+    while ( ( count < maxCount ) && ( 0 < pendingLocked() ) )
+        {
+        popLocked(&msgs[count++]);
+        }
+
+    MSGQ_LOGDB("MQ.getBatch() %d messages", count);
+
+    mHasMsg = false;
+
+    LOG_FUNCTION_NAME_EXIT;
+
+    return count;
+}
+
 /**
    @brief Get the input file descriptor of the message queue
 
@@ -155,9 +316,9 @@ int MessageQueue::getInFd()
 }
 
 /**
-   @brief Constructor for the message queue class
+   @brief Replace the input file descriptor used for wakeups
 
-   @param fd file read descriptor
+   @param fd eventfd compatible file descriptor
    @return none
  */
 
@@ -165,12 +326,20 @@ void MessageQueue::setInFd(int fd)
 {
     LOG_FUNCTION_NAME;
 
+    android::AutoMutex lock(mLock);
+
     if ( -1 != this->fd_read )
         {
         close(this->fd_read);
         }
 
     this->fd_read = fd;
+    mSignaled = false;
+
+    if ( 0 < pendingLocked() )
+        {
+        signalLocked();
+        }
 
     LOG_FUNCTION_NAME_EXIT;
 }
@@ -181,17 +350,12 @@ void MessageQueue::setInFd(int fd)
    @param msg Message structure to hold the message to be retrieved
    @return android::NO_ERROR On success
    @return android::BAD_VALUE if the message pointer is NULL
-   @return android::NO_INIT If the file write descriptor is not set
-   @return android::UNKNOWN_ERROR if the write operation fromthe file write descriptor fails
  */
 
 android::status_t MessageQueue::put(Message* msg)
 {
     LOG_FUNCTION_NAME;
 
-    char* p = (char*) msg;
-    size_t bytes = 0;
-
     if(!msg)
         {
         MSGQ_LOGEA("msg is NULL");
@@ -199,30 +363,87 @@ android::status_t MessageQueue::put(Message* msg)
         return android::BAD_VALUE;
         }
 
-    if(!this->fd_write)
-        {
-        MSGQ_LOGEA("write descriptor not initialized for message queue");
-        LOG_FUNCTION_NAME_EXIT;
-        return android::NO_INIT;
-        }
+    MSGQ_LOGDB("MQ.put(%d,%p,%p,%p,%p)", msg->command, msg->arg1,msg->arg2,msg->arg3,msg->arg4);
 
+    Message dropped;
+    bool hasDropped = false;
+    DropCallback dropCallback = NULL;
+    void *dropCookie = NULL;
 
-    MSGQ_LOGDB("MQ.put(%d,%p,%p,%p,%p)", msg->command, msg->arg1,msg->arg2,msg->arg3,msg->arg4);
+    {
+        android::AutoMutex lock(mLock);
 
-    while( bytes  < sizeof(msg) )
-        {
-        int err = write(this->fd_write, p, sizeof(*msg) - bytes);
+        mQueued++;
 
-        if( err < 0 )
+        while ( true )
             {
-            MSGQ_LOGEB("write() error: %s", strerror(errno));
-            LOG_FUNCTION_NAME_EXIT;
-            return android::UNKNOWN_ERROR;
+            CoalesceState *state = NULL;
+            if ( !mPolicies.isEmpty() )
+                {
+                ssize_t index = mPolicies.indexOfKey(msg->command);
+                if ( 0 <= index )
+                    {
+                    state = &mPolicies.editValueAt(index);
+                    }
+                }
+
+            if ( ( NULL != state ) && ( 0 < state->queued ) )
+                {
+                if ( COALESCE_KEEP_LATEST == state->policy )
+                    {
+                    int pos = findLocked(msg->command);
+                    Message &queued = mMessages[( mHead + pos ) % QUEUE_SIZE];
+                    dropped = queued;
+                    queued = *msg;
+                    hasDropped = true;
+                    break;
+                    }
+                else if ( ( COALESCE_DROP_OLDEST == state->policy ) &&
+                          ( state->queued >= state->maxQueued ) )
+                    {
+                    int pos = findLocked(msg->command);
+                    dropped = mMessages[( mHead + pos ) % QUEUE_SIZE];
+                    removeLocked(pos);
+                    state->queued--;
+                    hasDropped = true;
+                    }
+                }
+
+            if ( QUEUE_SIZE > mCount )
+                {
+                mMessages[( mHead + mCount ) % QUEUE_SIZE] = *msg;
+                mCount++;
+                if ( NULL != state )
+                    {
+                    state->queued++;
+                    }
+                break;
+                }
+
+            MSGQ_LOGDA("Message queue full, waiting for the consumer");
+            mNotFull.wait(mLock);
             }
-        else
+
+        if ( mMaxDepth < mCount )
             {
-            bytes += err;
+            mMaxDepth = mCount;
             }
+
+        if ( hasDropped )
+            {
+            mDropped++;
+            dropCallback = mDropCallback;
+            dropCookie = mDropCookie;
+            }
+
+        // a consumer which did not see the previous wakeup yet will find this
+        // message as well
+        signalLocked();
+    }
+
+    if ( hasDropped && ( NULL != dropCallback ) )
+        {
+        dropCallback(&dropped, dropCookie);
         }
 
     MSGQ_LOGDA("MessageQueue::put EXIT");
@@ -233,46 +454,130 @@ android::status_t MessageQueue::put(Message* msg)
 
 
 /**
-   @brief Returns if the message queue is empty or not
+   @brief Queue a control message ahead of all regular messages
 
-   @param none
-   @return true If the queue is empty
-   @return false If the queue has at least one message
+   Urgent messages are never coalesced and keep their order among themselves.
+
+   @param msg Message to be queued
+   @return android::NO_ERROR On success
+   @return android::BAD_VALUE if the message pointer is NULL
  */
-bool MessageQueue::isEmpty()
+android::status_t MessageQueue::putUrgent(Message* msg)
 {
     LOG_FUNCTION_NAME;
 
-    struct pollfd pfd;
-
-    pfd.fd = this->fd_read;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
-
-    if(!this->fd_read)
+    if(!msg)
         {
-        MSGQ_LOGEA("read descriptor not initialized for message queue");
+        MSGQ_LOGEA("msg is NULL");
         LOG_FUNCTION_NAME_EXIT;
-        return android::NO_INIT;
+        return android::BAD_VALUE;
         }
 
+    MSGQ_LOGDB("MQ.putUrgent(%d,%p,%p,%p,%p)", msg->command, msg->arg1,msg->arg2,msg->arg3,msg->arg4);
 
-    if( -1 == poll(&pfd,1,0) )
+    android::AutoMutex lock(mLock);
+
+    while ( URGENT_QUEUE_SIZE == mUrgentCount )
         {
-        MSGQ_LOGEB("poll() error: %s", strerror(errno));
-        LOG_FUNCTION_NAME_EXIT;
-        return false;
+        mNotFull.wait(mLock);
         }
 
-    if(pfd.revents & POLLIN)
+    mUrgent[( mUrgentHead + mUrgentCount ) % URGENT_QUEUE_SIZE] = *msg;
+    mUrgentCount++;
+    mQueued++;
+
+    signalLocked();
+
+    LOG_FUNCTION_NAME_EXIT;
+    return 0;
+}
+
+/**
+   @brief Set how queued messages with the given command are coalesced
+
+   @param command Message command the policy applies to
+   @param policy Coalescing policy, COALESCE_NONE removes it
+   @param maxQueued Messages allowed to wait with COALESCE_DROP_OLDEST
+   @return none
+ */
+void MessageQueue::setCoalescePolicy(int command, CoalescePolicy policy, int maxQueued)
+{
+    LOG_FUNCTION_NAME;
+
+    android::AutoMutex lock(mLock);
+
+    if ( COALESCE_NONE == policy )
         {
-        mHasMsg = true;
+        mPolicies.removeItem(command);
+        LOG_FUNCTION_NAME_EXIT;
+        return;
         }
-    else
+
+    CoalesceState state;
+    state.policy = policy;
+    state.maxQueued = ( 0 < maxQueued ) ? maxQueued : 1;
+    state.queued = 0;
+
+    for ( int i = 0 ; i < mCount ; i++ )
         {
-        mHasMsg = false;
+        if ( command == mMessages[( mHead + i ) % QUEUE_SIZE].command )
+            {
+            state.queued++;
+            }
         }
 
+    mPolicies.add(command, state);
+
+    LOG_FUNCTION_NAME_EXIT;
+}
+
+/**
+   @brief Set the callback releasing messages dropped by a coalescing policy
+
+   @param callback Callback invoked from put(), NULL to drop silently
+   @param cookie Passed back to the callback
+   @return none
+ */
+void MessageQueue::setDropCallback(DropCallback callback, void *cookie)
+{
+    android::AutoMutex lock(mLock);
+
+    mDropCallback = callback;
+    mDropCookie = cookie;
+}
+
+/**
+   @brief Current depth, high-water mark and put/drop counters
+
+   @param stats Structure to hold the statistics
+   @return none
+ */
+void MessageQueue::getStats(Stats &stats)
+{
+    android::AutoMutex lock(mLock);
+
+    stats.depth = mCount;
+    stats.maxDepth = mMaxDepth;
+    stats.urgentDepth = mUrgentCount;
+    stats.queued = mQueued;
+    stats.dropped = mDropped;
+}
+
+/**
+   @brief Returns if the message queue is empty or not
+
+   @param none
+   @return true If the queue is empty
+   @return false If the queue has at least one message
+ */
+bool MessageQueue::isEmpty()
+{
+    LOG_FUNCTION_NAME;
+
+    android::AutoMutex lock(mLock);
+
+    mHasMsg = ( 0 < pendingLocked() );
+
     LOG_FUNCTION_NAME_EXIT;
     return !mHasMsg;
 }
@@ -281,19 +586,24 @@ void MessageQueue::clear()
 {
     LOG_FUNCTION_NAME;
 
-    if(!this->fd_read)
-        {
-        MSGQ_LOGEA("read descriptor not initialized for message queue");
-        LOG_FUNCTION_NAME_EXIT;
-        return;
-        }
+    android::AutoMutex lock(mLock);
 
-    Message msg;
-    while(!isEmpty())
+    mNotFull.broadcast();
+
+    mHead = 0;
+    mCount = 0;
+    mUrgentHead = 0;
+    mUrgentCount = 0;
+    mHasMsg = false;
+
+    for ( size_t i = 0 ; i < mPolicies.size() ; i++ )
         {
-        get(&msg);
+        mPolicies.editValueAt(i).queued = 0;
         }
 
+    drainSignalLocked();
+
+    LOG_FUNCTION_NAME_EXIT;
 }
 
 
@@ -312,11 +622,14 @@ void MessageQueue::setMsg(bool hasMsg)
 /**
    @briefWait for message in maximum three different queues with a timeout
 
+   Queues which already hold messages are reported without calling into
+   the kernel, poll() is only used when all of them are empty.
+
    @param queue1 First queue. At least this should be set to a valid queue pointer
    @param queue2 Second queue. Optional.
    @param queue3 Third queue. Optional.
-   @param timeout The timeout value (in micro secs) to wait for a message in any of the queues
-   @return android::NO_ERROR On success
+   @param timeout The timeout value (in milli secs) to wait for a message in any of the queues
+   @return Number of queues holding messages, 0 on timeout
    @return android::BAD_VALUE If queue1 is NULL
    @return android::NO_INIT If the file read descriptor of any of the provided queues is not set
  */
@@ -324,8 +637,10 @@ android::status_t MessageQueue::waitForMsg(MessageQueue *queue1, MessageQueue *q
     {
     LOG_FUNCTION_NAME;
 
-    int n =1;
+    MessageQueue *queues[3];
     struct pollfd pfd[3];
+    int n = 0;
+    int ready = 0;
 
     if(!queue1)
         {
@@ -334,47 +649,51 @@ android::status_t MessageQueue::waitForMsg(MessageQueue *queue1, MessageQueue *q
         return android::BAD_VALUE;
         }
 
-    pfd[0].fd = queue1->getInFd();
-    if(!pfd[0].fd)
-        {
-        MSGQ_LOGEA("read descriptor not initialized for message queue1");
-        LOG_FUNCTION_NAME_EXIT;
-        return android::NO_INIT;
-        }
-    pfd[0].events = POLLIN;
-    pfd[0].revents = 0;
+    queues[n++] = queue1;
     if(queue2)
         {
         MSGQ_LOGDA("queue2 not-null");
-        pfd[1].fd = queue2->getInFd();
-        if(!pfd[1].fd)
-            {
-            MSGQ_LOGEA("read descriptor not initialized for message queue2");
-            LOG_FUNCTION_NAME_EXIT;
-            return android::NO_INIT;
-            }
-
-        pfd[1].events = POLLIN;
-        pfd[1].revents = 0;
-        n++;
+        queues[n++] = queue2;
         }
-
     if(queue3)
         {
         MSGQ_LOGDA("queue3 not-null");
-        pfd[2].fd = queue3->getInFd();
-        if(!pfd[2].fd)
+        queues[n++] = queue3;
+        }
+
+    for ( int i = 0 ; i < n ; i++ )
+        {
+        MessageQueue *queue = queues[i];
+        android::AutoMutex lock(queue->mLock);
+
+        if ( 0 > queue->fd_read )
             {
-            MSGQ_LOGEA("read descriptor not initialized for message queue3");
+            MSGQ_LOGEB("read descriptor not initialized for message queue%d", i + 1);
             LOG_FUNCTION_NAME_EXIT;
             return android::NO_INIT;
             }
 
-        pfd[2].events = POLLIN;
-        pfd[2].revents = 0;
-        n++;
+        if ( 0 < queue->pendingLocked() )
+            {
+            queue->mHasMsg = true;
+            ready++;
+            }
+        else
+            {
+            // a put() from now on signals the descriptor again
+            queue->drainSignalLocked();
+            }
+
+        pfd[i].fd = queue->fd_read;
+        pfd[i].events = POLLIN;
+        pfd[i].revents = 0;
         }
 
+    if ( 0 < ready )
+        {
+        LOG_FUNCTION_NAME_EXIT;
+        return ready;
+        }
 
     int ret = poll(pfd, n, timeout);
     if(ret==0)
@@ -390,24 +709,11 @@ android::status_t MessageQueue::waitForMsg(MessageQueue *queue1, MessageQueue *q
         return ret;
         }
 
-    if (pfd[0].revents & POLLIN)
-        {
-        queue1->setMsg(true);
-        }
-
-    if(queue2)
-        {
-        if (pfd[1].revents & POLLIN)
-            {
-            queue2->setMsg(true);
-            }
-        }
-
-    if(queue3)
+    for ( int i = 0 ; i < n ; i++ )
         {
-        if (pfd[2].revents & POLLIN)
+        if (pfd[i].revents & POLLIN)
             {
-            queue3->setMsg(true);
+            queues[i]->setMsg(true);
             }
         }
 
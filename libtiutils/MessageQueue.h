@@ -21,6 +21,7 @@
 
 #include "DebugUtils.h"
 #include <stdint.h>
+#include <utils/KeyedVector.h>
 
 #ifdef MSGQ_DEBUG
 #   define MSGQ_LOGDA DBGUTILS_LOGDA
@@ -48,16 +49,58 @@ struct Message
 };
 
 ///Message queue implementation
+///
+///Messages are kept in a bounded in-memory ring. The file descriptor
+///returned by getInFd() is an eventfd which is readable whenever the
+///ring holds messages, it is only written when the ring goes from empty
+///to non-empty and no wakeup is pending already, so queueing to a busy
+///consumer and dequeueing never enter the kernel.
+///
+///Messages queued with putUrgent() go to a separate lane which get()
+///drains first. Commands can be given a coalescing policy which bounds
+///how many of them wait in the queue when the consumer falls behind.
 class MessageQueue
 {
 public:
 
+    ///Number of messages the ring holds before put() blocks
+    static const int QUEUE_SIZE = 256;
+    ///Number of messages the urgent lane holds before putUrgent() blocks
+    static const int URGENT_QUEUE_SIZE = 16;
+
+    enum CoalescePolicy
+    {
+        ///Every message is delivered
+        COALESCE_NONE,
+        ///A new message replaces the queued one with the same command
+        COALESCE_KEEP_LATEST,
+        ///Once maxQueued messages with the same command wait, the oldest
+        ///of them is dropped
+        COALESCE_DROP_OLDEST
+    };
+
+    ///Called outside the queue lock with every message dropped by a policy
+    typedef void (*DropCallback)(Message *msg, void *cookie);
+
+    struct Stats
+    {
+        int depth;
+        int maxDepth;
+        int urgentDepth;
+        uint32_t queued;
+        uint32_t dropped;
+    };
+
     MessageQueue();
     ~MessageQueue();
 
-    ///Get a message from the queue
+    ///Get a message from the queue, blocks while the queue is empty
     android::status_t get(Message*);
 
+    ///Get up to maxCount queued messages without blocking, returns the
+    ///number of messages retrieved
+    int getBatch(Message *msgs, int maxCount);
+
     ///Get the input file descriptor of the message queue
     int getInFd();
 
@@ -67,6 +110,18 @@ public:
     ///Queue a message
     android::status_t put(Message*);
 
+    ///Queue a control message ahead of all regular messages
+    android::status_t putUrgent(Message*);
+
+    ///Set how queued messages with the given command are coalesced
+    void setCoalescePolicy(int command, CoalescePolicy policy, int maxQueued = 1);
+
+    ///Set the callback releasing messages dropped by a coalescing policy
+    void setDropCallback(DropCallback callback, void *cookie);
+
+    ///Current depth, high-water mark and put/drop counters
+    void getStats(Stats &stats);
+
     ///Returns if the message queue is empty or not
     bool isEmpty();
 
@@ -84,8 +139,40 @@ public:
     }
 
 private:
+    struct CoalesceState
+    {
+        CoalescePolicy policy;
+        int maxQueued;
+        int queued;
+    };
+
+    // all need mLock held
+    void signalLocked();
+    void drainSignalLocked();
+    int pendingLocked() const { return mCount + mUrgentCount; }
+    void popLocked(Message *msg);
+    int findLocked(int command) const;
+    void removeLocked(int pos);
+
+    android::Mutex mLock;
+    android::Condition mNotFull;
+    Message mMessages[QUEUE_SIZE];
+    int mHead;
+    int mCount;
+    Message mUrgent[URGENT_QUEUE_SIZE];
+    int mUrgentHead;
+    int mUrgentCount;
+    bool mSignaled;
+
+    android::KeyedVector<int, CoalesceState> mPolicies;
+    DropCallback mDropCallback;
+    void *mDropCookie;
+
+    int mMaxDepth;
+    uint32_t mQueued;
+    uint32_t mDropped;
+
     int fd_read;
-    int fd_write;
     bool mHasMsg;
 };
 
@@ -0,0 +1,630 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PixelConvert.h"
+
+#include <string.h>
+
+#if defined(ARCH_ARM_HAVE_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#   define PIXEL_CONVERT_HAVE_NEON
+#   include <arm_neon.h>
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+#   define PIXEL_CONVERT_HAVE_SSE2
+#   include <emmintrin.h>
+#endif
+
+
+
+
+namespace Ti {
+namespace Utils {
+namespace PixelConvert {
+
+
+
+
+/**
+ * Row kernels. Every conversion is expressed with these, so an engine only
+ * needs to provide the inner loops. Counts are in byte pairs unless noted.
+ */
+struct Kernels
+{
+    // even[i] = src[2i], n outputs
+    void (*splitEven)(const uint8_t * src, uint8_t * even, int n);
+    // even[i] = src[2i], odd[i] = src[2i+1]
+    void (*split)(const uint8_t * src, uint8_t * even, uint8_t * odd, int n);
+    // dst[2i] = src[2i+1], dst[2i+1] = src[2i]
+    void (*swap)(const uint8_t * src, uint8_t * dst, int n);
+    // dst[2i] = a[i], dst[2i+1] = b[i]
+    void (*merge)(const uint8_t * a, const uint8_t * b, uint8_t * dst, int n);
+    // n pixel pairs to packed YUV 4:4:4
+    void (*yuyvTo444)(uint8_t * dst, const uint8_t * src, int n);
+    void (*uyvyTo444)(uint8_t * dst, const uint8_t * src, int n);
+    void (*nv21To444)(uint8_t * dst, const uint8_t * y, const uint8_t * vu, int n);
+};
+
+
+
+
+static void splitEven_scalar(const uint8_t * src, uint8_t * even, int n)
+{
+    for ( int i = 0; i < n; ++i )
+        even[i] = src[2*i];
+}
+
+
+static void split_scalar(const uint8_t * src, uint8_t * even, uint8_t * odd, int n)
+{
+    for ( int i = 0; i < n; ++i )
+    {
+        even[i] = src[2*i];
+        odd[i] = src[2*i + 1];
+    }
+}
+
+
+static void swap_scalar(const uint8_t * src, uint8_t * dst, int n)
+{
+    for ( int i = 0; i < n; ++i )
+    {
+        const uint8_t a = src[2*i];
+        dst[2*i] = src[2*i + 1];
+        dst[2*i + 1] = a;
+    }
+}
+
+
+static void merge_scalar(const uint8_t * a, const uint8_t * b, uint8_t * dst, int n)
+{
+    for ( int i = 0; i < n; ++i )
+    {
+        dst[2*i] = a[i];
+        dst[2*i + 1] = b[i];
+    }
+}
+
+
+static void yuyvTo444_scalar(uint8_t * dst, const uint8_t * src, int n)
+{
+    for ( int i = 0; i < n; ++i, src += 4, dst += 6 )
+    {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[3];
+        dst[3] = src[2];
+        dst[4] = src[1];
+        dst[5] = src[3];
+    }
+}
+
+
+static void uyvyTo444_scalar(uint8_t * dst, const uint8_t * src, int n)
+{
+    for ( int i = 0; i < n; ++i, src += 4, dst += 6 )
+    {
+        dst[0] = src[1];
+        dst[1] = src[0];
+        dst[2] = src[2];
+        dst[3] = src[3];
+        dst[4] = src[0];
+        dst[5] = src[2];
+    }
+}
+
+
+static void nv21To444_scalar(uint8_t * dst, const uint8_t * y, const uint8_t * vu, int n)
+{
+    for ( int i = 0; i < n; ++i, y += 2, vu += 2, dst += 6 )
+    {
+        dst[0] = y[0];
+        dst[1] = vu[1];
+        dst[2] = vu[0];
+        dst[3] = y[1];
+        dst[4] = vu[1];
+        dst[5] = vu[0];
+    }
+}
+
+
+static const Kernels sScalarKernels = {
+    splitEven_scalar,
+    split_scalar,
+    swap_scalar,
+    merge_scalar,
+    yuyvTo444_scalar,
+    uyvyTo444_scalar,
+    nv21To444_scalar
+};
+
+
+
+
+#ifdef PIXEL_CONVERT_HAVE_NEON
+
+static void splitEven_neon(const uint8_t * src, uint8_t * even, int n)
+{
+    int i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+        vst1q_u8(even + i, vld2q_u8(src + 2*i).val[0]);
+    splitEven_scalar(src + 2*i, even + i, n - i);
+}
+
+
+static void split_neon(const uint8_t * src, uint8_t * even, uint8_t * odd, int n)
+{
+    int i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        const uint8x16x2_t v = vld2q_u8(src + 2*i);
+        vst1q_u8(even + i, v.val[0]);
+        vst1q_u8(odd + i, v.val[1]);
+    }
+    split_scalar(src + 2*i, even + i, odd + i, n - i);
+}
+
+
+static void swap_neon(const uint8_t * src, uint8_t * dst, int n)
+{
+    int i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+        vst1q_u8(dst + 2*i, vrev16q_u8(vld1q_u8(src + 2*i)));
+    swap_scalar(src + 2*i, dst + 2*i, n - i);
+}
+
+
+static void merge_neon(const uint8_t * a, const uint8_t * b, uint8_t * dst, int n)
+{
+    int i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        uint8x16x2_t v;
+        v.val[0] = vld1q_u8(a + i);
+        v.val[1] = vld1q_u8(b + i);
+        vst2q_u8(dst + 2*i, v);
+    }
+    merge_scalar(a + i, b + i, dst + 2*i, n - i);
+}
+
+
+static inline void store444_neon(uint8_t * dst, uint8x16_t y, uint8x8_t u, uint8x8_t v)
+{
+    const uint8x8x2_t uu = vzip_u8(u, u);
+    const uint8x8x2_t vv = vzip_u8(v, v);
+    uint8x16x3_t out;
+    out.val[0] = y;
+    out.val[1] = vcombine_u8(uu.val[0], uu.val[1]);
+    out.val[2] = vcombine_u8(vv.val[0], vv.val[1]);
+    vst3q_u8(dst, out);
+}
+
+
+static void yuyvTo444_neon(uint8_t * dst, const uint8_t * src, int n)
+{
+    int i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        // 16 pixels: val[0] = y, val[1] = uvuv..
+        const uint8x16x2_t yuv = vld2q_u8(src + 4*i);
+        const uint8x8x2_t uv = vuzp_u8(vget_low_u8(yuv.val[1]), vget_high_u8(yuv.val[1]));
+        store444_neon(dst + 6*i, yuv.val[0], uv.val[0], uv.val[1]);
+    }
+    yuyvTo444_scalar(dst + 6*i, src + 4*i, n - i);
+}
+
+
+static void uyvyTo444_neon(uint8_t * dst, const uint8_t * src, int n)
+{
+    int i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        // 16 pixels: val[0] = uvuv.., val[1] = y
+        const uint8x16x2_t yuv = vld2q_u8(src + 4*i);
+        const uint8x8x2_t uv = vuzp_u8(vget_low_u8(yuv.val[0]), vget_high_u8(yuv.val[0]));
+        store444_neon(dst + 6*i, yuv.val[1], uv.val[0], uv.val[1]);
+    }
+    uyvyTo444_scalar(dst + 6*i, src + 4*i, n - i);
+}
+
+
+static void nv21To444_neon(uint8_t * dst, const uint8_t * y, const uint8_t * vu, int n)
+{
+    int i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        const uint8x8x2_t c = vld2_u8(vu + 2*i);
+        store444_neon(dst + 6*i, vld1q_u8(y + 2*i), c.val[1], c.val[0]);
+    }
+    nv21To444_scalar(dst + 6*i, y + 2*i, vu + 2*i, n - i);
+}
+
+
+static const Kernels sNeonKernels = {
+    splitEven_neon,
+    split_neon,
+    swap_neon,
+    merge_neon,
+    yuyvTo444_neon,
+    uyvyTo444_neon,
+    nv21To444_neon
+};
+
+#endif // PIXEL_CONVERT_HAVE_NEON
+
+
+
+
+#ifdef PIXEL_CONVERT_HAVE_SSE2
+
+__attribute__((target("sse2")))
+static void splitEven_sse2(const uint8_t * src, uint8_t * even, int n)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2*i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2*i + 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(even + i),
+                _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+    }
+    splitEven_scalar(src + 2*i, even + i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void split_sse2(const uint8_t * src, uint8_t * even, uint8_t * odd, int n)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2*i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2*i + 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(even + i),
+                _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(odd + i),
+                _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    split_scalar(src + 2*i, even + i, odd + i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void swap_sse2(const uint8_t * src, uint8_t * dst, int n)
+{
+    int i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2*i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 2*i),
+                _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8)));
+    }
+    swap_scalar(src + 2*i, dst + 2*i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void merge_sse2(const uint8_t * a, const uint8_t * b, uint8_t * dst, int n)
+{
+    int i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 2*i), _mm_unpacklo_epi8(va, vb));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 2*i + 16), _mm_unpackhi_epi8(va, vb));
+    }
+    merge_scalar(a + i, b + i, dst + 2*i, n - i);
+}
+
+
+// 3-byte interleaving has no cheap SSE2 form, packed 4:4:4 stays scalar
+static const Kernels sSse2Kernels = {
+    splitEven_sse2,
+    split_sse2,
+    swap_sse2,
+    merge_sse2,
+    yuyvTo444_scalar,
+    uyvyTo444_scalar,
+    nv21To444_scalar
+};
+
+#endif // PIXEL_CONVERT_HAVE_SSE2
+
+
+
+
+static const Kernels * kernelsForEngine(const Engine engine)
+{
+    switch ( engine )
+    {
+#ifdef PIXEL_CONVERT_HAVE_NEON
+    case ENGINE_NEON:
+        return &sNeonKernels;
+#endif
+#ifdef PIXEL_CONVERT_HAVE_SSE2
+    case ENGINE_SSE2:
+        return &sSse2Kernels;
+#endif
+    default:
+        return &sScalarKernels;
+    }
+}
+
+
+static Engine detectEngine()
+{
+    static const Engine kPreference[] = { ENGINE_NEON, ENGINE_SSE2 };
+
+    for ( unsigned int i = 0; i < sizeof(kPreference)/sizeof(kPreference[0]); ++i )
+        if ( isEngineSupported(kPreference[i]) )
+            return kPreference[i];
+
+    return ENGINE_SCALAR;
+}
+
+
+// selected once, every thread computes the same value so the race is benign
+static volatile Engine sEngine = ENGINE_AUTO;
+static const Kernels * volatile sKernels = 0;
+
+
+static inline const Kernels * kernels()
+{
+    const Kernels * k = sKernels;
+    if ( !k )
+    {
+        const Engine e = detectEngine();
+        k = kernelsForEngine(e);
+        sEngine = e;
+        sKernels = k;
+    }
+    return k;
+}
+
+
+
+
+Engine engine()
+{
+    kernels();
+    return sEngine;
+}
+
+
+bool setEngine(const Engine engine)
+{
+    if ( engine == ENGINE_AUTO )
+    {
+        sKernels = 0;
+        kernels();
+        return true;
+    }
+
+    if ( !isEngineSupported(engine) )
+        return false;
+
+    sEngine = engine;
+    sKernels = kernelsForEngine(engine);
+    return true;
+}
+
+
+bool isEngineSupported(const Engine engine)
+{
+    switch ( engine )
+    {
+    case ENGINE_AUTO:
+    case ENGINE_SCALAR:
+        return true;
+#ifdef PIXEL_CONVERT_HAVE_NEON
+    case ENGINE_NEON:
+        // the library is built for NEON capable cores only when this is set
+        return true;
+#endif
+#ifdef PIXEL_CONVERT_HAVE_SSE2
+    case ENGINE_SSE2:
+        return __builtin_cpu_supports("sse2");
+#endif
+    default:
+        return false;
+    }
+}
+
+
+const char * engineName(const Engine engine)
+{
+    switch ( engine )
+    {
+    case ENGINE_AUTO:   return "auto";
+    case ENGINE_SCALAR: return "scalar";
+    case ENGINE_NEON:   return "neon";
+    case ENGINE_SSE2:   return "sse2";
+    default:            return "unknown";
+    }
+}
+
+
+
+
+void copyPlane(const uint8_t * src, const int srcStride,
+               uint8_t * dst, const int dstStride,
+               const int width, const int height)
+{
+    if ( srcStride == width && dstStride == width )
+    {
+        memcpy(dst, src, width*height);
+        return;
+    }
+
+    for ( int i = 0; i < height; ++i, src += srcStride, dst += dstStride )
+        memcpy(dst, src, width);
+}
+
+
+void yuyvToNv12(const uint8_t * src, const int srcStride,
+                uint8_t * dstY, const int dstYStride,
+                uint8_t * dstUV, const int dstUVStride,
+                const int width, const int height)
+{
+    const Kernels * const k = kernels();
+    const int evenWidth = width & ~1;
+
+    for ( int i = 0; i < height; ++i, src += srcStride, dstY += dstYStride )
+    {
+        if ( i & 1 )
+        {
+            k->splitEven(src, dstY, width);
+            continue;
+        }
+
+        k->split(src, dstY, dstUV, evenWidth);
+        if ( width & 1 )
+        {
+            // last macro pixel holds a single valid luma sample
+            dstY[evenWidth] = src[2*evenWidth];
+            dstUV[evenWidth] = src[2*evenWidth + 1];
+            dstUV[evenWidth + 1] = src[2*evenWidth + 3];
+        }
+        dstUV += dstUVStride;
+    }
+}
+
+
+void yuyvToUyvy(const uint8_t * src, const int srcStride,
+                uint8_t * dst, const int dstStride,
+                const int width, const int height)
+{
+    const Kernels * const k = kernels();
+    const int pairs = (width + 1) & ~1;
+
+    for ( int i = 0; i < height; ++i, src += srcStride, dst += dstStride )
+        k->swap(src, dst, pairs);
+}
+
+
+void nv12ToYuyv(const uint8_t * srcY, const int srcYStride,
+                const uint8_t * srcUV, const int srcUVStride,
+                uint8_t * dst, const int dstStride,
+                const int width, const int height)
+{
+    const Kernels * const k = kernels();
+    const int evenWidth = width & ~1;
+
+    for ( int i = 0; i < height; ++i, srcY += srcYStride, dst += dstStride )
+    {
+        const uint8_t * const uv = srcUV + (i/2)*srcUVStride;
+
+        k->merge(srcY, uv, dst, evenWidth);
+        if ( width & 1 )
+        {
+            // repeat the last luma sample to complete the macro pixel
+            uint8_t * const tail = dst + 2*evenWidth;
+            tail[0] = srcY[evenWidth];
+            tail[1] = uv[evenWidth];
+            tail[2] = srcY[evenWidth];
+            tail[3] = uv[evenWidth + 1];
+        }
+    }
+}
+
+
+void swapUV(const uint8_t * src, const int srcStride,
+            uint8_t * dst, const int dstStride,
+            const int width, const int height)
+{
+    const Kernels * const k = kernels();
+
+    for ( int i = 0; i < height; ++i, src += srcStride, dst += dstStride )
+        k->swap(src, dst, width);
+}
+
+
+void deinterleaveUV(const uint8_t * src, const int srcStride,
+                    uint8_t * dstU, const int dstUStride,
+                    uint8_t * dstV, const int dstVStride,
+                    const int width, const int height)
+{
+    const Kernels * const k = kernels();
+
+    for ( int i = 0; i < height; ++i, src += srcStride, dstU += dstUStride, dstV += dstVStride )
+        k->split(src, dstU, dstV, width);
+}
+
+
+void interleaveUV(const uint8_t * srcU, const int srcUStride,
+                  const uint8_t * srcV, const int srcVStride,
+                  uint8_t * dst, const int dstStride,
+                  const int width, const int height)
+{
+    const Kernels * const k = kernels();
+
+    for ( int i = 0; i < height; ++i, srcU += srcUStride, srcV += srcVStride, dst += dstStride )
+        k->merge(srcU, srcV, dst, width);
+}
+
+
+
+
+void yuyvRowToYuv444(uint8_t * dst, const uint8_t * src, const int width)
+{
+    kernels()->yuyvTo444(dst, src, width/2);
+    if ( width & 1 )
+    {
+        const uint8_t * const s = src + 2*(width & ~1);
+        uint8_t * const d = dst + 3*(width & ~1);
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[3];
+    }
+}
+
+
+void uyvyRowToYuv444(uint8_t * dst, const uint8_t * src, const int width)
+{
+    kernels()->uyvyTo444(dst, src, width/2);
+    if ( width & 1 )
+    {
+        const uint8_t * const s = src + 2*(width & ~1);
+        uint8_t * const d = dst + 3*(width & ~1);
+        d[0] = s[1];
+        d[1] = s[0];
+        d[2] = s[2];
+    }
+}
+
+
+void nv21RowToYuv444(uint8_t * dst, const uint8_t * y, const uint8_t * vu, const int width)
+{
+    kernels()->nv21To444(dst, y, vu, width/2);
+    if ( width & 1 )
+    {
+        const int x = width & ~1;
+        uint8_t * const d = dst + 3*x;
+        d[0] = y[x];
+        d[1] = vu[x + 1];
+        d[2] = vu[x];
+    }
+}
+
+
+
+
+} // namespace PixelConvert
+} // namespace Utils
+} // namespace Ti
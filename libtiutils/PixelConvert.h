@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#ifndef TI_UTILS_PIXEL_CONVERT_H
+#define TI_UTILS_PIXEL_CONVERT_H
+
+#include <stdint.h>
+
+
+
+
+namespace Ti {
+namespace Utils {
+namespace PixelConvert {
+
+
+
+
+/**
+ * Pixel format conversion routines shared by the camera HAL and the
+ * colour converter plugins.
+ *
+ * All routines take explicit strides in bytes, so cropping is done by
+ * offsetting the plane pointers. Widths and heights are in pixels of the
+ * plane being written unless stated otherwise, and odd widths are
+ * supported everywhere. The fastest engine supported by the running CPU
+ * is picked on first use.
+ */
+
+enum Engine
+{
+    ENGINE_AUTO,
+    ENGINE_SCALAR,
+    ENGINE_NEON,
+    ENGINE_SSE2,
+    ENGINE_MAX
+};
+
+///Engine currently used by the conversion routines
+Engine engine();
+
+///Forces an engine, ENGINE_AUTO restores runtime detection. Returns false if not supported.
+bool setEngine(Engine engine);
+
+bool isEngineSupported(Engine engine);
+
+const char * engineName(Engine engine);
+
+
+
+
+///Copies a plane of width bytes per row
+void copyPlane(const uint8_t * src, int srcStride,
+               uint8_t * dst, int dstStride,
+               int width, int height);
+
+///YUV422I (YUYV) to NV12, chroma is taken from even rows
+void yuyvToNv12(const uint8_t * src, int srcStride,
+                uint8_t * dstY, int dstYStride,
+                uint8_t * dstUV, int dstUVStride,
+                int width, int height);
+
+///YUV422I YUYV to UYVY, also works for UYVY to YUYV
+void yuyvToUyvy(const uint8_t * src, int srcStride,
+                uint8_t * dst, int dstStride,
+                int width, int height);
+
+///NV12 to YUV422I (YUYV), each chroma row is used for two luma rows
+void nv12ToYuyv(const uint8_t * srcY, int srcYStride,
+                const uint8_t * srcUV, int srcUVStride,
+                uint8_t * dst, int dstStride,
+                int width, int height);
+
+///Swaps interleaved chroma samples, NV12 chroma to NV21 and vice versa.
+///width is in chroma sample pairs.
+void swapUV(const uint8_t * src, int srcStride,
+            uint8_t * dst, int dstStride,
+            int width, int height);
+
+///Splits interleaved chroma into two planes, NV12 chroma to I420/YV12.
+///width is in chroma sample pairs.
+void deinterleaveUV(const uint8_t * src, int srcStride,
+                    uint8_t * dstU, int dstUStride,
+                    uint8_t * dstV, int dstVStride,
+                    int width, int height);
+
+///Merges two chroma planes into interleaved chroma, I420 to NV12.
+///width is in chroma sample pairs.
+void interleaveUV(const uint8_t * srcU, int srcUStride,
+                  const uint8_t * srcV, int srcVStride,
+                  uint8_t * dst, int dstStride,
+                  int width, int height);
+
+
+
+
+///Single row conversions to packed YUV 4:4:4 (Y, Cb, Cr) as used by libjpeg
+void yuyvRowToYuv444(uint8_t * dst, const uint8_t * src, int width);
+void uyvyRowToYuv444(uint8_t * dst, const uint8_t * src, int width);
+void nv21RowToYuv444(uint8_t * dst, const uint8_t * y, const uint8_t * vu, int width);
+
+
+
+
+} // namespace PixelConvert
+} // namespace Utils
+} // namespace Ti
+
+
+
+
+#endif // TI_UTILS_PIXEL_CONVERT_H
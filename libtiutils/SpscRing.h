@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TI_UTILS_SPSC_RING_H
+#define TI_UTILS_SPSC_RING_H
+
+#include <stdint.h>
+#include <cutils/atomic.h>
+
+namespace Ti {
+namespace Utils {
+
+/**
+ * Fixed size ring for exactly one producer and one consumer thread.
+ * push() and pop() never block and never take a lock, the producer only
+ * writes mTail and the consumer only writes mHead. SIZE has to be a power
+ * of two. Blocking, if needed, is up to the caller.
+ */
+template <typename T, int SIZE>
+class SpscRing
+{
+public:
+    SpscRing() : mHead(0), mTail(0) { }
+
+    ///Producer side, false if the ring is full
+    bool push(const T &item)
+    {
+        const uint32_t tail = mTail;
+        const uint32_t head = android_atomic_acquire_load(&mHead);
+
+        if ( (tail - head) >= (uint32_t)SIZE ) {
+            return false;
+        }
+
+        mItems[tail & (SIZE - 1)] = item;
+        android_atomic_release_store(tail + 1, &mTail);
+        return true;
+    }
+
+    ///Consumer side, false if the ring is empty
+    bool pop(T &item)
+    {
+        const uint32_t head = mHead;
+        const uint32_t tail = android_atomic_acquire_load(&mTail);
+
+        if ( head == tail ) {
+            return false;
+        }
+
+        item = mItems[head & (SIZE - 1)];
+        android_atomic_release_store(head + 1, &mHead);
+        return true;
+    }
+
+    ///Number of queued items, only a snapshot when called from a third thread
+    int size() const
+    {
+        const uint32_t head = android_atomic_acquire_load(&mHead);
+        const uint32_t tail = android_atomic_acquire_load(&mTail);
+        return (int)(tail - head);
+    }
+
+    ///Drops all items, neither side may be using the ring meanwhile
+    void clear()
+    {
+        android_atomic_release_store(0, &mHead);
+        android_atomic_release_store(0, &mTail);
+    }
+
+    int capacity() const { return SIZE; }
+
+private:
+    // the ring is not copyable
+    SpscRing(const SpscRing &);
+    SpscRing &operator=(const SpscRing &);
+
+    T mItems[SIZE];
+    volatile int32_t mHead;
+    volatile int32_t mTail;
+};
+
+} // namespace Utils
+} // namespace Ti
+
+#endif // TI_UTILS_SPSC_RING_H
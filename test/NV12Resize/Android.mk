@@ -0,0 +1,78 @@
+#
+# Copyright (C) Texas Instruments - http://www.ti.com/
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+LOCAL_PATH:= $(call my-dir)
+
+NV12_RESIZE_TEST_SRC := \
+    nv12_resize_test.cpp \
+    ../../camera/NV12_resize.cpp
+
+NV12_RESIZE_TEST_INCLUDES := \
+    $(LOCAL_PATH)/../../camera/inc \
+    $(LOCAL_PATH)/../../libtiutils
+
+NV12_RESIZE_TEST_CFLAGS := \
+    -Wall -fno-short-enums -O2 $(ANDROID_API_CFLAGS)
+
+# ====================
+#  Target executable
+# --------------------
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(NV12_RESIZE_TEST_SRC)
+LOCAL_C_INCLUDES := $(NV12_RESIZE_TEST_INCLUDES)
+LOCAL_CFLAGS := $(NV12_RESIZE_TEST_CFLAGS)
+
+ifdef ARCH_ARM_HAVE_NEON
+    LOCAL_CFLAGS += -DARCH_ARM_HAVE_NEON
+endif
+
+LOCAL_SHARED_LIBRARIES := \
+    libtiutils \
+    libutils \
+    libcutils \
+    liblog
+
+LOCAL_MODULE := nv12_resize_test
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+# ====================
+#  Host executable
+# --------------------
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    $(NV12_RESIZE_TEST_SRC) \
+    ../../libtiutils/DebugUtils.cpp
+
+LOCAL_C_INCLUDES := $(NV12_RESIZE_TEST_INCLUDES)
+LOCAL_CFLAGS := $(NV12_RESIZE_TEST_CFLAGS)
+
+LOCAL_STATIC_LIBRARIES := \
+    libutils \
+    libcutils \
+    liblog
+
+LOCAL_LDLIBS := -lpthread -lrt
+
+LOCAL_MODULE := nv12_resize_test_host
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_HOST_EXECUTABLE)
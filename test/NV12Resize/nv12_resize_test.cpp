@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+* @file nv12_resize_test.cpp
+*
+* Bit-exactness test and benchmark of the NV12 resize engines against
+* the reference VT_resizeFrame_Video_opt2_lp implementation.
+*
+* Usage: nv12_resize_test [-b iterations]
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "NV12_resize.h"
+
+struct TestSize {
+    int inWidth;
+    int inHeight;
+    int inStride;
+    int outWidth;
+    int outHeight;
+    int outStride;
+};
+
+static const TestSize kTestSizes[] = {
+    // thumbnails from full resolution captures
+    { 3264, 2448, 3264,  160,  120,  160 },
+    { 3264, 2448, 4096,  320,  240,  320 },
+    { 4032, 3024, 4096,  512,  384,  512 },
+    // preview / video sizes
+    { 1920, 1080, 4096, 1280,  720, 4096 },
+    { 1280,  720, 1280,  640,  480,  640 },
+    {  640,  480,  640, 1280,  960, 1280 },
+    // odd and small sizes exercise the scalar tails
+    {  641,  481,  672,  334,  221,  352 },
+    {   34,   18,   34,   18,   10,   18 },
+    {    2,    2,    2,   30,   30,   32 },
+};
+
+static const int kThreadCounts[] = { 2, 4, IC_RESIZE_THREADS_AUTO };
+
+struct Image {
+    structConvImage conv;
+    mmByte* data;
+    int size;
+};
+
+static bool allocImage(Image* img, int width, int height, int stride) {
+    // allocate full stride rows for both planes plus one guard row
+    img->size = stride * (height + height / 2 + 1);
+    img->data = (mmByte*) malloc(img->size);
+    if ( !img->data ) {
+        return false;
+    }
+
+    img->conv.uWidth = width;
+    img->conv.uHeight = height;
+    img->conv.uStride = stride;
+    img->conv.eFormat = IC_FORMAT_YCbCr420_lp;
+    img->conv.imgPtr = img->data;
+    img->conv.clrPtr = img->data + stride * height;
+    img->conv.uOffset = 0;
+    return true;
+}
+
+static void fillRandom(Image* img, unsigned int seed) {
+    for ( int i = 0; i < img->size; i++ ) {
+        seed = seed * 1103515245 + 12345;
+        img->data[i] = (mmByte)(seed >> 16);
+    }
+}
+
+static double nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int compareImages(const Image* ref, const Image* test) {
+    const structConvImage& c = ref->conv;
+    int mismatches = 0;
+
+    for ( int row = 0; row < c.uHeight; row++ ) {
+        if ( memcmp(c.imgPtr + row * c.uStride, test->conv.imgPtr + row * c.uStride, c.uWidth) ) {
+            mismatches++;
+        }
+    }
+
+    for ( int row = 0; row < c.uHeight / 2; row++ ) {
+        if ( memcmp(c.clrPtr + row * c.uStride, test->conv.clrPtr + row * c.uStride, c.uWidth & ~1) ) {
+            mismatches++;
+        }
+    }
+
+    return mismatches;
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = 0;
+    int failures = 0;
+
+    if ( (argc == 3) && !strcmp(argv[1], "-b") ) {
+        iterations = atoi(argv[2]);
+    }
+
+    printf("default engine: %s, max threads: %d\n",
+           VT_resizeFrame_GetEngineName(VT_resizeFrame_GetEngine()),
+           VT_resizeFrame_GetMaxThreads());
+
+    for ( unsigned int i = 0; i < sizeof(kTestSizes) / sizeof(kTestSizes[0]); i++ ) {
+        const TestSize& t = kTestSizes[i];
+        Image in, ref, out;
+
+        if ( !allocImage(&in, t.inWidth, t.inHeight, t.inStride) ||
+             !allocImage(&ref, t.outWidth, t.outHeight, t.outStride) ||
+             !allocImage(&out, t.outWidth, t.outHeight, t.outStride) ) {
+            printf("out of memory\n");
+            return 1;
+        }
+
+        fillRandom(&in, i + 1);
+        memset(ref.data, 0, ref.size);
+        VT_resizeFrame_Video_opt2_lp(&in.conv, &ref.conv, NULL, 0);
+
+        printf("%dx%d (%d) -> %dx%d (%d)\n", t.inWidth, t.inHeight, t.inStride,
+               t.outWidth, t.outHeight, t.outStride);
+
+        for ( int e = IC_RESIZE_ENGINE_SCALAR; e < IC_RESIZE_ENGINE_MAX; e++ ) {
+            const enumResizeEngine engine = (enumResizeEngine) e;
+
+            if ( !VT_resizeFrame_IsEngineSupported(engine) ) {
+                continue;
+            }
+
+            memset(out.data, 0, out.size);
+            if ( !VT_resizeFrame_Video_engine_lp(&in.conv, &out.conv, NULL, engine) ) {
+                printf("  %-8s FAILED to run\n", VT_resizeFrame_GetEngineName(engine));
+                failures++;
+                continue;
+            }
+
+            const int mismatches = compareImages(&ref, &out);
+            printf("  %-8s %s", VT_resizeFrame_GetEngineName(engine),
+                   mismatches ? "MISMATCH" : "bit-exact");
+            if ( mismatches ) {
+                printf(" (%d rows)", mismatches);
+                failures++;
+            }
+
+            if ( iterations > 0 ) {
+                double start = nowMs();
+                for ( int n = 0; n < iterations; n++ ) {
+                    VT_resizeFrame_Video_opt2_lp(&in.conv, &ref.conv, NULL, 0);
+                }
+                const double refMs = (nowMs() - start) / iterations;
+
+                start = nowMs();
+                for ( int n = 0; n < iterations; n++ ) {
+                    VT_resizeFrame_Video_engine_lp(&in.conv, &out.conv, NULL, engine);
+                }
+                const double engineMs = (nowMs() - start) / iterations;
+
+                printf("  opt2 %.3f ms, %.3f ms, x%.2f", refMs, engineMs,
+                       engineMs > 0 ? refMs / engineMs : 0.0);
+            }
+            printf("\n");
+        }
+
+        for ( unsigned int n = 0; n < sizeof(kThreadCounts) / sizeof(kThreadCounts[0]); n++ ) {
+            const int threads = kThreadCounts[n];
+
+            memset(out.data, 0, out.size);
+            if ( !VT_resizeFrame_Video_parallel_lp(&in.conv, &out.conv, NULL, threads) ) {
+                printf("  %d threads FAILED to run\n", threads);
+                failures++;
+                continue;
+            }
+
+            const int mismatches = compareImages(&ref, &out);
+            if ( threads == IC_RESIZE_THREADS_AUTO ) {
+                printf("  auto     ");
+            } else {
+                printf("  %d thr    ", threads);
+            }
+            printf("%s", mismatches ? "MISMATCH" : "bit-exact");
+            if ( mismatches ) {
+                printf(" (%d rows)", mismatches);
+                failures++;
+            }
+
+            if ( iterations > 0 ) {
+                const double start = nowMs();
+                for ( int k = 0; k < iterations; k++ ) {
+                    VT_resizeFrame_Video_parallel_lp(&in.conv, &out.conv, NULL, threads);
+                }
+                printf("  %.3f ms", (nowMs() - start) / iterations);
+            }
+            printf("\n");
+        }
+
+        free(in.data);
+        free(ref.data);
+        free(out.data);
+    }
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
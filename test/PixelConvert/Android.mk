@@ -0,0 +1,61 @@
+#
+# Copyright (C) Texas Instruments - http://www.ti.com/
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+LOCAL_PATH:= $(call my-dir)
+
+PIXEL_CONVERT_TEST_INCLUDES := \
+    $(LOCAL_PATH)/../../libtiutils
+
+PIXEL_CONVERT_TEST_CFLAGS := \
+    -Wall -fno-short-enums -O2 $(ANDROID_API_CFLAGS)
+
+# ====================
+#  Target executable
+# --------------------
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := pixel_convert_test.cpp
+LOCAL_C_INCLUDES := $(PIXEL_CONVERT_TEST_INCLUDES)
+LOCAL_CFLAGS := $(PIXEL_CONVERT_TEST_CFLAGS)
+
+LOCAL_SHARED_LIBRARIES := \
+    libtiutils
+
+LOCAL_MODULE := pixel_convert_test
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+# ====================
+#  Host executable
+# --------------------
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    pixel_convert_test.cpp \
+    ../../libtiutils/PixelConvert.cpp
+
+LOCAL_C_INCLUDES := $(PIXEL_CONVERT_TEST_INCLUDES)
+LOCAL_CFLAGS := $(PIXEL_CONVERT_TEST_CFLAGS)
+
+LOCAL_LDLIBS := -lrt
+
+LOCAL_MODULE := pixel_convert_test_host
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+* @file pixel_convert_test.cpp
+*
+* Golden test and benchmark of the libtiutils pixel conversion routines.
+* Every supported engine is checked against straightforward per-pixel
+* reference conversions, with strides, crop offsets and odd widths.
+*
+* Usage: pixel_convert_test [-b iterations]
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "PixelConvert.h"
+
+using namespace Ti::Utils;
+
+struct TestSize {
+    int width;
+    int height;
+    int pad;     // extra bytes at the end of every row
+    int cropX;   // crop offset into the source, in pixels
+    int cropY;
+};
+
+static const TestSize kTestSizes[] = {
+    { 1920, 1080,   0,  0, 0 },
+    { 1280,  720, 128,  0, 0 },
+    {  640,  480,  64, 16, 8 },
+    {  641,  481,  31,  3, 2 },
+    {   33,    7,   5,  1, 1 },
+    {    1,    1,   0,  0, 0 },
+};
+
+// every buffer gets a guard area, writes past the expected bytes must not happen
+static const int kGuard = 64;
+static const uint8_t kGuardValue = 0xA5;
+
+struct Buffer {
+    uint8_t* data;
+    int size;
+};
+
+static void allocBuffer(Buffer* b, int size) {
+    b->size = size;
+    b->data = (uint8_t*) malloc(size + kGuard);
+    memset(b->data, kGuardValue, size + kGuard);
+}
+
+static void fillRandom(Buffer* b, unsigned int seed) {
+    for ( int i = 0; i < b->size; i++ ) {
+        seed = seed * 1103515245 + 12345;
+        b->data[i] = (uint8_t)(seed >> 16);
+    }
+}
+
+static bool guardIntact(const Buffer* b) {
+    for ( int i = 0; i < kGuard; i++ ) {
+        if ( b->data[b->size + i] != kGuardValue ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static double nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* reference conversions, written per pixel from the format definitions */
+
+static void refYuyvToNv12(const uint8_t* src, int srcStride, uint8_t* y, int yStride,
+                          uint8_t* uv, int uvStride, int width, int height) {
+    for ( int i = 0; i < height; i++ ) {
+        for ( int j = 0; j < width; j++ ) {
+            y[i*yStride + j] = src[i*srcStride + 2*j];
+        }
+        if ( i % 2 == 0 ) {
+            for ( int j = 0; j < (width + 1) / 2; j++ ) {
+                uv[(i/2)*uvStride + 2*j]     = src[i*srcStride + 4*j + 1];
+                uv[(i/2)*uvStride + 2*j + 1] = src[i*srcStride + 4*j + 3];
+            }
+        }
+    }
+}
+
+static void refYuyvToUyvy(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                          int width, int height) {
+    for ( int i = 0; i < height; i++ ) {
+        for ( int j = 0; j < (width + 1) / 2; j++ ) {
+            const uint8_t* s = src + i*srcStride + 4*j;
+            uint8_t* d = dst + i*dstStride + 4*j;
+            d[0] = s[1]; d[1] = s[0]; d[2] = s[3]; d[3] = s[2];
+        }
+    }
+}
+
+static void refNv12ToYuyv(const uint8_t* y, int yStride, const uint8_t* uv, int uvStride,
+                          uint8_t* dst, int dstStride, int width, int height) {
+    for ( int i = 0; i < height; i++ ) {
+        for ( int j = 0; j < (width + 1) / 2; j++ ) {
+            const int x1 = (2*j + 1 < width) ? 2*j + 1 : 2*j;
+            uint8_t* d = dst + i*dstStride + 4*j;
+            d[0] = y[i*yStride + 2*j];
+            d[1] = uv[(i/2)*uvStride + 2*j];
+            d[2] = y[i*yStride + x1];
+            d[3] = uv[(i/2)*uvStride + 2*j + 1];
+        }
+    }
+}
+
+static void refSwapUV(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                      int width, int height) {
+    for ( int i = 0; i < height; i++ ) {
+        for ( int j = 0; j < width; j++ ) {
+            dst[i*dstStride + 2*j]     = src[i*srcStride + 2*j + 1];
+            dst[i*dstStride + 2*j + 1] = src[i*srcStride + 2*j];
+        }
+    }
+}
+
+static void refDeinterleaveUV(const uint8_t* src, int srcStride, uint8_t* u, int uStride,
+                              uint8_t* v, int vStride, int width, int height) {
+    for ( int i = 0; i < height; i++ ) {
+        for ( int j = 0; j < width; j++ ) {
+            u[i*uStride + j] = src[i*srcStride + 2*j];
+            v[i*vStride + j] = src[i*srcStride + 2*j + 1];
+        }
+    }
+}
+
+static void refYuyvRowToYuv444(uint8_t* dst, const uint8_t* src, int width, bool uyvy) {
+    for ( int j = 0; j < width; j++ ) {
+        const uint8_t* m = src + 4*(j/2);
+        dst[3*j]     = uyvy ? m[(j & 1) ? 3 : 1] : m[(j & 1) ? 2 : 0];
+        dst[3*j + 1] = uyvy ? m[0] : m[1];
+        dst[3*j + 2] = uyvy ? m[2] : m[3];
+    }
+}
+
+static void refNv21RowToYuv444(uint8_t* dst, const uint8_t* y, const uint8_t* vu, int width) {
+    for ( int j = 0; j < width; j++ ) {
+        dst[3*j]     = y[j];
+        dst[3*j + 1] = vu[2*(j/2) + 1];
+        dst[3*j + 2] = vu[2*(j/2)];
+    }
+}
+
+/* one kernel under test, converting in to out for the given size */
+struct Kernel {
+    const char* name;
+    void (*run)(const TestSize& t, const Buffer& in, Buffer& out, bool reference);
+    int (*inSize)(const TestSize& t);
+    int (*outSize)(const TestSize& t);
+    int (*bytesMoved)(const TestSize& t);
+};
+
+static int stride(const TestSize& t, int bpp) { return (t.width + t.cropX) * bpp + t.pad; }
+static int rows(const TestSize& t) { return t.height + t.cropY; }
+static int packedSize(const TestSize& t) { return stride(t, 2) * rows(t) + 4; }
+static int nv12Size(const TestSize& t) { return stride(t, 1) * (rows(t) + (rows(t) + 1) / 2) + 2; }
+
+static void runYuyvToNv12(const TestSize& t, const Buffer& in, Buffer& out, bool reference) {
+    const int s = stride(t, 2), ys = stride(t, 1);
+    const uint8_t* src = in.data + t.cropY * s + ((t.cropX * 2) & ~3);
+    uint8_t* y = out.data;
+    uint8_t* uv = out.data + ys * rows(t);
+    if ( reference ) {
+        refYuyvToNv12(src, s, y, ys, uv, ys, t.width, t.height);
+    } else {
+        PixelConvert::yuyvToNv12(src, s, y, ys, uv, ys, t.width, t.height);
+    }
+}
+
+static void runYuyvToUyvy(const TestSize& t, const Buffer& in, Buffer& out, bool reference) {
+    const int s = stride(t, 2);
+    const uint8_t* src = in.data + t.cropY * s + ((t.cropX * 2) & ~3);
+    if ( reference ) {
+        refYuyvToUyvy(src, s, out.data, s, t.width, t.height);
+    } else {
+        PixelConvert::yuyvToUyvy(src, s, out.data, s, t.width, t.height);
+    }
+}
+
+static void runNv12ToYuyv(const TestSize& t, const Buffer& in, Buffer& out, bool reference) {
+    const int ys = stride(t, 1), s = stride(t, 2);
+    const uint8_t* y = in.data + t.cropY * ys + t.cropX;
+    const uint8_t* uv = in.data + ys * rows(t) + (t.cropY / 2) * ys + (t.cropX & ~1);
+    if ( reference ) {
+        refNv12ToYuyv(y, ys, uv, ys, out.data, s, t.width, t.height);
+    } else {
+        PixelConvert::nv12ToYuyv(y, ys, uv, ys, out.data, s, t.width, t.height);
+    }
+}
+
+static void runSwapUV(const TestSize& t, const Buffer& in, Buffer& out, bool reference) {
+    const int s = stride(t, 1);
+    const uint8_t* uv = in.data + (t.cropY / 2) * s + (t.cropX & ~1);
+    if ( reference ) {
+        refSwapUV(uv, s, out.data, s, (t.width + 1) / 2, (t.height + 1) / 2);
+    } else {
+        PixelConvert::swapUV(uv, s, out.data, s, (t.width + 1) / 2, (t.height + 1) / 2);
+    }
+}
+
+static void runDeinterleaveUV(const TestSize& t, const Buffer& in, Buffer& out, bool reference) {
+    const int s = stride(t, 1), cs = s / 2;
+    const uint8_t* uv = in.data + (t.cropY / 2) * s + (t.cropX & ~1);
+    uint8_t* u = out.data;
+    uint8_t* v = out.data + cs * rows(t);
+    if ( reference ) {
+        refDeinterleaveUV(uv, s, u, cs, v, cs, (t.width + 1) / 2, (t.height + 1) / 2);
+    } else {
+        PixelConvert::deinterleaveUV(uv, s, u, cs, v, cs, (t.width + 1) / 2, (t.height + 1) / 2);
+    }
+}
+
+static void runYuyvRowToYuv444(const TestSize& t, const Buffer& in, Buffer& out, bool reference) {
+    for ( int i = 0; i < t.height; i++ ) {
+        const uint8_t* src = in.data + i * stride(t, 2);
+        uint8_t* dst = out.data + i * t.width * 3;
+        if ( reference ) {
+            refYuyvRowToYuv444(dst, src, t.width, false);
+        } else {
+            PixelConvert::yuyvRowToYuv444(dst, src, t.width);
+        }
+    }
+}
+
+static void runUyvyRowToYuv444(const TestSize& t, const Buffer& in, Buffer& out, bool reference) {
+    for ( int i = 0; i < t.height; i++ ) {
+        const uint8_t* src = in.data + i * stride(t, 2);
+        uint8_t* dst = out.data + i * t.width * 3;
+        if ( reference ) {
+            refYuyvRowToYuv444(dst, src, t.width, true);
+        } else {
+            PixelConvert::uyvyRowToYuv444(dst, src, t.width);
+        }
+    }
+}
+
+static void runNv21RowToYuv444(const TestSize& t, const Buffer& in, Buffer& out, bool reference) {
+    const int s = stride(t, 1);
+    for ( int i = 0; i < t.height; i++ ) {
+        const uint8_t* y = in.data + i * s;
+        const uint8_t* vu = in.data + s * rows(t) + (i / 2) * s;
+        uint8_t* dst = out.data + i * t.width * 3;
+        if ( reference ) {
+            refNv21RowToYuv444(dst, y, vu, t.width);
+        } else {
+            PixelConvert::nv21RowToYuv444(dst, y, vu, t.width);
+        }
+    }
+}
+
+static int yuv444Size(const TestSize& t) { return t.width * t.height * 3; }
+static int bytesPacked(const TestSize& t) { return t.width * t.height * 2; }
+static int bytesChroma(const TestSize& t) { return t.width * t.height / 2; }
+static int bytes444(const TestSize& t) { return t.width * t.height * 3; }
+
+static const Kernel kKernels[] = {
+    { "yuyvToNv12",      runYuyvToNv12,      packedSize, nv12Size,   bytesPacked },
+    { "yuyvToUyvy",      runYuyvToUyvy,      packedSize, packedSize, bytesPacked },
+    { "nv12ToYuyv",      runNv12ToYuyv,      nv12Size,   packedSize, bytesPacked },
+    { "swapUV",          runSwapUV,          nv12Size,   nv12Size,   bytesChroma },
+    { "deinterleaveUV",  runDeinterleaveUV,  nv12Size,   nv12Size,   bytesChroma },
+    { "yuyvRowToYuv444", runYuyvRowToYuv444, packedSize, yuv444Size, bytes444 },
+    { "uyvyRowToYuv444", runUyvyRowToYuv444, packedSize, yuv444Size, bytes444 },
+    { "nv21RowToYuv444", runNv21RowToYuv444, nv12Size,   yuv444Size, bytes444 },
+};
+
+int main(int argc, char* argv[]) {
+    int iterations = 0;
+    int failures = 0;
+
+    if ( (argc == 3) && !strcmp(argv[1], "-b") ) {
+        iterations = atoi(argv[2]);
+    }
+
+    printf("default engine: %s\n", PixelConvert::engineName(PixelConvert::engine()));
+
+    for ( unsigned int i = 0; i < sizeof(kTestSizes) / sizeof(kTestSizes[0]); i++ ) {
+        const TestSize& t = kTestSizes[i];
+
+        printf("%dx%d pad %d crop %d,%d\n", t.width, t.height, t.pad, t.cropX, t.cropY);
+
+        for ( unsigned int k = 0; k < sizeof(kKernels) / sizeof(kKernels[0]); k++ ) {
+            const Kernel& kernel = kKernels[k];
+            Buffer in, ref, out;
+
+            allocBuffer(&in, kernel.inSize(t));
+            allocBuffer(&ref, kernel.outSize(t));
+            allocBuffer(&out, kernel.outSize(t));
+            fillRandom(&in, i * 31 + k + 1);
+
+            kernel.run(t, in, ref, true);
+
+            for ( int e = PixelConvert::ENGINE_SCALAR; e < PixelConvert::ENGINE_MAX; e++ ) {
+                const PixelConvert::Engine engine = (PixelConvert::Engine) e;
+
+                if ( !PixelConvert::setEngine(engine) ) {
+                    continue;
+                }
+
+                memset(out.data, kGuardValue, out.size + kGuard);
+                kernel.run(t, in, out, false);
+
+                const bool match = !memcmp(ref.data, out.data, out.size) && guardIntact(&out);
+                printf("  %-16s %-7s %s", kernel.name, PixelConvert::engineName(engine),
+                       match ? "ok" : "MISMATCH");
+                if ( !match ) {
+                    failures++;
+                }
+
+                if ( iterations > 0 ) {
+                    const double start = nowMs();
+                    for ( int n = 0; n < iterations; n++ ) {
+                        kernel.run(t, in, out, false);
+                    }
+                    const double ms = (nowMs() - start) / iterations;
+                    printf("  %8.3f ms %6.2f GB/s", ms,
+                           ms > 0 ? kernel.bytesMoved(t) / (ms * 1000000.0) : 0.0);
+                }
+                printf("\n");
+            }
+
+            free(in.data);
+            free(ref.data);
+            free(out.data);
+        }
+    }
+
+    PixelConvert::setEngine(PixelConvert::ENGINE_AUTO);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}